@@ -1,33 +1,51 @@
+#define _GNU_SOURCE
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
 #include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <regex.h>
 #include <string.h>
 #include <time.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/un.h>
 #include <sys/wait.h>
 #include <termios.h>
 #include <unistd.h>
 
-#define MAX_SONGS 1024
+#define MAX_SONGS 131072
 #define SONGS_DIR "songs"
-#define MPV_SOCKET "/tmp/musicplayer-mpv.sock"
+#define MPV_SOCKET "%s/mpv.%d.%d.%d.sock" /* run_dir, pid, zone, slot */
+#define CTL_SOCKET "musicplayer.sock"
 
 static struct termios orig_termios;
 static pid_t mpv_pid = -1;
 static int paused = 0;
 static int tmux_mode = 0;
+static int daemon_mode = 0; /* serving clients over ctl_socket, no terminal */
+static int client_mode = 0; /* --client: drawing the state a daemon sends */
+static int replay_mode = 0; /* --replay: headless on a virtual clock, saves nothing */
+static const char *ctl_socket;
+static char run_dir[80]; /* sockets and FIFOs; see run_dir_init() */
 
 enum { LOOP_ALL, LOOP_SINGLE };
 static int loop_mode = LOOP_ALL;
 static int shuffle = 0;
-static int played[MAX_SONGS];
+static uint64_t *played;        /* shuffle: heard in this round (bits), per zone */
 static int nplayed = 0;
 
 static const char *songs_dir = SONGS_DIR;
@@ -40,8 +58,50 @@ static double song_pos = 0;
 static double song_dur = 0;
 static int volume = 100;
 
+/* Columnar metadata store: one array per field, indexed like songs[].
+ * Smart playlist predicates run over a whole column at a time. */
+enum { F_NAME, F_ARTIST, F_TITLE, F_DURATION, F_PLAYS, F_ADDED, F_PLAYED, F_SKIPS, NFIELDS };
+static const char *field_names[NFIELDS] = {
+	"name", "artist", "title", "duration", "plays", "added", "played", "skips",
+};
+static char *meta_artist[MAX_SONGS];
+static char *meta_title[MAX_SONGS];
+static float meta_dur[MAX_SONGS];      /* seconds, 0 = unknown */
+static int meta_plays[MAX_SONGS];
+static int meta_skips[MAX_SONGS];
+static long long meta_added[MAX_SONGS]; /* file mtime */
+static long long meta_last[MAX_SONGS];  /* last played, unix seconds, 0 = never */
+static long long meta_size[MAX_SONGS];
+static float meta_lufs[MAX_SONGS];     /* integrated loudness, NAN = not analysed */
+static float meta_peak[MAX_SONGS];     /* true peak, dBTP */
+static int meta_wave[MAX_SONGS];       /* record in cache/waveforms, -1 = none */
+static int meta_feat[MAX_SONGS];       /* record in cache/features, -1 = none */
+static uint64_t meta_head[MAX_SONGS];  /* hash of the first and last DUP_CHUNK bytes, 0 = none */
+static uint64_t meta_hash[MAX_SONGS];  /* hash of the whole file, 0 = none */
+/* Every song's feature vector again in 8 bits (steps of 1/FEAT_STEPS,
+ * clamped to +-FEAT_QMAX), sixteen songs to a block and dimension by
+ * dimension: lane i % 16 of block i / 16. The radio search streams this
+ * one dense array, a fifth the size of the cache records, and feat_have[]
+ * marks the lanes that hold a vector. */
+#define FEAT_DIM 24 /* floats per similarity vector, a multiple of 4 */
+#define FEAT_STEPS 24
+#define FEAT_QMAX 90 /* a squared difference fits 15 bits, two sum in 16 */
+static int8_t feat_lanes[MAX_SONGS / 16][FEAT_DIM][16] __attribute__((aligned(16)));
+static uint16_t feat_have[MAX_SONGS / 16];
+/* Terminal columns of songs[i], plus the last truncation asked for: the
+ * first fit_len bytes fill fit_cols columns without splitting a codepoint. */
+struct textw {
+	unsigned short width, fit_cols, fit_len, fit_used;
+};
+static struct textw meta_textw[MAX_SONGS];
+static unsigned meta_changed = 0;      /* (1 << F_*) columns changed since sort_poll() */
+static unsigned smart_changed = 0;     /* the same, since the smart playlist was evaluated */
+static unsigned view_gen = 1;          /* bumped when display list or durations change */
+
 #define STATE_FILE "state.save"
 static const char *state_file = STATE_FILE;
+#define CACHE_DIR "cache"
+static const char *cache_dir = CACHE_DIR;
 
 static char saved_song[1024];
 static char saved_cursor[1024];
@@ -59,6 +119,7 @@ static int filter_active = 0;
 
 #define MAX_PLAYLISTS 64
 #define PLAYLISTS_DIR "playlists"
+#define LYRICS_DIR "lyrics"
 #define SIDEBAR_WIDTH 24
 
 #define ESC "\033["
@@ -72,6 +133,7 @@ static int filter_active = 0;
 #define BG_APP ESC "48;2;0;5;15m"
 #define BG_SIDEBAR ESC "48;2;3;8;20m"
 #define BG_ACCENT ESC "48;2;29;155;240m"
+#define BG_VISUAL ESC "48;2;16;42;74m"
 #define MAIN_BASE ANSI_RESET FG_TEXT BG_APP
 #define SIDEBAR_BASE ANSI_RESET FG_TEXT BG_SIDEBAR
 #define MAIN_ACCENT ANSI_RESET FG_ACCENT BG_APP
@@ -89,6 +151,7 @@ static int filter_active = 0;
 #define SIDEBAR_CURSOR ANSI_RESET ANSI_BOLD FG_TEXT BG_SIDEBAR
 #define SIDEBAR_SELECTED ANSI_RESET ANSI_BOLD FG_TEXT BG_ACCENT
 #define MAIN_DIM ANSI_RESET ANSI_DIM FG_TEXT BG_APP
+#define MAIN_VISUAL ANSI_RESET FG_TEXT BG_VISUAL
 #define SIDEBAR_DIM ANSI_RESET ANSI_DIM FG_TEXT BG_SIDEBAR
 #define SEP_H "─"
 #define SEP_V "│"
@@ -97,6 +160,7 @@ static int filter_active = 0;
 #define DISABLE_KITTY_KBD ESC "<u"
 
 static const char *playlists_dir = PLAYLISTS_DIR;
+static const char *lyrics_dir = LYRICS_DIR;
 static char *playlists[MAX_PLAYLISTS];
 static int nplaylists = 0;
 
@@ -107,8 +171,34 @@ static int panel_focus = PANEL_MAIN;
 static int playlist_active = -1;
 static int playlist_songs[MAX_SONGS];
 static int nplaylist_songs = 0;
+enum { PL_FILE, PL_SMART, PL_DUPES };
+static int playlist_kind[MAX_PLAYLISTS];
+static const char *playlist_query[MAX_PLAYLISTS]; /* built-in smart query, NULL = read the file */
+
+/* Up-next queue: growable ring buffer of songs[] indices, O(1) push/pop at
+ * both ends. Consulted before loop/shuffle when picking the next song. */
+#define QUEUE_PANEL_MAX 8
+static int *queue_buf = NULL;
+static int queue_cap = 0;
+static int queue_head = 0;
+static int queue_len = 0;
+static int queue_panel = 0;
+#define STATS_PANEL_ROWS 5
+static int stats_panel = 0;
+#define LYRICS_PANEL_ROWS 3
+static int lyrics_panel = 0;
+static char **saved_queue = NULL; /* names from state.save until restore */
+static int nsaved_queue = 0;
 
 static int delete_pending = -1; /* songs[] index marked for deletion */
+#define DELETE_SELECTION -2      /* delete_pending: the whole visual selection */
+
+/* Visual selection: a bitset over songs[] indices, so it survives filter
+ * and playlist switches. V anchors a range at the cursor that follows it
+ * until V again folds it into the set; v toggles one song. */
+static uint64_t sel_bits[(MAX_SONGS + 63) / 64];
+static int nselected = 0;
+static int visual_anchor = -1; /* display position, -1 = no live range */
 static char trash_dir[PATH_MAX];
 
 static void die(const char *msg) {
@@ -129,19 +219,170 @@ static void term_restore(void) {
 }
 
 static int mpv_fd = -1;
+static double pos_stamp = 0; /* mono_now() when song_pos was last read */
 
-static int mpv_connect(void) {
-	if (mpv_fd >= 0) return 0;
-	mpv_fd = socket(AF_UNIX, SOCK_STREAM, 0);
-	if (mpv_fd < 0) return -1;
+/* Buffering health, from mpv's paused-for-cache and demuxer-cache-duration.
+ * Each stall raises the demuxer readahead used for this and later tracks. */
+#define CACHE_SECS_MIN 30
+#define CACHE_SECS_MAX 600
+static int cache_waiting = 0;  /* mpv paused for cache right now */
+static double cache_ahead = -1; /* seconds buffered, -1 = unknown */
+static int song_stalls = 0;    /* underruns in the playing track */
+static int total_stalls = 0;
+static int cache_secs = 0;     /* --demuxer-readahead-secs, 0 = mpv default */
+
+/* Local song file cache (fc_* below), shown in the stats panel. */
+struct fc_entry {
+	unsigned long long hash;
+	long long size;
+	double used; /* atime */
+};
+
+static pthread_mutex_t fc_lock = PTHREAD_MUTEX_INITIALIZER;
+static long long fc_budget = 0; /* bytes, 0 = off */
+static const char *fc_dir;
+static struct fc_entry *fc_ents;
+static int fc_n = 0, fc_cap = 0;
+static long long fc_bytes = 0;
+static int fc_hits = 0, fc_misses = 0;
+
+static double real_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* --replay's virtual clock, moved only by the script; 0 = real time. */
+static double virt_now = 0;
+static double virt_wall = 0; /* Unix time at virt_now 0 */
+
+static double mono_now(void) {
+	return virt_now > 0 ? virt_now : real_now();
+}
+
+/* Unix time for stamps that are saved or shown (plays, the song cache's
+ * LRU); under --replay it runs on the virtual clock too. */
+static double wall_now(void) {
+	if (virt_now > 0) return virt_wall + virt_now;
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* CPU time of the calling thread, for costs a busy machine would inflate. */
+static double thread_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Playback position now, between update_position() reads. */
+static double interp_pos(void) {
+	return song_pos + (paused ? 0 : mono_now() - pos_stamp);
+}
+
+/* Worker threads post to wake_fd when they have results for the main
+ * loop, so it can sleep in poll() instead of checking on a timer. */
+static int wake_fd = -1;
+
+static void loop_wake(void) {
+	uint64_t one = 1;
+	if (wake_fd >= 0 && write(wake_fd, &one, sizeof(one)) < 0) {
+		/* the counter is already nonzero: the loop wakes anyway */
+	}
+}
+
+/* Coalesced seek and volume commands (ipc_flush() below). */
+#define REQ_SEEK 6
+#define REQ_VOLUME 7
+static int seek_dirty = 0;     /* seek_target not sent yet */
+static double seek_target = 0;
+static int seek_inflight = 0;  /* sent, not acknowledged */
+static int volume_dirty = 0;
+static int volume_inflight = 0;
+
+/* Radio mode (radio_next() below). */
+static int radio = 0;
+static double radio_ms = -1; /* wall time of the last nearest-neighbour search */
+static int radio_seen = 0;   /* vectors it compared */
+
+/* Crossfade (xfade_* below): while the next track ramps up on a second
+ * mpv, the outgoing one lives on in xf_pid / xf_fd / xf_socket. */
+static int crossfade_secs = 0;
+static pid_t xf_pid = -1;
+static int xf_fd = -1;
+static int xf_tfd = -1;          /* ramp timerfd, -1 = no crossfade */
+static const char *xf_socket;
+static double xf_t0, xf_len;
+static unsigned long long xf_ticks;
+static int xf_steps = 0;         /* steps in the last ramp */
+static double xf_late = 0;       /* worst step lateness in it, ms */
+
+/* Sleep timer (sleep_* near loop_tick()): every zone fades out and stops
+ * at sleep_at, a mono_now() time; 0 = off. */
+static double sleep_at = 0;
+static double sleep_fade = 0;    /* seconds of fade before sleep_at */
+static int sleep_fading = 0;
+
+/* Zones: independent playback contexts (own mpv and socket, queue,
+ * volume, loop and shuffle) over the one library, named by
+ * MUSIC_PLAYER_ZONES. The playback globals always belong to the zone
+ * being worked on; zone_switch() parks them in zones[] and loads another
+ * zone's. */
+#define MAX_ZONES 8
+struct zone {
+	char name[32];
+	char socket[2][108];     /* alternate slots, so a crossfade has two */
+	const char *mpv_socket;
+	pid_t mpv_pid;
+	int mpv_fd, playing, paused, volume, loop_mode, shuffle;
+	double song_pos, song_dur, pos_stamp;
+	uint64_t *played;
+	int nplayed, shuffle_pick;
+	int radio_from, radio_pick;
+	int *queue_buf;
+	int queue_cap, queue_head, queue_len;
+	int cache_waiting, song_stalls;
+	double cache_ahead;
+	int seek_dirty, seek_inflight, volume_dirty, volume_inflight;
+	double seek_target;
+	int norm_live, viz_live;
+	float norm_applied;
+	unsigned long long pf_hash;
+	pid_t xf_pid;
+	int xf_fd, xf_tfd;
+	const char *xf_socket;
+	double xf_t0, xf_len;
+	unsigned long long xf_ticks;
+	/* what the zone plays through once it is not on screen: the list
+	 * shown when it lost the keys, and where in it it is */
+	int *list, nlist, list_pos;
+};
+static struct zone zones[MAX_ZONES];
+static uint64_t zone_played[MAX_ZONES][(MAX_SONGS + 63) / 64];
+static int nzones = 1;
+static int zone_cur = 0;  /* whose state the globals hold */
+static int zone_view = 0; /* the zone keys control */
+static const char *mpv_socket = zones[0].socket[0];
+
+static void zone_switch(int z);
+
+static int ipc_open(const char *path) {
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) return -1;
 	struct sockaddr_un addr = { .sun_family = AF_UNIX };
-	strncpy(addr.sun_path, MPV_SOCKET, sizeof(addr.sun_path) - 1);
-	if (connect(mpv_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
-		close(mpv_fd);
-		mpv_fd = -1;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		close(fd);
 		return -1;
 	}
-	return 0;
+	return fd;
+}
+
+static int mpv_connect(void) {
+	if (mpv_fd >= 0) return 0;
+	mpv_fd = ipc_open(mpv_socket);
+	return mpv_fd < 0 ? -1 : 0;
 }
 
 static void mpv_disconnect(void) {
@@ -149,6 +390,7 @@ static void mpv_disconnect(void) {
 		close(mpv_fd);
 		mpv_fd = -1;
 	}
+	seek_inflight = volume_inflight = 0; /* their acks went with the socket */
 }
 
 static void mpv_cmd(const char *cmd) {
@@ -169,19 +411,143 @@ static double parse_response(const char *buf, int id) {
 	const char *sol = hit;
 	while (sol > buf && sol[-1] != '\n') sol--;
 	const char *data = strstr(sol, "\"data\":");
-	if (data && data < hit + 32)
-		return strtod(data + 7, NULL);
+	if (data && data < hit + 32) {
+		char *end;
+		double v = strtod(data + 7, &end);
+		if (end != data + 7) return v; /* not null or a string */
+	}
 	return -1;
 }
 
-/* Send both time-pos and duration queries at once, read all responses. */
+static int has_response(const char *buf, int id) {
+	char needle[32];
+	snprintf(needle, sizeof(needle), "\"request_id\":%d", id);
+	return strstr(buf, needle) != NULL;
+}
+
+/* "data":true in the response line for id; 0 when false or unavailable. */
+static int parse_flag(const char *buf, int id) {
+	char needle[32];
+	snprintf(needle, sizeof(needle), "\"request_id\":%d", id);
+	const char *hit = strstr(buf, needle);
+	if (!hit) return 0;
+	const char *sol = hit;
+	while (sol > buf && sol[-1] != '\n') sol--;
+	const char *data = strstr(sol, "\"data\":true");
+	return data && data < hit + 32;
+}
+
+/* An underrun: count it and give mpv a longer demuxer readahead. */
+static void cache_stall(void) {
+	song_stalls++;
+	total_stalls++;
+	cache_secs = cache_secs ? cache_secs * 2 : CACHE_SECS_MIN;
+	if (cache_secs > CACHE_SECS_MAX) cache_secs = CACHE_SECS_MAX;
+	char cmd[160];
+	snprintf(cmd, sizeof(cmd),
+		"{\"command\":[\"set_property\",\"cache\",\"yes\"]}\n"
+		"{\"command\":[\"set_property\",\"demuxer-readahead-secs\",%d]}\n", cache_secs);
+	mpv_cmd(cmd);
+}
+
+/* IPC coalescing: seek and volume keys only update the local target, and
+ * ipc_flush() sends one absolute seek and one volume set per frame, so
+ * autorepeat can't queue dozens of seeks in mpv. The position is shown at
+ * the target at once. Each flushed command carries a request id; until
+ * update_position() sees it acknowledged, mpv's own time-pos and volume
+ * are not trusted over the local values. After that they win, so a volume
+ * changed inside mpv is picked up. While paused, ipc_await_acks() reads
+ * the acks instead. */
+/* Seek to an absolute position, or relative to a pending target. */
+static void seek_to(double t, int relative) {
+	if (mpv_pid <= 0) return;
+	if (relative) t += seek_dirty ? seek_target : interp_pos();
+	if (song_dur > 0 && t > song_dur) t = song_dur;
+	if (t < 0) t = 0;
+	seek_target = t;
+	seek_dirty = 1;
+	song_pos = t;
+	pos_stamp = mono_now();
+}
+
+static void volume_step(int delta) {
+	volume += delta;
+	if (volume > 100) volume = 100;
+	if (volume < 0) volume = 0;
+	if (mpv_pid > 0) volume_dirty = 1;
+}
+
+/* Forget pending values; a new mpv starts at the current ones. */
+static void ipc_reset(void) {
+	seek_dirty = seek_inflight = 0;
+	volume_dirty = volume_inflight = 0;
+}
+
+/* Mark the coalesced commands answered in buf as acknowledged. */
+static void ipc_acks(const char *buf) {
+	if (has_response(buf, REQ_SEEK)) seek_inflight = 0;
+	if (has_response(buf, REQ_VOLUME)) volume_inflight = 0;
+}
+
+/* Read replies until the pending acks arrive (or 20 polls of 50ms pass).
+ * For the paused case: update_position() sends no queries then, so
+ * nothing else would read them. */
+static void ipc_await_acks(void) {
+	if (mpv_fd < 0) return;
+	char buf[4096];
+	int total = 0;
+	buf[0] = '\0';
+	struct pollfd pfd = { .fd = mpv_fd, .events = POLLIN };
+	for (int i = 0; i < 20 && (seek_inflight || volume_inflight); i++) {
+		if (poll(&pfd, 1, 50) <= 0) break;
+		if (total > (int)sizeof(buf) - 256) { /* mpv events: keep a tail */
+			memmove(buf, buf + total - 64, 64);
+			total = 64;
+		}
+		int r = read(mpv_fd, buf + total, sizeof(buf) - 1 - total);
+		if (r <= 0) { mpv_disconnect(); return; }
+		total += r;
+		buf[total] = '\0';
+		ipc_acks(buf);
+	}
+}
+
+/* Send whatever the frame's keys left pending, in one write. */
+static void ipc_flush(void) {
+	if (!seek_dirty && !volume_dirty) return;
+	char cmd[256];
+	int n = 0;
+	if (seek_dirty)
+		n += snprintf(cmd + n, sizeof(cmd) - n,
+			"{\"command\":[\"seek\",%.3f,\"absolute\"],\"request_id\":%d}\n",
+			seek_target, REQ_SEEK);
+	if (volume_dirty)
+		n += snprintf(cmd + n, sizeof(cmd) - n,
+			"{\"command\":[\"set_property\",\"volume\",%d],\"request_id\":%d}\n",
+			volume, REQ_VOLUME);
+	seek_inflight |= seek_dirty;
+	volume_inflight |= volume_dirty;
+	seek_dirty = volume_dirty = 0;
+	mpv_cmd(cmd);
+	if (paused) ipc_await_acks();
+}
+
+/* Send the position, duration, cache and volume queries at once, read all
+ * responses. */
 static void update_position(void) {
-	if (mpv_pid <= 0 || paused) return;
+	if (mpv_pid <= 0) return;
+	if (paused) {
+		ipc_await_acks();
+		return;
+	}
 	if (mpv_connect() != 0) return;
 
 	const char *cmds =
 		"{\"command\":[\"get_property\",\"time-pos\"],\"request_id\":1}\n"
-		"{\"command\":[\"get_property\",\"duration\"],\"request_id\":2}\n";
+		"{\"command\":[\"get_property\",\"duration\"],\"request_id\":2}\n"
+		"{\"command\":[\"get_property\",\"paused-for-cache\"],\"request_id\":3}\n"
+		"{\"command\":[\"get_property\",\"demuxer-cache-duration\"],\"request_id\":4}\n"
+		"{\"command\":[\"get_property\",\"volume\"],\"request_id\":5}\n";
 	if (write(mpv_fd, cmds, strlen(cmds)) < 0) {
 		mpv_disconnect();
 		return;
@@ -189,29 +555,408 @@ static void update_position(void) {
 
 	char buf[4096];
 	int total = 0;
+	buf[0] = '\0';
 	struct pollfd pfd = { .fd = mpv_fd, .events = POLLIN };
 	int got_pos = 0, got_dur = 0;
 
-	/* read until we have both responses or timeout */
-	for (int i = 0; i < 20 && !(got_pos && got_dur); i++) {
+	/* read until every request is answered (an error counts) or timeout */
+	for (int i = 0; i < 20 && !has_response(buf, 5); i++) {
 		if (poll(&pfd, 1, 50) <= 0) break;
 		int r = read(mpv_fd, buf + total, sizeof(buf) - 1 - total);
 		if (r <= 0) { mpv_disconnect(); return; }
 		total += r;
 		buf[total] = '\0';
 
-		if (!got_pos) {
+		if (!got_pos && !seek_inflight) {
 			double v = parse_response(buf, 1);
-			if (v >= 0) { song_pos = v; got_pos = 1; }
+			if (v >= 0) { song_pos = v; got_pos = 1; pos_stamp = mono_now(); }
 		}
 		if (!got_dur) {
 			double v = parse_response(buf, 2);
-			if (v >= 0) { song_dur = v; got_dur = 1; }
+			if (v >= 0) {
+				song_dur = v;
+				got_dur = 1;
+				if (playing >= 0 && meta_dur[playing] != (float)v) {
+					meta_dur[playing] = (float)v;
+					meta_changed |= 1u << F_DURATION;
+					view_gen++;
+				}
+			}
+		}
+	}
+	if (!has_response(buf, 5)) return;
+	int waiting = parse_flag(buf, 3);
+	if (waiting && !cache_waiting) cache_stall();
+	cache_waiting = waiting;
+	cache_ahead = parse_response(buf, 4);
+
+	/* acknowledged this round: the next round's answers are post-command */
+	int volume_acked = has_response(buf, REQ_VOLUME);
+	ipc_acks(buf);
+	if (!volume_acked && !volume_inflight && !volume_dirty && xf_tfd < 0 && !sleep_fading) { /* not mid-ramp */
+		double v = parse_response(buf, 5);
+		if (v >= 0) volume = v > 100 ? 100 : (int)(v + 0.5);
+	}
+}
+
+static int normalize = 1;
+static float norm_applied = 0; /* gain passed to the running mpv, dB */
+static int norm_live = 0;      /* an @norm filter is installed */
+
+/* Spectrum audio bar, measured by the playing mpv itself: the @viz filter
+ * (viz_filter()) is a lavfi side branch that splits a mono copy of the
+ * stream into VIZ_TAP_BANDS band-passes and prints each band's RMS,
+ * VIZ_FPS times a second, into a FIFO. The audio passes through untouched.
+ * The main loop keeps the frames by stream time and draws the one at the
+ * playback position. The Hann-windowed real FFT below serves --spectrum
+ * and the feature analysis. */
+#define VIZ_RATE 22050
+#define VIZ_N 1024             /* real samples per FFT */
+#define FFT_M (VIZ_N / 2)      /* complex FFT size after real packing */
+#define VIZ_MAX_BANDS 128
+#define VIZ_FPS 30
+#define VIZ_FMIN 40.0f
+#define VIZ_FLOOR_DB -70.0f
+#define VIZ_TAP_BANDS 16
+#define VIZ_FRAMES 64          /* measured frames kept, about 2s */
+
+struct viz_frame {
+	double t;                  /* stream time, s */
+	float db[VIZ_TAP_BANDS];   /* RMS per band, dBFS, floored */
+};
+
+static int viz_enabled = 0;
+static int viz_live = 0;             /* @viz is on the playing mpv */
+static int viz_fd = -1;              /* FIFO read end, kept open once made */
+static char viz_fifo[PATH_MAX];
+static struct viz_frame viz_frames[VIZ_FRAMES]; /* ring, newest at viz_head - 1 */
+static int viz_head = 0, viz_count = 0;
+static struct viz_frame viz_part;    /* frame being parsed */
+static int viz_part_open = 0;
+static char viz_line[256];           /* partial line from the FIFO */
+static int viz_line_len = 0;
+static float viz_level[VIZ_MAX_BANDS];
+static int viz_row = 0, viz_col = 0, viz_width = 0; /* last place draw() put the bar */
+static unsigned char viz_drawn[VIZ_MAX_BANDS]; /* glyph shown per cell */
+
+typedef float v4f __attribute__((vector_size(16)));
+
+static float fft_twr[FFT_M], fft_twi[FFT_M]; /* stage h twiddles at [h-1, 2h-1) */
+static float fft_postr[FFT_M], fft_posti[FFT_M];
+static float fft_window[VIZ_N];
+static int fft_rev[FFT_M];
+static int fft_ready = 0;
+
+static void fft_init(void) {
+	if (fft_ready) return;
+	const float pi = 3.14159265358979f;
+	for (int h = 1; h < FFT_M; h <<= 1)
+		for (int j = 0; j < h; j++) {
+			fft_twr[h - 1 + j] = cosf(-pi * j / h);
+			fft_twi[h - 1 + j] = sinf(-pi * j / h);
+		}
+	for (int k = 0; k < FFT_M; k++) {
+		fft_postr[k] = cosf(-2 * pi * k / VIZ_N);
+		fft_posti[k] = sinf(-2 * pi * k / VIZ_N);
+	}
+	for (int n = 0; n < VIZ_N; n++)
+		fft_window[n] = 0.5f - 0.5f * cosf(2 * pi * n / (VIZ_N - 1));
+	int bits = 0;
+	while ((1 << bits) < FFT_M) bits++;
+	for (int i = 0; i < FFT_M; i++) {
+		int r = 0;
+		for (int b = 0; b < bits; b++)
+			if (i & (1 << b)) r |= 1 << (bits - 1 - b);
+		fft_rev[i] = r;
+	}
+	fft_ready = 1;
+}
+
+/* In-place radix-2 complex FFT on split re/im arrays. Stages with at least
+ * four butterflies per group run four at a time on 128-bit vectors. */
+static void fft_complex(float *re, float *im) {
+	for (int i = 0; i < FFT_M; i++) {
+		int j = fft_rev[i];
+		if (j > i) {
+			float t = re[i]; re[i] = re[j]; re[j] = t;
+			t = im[i]; im[i] = im[j]; im[j] = t;
+		}
+	}
+	for (int h = 1; h < FFT_M; h <<= 1) {
+		const float *wr = fft_twr + h - 1, *wi = fft_twi + h - 1;
+		for (int k = 0; k < FFT_M; k += 2 * h) {
+			float *ar = re + k, *ai = im + k, *br = re + k + h, *bi = im + k + h;
+			int j = 0;
+			for (; h >= 4 && j < h; j += 4) {
+				v4f xr, xi, yr, yi, cr, ci;
+				memcpy(&xr, ar + j, sizeof(v4f));
+				memcpy(&xi, ai + j, sizeof(v4f));
+				memcpy(&yr, br + j, sizeof(v4f));
+				memcpy(&yi, bi + j, sizeof(v4f));
+				memcpy(&cr, wr + j, sizeof(v4f));
+				memcpy(&ci, wi + j, sizeof(v4f));
+				v4f tr = yr * cr - yi * ci;
+				v4f ti = yr * ci + yi * cr;
+				v4f o;
+				o = xr + tr; memcpy(ar + j, &o, sizeof(v4f));
+				o = xi + ti; memcpy(ai + j, &o, sizeof(v4f));
+				o = xr - tr; memcpy(br + j, &o, sizeof(v4f));
+				o = xi - ti; memcpy(bi + j, &o, sizeof(v4f));
+			}
+			for (; j < h; j++) {
+				float tr = br[j] * wr[j] - bi[j] * wi[j];
+				float ti = br[j] * wi[j] + bi[j] * wr[j];
+				br[j] = ar[j] - tr;
+				bi[j] = ai[j] - ti;
+				ar[j] += tr;
+				ai[j] += ti;
+			}
+		}
+	}
+}
+
+/* Magnitudes of bins 0..FFT_M-1 of a VIZ_N-point real signal, computed as
+ * an FFT_M-point complex FFT of the even/odd samples plus a split step. */
+static void fft_real_mag(const float *x, float *mag) {
+	float re[FFT_M], im[FFT_M];
+	for (int k = 0; k < FFT_M; k++) {
+		re[k] = x[2 * k];
+		im[k] = x[2 * k + 1];
+	}
+	fft_complex(re, im);
+	mag[0] = fabsf(re[0] + im[0]);
+	for (int k = 1; k < FFT_M; k++) {
+		float cr = re[FFT_M - k], ci = -im[FFT_M - k];
+		float er = (re[k] + cr) * 0.5f, ei = (im[k] + ci) * 0.5f;
+		float dr = (re[k] - cr) * 0.5f, di = (im[k] - ci) * 0.5f;
+		float orr = di, oi = -dr; /* -i * d */
+		float xr = er + orr * fft_postr[k] - oi * fft_posti[k];
+		float xi = ei + orr * fft_posti[k] + oi * fft_postr[k];
+		mag[k] = sqrtf(xr * xr + xi * xi);
+	}
+}
+
+/* Window samples[VIZ_N] (oldest first, -1..1), FFT, and bin into nbands
+ * log-spaced bands from VIZ_FMIN to Nyquist. Levels are 0..1. */
+static void spectrum_bands(const float *samples, int rate, int nbands, float *out) {
+	float x[VIZ_N], mag[FFT_M];
+	fft_init();
+	for (int n = 0; n < VIZ_N; n++)
+		x[n] = samples[n] * fft_window[n];
+	fft_real_mag(x, mag);
+
+	float fmax = rate / 2.0f;
+	float ratio = fmax / VIZ_FMIN;
+	float scale = 4.0f / VIZ_N; /* full-scale sine under Hann -> 1.0 */
+	for (int b = 0; b < nbands; b++) {
+		int lo = (int)(VIZ_FMIN * powf(ratio, (float)b / nbands) * VIZ_N / rate);
+		int hi = (int)(VIZ_FMIN * powf(ratio, (float)(b + 1) / nbands) * VIZ_N / rate);
+		if (lo < 1) lo = 1;
+		if (hi <= lo) hi = lo + 1;
+		if (hi > FFT_M) hi = FFT_M;
+		float peak = 0;
+		for (int k = lo; k < hi; k++)
+			if (mag[k] > peak) peak = mag[k];
+		float db = 20.0f * log10f(peak * scale + 1e-9f);
+		float v = (db - VIZ_FLOOR_DB) / -VIZ_FLOOR_DB;
+		out[b] = v < 0 ? 0 : v > 1 ? 1 : v;
+	}
+}
+
+/* Forget the frames and the bar; the next mpv starts without the tap
+ * until mpv_start() or viz_update() adds it. */
+static void viz_reset(void) {
+	viz_count = 0;
+	viz_part_open = 0;
+	memset(viz_level, 0, sizeof(viz_level));
+	viz_live = 0;
+}
+
+/* Make the FIFO and open its read end, once. Non-blocking, so mpv's open
+ * of the write end never waits on us; the pipe is grown so a busy main
+ * loop never holds up mpv's filter thread. */
+static int viz_fifo_open(void) {
+	if (viz_fd >= 0) return 0;
+	if (!run_dir[0]) return -1;
+	snprintf(viz_fifo, sizeof(viz_fifo), "%s/viz.%d.fifo", run_dir, (int)getpid());
+	unlink(viz_fifo);
+	if (mkfifo(viz_fifo, 0600) != 0) {
+		viz_fifo[0] = '\0';
+		return -1;
+	}
+	viz_fd = open(viz_fifo, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (viz_fd < 0) {
+		unlink(viz_fifo);
+		viz_fifo[0] = '\0';
+		return -1;
+	}
+	fcntl(viz_fd, F_SETPIPE_SZ, 1 << 20);
+	return 0;
+}
+
+static void viz_close(void) {
+	if (viz_fd >= 0) {
+		close(viz_fd);
+		viz_fd = -1;
+	}
+	if (viz_fifo[0]) {
+		unlink(viz_fifo);
+		viz_fifo[0] = '\0';
+	}
+}
+
+/* Centre of tap band b, log-spaced from VIZ_FMIN to 10 kHz. */
+static float viz_band_hz(int b) {
+	return VIZ_FMIN * powf(10000.0f / VIZ_FMIN, (float)b / (VIZ_TAP_BANDS - 1));
+}
+
+/* The @viz filter for --af or "af pre", into out. astats prints one
+ * lavfi.astats.<band>.RMS_level line per band and frame; ametadata writes
+ * them to the FIFO as they come. 0 when the FIFO is unavailable or its
+ * path would need escaping inside the graph. */
+static int viz_filter(char *out, size_t size) {
+	if (viz_fifo_open() != 0 || strpbrk(viz_fifo, "\\'\":,;[]%= ")) return 0;
+	char graph[3072];
+	int n = snprintf(graph, sizeof(graph),
+		"asplit[vo][va];[va]aformat=sample_fmts=flt:sample_rates=%d:channel_layouts=mono,"
+		"asetnsamples=n=%d,asplit=%d", VIZ_RATE, VIZ_RATE / VIZ_FPS, VIZ_TAP_BANDS);
+	for (int b = 0; b < VIZ_TAP_BANDS; b++)
+		n += snprintf(graph + n, sizeof(graph) - n, "[b%d]", b);
+	for (int b = 0; b < VIZ_TAP_BANDS; b++)
+		n += snprintf(graph + n, sizeof(graph) - n,
+			";[b%d]bandpass=f=%.0f:width_type=o:w=0.6[c%d]", b, viz_band_hz(b), b);
+	n += snprintf(graph + n, sizeof(graph) - n, ";");
+	for (int b = 0; b < VIZ_TAP_BANDS; b++)
+		n += snprintf(graph + n, sizeof(graph) - n, "[c%d]", b);
+	n += snprintf(graph + n, sizeof(graph) - n,
+		"amerge=inputs=%d,astats=metadata=1:reset=1:measure_overall=none:"
+		"measure_perchannel=RMS_level,ametadata=mode=print:file=%s:direct=1,anullsink",
+		VIZ_TAP_BANDS, viz_fifo);
+	/* %len% quoting: mpv takes the graph verbatim */
+	return n < (int)sizeof(graph) &&
+		snprintf(out, size, "@viz:lavfi=%%%d%%%s", n, graph) < (int)size;
+}
+
+/* One line of ametadata output. "frame:N pts:P pts_time:T" opens a frame;
+ * "lavfi.astats.<ch>.RMS_level=<dB>" fills band ch - 1, and the last band
+ * puts the frame in the ring. */
+static void viz_parse_line(const char *line) {
+	const char *t = strstr(line, "pts_time:");
+	if (strncmp(line, "frame:", 6) == 0) {
+		viz_part_open = t != NULL;
+		if (t) viz_part.t = strtod(t + 9, NULL);
+		return;
+	}
+	int ch;
+	const char *eq = strchr(line, '=');
+	if (!viz_part_open || !eq || sscanf(line, "lavfi.astats.%d.", &ch) != 1 ||
+	    ch < 1 || ch > VIZ_TAP_BANDS || strncmp(eq - 10, ".RMS_level", 10) != 0)
+		return;
+	float db = strtof(eq + 1, NULL); /* "-inf" for silence */
+	viz_part.db[ch - 1] = db > VIZ_FLOOR_DB ? db : VIZ_FLOOR_DB;
+	if (ch < VIZ_TAP_BANDS) return;
+	viz_frames[viz_head] = viz_part;
+	viz_head = (viz_head + 1) % VIZ_FRAMES;
+	if (viz_count < VIZ_FRAMES) viz_count++;
+	viz_part_open = 0;
+}
+
+/* Take whatever mpv has written; never blocks. */
+static void viz_drain(void) {
+	if (viz_fd < 0) return;
+	char buf[4096];
+	ssize_t r;
+	while ((r = read(viz_fd, buf, sizeof(buf))) > 0)
+		for (ssize_t i = 0; i < r; i++) {
+			if (buf[i] != '\n') {
+				if (viz_line_len < (int)sizeof(viz_line) - 1)
+					viz_line[viz_line_len++] = buf[i];
+				continue;
+			}
+			viz_line[viz_line_len] = '\0';
+			viz_parse_line(viz_line);
+			viz_line_len = 0;
+		}
+}
+
+/* The newest frame at the playback position, if one is that recent. mpv
+ * filters ahead of what is audible, and after a seek the ring still holds
+ * frames from before it, so both sides are bounded. */
+static const struct viz_frame *viz_frame_at(double pos) {
+	const struct viz_frame *best = NULL;
+	for (int k = 0; k < viz_count; k++) {
+		const struct viz_frame *f = &viz_frames[(viz_head - 1 - k + VIZ_FRAMES) % VIZ_FRAMES];
+		if (f->t <= pos + 0.01 && f->t > pos - 0.5 && (!best || f->t > best->t))
+			best = f;
+	}
+	return best;
+}
+
+static int viz_active(void) {
+	return viz_enabled && mpv_pid > 0 && playing >= 0;
+}
+
+/* Keep the tap in step with b, drain the FIFO and set the bar from the
+ * frame at the playback position. The tap sits ahead of @norm, so the
+ * applied gain is added here; bands are interpolated across the columns. */
+static void viz_update(void) {
+	viz_drain();
+	if (viz_live && !viz_enabled) {
+		mpv_cmd("{\"command\":[\"af\",\"remove\",\"@viz\"]}\n");
+		viz_live = 0;
+		memset(viz_level, 0, sizeof(viz_level));
+	}
+	if (!viz_active() || paused) return;
+	if (!viz_live) {
+		char filter[4096], cmd[4200];
+		if (viz_filter(filter, sizeof(filter)) && mpv_connect() == 0) {
+			snprintf(cmd, sizeof(cmd), "{\"command\":[\"af\",\"pre\",\"%s\"]}\n", filter);
+			mpv_cmd(cmd);
+			viz_live = 1;
+		}
+	}
+
+	if (viz_width <= 0) return;
+	const struct viz_frame *f = viz_frame_at(interp_pos());
+	float gain = norm_live ? norm_applied : 0;
+	int nb = viz_width < VIZ_MAX_BANDS ? viz_width : VIZ_MAX_BANDS;
+	for (int c = 0; c < nb; c++) {
+		float lv = 0;
+		if (f) {
+			float x = (c + 0.5f) * VIZ_TAP_BANDS / nb - 0.5f;
+			if (x < 0) x = 0;
+			if (x > VIZ_TAP_BANDS - 1) x = VIZ_TAP_BANDS - 1;
+			int i = (int)x, j = i + 1 < VIZ_TAP_BANDS ? i + 1 : i;
+			float db = f->db[i] + (f->db[j] - f->db[i]) * (x - i) + gain;
+			lv = (db - VIZ_FLOOR_DB) / -VIZ_FLOOR_DB;
+			lv = lv < 0 ? 0 : lv > 1 ? 1 : lv;
 		}
+		float decayed = viz_level[c] * 0.8f;
+		viz_level[c] = lv > decayed ? lv : decayed;
+	}
+}
+
+/* Stop the outgoing crossfade instance and the ramp timer. */
+static void xfade_retire(void) {
+	if (xf_tfd >= 0) {
+		close(xf_tfd);
+		xf_tfd = -1;
+	}
+	if (xf_fd >= 0) {
+		close(xf_fd);
+		xf_fd = -1;
+	}
+	if (xf_pid > 0) {
+		kill(xf_pid, SIGTERM);
+		waitpid(xf_pid, NULL, 0);
+		xf_pid = -1;
+		unlink(xf_socket);
 	}
 }
 
 static void kill_mpv(void) {
+	xfade_retire();
+	viz_reset();
 	mpv_disconnect();
 	if (mpv_pid > 0) {
 		kill(mpv_pid, SIGTERM);
@@ -222,12 +967,23 @@ static void kill_mpv(void) {
 	}
 	song_pos = 0;
 	song_dur = 0;
-	unlink(MPV_SOCKET);
+	ipc_reset();
+	unlink(mpv_socket);
 }
 
+static void state_bin_sync(void);
+
 static void cleanup(void) {
-	kill_mpv();
-	term_restore();
+	if (!replay_mode) state_bin_sync();
+	for (int z = nzones - 1; z >= 0; z--) {
+		zone_switch(z);
+		kill_mpv();
+	}
+	viz_close();
+	if (daemon_mode)
+		unlink(ctl_socket);
+	else if (!replay_mode)
+		term_restore();
 }
 
 static void sig_handler(int sig) {
@@ -261,6 +1017,240 @@ static void term_raw(void) {
 			sizeof(ENABLE_KITTY_KBD) - 1);
 }
 
+/* Display width per codepoint, 2 bits each for the BMP, built once from
+ * the East Asian Wide/Fullwidth and combining-mark ranges so that laying
+ * out a row is a table lookup per character. */
+static unsigned char cp_width_tab[0x10000 / 4];
+
+static void width_table_init(void) {
+	static const unsigned zero[][2] = {
+		{ 0x0300, 0x036f }, { 0x0483, 0x0489 }, { 0x0591, 0x05bd }, { 0x05bf, 0x05c7 },
+		{ 0x0610, 0x061a }, { 0x064b, 0x065f }, { 0x0670, 0x0670 }, { 0x06d6, 0x06ed },
+		{ 0x0900, 0x0903 }, { 0x093a, 0x094f }, { 0x0e31, 0x0e31 }, { 0x0e34, 0x0e3a },
+		{ 0x0e47, 0x0e4e }, { 0x1ab0, 0x1aff }, { 0x1dc0, 0x1dff }, { 0x200b, 0x200f },
+		{ 0x202a, 0x202e }, { 0x2060, 0x2064 }, { 0x20d0, 0x20ff }, { 0x302a, 0x302f },
+		{ 0x3099, 0x309a }, { 0xfe00, 0xfe0f }, { 0xfe20, 0xfe2f }, { 0xfeff, 0xfeff },
+	};
+	static const unsigned wide[][2] = {
+		{ 0x1100, 0x115f }, { 0x231a, 0x231b }, { 0x2329, 0x232a }, { 0x23e9, 0x23ec },
+		{ 0x25fd, 0x25fe }, { 0x2614, 0x2615 }, { 0x2648, 0x2653 }, { 0x26a1, 0x26a1 },
+		{ 0x26aa, 0x26ab }, { 0x26bd, 0x26be }, { 0x26c4, 0x26c5 }, { 0x26d4, 0x26d4 },
+		{ 0x26ea, 0x26ea }, { 0x26f2, 0x26f5 }, { 0x26fa, 0x26fd }, { 0x2705, 0x2705 },
+		{ 0x270a, 0x270b }, { 0x2728, 0x2728 }, { 0x274c, 0x274c }, { 0x2753, 0x2755 },
+		{ 0x2757, 0x2757 }, { 0x2795, 0x2797 }, { 0x27b0, 0x27b0 }, { 0x2b1b, 0x2b1c },
+		{ 0x2b50, 0x2b55 }, { 0x2e80, 0x3029 }, { 0x3030, 0x303e }, { 0x3041, 0x3098 },
+		{ 0x309b, 0x33ff }, { 0x3400, 0x4dbf }, { 0x4e00, 0x9fff }, { 0xa000, 0xa4cf },
+		{ 0xa960, 0xa97f }, { 0xac00, 0xd7a3 }, { 0xf900, 0xfaff }, { 0xfe10, 0xfe19 },
+		{ 0xfe30, 0xfe6f }, { 0xff00, 0xff60 }, { 0xffe0, 0xffe6 },
+	};
+	memset(cp_width_tab, 0x55, sizeof(cp_width_tab)); /* width 1 everywhere */
+	for (size_t r = 0; r < sizeof(zero) / sizeof(zero[0]); r++)
+		for (unsigned c = zero[r][0]; c <= zero[r][1]; c++)
+			cp_width_tab[c >> 2] &= ~(3 << (c & 3) * 2);
+	for (size_t r = 0; r < sizeof(wide) / sizeof(wide[0]); r++)
+		for (unsigned c = wide[r][0]; c <= wide[r][1]; c++)
+			cp_width_tab[c >> 2] = (cp_width_tab[c >> 2] & ~(3 << (c & 3) * 2)) | 2 << (c & 3) * 2;
+}
+
+static int cp_width(unsigned c) {
+	if (c < 0x10000) return cp_width_tab[c >> 2] >> (c & 3) * 2 & 3;
+	if ((c >= 0x1f300 && c <= 0x1f64f) || (c >= 0x1f900 && c <= 0x1faff) ||
+	    (c >= 0x20000 && c <= 0x3fffd))
+		return 2;
+	if (c >= 0xe0000 && c <= 0xe01ef) return 0; /* tags, variation selectors */
+	return 1;
+}
+
+/* Decode one UTF-8 sequence; malformed bytes count as one column each. */
+static int utf8_next(const char *s, unsigned *cp) {
+	const unsigned char *u = (const unsigned char *)s;
+	int n = u[0] < 0x80 ? 1 : (u[0] & 0xe0) == 0xc0 ? 2 : (u[0] & 0xf0) == 0xe0 ? 3 :
+		(u[0] & 0xf8) == 0xf0 ? 4 : 0;
+	if (n == 0) {
+		*cp = 0xfffd;
+		return 1;
+	}
+	unsigned c = n == 1 ? u[0] : u[0] & (0x7f >> n);
+	for (int i = 1; i < n; i++) {
+		if ((u[i] & 0xc0) != 0x80) {
+			*cp = 0xfffd;
+			return 1;
+		}
+		c = c << 6 | (u[i] & 0x3f);
+	}
+	*cp = c;
+	return n;
+}
+
+/* Bytes of the longest prefix of s that fits in cols columns; *used gets
+ * the columns it covers. ASCII runs skip the decoder. */
+static int text_fit(const char *s, int cols, int *used) {
+	int i = 0, w = 0;
+	while (s[i]) {
+		if ((unsigned char)s[i] < 0x80) {
+			if (w + 1 > cols) break;
+			i++;
+			w++;
+			continue;
+		}
+		unsigned cp;
+		int n = utf8_next(s + i, &cp);
+		int cw = cp_width(cp);
+		if (w + cw > cols) break;
+		i += n;
+		w += cw;
+	}
+	*used = w;
+	return i;
+}
+
+static int text_width(const char *s) {
+	int w;
+	text_fit(s, 1 << 30, &w);
+	return w;
+}
+
+/* Prefix of songs[idx] that fits in cols; cached per song for the last
+ * width asked, which is what every redraw at a fixed size asks again. */
+static int song_fit(int idx, int cols, int *used) {
+	struct textw *t = &meta_textw[idx];
+	if (cols < 0) cols = 0;
+	if (cols >= t->width) {
+		*used = t->width;
+		return (int)strlen(songs[idx]);
+	}
+	if (t->fit_cols != cols) {
+		int u;
+		t->fit_len = text_fit(songs[idx], cols, &u);
+		t->fit_used = u;
+		t->fit_cols = cols;
+	}
+	*used = t->fit_used;
+	return t->fit_len;
+}
+
+/* Put songs[idx]'s vector in feat_lanes, or mark it absent (v NULL). */
+static void feat_lane_set(int idx, const float *v) {
+	for (int k = 0; k < FEAT_DIM; k++) {
+		long q = v ? lrintf(v[k] * FEAT_STEPS) : 0;
+		feat_lanes[idx / 16][k][idx % 16] = q < -FEAT_QMAX ? -FEAT_QMAX : q > FEAT_QMAX ? FEAT_QMAX : q;
+	}
+	if (v)
+		feat_have[idx / 16] |= 1u << (idx % 16);
+	else
+		feat_have[idx / 16] &= ~(1u << (idx % 16));
+}
+
+/* Every column but size and added, which come from stat(). */
+static void meta_fill_name(int idx) {
+	const char *name = songs[idx];
+	const char *ext = strrchr(name, '.');
+	const char *sep = strstr(name, " - ");
+	int end = (ext && ext != name) ? (int)(ext - name) : (int)strlen(name);
+
+	if (sep && sep - name < end) {
+		meta_artist[idx] = strndup(name, sep - name);
+		meta_title[idx] = strndup(sep + 3, end - (sep + 3 - name));
+	} else {
+		meta_artist[idx] = strdup("");
+		meta_title[idx] = strndup(name, end);
+	}
+	meta_dur[idx] = 0;
+	meta_plays[idx] = 0;
+	meta_skips[idx] = 0;
+	meta_last[idx] = 0;
+	meta_lufs[idx] = NAN;
+	meta_peak[idx] = NAN;
+	meta_wave[idx] = -1;
+	meta_feat[idx] = -1;
+	meta_head[idx] = 0;
+	meta_hash[idx] = 0;
+	feat_lane_set(idx, NULL);
+	int w = text_width(name);
+	meta_textw[idx] = (struct textw){ w > 0xffff ? 0xffff : w, 0xffff, 0, 0 };
+}
+
+/* Derive artist/title columns from "Artist - Title.ext" and stat the file. */
+static void meta_fill(int idx) {
+	const char *name = songs[idx];
+	meta_fill_name(idx);
+
+	char path[PATH_MAX];
+	struct stat st;
+	snprintf(path, sizeof(path), "%s/%s", songs_dir, name);
+	if (stat(path, &st) == 0) {
+		meta_added[idx] = st.st_mtime;
+		meta_size[idx] = st.st_size;
+	} else {
+		meta_added[idx] = 0;
+		meta_size[idx] = 0;
+	}
+}
+
+/* Move the metadata row of songs[src] to slot dst (dst <= src) while
+ * compacting after removals. */
+static void meta_move(int dst, int src) {
+	meta_artist[dst] = meta_artist[src];
+	meta_title[dst] = meta_title[src];
+	meta_dur[dst] = meta_dur[src];
+	meta_plays[dst] = meta_plays[src];
+	meta_skips[dst] = meta_skips[src];
+	meta_added[dst] = meta_added[src];
+	meta_last[dst] = meta_last[src];
+	meta_size[dst] = meta_size[src];
+	meta_lufs[dst] = meta_lufs[src];
+	meta_peak[dst] = meta_peak[src];
+	meta_wave[dst] = meta_wave[src];
+	meta_feat[dst] = meta_feat[src];
+	meta_head[dst] = meta_head[src];
+	meta_hash[dst] = meta_hash[src];
+	feat_lane_set(dst, NULL);
+	if (feat_have[src / 16] >> (src % 16) & 1) {
+		for (int k = 0; k < FEAT_DIM; k++)
+			feat_lanes[dst / 16][k][dst % 16] = feat_lanes[src / 16][k][src % 16];
+		feat_have[dst / 16] |= 1u << (dst % 16);
+	}
+	meta_textw[dst] = meta_textw[src];
+}
+
+/* Row i of an n-row column of size-byte cells takes row order[i]. */
+static void column_permute(void *col, size_t size, const int *order, int n) {
+	static char tmp[MAX_SONGS * sizeof(long long)];
+	for (int i = 0; i < n; i++)
+		memcpy(tmp + i * size, (char *)col + order[i] * size, size);
+	memcpy(col, tmp, n * size);
+}
+
+/* Reorder songs[] and the metadata columns so row i takes what row
+ * order[i] held. Only runs before analysis_start() attaches the caches,
+ * so there are no feature lanes to carry. */
+static void meta_permute(const int *order, int n) {
+	column_permute(songs, sizeof(songs[0]), order, n);
+	column_permute(meta_artist, sizeof(meta_artist[0]), order, n);
+	column_permute(meta_title, sizeof(meta_title[0]), order, n);
+	column_permute(meta_dur, sizeof(meta_dur[0]), order, n);
+	column_permute(meta_plays, sizeof(meta_plays[0]), order, n);
+	column_permute(meta_skips, sizeof(meta_skips[0]), order, n);
+	column_permute(meta_added, sizeof(meta_added[0]), order, n);
+	column_permute(meta_last, sizeof(meta_last[0]), order, n);
+	column_permute(meta_size, sizeof(meta_size[0]), order, n);
+	column_permute(meta_lufs, sizeof(meta_lufs[0]), order, n);
+	column_permute(meta_peak, sizeof(meta_peak[0]), order, n);
+	column_permute(meta_wave, sizeof(meta_wave[0]), order, n);
+	column_permute(meta_feat, sizeof(meta_feat[0]), order, n);
+	column_permute(meta_head, sizeof(meta_head[0]), order, n);
+	column_permute(meta_hash, sizeof(meta_hash[0]), order, n);
+	column_permute(meta_textw, sizeof(meta_textw[0]), order, n);
+}
+
+static int song_entry(const struct dirent *d) {
+	const char *ext = strrchr(d->d_name, '.');
+	return d->d_name[0] != '.' && d->d_type == DT_REG &&
+		!(ext && strcmp(ext, ".lrc") == 0); /* lyrics sidecars aren't songs */
+}
+
+/* The whole library at once, for the command-line modes; the TUI and the
+ * daemon stream it in with scan_start() below. */
 static int scan_songs(void) {
 	struct dirent **namelist;
 	int n = scandir(songs_dir, &namelist, NULL, alphasort);
@@ -268,9 +1258,12 @@ static int scan_songs(void) {
 		die("scandir");
 
 	for (int i = 0; i < n; i++) {
-		if (namelist[i]->d_name[0] != '.' && namelist[i]->d_type == DT_REG) {
-			if (nsongs < MAX_SONGS)
-				songs[nsongs++] = strdup(namelist[i]->d_name);
+		if (song_entry(namelist[i])) {
+			if (nsongs < MAX_SONGS) {
+				songs[nsongs] = strdup(namelist[i]->d_name);
+				meta_fill(nsongs);
+				nsongs++;
+			}
 		}
 		free(namelist[i]);
 	}
@@ -278,6 +1271,94 @@ static int scan_songs(void) {
 	return nsongs;
 }
 
+/* Background library scan: a worker reads songs_dir entry by entry,
+ * stats the files and hands them over in batches, at most SCAN_BATCH
+ * songs or SCAN_BATCH_MS apart, through scan_ready and loop_wake(), so
+ * a slow directory shows its first songs before the listing ends.
+ * scan_poll() appends each batch to songs[] in directory order, so
+ * indices never shift while the list fills, and puts songs[] in name
+ * order with songs_sort() once the last batch is in. */
+#define SCAN_BATCH 1024
+#define SCAN_BATCH_MS 50
+
+struct scan_batch {
+	struct scan_batch *next;
+	int n;
+	char *name[SCAN_BATCH];
+	long long size[SCAN_BATCH], mtime[SCAN_BATCH];
+};
+
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct scan_batch *scan_ready;           /* oldest first */
+static struct scan_batch **scan_ready_tail = &scan_ready;
+static int scan_finished = 0; /* worker side: nothing more will come */
+static int scan_errno = 0;    /* scandir() failed */
+static int scan_active = 0;   /* main side: the library is still filling */
+static double scan_t0, scan_ms;
+static struct stat scan_dir_st; /* songs_dir as it was before the listing */
+
+static void scan_publish(struct scan_batch *b, int finished, int err) {
+	pthread_mutex_lock(&scan_lock);
+	if (b) {
+		*scan_ready_tail = b;
+		scan_ready_tail = &b->next;
+	}
+	scan_finished = finished;
+	scan_errno = err;
+	pthread_mutex_unlock(&scan_lock);
+	loop_wake();
+}
+
+static void *scan_worker(void *arg) {
+	(void)arg;
+	if (stat(songs_dir, &scan_dir_st) != 0) scan_dir_st.st_ino = 0;
+	DIR *dir = opendir(songs_dir);
+	if (!dir) {
+		scan_publish(NULL, 1, errno);
+		return NULL;
+	}
+	struct scan_batch *b = NULL;
+	double sent = mono_now();
+	char path[PATH_MAX];
+	struct dirent *d;
+	int err = 0;
+	for (;;) {
+		errno = 0;
+		if (!(d = readdir(dir))) {
+			err = errno;
+			break;
+		}
+		if (!song_entry(d)) continue;
+		if (!b && !(b = calloc(1, sizeof(*b)))) break;
+		struct stat st;
+		snprintf(path, sizeof(path), "%s/%s", songs_dir, d->d_name);
+		int ok = stat(path, &st) == 0;
+		b->name[b->n] = strdup(d->d_name);
+		b->size[b->n] = ok ? st.st_size : 0;
+		b->mtime[b->n] = ok ? st.st_mtime : 0;
+		if (b->name[b->n]) b->n++;
+		double now = mono_now();
+		if (b->n == SCAN_BATCH || now - sent >= SCAN_BATCH_MS / 1000.0) {
+			scan_publish(b, 0, 0);
+			b = NULL;
+			sent = now;
+		}
+	}
+	closedir(dir);
+	scan_publish(b, 1, err);
+	return NULL;
+}
+
+static void scan_start(void) {
+	pthread_t t;
+	scan_active = 1;
+	scan_t0 = mono_now();
+	if (pthread_create(&t, NULL, scan_worker, NULL) == 0)
+		pthread_detach(t);
+	else
+		scan_worker(NULL);
+}
+
 static void scan_playlists(void) {
 	struct dirent **namelist;
 	int n = scandir(playlists_dir, &namelist, NULL, alphasort);
@@ -285,657 +1366,7773 @@ static void scan_playlists(void) {
 
 	for (int i = 0; i < n; i++) {
 		const char *name = namelist[i]->d_name;
-		const char *ext = strstr(name, ".playlist");
-		if (ext && ext[9] == '\0' && ext != name) {
-			if (nplaylists < MAX_PLAYLISTS) {
-				int baselen = ext - name;
-				playlists[nplaylists] = malloc(baselen + 1);
-				memcpy(playlists[nplaylists], name, baselen);
-				playlists[nplaylists][baselen] = '\0';
-				nplaylists++;
-			}
+		const char *ext = strrchr(name, '.');
+		int kind = -1;
+		if (ext && ext != name) {
+			if (strcmp(ext, ".playlist") == 0) kind = PL_FILE;
+			else if (strcmp(ext, ".smart") == 0) kind = PL_SMART;
+		}
+		if (kind >= 0 && nplaylists < MAX_PLAYLISTS) {
+			int baselen = ext - name;
+			playlists[nplaylists] = malloc(baselen + 1);
+			memcpy(playlists[nplaylists], name, baselen);
+			playlists[nplaylists][baselen] = '\0';
+			playlist_kind[nplaylists] = kind;
+			nplaylists++;
 		}
 		free(namelist[i]);
 	}
 	free(namelist);
 }
 
-static void load_playlist(int idx);
-static int find_in_display(int song_idx);
-static int song_at(int pos);
-static int display_len(void);
-static void play_song(int idx);
+/* Built-in views over the play history, listed after the playlist files. */
+static void add_history_views(void) {
+	static const char *views[][2] = {
+		{ "Recently played", "played>0 order by played desc limit 100" },
+		{ "Most played", "plays>0 order by plays desc limit 100" },
+	};
+	for (int i = 0; i < 2 && nplaylists < MAX_PLAYLISTS; i++) {
+		playlists[nplaylists] = strdup(views[i][0]);
+		playlist_kind[nplaylists] = PL_SMART;
+		playlist_query[nplaylists] = views[i][1];
+		nplaylists++;
+	}
+}
 
-static void load_state(void) {
-	FILE *f = fopen(state_file, "r");
-	if (!f) return;
-	char line[1024];
-	while (fgets(line, sizeof(line), f)) {
-		int len = strlen(line);
-		while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
-			line[--len] = '\0';
+/* Open-addressing hash from filename to songs[] index. */
+#define SONG_INDEX_SIZE (MAX_SONGS * 2)
+static int song_index[SONG_INDEX_SIZE]; /* songs[] index + 1, 0 = empty */
 
-		int v;
-		char s[16];
-		if (sscanf(line, "volume=%d", &v) == 1) {
-			if (v >= 0 && v <= 100) volume = v;
-		} else if (strncmp(line, "song=", 5) == 0) {
-			strncpy(saved_song, line + 5, sizeof(saved_song) - 1);
-			saved_song[sizeof(saved_song) - 1] = '\0';
-		} else if (sscanf(line, "position=%lf", &saved_pos) == 1) {
-			/* parsed inline */
-		} else if (strncmp(line, "cursor=", 7) == 0) {
-			strncpy(saved_cursor, line + 7, sizeof(saved_cursor) - 1);
-			saved_cursor[sizeof(saved_cursor) - 1] = '\0';
-		} else if (strncmp(line, "playlist=", 9) == 0) {
-			strncpy(saved_playlist, line + 9, sizeof(saved_playlist) - 1);
-			saved_playlist[sizeof(saved_playlist) - 1] = '\0';
-		} else if (sscanf(line, "loop=%15s", s) == 1) {
-			if (strcmp(s, "single") == 0) loop_mode = LOOP_SINGLE;
-			else loop_mode = LOOP_ALL;
-		} else if (sscanf(line, "shuffle=%d", &v) == 1) {
-			shuffle = (v != 0);
-		} else if (sscanf(line, "paused=%d", &v) == 1) {
-			saved_paused = (v != 0);
-		}
+static unsigned long long fnv1a(const char *s) {
+	unsigned long long h = 1469598103934665603ULL;
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 1099511628211ULL;
 	}
-	fclose(f);
+	return h;
 }
 
-static void save_state(void) {
-	FILE *f = fopen(state_file, "w");
-	if (!f) return;
-	fprintf(f, "volume=%d\n", volume);
-	if (playing >= 0) {
-		fprintf(f, "song=%s\n", songs[playing]);
-		fprintf(f, "position=%.2f\n", song_pos);
-		fprintf(f, "paused=%d\n", paused);
-	}
-	if (display_len() > 0 && cursor >= 0 && cursor < display_len())
-		fprintf(f, "cursor=%s\n", songs[song_at(cursor)]);
-	if (playlist_active >= 0)
-		fprintf(f, "playlist=%s\n", playlists[playlist_active]);
-	fprintf(f, "loop=%s\n", (loop_mode == LOOP_SINGLE) ? "single" : "all");
-	fprintf(f, "shuffle=%d\n", shuffle);
-	fclose(f);
+static void song_index_put(int i, unsigned long long hash) {
+	unsigned slot = hash % SONG_INDEX_SIZE;
+	while (song_index[slot]) slot = (slot + 1) % SONG_INDEX_SIZE;
+	song_index[slot] = i + 1;
 }
 
-static void restore_state(void) {
-	/* restore playlist first (affects find_in_display) */
-	if (saved_playlist[0]) {
-		for (int i = 0; i < nplaylists; i++) {
-			if (strcmp(playlists[i], saved_playlist) == 0) {
-				playlist_active = i;
-				load_playlist(i);
-				break;
-			}
-		}
+static void song_index_add(int i) {
+	song_index_put(i, fnv1a(songs[i]));
+}
+
+static void song_index_rebuild(void) {
+	memset(song_index, 0, sizeof(song_index));
+	for (int i = 0; i < nsongs; i++)
+		song_index_add(i);
+}
+
+static int song_find(const char *name) {
+	unsigned slot = fnv1a(name) % SONG_INDEX_SIZE;
+	while (song_index[slot]) {
+		int i = song_index[slot] - 1;
+		if (strcmp(songs[i], name) == 0) return i;
+		slot = (slot + 1) % SONG_INDEX_SIZE;
 	}
+	return -1;
+}
 
-	/* restore cursor */
-	if (saved_cursor[0]) {
-		for (int i = 0; i < nsongs; i++) {
-			if (strcmp(songs[i], saved_cursor) == 0) {
-				cursor = find_in_display(i);
-				break;
-			}
-		}
+/* cache/library: the last complete scan, for the query commands. It holds
+ * while songs_dir's device, inode and mtime still match the stat taken
+ * before that scan listed it, so adding, removing or renaming a song
+ * retires it; a file rewritten in place keeps its old size and mtime here
+ * until the next scan. Layout: the header, then fnv1a hash, size and mtime
+ * as int64 arrays of count, then the names NUL-terminated in scan order.
+ * The hashes rebuild song_index without rereading every name. */
+#define LIB_MAGIC 0x494c504dU /* "MPLI" */
+#define LIB_VERSION 1
+
+struct lib_header {
+	uint32_t magic, version, count, pad;
+	uint64_t dev, ino;
+	int64_t dir_sec, dir_nsec;
+	uint64_t names_len;
+};
+
+static const uint64_t *lib_hash; /* into the mapping, after library_load() */
+static const int64_t *lib_size, *lib_mtime;
+
+static int lib_current(const struct lib_header *h, const struct stat *dir) {
+	return h->magic == LIB_MAGIC && h->version == LIB_VERSION && dir->st_ino &&
+		h->dev == (uint64_t)dir->st_dev && h->ino == (uint64_t)dir->st_ino &&
+		h->dir_sec == (int64_t)dir->st_mtim.tv_sec &&
+		h->dir_nsec == (int64_t)dir->st_mtim.tv_nsec;
+}
+
+/* Write songs[] as scanned from scan_dir_st, unless the file already
+ * describes that listing. */
+static void library_save(void) {
+	if (replay_mode) return;
+	char path[PATH_MAX], tmp[PATH_MAX + 8];
+	snprintf(path, sizeof(path), "%s/library", cache_dir);
+	struct lib_header h = { 0 };
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		int same = read(fd, &h, sizeof(h)) == (ssize_t)sizeof(h) &&
+			lib_current(&h, &scan_dir_st) && h.count == (uint32_t)nsongs;
+		close(fd);
+		if (same) return;
 	}
+	if (!scan_dir_st.st_ino) return;
 
-	/* restore playback */
-	if (saved_song[0]) {
-		int idx = -1;
+	h = (struct lib_header){ LIB_MAGIC, LIB_VERSION, nsongs, 0,
+		scan_dir_st.st_dev, scan_dir_st.st_ino,
+		scan_dir_st.st_mtim.tv_sec, scan_dir_st.st_mtim.tv_nsec, 0 };
+	for (int i = 0; i < nsongs; i++) h.names_len += strlen(songs[i]) + 1;
+	mkdir(cache_dir, 0755);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	FILE *f = fopen(tmp, "w");
+	if (!f) return;
+	fwrite(&h, sizeof(h), 1, f);
+	for (int col = 0; col < 3; col++) {
 		for (int i = 0; i < nsongs; i++) {
-			if (strcmp(songs[i], saved_song) == 0) {
-				idx = i;
-				break;
-			}
-		}
-		if (idx >= 0) {
-			play_song(idx);
-			/* wait for mpv IPC socket */
-			for (int i = 0; i < 10; i++) {
-				usleep(50000);
-				if (mpv_connect() == 0) break;
-			}
-			if (saved_pos > 0) {
-				char cmd[128];
-				snprintf(cmd, sizeof(cmd),
-					"{\"command\":[\"seek\",%.2f,\"absolute\"]}\n", saved_pos);
-				mpv_cmd(cmd);
-			}
-			if (saved_paused) {
-				mpv_cmd("{\"command\":[\"cycle\",\"pause\"]}\n");
-				paused = 1;
-			}
+			int64_t v = col == 0 ? (int64_t)fnv1a(songs[i]) :
+				col == 1 ? meta_size[i] : meta_added[i];
+			fwrite(&v, sizeof(v), 1, f);
 		}
 	}
+	for (int i = 0; i < nsongs; i++) fwrite(songs[i], strlen(songs[i]) + 1, 1, f);
+	if (fclose(f) != 0 || rename(tmp, path) != 0) unlink(tmp);
 }
 
-static void load_playlist(int idx) {
+/* Point songs[] at the names in cache/library and lib_hash, lib_size and
+ * lib_mtime at its columns. Returns -1 when it is missing or stale. */
+static int library_load(void) {
 	char path[PATH_MAX];
-	snprintf(path, sizeof(path), "%s/%s.playlist", playlists_dir, playlists[idx]);
-	FILE *f = fopen(path, "r");
-	if (!f) return;
+	snprintf(path, sizeof(path), "%s/library", cache_dir);
+	struct stat dir, st;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return -1;
+	void *m = MAP_FAILED;
+	if (stat(songs_dir, &dir) == 0 && fstat(fd, &st) == 0 &&
+	    (size_t)st.st_size >= sizeof(struct lib_header))
+		m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED) return -1;
 
-	nplaylist_songs = 0;
-	char line[1024];
-	while (fgets(line, sizeof(line), f)) {
-		/* strip newline */
-		int len = strlen(line);
-		while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
-			line[--len] = '\0';
-		if (len == 0) continue;
-		for (int i = 0; i < nsongs; i++) {
-			if (strcmp(songs[i], line) == 0) {
-				if (nplaylist_songs < MAX_SONGS)
-					playlist_songs[nplaylist_songs++] = i;
-				break;
-			}
-		}
+	const struct lib_header *h = m;
+	size_t body = sizeof(*h) + (size_t)h->count * 3 * sizeof(int64_t);
+	if (!lib_current(h, &dir) || h->count > MAX_SONGS ||
+	    body + h->names_len != (size_t)st.st_size) {
+		munmap(m, st.st_size);
+		return -1;
 	}
-	fclose(f);
-}
-
-static int find_in_display(int song_idx) {
-	if (filter_active) {
-		for (int i = 0; i < nfiltered; i++)
-			if (filtered[i] == song_idx) return i;
-	} else if (playlist_active >= 0) {
-		for (int i = 0; i < nplaylist_songs; i++)
-			if (playlist_songs[i] == song_idx) return i;
-	} else {
-		if (song_idx >= 0 && song_idx < nsongs) return song_idx;
+	char *name = (char *)m + body, *end = name + h->names_len;
+	for (uint32_t i = 0; i < h->count; i++) {
+		char *nul = memchr(name, '\0', end - name);
+		if (!nul) {
+			munmap(m, st.st_size);
+			return -1;
+		}
+		songs[i] = name;
+		name = nul + 1;
 	}
+	lib_hash = (const uint64_t *)(h + 1);
+	lib_size = (const int64_t *)lib_hash + h->count;
+	lib_mtime = lib_size + h->count;
+	nsongs = h->count;
 	return 0;
 }
 
-static int term_rows(void) {
-	struct winsize ws;
-	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1)
-		return 24;
-	return ws.ws_row;
-}
+/* Play history: an append-only log of 16-byte records (play, skip with
+ * position, completion) keyed by filename hash, so entries survive a song
+ * leaving and rejoining the library. At startup the log is mmap-scanned
+ * into per-song aggregates (plays, skips, last played) which fill
+ * meta_plays, meta_skips and meta_last. history.snap holds the aggregates
+ * as of a log offset, so only the tail after it is scanned; a new snapshot
+ * is written whenever the tail passes HIST_SNAP_EVERY records, and the log
+ * then starts over from its header. Offsets count every byte ever logged:
+ * the log's header says how many were dropped before its first record. */
+#define HISTORY_FILE "history.log"
+#define HISTORY_SNAP "history.snap"
+#define HIST_SNAP_EVERY 4096
+enum { HIST_PLAY = 1, HIST_SKIP, HIST_DONE };
 
-static int term_cols(void) {
-	struct winsize ws;
-	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1)
-		return 80;
-	return ws.ws_col;
-}
+struct hist_rec {
+	uint64_t song;  /* fnv1a of the file name */
+	uint32_t time;  /* unix seconds */
+	uint16_t pos;   /* seconds into the song */
+	uint8_t type;   /* HIST_* */
+	uint8_t pad;
+};
 
-static int song_at(int pos) {
-	if (filter_active) return filtered[pos];
-	if (playlist_active >= 0) return playlist_songs[pos];
-	return pos;
-}
+struct hist_header {
+	char magic[4];  /* "MPHL" for the log, "MPHS" for the snapshot */
+	uint32_t version;
+	uint64_t offset; /* log: bytes dropped before it; snapshot: bytes covered */
+	uint64_t count;  /* snapshot: aggregates that follow */
+};
 
-static int display_len(void) {
-	if (filter_active) return nfiltered;
-	if (playlist_active >= 0) return nplaylist_songs;
-	return nsongs;
+struct hist_agg {
+	uint64_t song;  /* 0 = empty slot */
+	uint32_t plays, skips, last, pad;
+};
+
+static const char *history_file = HISTORY_FILE;
+static const char *history_snap = HISTORY_SNAP;
+static int hist_fd = -1;
+static struct hist_agg *hist_tab;
+static size_t hist_cap, hist_count;
+static uint64_t hist_size;  /* log bytes, always header + whole records */
+static uint64_t hist_base;  /* bytes compacted away before the log's own */
+static uint64_t hist_tail;  /* records since the snapshot */
+static int hist_resuming = 0; /* restore_state() replaying the saved song */
+
+static struct hist_agg *hist_slot(uint64_t song, int create) {
+	if (create && (hist_count + 1) * 2 > hist_cap) {
+		size_t ncap = hist_cap ? hist_cap * 2 : 1024;
+		struct hist_agg *nt = calloc(ncap, sizeof(*nt));
+		if (!nt) return NULL;
+		for (size_t i = 0; i < hist_cap; i++) {
+			if (!hist_tab[i].song) continue;
+			size_t s = hist_tab[i].song & (ncap - 1);
+			while (nt[s].song) s = (s + 1) & (ncap - 1);
+			nt[s] = hist_tab[i];
+		}
+		free(hist_tab);
+		hist_tab = nt;
+		hist_cap = ncap;
+	}
+	if (!hist_cap) return NULL;
+	size_t s = song & (hist_cap - 1);
+	while (hist_tab[s].song) {
+		if (hist_tab[s].song == song) return &hist_tab[s];
+		s = (s + 1) & (hist_cap - 1);
+	}
+	if (!create) return NULL;
+	hist_tab[s].song = song;
+	hist_count++;
+	return &hist_tab[s];
 }
 
-static void apply_filter(void) {
-	int prev_song = song_at(cursor);
+static void hist_apply(const struct hist_rec *r) {
+	struct hist_agg *a = hist_slot(r->song ? r->song : 1, 1);
+	if (!a) return;
+	if (r->type == HIST_PLAY) {
+		a->plays++;
+		if (r->time > a->last) a->last = r->time;
+	} else if (r->type == HIST_SKIP) {
+		a->skips++;
+	}
+}
 
-	if (search_len == 0) {
-		filter_active = 0;
-		cursor = find_in_display(prev_song);
+/* The snapshot holds every record: replace the log with a bare header
+ * whose base puts its end where the snapshot's offset is. Each file is
+ * swapped in whole by rename(), so stopping between the two leaves an old
+ * log the snapshot still lines up with. */
+static void hist_compact(uint64_t covered) {
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", history_file);
+	struct hist_header h = { "MPHL", 1, covered - sizeof(h), 0 };
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0) return;
+	if (write(fd, &h, sizeof(h)) != (ssize_t)sizeof(h) || rename(tmp, history_file) != 0) {
+		close(fd);
+		unlink(tmp);
 		return;
 	}
+	close(hist_fd);
+	hist_fd = fd;
+	hist_base = h.offset;
+	hist_size = sizeof(h);
+}
 
-	regex_t re;
-	if (regcomp(&re, search_buf, REG_EXTENDED | REG_ICASE | REG_NOSUB) != 0)
-		return; /* invalid regex, keep previous state */
-
-	nfiltered = 0;
-	int base_count = (playlist_active >= 0) ? nplaylist_songs : nsongs;
-	for (int i = 0; i < base_count; i++) {
-		int sidx = (playlist_active >= 0) ? playlist_songs[i] : i;
-		if (regexec(&re, songs[sidx], 0, NULL, 0) == 0)
-			filtered[nfiltered++] = sidx;
+static void hist_snapshot(void) {
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", history_snap);
+	FILE *f = fopen(tmp, "w");
+	if (!f) return;
+	struct hist_header h = { "MPHS", 1, hist_base + hist_size, hist_count };
+	fwrite(&h, sizeof(h), 1, f);
+	for (size_t i = 0; i < hist_cap; i++)
+		if (hist_tab[i].song) fwrite(&hist_tab[i], sizeof(hist_tab[i]), 1, f);
+	if (fclose(f) == 0 && rename(tmp, history_snap) == 0) {
+		hist_tail = 0;
+		hist_compact(h.offset);
+	} else {
+		unlink(tmp);
 	}
-	regfree(&re);
-	filter_active = 1;
+}
 
-	/* try to keep cursor on the same song */
-	cursor = 0;
-	for (int i = 0; i < nfiltered; i++) {
-		if (filtered[i] == prev_song) {
-			cursor = i;
-			break;
+/* Aggregates from the snapshot, if it matches the log; returns the
+ * position in the log it covers up to, or that of the first record. */
+static uint64_t hist_load_snapshot(void) {
+	uint64_t start = sizeof(struct hist_header);
+	int fd = open(history_snap, O_RDONLY);
+	if (fd < 0) return start;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct hist_header)) {
+		close(fd);
+		return start;
+	}
+	void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED) return start;
+	const struct hist_header *h = m;
+	const struct hist_agg *a = (const void *)(h + 1);
+	if (memcmp(h->magic, "MPHS", 4) == 0 && h->version == 1 &&
+	    h->offset >= hist_base + start && h->offset <= hist_base + hist_size &&
+	    (h->offset - hist_base - start) % sizeof(struct hist_rec) == 0 &&
+	    sizeof(*h) + h->count * sizeof(*a) == (uint64_t)st.st_size) {
+		for (uint64_t i = 0; i < h->count; i++) {
+			struct hist_agg *d = hist_slot(a[i].song, 1);
+			if (d) *d = a[i];
 		}
+		start = h->offset - hist_base;
 	}
+	munmap(m, st.st_size);
+	return start;
 }
 
-static void flush_buf(char *buf, int *len) {
-	if (*len > 0) {
-		write(STDOUT_FILENO, buf, *len);
-		*len = 0;
+/* Aggregates into the metadata of songs[from..]: all of them at load,
+ * each scan batch as it arrives. */
+static void history_fill(int from) {
+	for (int i = from; i < nsongs; i++) {
+		const struct hist_agg *a = hist_slot(fnv1a(songs[i]), 0);
+		if (!a) continue;
+		meta_plays[i] = a->plays;
+		meta_skips[i] = a->skips;
+		meta_last[i] = a->last;
 	}
+	meta_changed |= (1u << F_PLAYS) | (1u << F_SKIPS) | (1u << F_PLAYED);
 }
 
-static void appendf(char *buf, int *len, size_t size, const char *fmt, ...) {
-	va_list ap;
-
-	for (;;) {
-		va_start(ap, fmt);
-		int n = vsnprintf(buf + *len, size - *len, fmt, ap);
-		va_end(ap);
-		if (n < 0)
-			return;
-		if ((size_t)n < size - *len) {
-			*len += n;
+/* Open the log, rebuild the aggregates and copy them into the metadata
+ * columns. A log with a foreign header is left alone and not written. */
+static void history_load(void) {
+	int fd = replay_mode ? open(history_file, O_RDONLY) :
+		open(history_file, O_RDWR | O_CREAT | O_APPEND, 0644);
+	if (fd < 0) return;
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return;
+	}
+	struct hist_header h = { "MPHL", 1, 0, 0 };
+	const size_t hs = sizeof(h), rs = sizeof(struct hist_rec);
+	if (st.st_size < (off_t)hs) {
+		/* new, or died before the header was complete */
+		if (replay_mode || ftruncate(fd, 0) != 0 || write(fd, &h, hs) != (ssize_t)hs) {
+			close(fd);
 			return;
 		}
+		st.st_size = hs;
+	}
+	/* drop a torn last record so appends stay aligned */
+	off_t whole = hs + (st.st_size - hs) / rs * rs;
+	if (whole != st.st_size && !replay_mode && ftruncate(fd, whole) != 0) {
+		close(fd);
+		return;
+	}
+	hist_size = whole;
 
-		flush_buf(buf, len);
-		if ((size_t)n >= size) {
-			char *tmp = malloc((size_t)n + 1);
-			if (!tmp)
-				return;
-			va_start(ap, fmt);
-			vsnprintf(tmp, (size_t)n + 1, fmt, ap);
-			va_end(ap);
-			write(STDOUT_FILENO, tmp, (size_t)n);
-			free(tmp);
-			return;
-		}
+	void *m = mmap(NULL, hist_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (m == MAP_FAILED || memcmp(m, "MPHL", 4) != 0 ||
+	    ((const struct hist_header *)m)->version != 1) {
+		if (m != MAP_FAILED) munmap(m, hist_size);
+		close(fd);
+		return;
+	}
+	hist_base = ((const struct hist_header *)m)->offset;
+	uint64_t start = hist_load_snapshot();
+	const struct hist_rec *r = (const void *)((const char *)m + start);
+	uint64_t n = (hist_size - start) / rs;
+	for (uint64_t i = 0; i < n; i++) hist_apply(&r[i]);
+	munmap(m, hist_size);
+	hist_tail = n;
+	if (replay_mode) {
+		close(fd);
+	} else {
+		hist_fd = fd;
+		if (hist_tail >= HIST_SNAP_EVERY) hist_snapshot();
 	}
+	history_fill(0);
 }
 
-static void append_repeat(char *buf, int *len, size_t size, char ch, int count) {
-	for (int i = 0; i < count; i++) {
-		if (*len >= (int)size - 1)
-			flush_buf(buf, len);
-		buf[(*len)++] = ch;
+/* Append a record and count it. --replay counts it in memory only. */
+static void history_log(int type, int idx, double pos) {
+	if ((hist_fd < 0 && !replay_mode) || idx < 0) return;
+	struct hist_rec r = {
+		fnv1a(songs[idx]), (uint32_t)wall_now(),
+		pos <= 0 ? 0 : pos >= 65535 ? 65535 : (uint16_t)pos, type, 0,
+	};
+	if (hist_fd >= 0) {
+		if (write(hist_fd, &r, sizeof(r)) != (ssize_t)sizeof(r)) return;
+		hist_size += sizeof(r);
+	}
+	hist_apply(&r);
+	if (type == HIST_SKIP) {
+		meta_skips[idx]++;
+		meta_changed |= 1u << F_SKIPS;
 	}
+	if (hist_fd >= 0 && ++hist_tail >= HIST_SNAP_EVERY) hist_snapshot();
 }
 
-static void append_repeat_text(char *buf, int *len, size_t size, const char *text, int count) {
-	for (int i = 0; i < count; i++)
-		appendf(buf, len, size, "%s", text);
+/* Background analysis pipeline. Worker threads (one per core) take jobs,
+ * decode the file once to 48 kHz stereo s16 through an ffmpeg or mpv
+ * subprocess and feed the PCM to each analysis the job needs. Results are
+ * handed back to the main loop, which applies them by name (indices may
+ * have shifted meanwhile) and appends them to the per-file cache. */
+#define AN_RATE 48000
+#define AN_MAX_WORKERS 8
+#define NORM_TARGET_LUFS -18.0f
+#define NORM_MAX_PEAK -1.0f   /* dBTP ceiling after gain */
+#define LUFS_UNDECODABLE -99.0f
+
+#define WF_BUCKETS 320
+
+/* AN_DURATION reads container headers only; the rest need a decoder. */
+enum { AN_LOUDNESS = 1, AN_WAVEFORM = 2, AN_DURATION = 4, AN_FEATURES = 8,
+	AN_HEAD = 16, AN_HASH = 32 };
+#define AN_DECODE (AN_LOUDNESS | AN_WAVEFORM | AN_FEATURES)
+#define AN_CONTENT (AN_HEAD | AN_HASH)
+
+struct ajob {
+	char *name;
+	char *path;
+	int idx;               /* songs[] index at enqueue time (hint) */
+	long long size, mtime;
+	unsigned need;         /* AN_* analyses to run */
+	unsigned done;         /* AN_* analyses that produced a result */
+	int decoded;           /* -1 = no decoder available */
+	float lufs, peak;
+	float dur;             /* seconds, <= 0 = headers did not say */
+	unsigned char wf_peak[WF_BUCKETS], wf_rms[WF_BUCKETS];
+	float feat[FEAT_DIM];
+	uint64_t head, hash;   /* content hashes, see hash_file() */
+	struct ajob *next;
+};
+
+static pthread_mutex_t an_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t an_cond = PTHREAD_COND_INITIALIZER;
+static struct ajob *an_todo = NULL, *an_todo_tail = NULL;
+static struct ajob *an_done = NULL;
+static int an_workers = 0;
+static int an_no_decoder = 0; /* neither ffmpeg nor mpv could be spawned */
+static int an_pending = 0;    /* main side: jobs queued and not yet applied */
+static int dup_jobs = 0;      /* main side: AN_CONTENT jobs not yet applied */
+enum { DUP_IDLE, DUP_WAIT, DUP_HEAD, DUP_HASH, DUP_DONE };
+static int dup_state = DUP_IDLE;
+
+/* Spawn a decoder writing raw s16le PCM to a pipe. Returns the read end,
+ * or -1 when no decoder can be started. posix_spawn is used because this
+ * runs on worker threads. */
+static int decode_open(const char *path, int rate, int channels, pid_t *pid) {
+	char ar[16], ac[16], mpv_rate[48], mpv_ch[48];
+	snprintf(ar, sizeof(ar), "%d", rate);
+	snprintf(ac, sizeof(ac), "%d", channels);
+	snprintf(mpv_rate, sizeof(mpv_rate), "--audio-samplerate=%d", rate);
+	snprintf(mpv_ch, sizeof(mpv_ch), "--audio-channels=%s", channels == 1 ? "mono" : "stereo");
+	char *ffmpeg[] = { "ffmpeg", "-nostdin", "-v", "quiet", "-i", (char *)path, "-vn",
+		"-f", "s16le", "-ac", ac, "-ar", ar, "-", NULL };
+	char *mpv[] = { "mpv", "--no-video", "--no-terminal", "--no-config", "--ao=pcm",
+		"--ao-pcm-file=/dev/stdout", "--ao-pcm-waveheader=no", "--audio-format=s16",
+		mpv_ch, mpv_rate, (char *)path, NULL };
+	char **argvs[2] = { ffmpeg, mpv };
+
+	for (int i = 0; i < 2; i++) {
+		int p[2];
+		if (pipe2(p, O_CLOEXEC) != 0) return -1;
+		posix_spawn_file_actions_t fa;
+		posix_spawn_file_actions_init(&fa);
+		posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+		posix_spawn_file_actions_adddup2(&fa, p[1], STDOUT_FILENO);
+		posix_spawn_file_actions_addopen(&fa, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+		int err = posix_spawnp(pid, argvs[i][0], &fa, NULL, argvs[i], environ);
+		posix_spawn_file_actions_destroy(&fa);
+		close(p[1]);
+		if (err == 0) return p[0];
+		close(p[0]);
+	}
+	return -1;
 }
 
-static void draw(void) {
-	int rows = term_rows();
-	int cols = term_cols();
-	int list_rows = rows - 4; /* header + separator + status + progress */
-	if (list_rows < 0)
-		list_rows = 0;
+static void decode_close(int fd, pid_t pid) {
+	close(fd);
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+}
 
-	write(STDOUT_FILENO, MAIN_BASE "\033[2J\033[H",
-		sizeof(MAIN_BASE "\033[2J\033[H") - 1);
+/* EBU R128 / BS.1770 loudness: K-weighting (high shelf + high pass
+ * biquads), 400ms blocks with 75% overlap, absolute -70 LUFS gate and
+ * relative -10 LU gate. True peak uses 4x polyphase oversampling. */
+#define TP_TAPS 48
+#define TP_PHASES 4
 
-	char buf[65536];
-	int len = 0;
-	char line[4096];
+struct biquad { double b0, b1, b2, a1, a2; };
 
-	int main_cols = cols;
-	int main_col = 1;
-	int sidebar_width = 0;
-	int sb_col = 0;
-	int sidebar_focused = playlist_menu && panel_focus == PANEL_SIDEBAR;
-	int main_focused = !playlist_menu || panel_focus == PANEL_MAIN;
-	const char *sidebar_border = sidebar_focused ? SIDEBAR_BORDER_FOCUSED : SIDEBAR_BORDER_UNFOCUSED;
-	const char *main_border = main_focused ? MAIN_BORDER_FOCUSED : MAIN_BORDER_UNFOCUSED;
+struct loudness {
+	struct biquad shelf, hpass;
+	double z[2][2][4];        /* [channel][stage] x1 x2 y1 y2 */
+	int sub_len;              /* frames per 100ms sub-block */
+	int sub_n;
+	double sub_acc;
+	double sub[4];            /* last four sub-block mean squares */
+	int nsub;
+	float *blocks;            /* mean square per 400ms gating block */
+	int nblocks, cap;
+	float hist[2][TP_TAPS / TP_PHASES];
+	int hpos;
+	float peak;               /* linear true peak */
+};
 
-	if (playlist_menu && cols > 2) {
-		sidebar_width = SIDEBAR_WIDTH;
-		if (sidebar_width > cols - 2)
-			sidebar_width = cols - 2;
-		if (sidebar_width < 1)
-			sidebar_width = 1;
+static float tp_coef[TP_TAPS];
 
-		main_cols = cols - sidebar_width - 1;
-		if (main_cols < 1)
-			main_cols = 1;
-		sb_col = 1;
-		main_col = sidebar_width + 2;
+static void loudness_init(struct loudness *L, int rate) {
+	memset(L, 0, sizeof(*L));
+	double K = tan(M_PI * 1681.974450955533 / rate);
+	double Q = 0.7071752369554196;
+	double Vh = pow(10.0, 3.999843853973347 / 20.0);
+	double Vb = pow(Vh, 0.4996667741545416);
+	double a0 = 1.0 + K / Q + K * K;
+	L->shelf.b0 = (Vh + Vb * K / Q + K * K) / a0;
+	L->shelf.b1 = 2.0 * (K * K - Vh) / a0;
+	L->shelf.b2 = (Vh - Vb * K / Q + K * K) / a0;
+	L->shelf.a1 = 2.0 * (K * K - 1.0) / a0;
+	L->shelf.a2 = (1.0 - K / Q + K * K) / a0;
 
-		for (int r = 1; r <= rows; r++) {
-			appendf(buf, &len, sizeof(buf), "\033[%d;%dH%s", r, sb_col, SIDEBAR_BASE);
-			append_repeat(buf, &len, sizeof(buf), ' ', sidebar_width);
-			appendf(buf, &len, sizeof(buf), "%s", MAIN_BASE);
-		}
+	K = tan(M_PI * 38.13547087602444 / rate);
+	Q = 0.5003270373238773;
+	a0 = 1.0 + K / Q + K * K;
+	L->hpass.b0 = 1.0;
+	L->hpass.b1 = -2.0;
+	L->hpass.b2 = 1.0;
+	L->hpass.a1 = 2.0 * (K * K - 1.0) / a0;
+	L->hpass.a2 = (1.0 - K / Q + K * K) / a0;
 
-		appendf(buf, &len, sizeof(buf),
-			"\033[1;%dH%s%-*.*s%s",
-			sb_col, SIDEBAR_ACCENT_BOLD,
-			sidebar_width, sidebar_width, " Playlists", MAIN_BASE);
+	L->sub_len = rate / 10;
 
-		appendf(buf, &len, sizeof(buf), "\033[2;%dH%s", sb_col, sidebar_border);
-		append_repeat_text(buf, &len, sizeof(buf), SEP_H, sidebar_width);
-		appendf(buf, &len, sizeof(buf), "%s", MAIN_BASE);
+	if (tp_coef[TP_TAPS / 2] == 0) {
+		/* Hann-windowed sinc low-pass at the original Nyquist */
+		for (int n = 0; n < TP_TAPS; n++) {
+			double t = (n - (TP_TAPS - 1) / 2.0) / TP_PHASES;
+			double sinc = (t == 0) ? 1.0 : sin(M_PI * t) / (M_PI * t);
+			double w = 0.5 - 0.5 * cos(2 * M_PI * (n + 0.5) / TP_TAPS);
+			tp_coef[n] = (float)(sinc * w);
+		}
+	}
+}
 
-		for (int i = 0; i <= nplaylists && i < list_rows; i++) {
-			int row = i + 3;
-			const char *name = (i == 0) ? "[All Songs]" : playlists[i - 1];
-			const char *pfix = (i == playlist_cursor) ? "> " : "  ";
-			const char *style = SIDEBAR_BASE;
-			int is_active = (i == 0 && playlist_active == -1) ||
-				(i > 0 && playlist_active == i - 1);
+static double biquad_run(const struct biquad *f, double *z, double x) {
+	double y = f->b0 * x + f->b1 * z[0] + f->b2 * z[1] - f->a1 * z[2] - f->a2 * z[3];
+	z[1] = z[0];
+	z[0] = x;
+	z[3] = z[2];
+	z[2] = y;
+	return y;
+}
 
-			if (i == playlist_cursor)
-				style = sidebar_focused ? SIDEBAR_SELECTED : SIDEBAR_CURSOR;
-			else if (is_active)
-				style = SIDEBAR_ACCENT_BOLD;
+/* Feed interleaved frames (channels = 1 or 2, samples -1..1). */
+static void loudness_feed(struct loudness *L, const float *x, int frames, int channels) {
+	const int per_phase = TP_TAPS / TP_PHASES;
+	for (int i = 0; i < frames; i++) {
+		for (int c = 0; c < channels; c++) {
+			float s = x[i * channels + c];
+			double y = biquad_run(&L->hpass, L->z[c][1],
+				biquad_run(&L->shelf, L->z[c][0], s));
+			L->sub_acc += y * y;
 
-			snprintf(line, sizeof(line), "%s%s", pfix, name);
-			appendf(buf, &len, sizeof(buf),
-				"\033[%d;%dH%s%-*.*s%s",
-				row, sb_col, style,
-				sidebar_width, sidebar_width, line, MAIN_BASE);
+			L->hist[c][L->hpos] = s;
+			for (int ph = 0; ph < TP_PHASES; ph++) {
+				float acc = 0;
+				for (int k = 0; k < per_phase; k++)
+					acc += tp_coef[k * TP_PHASES + ph] *
+						L->hist[c][(L->hpos - k + per_phase) % per_phase];
+				if (fabsf(acc) > L->peak) L->peak = fabsf(acc);
+			}
 		}
+		L->hpos = (L->hpos + 1) % per_phase;
 
-		int border_col = sidebar_width + 1;
-		for (int r = 1; r <= rows; r++) {
-			const char *border = (r == 2) ? SEP_CROSS : SEP_V;
-			appendf(buf, &len, sizeof(buf),
-				"\033[%d;%dH%s%s%s",
-				r, border_col, sidebar_border, border, MAIN_BASE);
+		if (++L->sub_n == L->sub_len) {
+			memmove(L->sub, L->sub + 1, 3 * sizeof(double));
+			L->sub[3] = L->sub_acc / L->sub_len;
+			L->sub_acc = 0;
+			L->sub_n = 0;
+			if (++L->nsub >= 4) {
+				if (L->nblocks == L->cap) {
+					L->cap = L->cap ? L->cap * 2 : 1024;
+					L->blocks = realloc(L->blocks, L->cap * sizeof(float));
+				}
+				L->blocks[L->nblocks++] = (float)((L->sub[0] + L->sub[1] + L->sub[2] + L->sub[3]) / 4);
+			}
 		}
-	} else if (main_cols < 1) {
-		main_cols = 1;
 	}
+}
 
-	if (playlist_active >= 0) {
-		appendf(buf, &len, sizeof(buf),
-			"\033[1;%dH%s  MusicPlayer [%s]%s",
-			main_col, MAIN_ACCENT_BOLD, playlists[playlist_active], MAIN_BASE);
+/* Integrated loudness in LUFS (-70 for silence) and true peak in dBTP. */
+static void loudness_finish(struct loudness *L, float *lufs, float *peak_db) {
+	const double abs_gate = pow(10.0, (-70.0 + 0.691) / 10.0);
+	double sum = 0;
+	int n = 0;
+	for (int i = 0; i < L->nblocks; i++)
+		if (L->blocks[i] > abs_gate) { sum += L->blocks[i]; n++; }
+	*lufs = -70.0f;
+	if (n > 0) {
+		double rel_gate = sum / n * pow(10.0, -10.0 / 10.0);
+		double gsum = 0;
+		int gn = 0;
+		for (int i = 0; i < L->nblocks; i++)
+			if (L->blocks[i] > abs_gate && L->blocks[i] > rel_gate) { gsum += L->blocks[i]; gn++; }
+		if (gn > 0)
+			*lufs = (float)(-0.691 + 10.0 * log10(gsum / gn));
+	}
+	*peak_db = (L->peak > 0) ? 20.0f * log10f(L->peak) : -99.0f;
+	free(L->blocks);
+	L->blocks = NULL;
+}
+
+/* Waveform thumbnail: peak and RMS per 20ms chunk while decoding (the
+ * length is not known up front), folded into WF_BUCKETS at the end. */
+struct wavebuild {
+	float *peak, *sumsq;
+	int n, cap;
+	int chunk;        /* frames per chunk */
+	int fill;
+	float cur_peak;
+	double cur_sq;
+};
+
+static void wave_init(struct wavebuild *w, int rate) {
+	memset(w, 0, sizeof(*w));
+	w->chunk = rate / 50;
+}
+
+static void wave_push(struct wavebuild *w) {
+	if (w->n == w->cap) {
+		w->cap = w->cap ? w->cap * 2 : 4096;
+		w->peak = realloc(w->peak, w->cap * sizeof(float));
+		w->sumsq = realloc(w->sumsq, w->cap * sizeof(float));
+	}
+	w->peak[w->n] = w->cur_peak;
+	w->sumsq[w->n] = (float)(w->cur_sq / w->chunk);
+	w->n++;
+	w->fill = 0;
+	w->cur_peak = 0;
+	w->cur_sq = 0;
+}
+
+static void wave_feed(struct wavebuild *w, const float *x, int frames, int channels) {
+	for (int i = 0; i < frames; i++) {
+		for (int c = 0; c < channels; c++) {
+			float v = fabsf(x[i * channels + c]);
+			if (v > w->cur_peak) w->cur_peak = v;
+			w->cur_sq += (double)v * v / channels;
+		}
+		if (++w->fill == w->chunk) wave_push(w);
+	}
+}
+
+/* Fold chunks into buckets; returns 0 if there was no audio at all. */
+static int wave_finish(struct wavebuild *w, unsigned char *peak, unsigned char *rms) {
+	if (w->fill > 0) wave_push(w);
+	int ok = w->n > 0;
+	for (int b = 0; b < WF_BUCKETS && ok; b++) {
+		int lo = (int)((long long)b * w->n / WF_BUCKETS);
+		int hi = (int)((long long)(b + 1) * w->n / WF_BUCKETS);
+		if (hi <= lo) hi = lo + 1;
+		float pk = 0;
+		double sq = 0;
+		for (int i = lo; i < hi; i++) {
+			if (w->peak[i] > pk) pk = w->peak[i];
+			sq += w->sumsq[i];
+		}
+		float r = sqrtf((float)(sq / (hi - lo)));
+		peak[b] = (unsigned char)(fminf(pk, 1.0f) * 255 + 0.5f);
+		rms[b] = (unsigned char)(fminf(r, 1.0f) * 255 + 0.5f);
+	}
+	free(w->peak);
+	free(w->sumsq);
+	return ok;
+}
+
+/* Similarity features for radio mode, from the same decode. The signal is
+ * mixed to mono and averaged down to about 24 kHz, then cut into VIZ_N
+ * point frames every FEAT_HOP samples for the spectrum FFT. Per track it
+ * keeps: tempo (autocorrelation of the spectral flux, 60-180 BPM, leaning
+ * towards 120), how clear that pulse is, spectral centroid, the spread of
+ * frame loudness, a 12-bin chroma profile and the long-term spectrum over
+ * FEAT_BANDS log-spaced bands. feat_finish() scales each group so it
+ * weighs about the same in the Euclidean distance radio mode uses. */
+#define FEAT_HOP (VIZ_N / 2)
+#define FEAT_BANDS 8
+#define FEAT_BPM_MIN 60
+#define FEAT_BPM_MAX 180
+#define FEAT_PULSE_MIN 0.1f /* weaker autocorrelation peaks are no tempo */
+
+struct featbuild {
+	int decim, rate;           /* input frames per sample, analysed rate */
+	int dfill;
+	float dacc;
+	float frame[VIZ_N];
+	int fill;
+	float prev[FFT_M];         /* last frame's log magnitudes, for flux */
+	unsigned char pc[FFT_M];   /* bin -> pitch class (C = 0), 12 = none */
+	unsigned char band[FFT_M]; /* bin -> band, FEAT_BANDS = none */
+	double chroma[12], bands[FEAT_BANDS];
+	double centroid, db, db_sq;
+	long voiced;               /* frames above the silence floor */
+	float *flux;
+	int nflux, cap;
+};
+
+static void feat_init(struct featbuild *F, int rate) {
+	memset(F, 0, sizeof(*F));
+	fft_init();
+	F->decim = (rate + 12000) / 24000;
+	if (F->decim < 1) F->decim = 1;
+	F->rate = rate / F->decim;
+	float fmax = fminf(F->rate / 2.0f, 12000.0f);
+	for (int k = 0; k < FFT_M; k++) {
+		float f = (float)k * F->rate / VIZ_N;
+		F->pc[k] = 12;
+		if (f >= 55 && f <= 5000) {
+			int semis = (int)lrintf(12 * log2f(f / 440)); /* from A4 */
+			F->pc[k] = ((semis + 9) % 12 + 12) % 12;
+		}
+		int b = f >= 50 ? (int)(FEAT_BANDS * logf(f / 50) / logf(fmax / 50)) : -1;
+		F->band[k] = (b >= 0 && b < FEAT_BANDS) ? b : FEAT_BANDS;
+	}
+}
+
+static void feat_frame(struct featbuild *F) {
+	float x[VIZ_N], mag[FFT_M];
+	for (int n = 0; n < VIZ_N; n++)
+		x[n] = F->frame[n] * fft_window[n];
+	fft_real_mag(x, mag);
+
+	double sum = 0, moment = 0, energy = 0, flux = 0;
+	for (int k = 1; k < FFT_M; k++) {
+		float m = mag[k] * (4.0f / VIZ_N); /* full-scale sine -> 1 */
+		float p = m * m;
+		float lm = log1pf(m * 1000);
+		if (lm > F->prev[k]) flux += lm - F->prev[k];
+		F->prev[k] = lm;
+		sum += m;
+		moment += (double)k * m;
+		energy += p;
+		if (F->pc[k] < 12) F->chroma[F->pc[k]] += p;
+		if (F->band[k] < FEAT_BANDS) F->bands[F->band[k]] += p;
+	}
+	if (F->nflux == F->cap) {
+		int cap = F->cap ? F->cap * 2 : 4096;
+		float *fl = realloc(F->flux, cap * sizeof(float));
+		if (fl) {
+			F->flux = fl;
+			F->cap = cap;
+		}
+	}
+	if (F->nflux < F->cap) F->flux[F->nflux++] = (float)flux;
+	if (energy > 1e-8) { /* -80 dB */
+		double db = 10 * log10(energy);
+		F->centroid += moment / sum * F->rate / VIZ_N;
+		F->db += db;
+		F->db_sq += db * db;
+		F->voiced++;
+	}
+	memmove(F->frame, F->frame + FEAT_HOP, (VIZ_N - FEAT_HOP) * sizeof(float));
+	F->fill = VIZ_N - FEAT_HOP;
+}
+
+static void feat_feed(struct featbuild *F, const float *x, int frames, int channels) {
+	for (int i = 0; i < frames; i++) {
+		float s = 0;
+		for (int c = 0; c < channels; c++) s += x[i * channels + c];
+		F->dacc += s / channels;
+		if (++F->dfill < F->decim) continue;
+		F->frame[F->fill++] = F->dacc / F->decim;
+		F->dacc = 0;
+		F->dfill = 0;
+		if (F->fill == VIZ_N) feat_frame(F);
+	}
+}
+
+/* Tempo in BPM from the flux series (0 when too short or without a
+ * steady pulse), and the normalised autocorrelation at that lag in
+ * *clarity. */
+static float feat_tempo(const struct featbuild *F, float *clarity) {
+	float fps = (float)F->rate / FEAT_HOP;
+	int lo = (int)(fps * 60 / FEAT_BPM_MAX), hi = (int)(fps * 60 / FEAT_BPM_MIN) + 1;
+	int n = F->nflux;
+	*clarity = 0;
+	if (lo < 2 || n < 2 * hi) return 0;
+	double mean = 0;
+	for (int i = 0; i < n; i++) mean += F->flux[i];
+	mean /= n;
+	double r[hi + 2], r0 = 0;
+	for (int i = 0; i < n; i++) r0 += (F->flux[i] - mean) * (F->flux[i] - mean);
+	if (r0 <= 0) return 0;
+	for (int L = lo - 1; L <= hi + 1; L++) {
+		double acc = 0;
+		for (int i = 0; i + L < n; i++)
+			acc += (F->flux[i] - mean) * (F->flux[i + L] - mean);
+		r[L] = acc / (n - L) * n / r0;
+	}
+	int best = -1;
+	double best_w = 0;
+	for (int L = lo; L <= hi; L++) {
+		float oct = log2f(fps * 60 / L / 120);
+		double w = r[L] * expf(-0.5f * oct * oct);
+		if (best < 0 || w > best_w) {
+			best = L;
+			best_w = w;
+		}
+	}
+	/* parabolic peak between neighbouring lags */
+	double a = r[best - 1], b = r[best], c = r[best + 1];
+	double den = a - 2 * b + c, off = den < 0 ? 0.5 * (a - c) / den : 0;
+	if (off > 0.5) off = 0.5;
+	if (off < -0.5) off = -0.5;
+	*clarity = b < 0 ? 0 : b > 1 ? 1 : (float)b;
+	if (*clarity < FEAT_PULSE_MIN) return 0;
+	return 60 * fps / (float)(best + off);
+}
+
+/* The vector, plus the raw tempo and centroid for --features; returns 0
+ * when there was no audible audio. */
+static int feat_finish(struct featbuild *F, float *v, float *bpm, float *centroid) {
+	int ok = F->voiced > 0;
+	memset(v, 0, FEAT_DIM * sizeof(float));
+	*bpm = *centroid = 0;
+	if (ok) {
+		float clarity;
+		*bpm = feat_tempo(F, &clarity);
+		*centroid = (float)(F->centroid / F->voiced);
+		double mdb = F->db / F->voiced;
+		double spread = sqrt(fmax(F->db_sq / F->voiced - mdb * mdb, 0));
+		v[0] = *bpm > 0 ? log2f(*bpm / 120) * 2 : 0;
+		v[1] = clarity;
+		v[2] = log2f(fmaxf(*centroid, 50) / 1500);
+		v[3] = (float)(spread / 10);
+		double csum = 0;
+		for (int i = 0; i < 12; i++) csum += F->chroma[i];
+		for (int i = 0; i < 12 && csum > 0; i++)
+			v[4 + i] = (float)(F->chroma[i] / csum * 3);
+		double bdb[FEAT_BANDS], bmean = 0;
+		for (int b = 0; b < FEAT_BANDS; b++) {
+			bdb[b] = 10 * log10(F->bands[b] + 1e-12);
+			bmean += bdb[b] / FEAT_BANDS;
+		}
+		for (int b = 0; b < FEAT_BANDS; b++)
+			v[16 + b] = (float)((bdb[b] - bmean) / 20);
+	}
+	free(F->flux);
+	return ok;
+}
+
+/* Durations from container headers, without decoding. Each parser gets
+ * the whole file mapped read-only and returns seconds, or -1. */
+static uint32_t be32(const unsigned char *p) {
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static uint32_t le32(const unsigned char *p) {
+	return (uint32_t)p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0];
+}
+
+/* Offset just past an ID3v2 tag, or 0. */
+static size_t id3v2_skip(const unsigned char *p, size_t n) {
+	if (n < 10 || memcmp(p, "ID3", 3) != 0) return 0;
+	size_t len = 10 + ((p[6] & 0x7f) << 21 | (p[7] & 0x7f) << 14 | (p[8] & 0x7f) << 7 | (p[9] & 0x7f));
+	if (p[5] & 0x10) len += 10; /* footer */
+	return len < n ? len : n;
+}
+
+struct mp3_frame {
+	int len, spf, rate, side;
+};
+
+static int mp3_frame_parse(const unsigned char *p, struct mp3_frame *f) {
+	static const short kbps[2][3][15] = {
+		{ /* MPEG 1: layer III, II, I */
+			{ 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 },
+			{ 0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384 },
+			{ 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },
+		},
+		{ /* MPEG 2 / 2.5 */
+			{ 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+			{ 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+			{ 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256 },
+		},
+	};
+	static const int rates[3] = { 44100, 48000, 32000 };
+	if (p[0] != 0xff || (p[1] & 0xe0) != 0xe0) return 0;
+	int ver = (p[1] >> 3) & 3;   /* 0 = 2.5, 2 = 2, 3 = 1 */
+	int layer = (p[1] >> 1) & 3; /* 1 = III, 2 = II, 3 = I */
+	int bri = p[2] >> 4, sri = (p[2] >> 2) & 3, pad = (p[2] >> 1) & 1;
+	if (ver == 1 || layer == 0 || bri == 0 || bri == 15 || sri == 3) return 0;
+	int v1 = ver == 3, mono = (p[3] >> 6) == 3;
+	int br = kbps[!v1][layer - 1][bri] * 1000;
+	f->rate = rates[sri] >> (ver == 3 ? 0 : ver == 2 ? 1 : 2);
+	if (layer == 3) {
+		f->spf = 384;
+		f->len = (12 * br / f->rate + pad) * 4;
 	} else {
-		appendf(buf, &len, sizeof(buf),
-			"\033[1;%dH%s  MusicPlayer%s",
-			main_col, MAIN_ACCENT_BOLD, MAIN_BASE);
+		f->spf = (layer == 1 && !v1) ? 576 : 1152;
+		f->len = f->spf / 8 * br / f->rate + pad;
 	}
-	{
-		int vbars = volume / 5;
-		if (vbars < 0)
-			vbars = 0;
-		if (vbars > 20)
-			vbars = 20;
+	f->side = v1 ? (mono ? 17 : 32) : (mono ? 9 : 17);
+	return f->len >= 4;
+}
 
-		appendf(buf, &len, sizeof(buf), " | [");
-		if (vbars > 0)
-			appendf(buf, &len, sizeof(buf), "%s", MAIN_ACCENT);
-		for (int i = 0; i < 20; i++) {
-			if (i == vbars)
-				appendf(buf, &len, sizeof(buf), "%s", MAIN_DIM);
-			append_repeat(buf, &len, sizeof(buf), '|', 1);
+static double mp3_duration(const unsigned char *p, size_t n) {
+	size_t off = id3v2_skip(p, n);
+	struct mp3_frame f, g;
+
+	/* first sync whose successor also parses (or ends the file) */
+	size_t limit = off + 65536 < n ? off + 65536 : n;
+	for (; off + 4 <= limit; off++) {
+		if (!mp3_frame_parse(p + off, &f)) continue;
+		size_t next = off + f.len;
+		if (next + 4 > n || mp3_frame_parse(p + next, &g)) break;
+	}
+	if (off + 4 > limit) return -1;
+
+	/* Xing/Info or VBRI frame count */
+	size_t x = off + 4 + f.side;
+	if (x + 12 <= n && (!memcmp(p + x, "Xing", 4) || !memcmp(p + x, "Info", 4)) && (be32(p + x + 4) & 1))
+		return (double)be32(p + x + 8) * f.spf / f.rate;
+	size_t v = off + 4 + 32;
+	if (v + 18 <= n && !memcmp(p + v, "VBRI", 4))
+		return (double)be32(p + v + 14) * f.spf / f.rate;
+
+	/* no index: walk the frames */
+	long long samples = 0;
+	while (off + 4 <= n && mp3_frame_parse(p + off, &g)) {
+		samples += g.spf;
+		off += g.len;
+	}
+	return (double)samples / f.rate;
+}
+
+static double flac_duration(const unsigned char *p, size_t n) {
+	size_t off = id3v2_skip(p, n);
+	if (off + 8 + 18 > n || memcmp(p + off, "fLaC", 4) != 0 || (p[off + 4] & 0x7f) != 0)
+		return -1;
+	const unsigned char *si = p + off + 8;
+	uint32_t rate = si[10] << 12 | si[11] << 4 | si[12] >> 4;
+	unsigned long long total = (unsigned long long)(si[13] & 0x0f) << 32 | be32(si + 14);
+	return rate && total ? (double)total / rate : -1;
+}
+
+static double ogg_duration(const unsigned char *p, size_t n) {
+	if (n < 28 || memcmp(p, "OggS", 4) != 0) return -1;
+	uint32_t serial = le32(p + 14);
+	size_t body = 27 + p[26];
+	if (body + 19 > n) return -1;
+	const unsigned char *id = p + body;
+	double rate;
+	long long preskip = 0;
+	if (!memcmp(id, "\x01vorbis", 7)) {
+		rate = le32(id + 12);
+	} else if (!memcmp(id, "OpusHead", 8)) {
+		rate = 48000;
+		preskip = id[10] | id[11] << 8;
+	} else {
+		return -1;
+	}
+	if (rate <= 0) return -1;
+
+	/* granule position of the last page of this stream */
+	for (size_t off = n - 27; off > 0; off--) {
+		if (p[off] != 'O' || memcmp(p + off, "OggS", 4) != 0 || le32(p + off + 14) != serial)
+			continue;
+		long long gran = (long long)((unsigned long long)le32(p + off + 10) << 32 | le32(p + off + 6));
+		if (gran > 0) return (gran - preskip) / rate;
+	}
+	return -1;
+}
+
+static double wav_duration(const unsigned char *p, size_t n) {
+	if (n < 12 || memcmp(p, "RIFF", 4) != 0 || memcmp(p + 8, "WAVE", 4) != 0) return -1;
+	uint32_t byte_rate = 0;
+	for (size_t off = 12; off + 8 <= n;) {
+		uint32_t clen = le32(p + off + 4);
+		if (!memcmp(p + off, "fmt ", 4) && clen >= 16 && off + 20 <= n) {
+			byte_rate = le32(p + off + 16);
+		} else if (!memcmp(p + off, "data", 4)) {
+			size_t have = n - off - 8;
+			return byte_rate ? (double)(clen < have ? clen : have) / byte_rate : -1;
 		}
-		appendf(buf, &len, sizeof(buf), "%s]", MAIN_BASE);
+		off += 8 + (size_t)clen + (clen & 1);
 	}
+	return -1;
+}
 
-	appendf(buf, &len, sizeof(buf), "\033[2;%dH%s", main_col, main_border);
-	append_repeat_text(buf, &len, sizeof(buf), SEP_H, main_cols);
-	appendf(buf, &len, sizeof(buf), "%s", MAIN_BASE);
+static double probe_duration(const char *path) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return -1;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < 12) {
+		close(fd);
+		return -1;
+	}
+	size_t n = st.st_size;
+	const unsigned char *p = mmap(NULL, n, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) return -1;
 
-	/* song list — vim-style edge scrolling */
-	int count = display_len();
-	if (cursor < scroll_offset)
-		scroll_offset = cursor;
-	else if (cursor >= scroll_offset + list_rows)
-		scroll_offset = cursor - list_rows + 1;
-	if (count <= list_rows)
-		scroll_offset = 0;
-	else if (scroll_offset > count - list_rows)
-		scroll_offset = count - list_rows;
-	if (scroll_offset < 0)
-		scroll_offset = 0;
+	double d = wav_duration(p, n);
+	if (d < 0) d = flac_duration(p, n);
+	if (d < 0) d = ogg_duration(p, n);
+	if (d < 0) d = mp3_duration(p, n);
+	munmap((void *)p, n);
+	return d;
+}
 
-	for (int i = 0; i < list_rows && (i + scroll_offset) < count; i++) {
-		int dpos = i + scroll_offset;
-		int sidx = song_at(dpos);
-		const char *prefix = (dpos == cursor) ? "> " : "  ";
-		const char *style = MAIN_BASE;
+/* XXH64, streamed: a fast non-cryptographic hash that takes 32 bytes a
+ * round in four independent lanes. */
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
 
-		if (sidx == delete_pending) {
-			style = (dpos == cursor) ? MAIN_DELETE_BOLD : MAIN_DELETE;
-		} else if (dpos == cursor) {
-			style = main_focused ? MAIN_SELECTED : MAIN_CURSOR;
-		} else if (sidx == playing) {
-			style = MAIN_ACCENT;
+struct xxh64 {
+	uint64_t v[4], total;
+	unsigned char buf[32];
+	int n;
+};
+
+static uint64_t xxh_rotl(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t in) {
+	return xxh_rotl(acc + in * XXH_P2, 31) * XXH_P1;
+}
+
+static uint64_t xxh_read64(const unsigned char *p) {
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return v;
+}
+
+static void xxh64_init(struct xxh64 *h) {
+	memset(h, 0, sizeof(*h));
+	h->v[0] = XXH_P1 + XXH_P2;
+	h->v[1] = XXH_P2;
+	h->v[3] = -XXH_P1;
+}
+
+static void xxh64_feed(struct xxh64 *h, const unsigned char *p, size_t len) {
+	h->total += len;
+	if (h->n) {
+		size_t room = 32 - h->n, take = room < len ? room : len;
+		memcpy(h->buf + h->n, p, take);
+		h->n += take;
+		p += take;
+		len -= take;
+		if (h->n < 32) return;
+		for (int i = 0; i < 4; i++) h->v[i] = xxh_round(h->v[i], xxh_read64(h->buf + 8 * i));
+		h->n = 0;
+	}
+	for (; len >= 32; p += 32, len -= 32)
+		for (int i = 0; i < 4; i++) h->v[i] = xxh_round(h->v[i], xxh_read64(p + 8 * i));
+	memcpy(h->buf, p, len);
+	h->n = len;
+}
+
+static uint64_t xxh64_final(const struct xxh64 *h) {
+	uint64_t r;
+	if (h->total >= 32) {
+		r = xxh_rotl(h->v[0], 1) + xxh_rotl(h->v[1], 7) + xxh_rotl(h->v[2], 12) + xxh_rotl(h->v[3], 18);
+		for (int i = 0; i < 4; i++) r = (r ^ xxh_round(0, h->v[i])) * XXH_P1 + XXH_P4;
+	} else {
+		r = XXH_P5;
+	}
+	r += h->total;
+	const unsigned char *p = h->buf;
+	int n = h->n;
+	for (; n >= 8; p += 8, n -= 8)
+		r = xxh_rotl(r ^ xxh_round(0, xxh_read64(p)), 27) * XXH_P1 + XXH_P4;
+	if (n >= 4) {
+		uint32_t w;
+		memcpy(&w, p, 4);
+		r = xxh_rotl(r ^ (uint64_t)w * XXH_P1, 23) * XXH_P2 + XXH_P3;
+		p += 4;
+		n -= 4;
+	}
+	for (; n > 0; p++, n--)
+		r = xxh_rotl(r ^ *p * XXH_P5, 11) * XXH_P1;
+	r ^= r >> 33;
+	r *= XXH_P2;
+	r ^= r >> 29;
+	r *= XXH_P3;
+	return r ^ (r >> 32);
+}
+
+/* Content hashes for the duplicate finder. The head hash reads only the
+ * first and last DUP_CHUNK bytes (the whole file when that is all of it,
+ * which then settles the full hash too); the full hash streams the file.
+ * A file whose size no longer matches the job is left unhashed. 0 means
+ * "none", so a real 0 becomes 1. */
+#define DUP_CHUNK (64 << 10)
+#define HASH_BLOCK (1 << 20)
+
+static void hash_file(struct ajob *j) {
+	int fd = open(j->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return;
+	struct stat st;
+	unsigned char *buf = malloc(HASH_BLOCK);
+	if (!buf || fstat(fd, &st) != 0 || st.st_size != j->size) {
+		free(buf);
+		close(fd);
+		return;
+	}
+	struct xxh64 h;
+	long long size = j->size;
+	if (j->need & AN_HEAD) {
+		long long first = size <= 2 * DUP_CHUNK ? size : DUP_CHUNK;
+		xxh64_init(&h);
+		int ok = pread(fd, buf, first, 0) == first;
+		if (ok) xxh64_feed(&h, buf, first);
+		if (ok && size > 2 * DUP_CHUNK) {
+			ok = pread(fd, buf, DUP_CHUNK, size - DUP_CHUNK) == DUP_CHUNK;
+			if (ok) xxh64_feed(&h, buf, DUP_CHUNK);
+		}
+		if (ok) {
+			j->head = xxh64_final(&h);
+			if (!j->head) j->head = 1;
+			j->done |= AN_HEAD;
+			if (size <= 2 * DUP_CHUNK) {
+				j->hash = j->head;
+				j->done |= AN_HASH;
+			}
+		}
+	}
+	if ((j->need & AN_HASH) && !(j->done & AN_HASH)) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		xxh64_init(&h);
+		ssize_t r;
+		while ((r = read(fd, buf, HASH_BLOCK)) > 0) xxh64_feed(&h, buf, r);
+		if (r == 0 && (long long)h.total == size) {
+			j->hash = xxh64_final(&h);
+			if (!j->hash) j->hash = 1;
+			j->done |= AN_HASH;
 		}
+	}
+	free(buf);
+	close(fd);
+}
 
-		const char *suffix = "";
-		if (sidx == delete_pending) {
-			suffix = " [delete]";
-		} else if (sidx == playing) {
-			if (loop_mode == LOOP_SINGLE) suffix = " [repeat]";
-			else if (shuffle) suffix = " [shuffle]";
+static void an_run(struct ajob *j) {
+	if (j->need & AN_DURATION) {
+		j->dur = probe_duration(j->path);
+		j->done |= AN_DURATION;
+	}
+	if (j->need & AN_CONTENT) hash_file(j);
+	if (!(j->need & AN_DECODE)) return;
+
+	pid_t pid;
+	int fd = decode_open(j->path, AN_RATE, 2, &pid);
+	if (fd < 0) {
+		j->decoded = -1;
+		return;
+	}
+
+	struct loudness L;
+	struct wavebuild W;
+	struct featbuild *F = (j->need & AN_FEATURES) ? malloc(sizeof(*F)) : NULL;
+	if (j->need & AN_LOUDNESS) loudness_init(&L, AN_RATE);
+	if (j->need & AN_WAVEFORM) wave_init(&W, AN_RATE);
+	if (F) feat_init(F, AN_RATE);
+
+	short pcm[8192];
+	float x[8192];
+	long long frames = 0;
+	int have = 0; /* bytes buffered in pcm */
+	for (;;) {
+		int r = read(fd, (char *)pcm + have, sizeof(pcm) - have);
+		if (r <= 0) break;
+		have += r;
+		int n = have / 4; /* whole stereo frames */
+		for (int i = 0; i < n * 2; i++) x[i] = pcm[i] / 32768.0f;
+		if (j->need & AN_LOUDNESS) loudness_feed(&L, x, n, 2);
+		if (j->need & AN_WAVEFORM) wave_feed(&W, x, n, 2);
+		if (F) feat_feed(F, x, n, 2);
+		frames += n;
+		have -= n * 4;
+		memmove(pcm, (char *)pcm + n * 4, have);
+	}
+	decode_close(fd, pid);
+
+	j->decoded = 1;
+	if (j->need & AN_LOUDNESS) {
+		loudness_finish(&L, &j->lufs, &j->peak);
+		if (frames == 0) j->lufs = LUFS_UNDECODABLE;
+		j->done |= AN_LOUDNESS;
+	}
+	if ((j->need & AN_WAVEFORM) && wave_finish(&W, j->wf_peak, j->wf_rms))
+		j->done |= AN_WAVEFORM;
+	if (F) {
+		float bpm, centroid;
+		if (feat_finish(F, j->feat, &bpm, &centroid)) j->done |= AN_FEATURES;
+		free(F);
+	}
+	/* a full decode also settles durations the headers could not give */
+	if (frames > 0 && !(j->dur > 0)) {
+		j->dur = (float)frames / AN_RATE;
+		j->done |= AN_DURATION;
+	}
+}
+
+static void *an_worker(void *arg) {
+	(void)arg;
+	for (;;) {
+		pthread_mutex_lock(&an_lock);
+		while (!an_todo)
+			pthread_cond_wait(&an_cond, &an_lock);
+		struct ajob *j = an_todo;
+		an_todo = j->next;
+		if (!an_todo) an_todo_tail = NULL;
+		int skip = an_no_decoder && !(j->need & ~AN_DECODE);
+		if (an_no_decoder) j->need &= ~AN_DECODE;
+		pthread_mutex_unlock(&an_lock);
+
+		if (skip) j->decoded = -1;
+		else an_run(j);
+
+		pthread_mutex_lock(&an_lock);
+		if (j->decoded < 0) an_no_decoder = 1;
+		j->next = an_done;
+		an_done = j;
+		pthread_mutex_unlock(&an_lock);
+		loop_wake();
+	}
+	return NULL;
+}
+
+static void an_enqueue(int idx, unsigned need) {
+	if (an_no_decoder) need &= ~AN_DECODE;
+	if (need == 0) return;
+	struct ajob *j = calloc(1, sizeof(*j));
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", songs_dir, songs[idx]);
+	j->name = strdup(songs[idx]);
+	j->path = strdup(path);
+	j->idx = idx;
+	j->size = meta_size[idx];
+	j->mtime = meta_added[idx];
+	j->need = need;
+	an_pending++;
+	if (need & AN_CONTENT) dup_jobs++;
+
+	pthread_mutex_lock(&an_lock);
+	if (!(need & ~AN_CONTENT) && an_todo) {
+		/* hashing only reads the file: ahead of any queued decode */
+		j->next = an_todo;
+		an_todo = j;
+	} else {
+		if (an_todo_tail) an_todo_tail->next = j;
+		else an_todo = j;
+		an_todo_tail = j;
+	}
+	if (an_workers == 0) {
+		fft_init(); /* shared tables, filled before any worker reads them */
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		int n = ncpu < 1 ? 1 : ncpu > AN_MAX_WORKERS ? AN_MAX_WORKERS : (int)ncpu;
+		for (int i = 0; i < n; i++) {
+			pthread_t t;
+			if (pthread_create(&t, NULL, an_worker, NULL) == 0) {
+				pthread_detach(t);
+				an_workers++;
+			}
 		}
+	}
+	pthread_cond_signal(&an_cond);
+	pthread_mutex_unlock(&an_lock);
+}
 
-		snprintf(line, sizeof(line), "%s%s%s", prefix, songs[sidx], suffix);
-		appendf(buf, &len, sizeof(buf),
-			"\033[%d;%dH%s%-*.*s%s",
-			i + 3, main_col, style, main_cols, main_cols, line, MAIN_BASE);
+/* Move the pending job for songs[idx], if any, to the front of the queue.
+ * Jobs are matched by name: a rescan renumbers songs[] under them. */
+static void an_prioritize(int idx) {
+	pthread_mutex_lock(&an_lock);
+	struct ajob *prev = NULL;
+	for (struct ajob *j = an_todo; j; prev = j, j = j->next) {
+		if (!(j->need & AN_DECODE) || strcmp(j->name, songs[idx]) != 0)
+			continue;
+		if (prev) {
+			prev->next = j->next;
+			if (an_todo_tail == j) an_todo_tail = prev;
+			j->next = an_todo;
+			an_todo = j;
+		}
+		break;
 	}
+	pthread_mutex_unlock(&an_lock);
+}
 
-	/* status lines at bottom */
-	if (playing >= 0) {
-		const char *state = paused ? "[paused]" : "[playing]";
-		const char *lmode = "";
-		if (loop_mode == LOOP_SINGLE) lmode = "[repeat]";
-		else if (shuffle) lmode = "[shuffle]";
-		int pm = (int)song_pos / 60, ps = (int)song_pos % 60;
-		int dm = (int)song_dur / 60, ds = (int)song_dur % 60;
+/* Gain in dB that brings songs[idx] to NORM_TARGET_LUFS without pushing
+ * its true peak above NORM_MAX_PEAK; 0 when unknown or silent. */
+static float norm_gain(int idx) {
+	float lufs = meta_lufs[idx];
+	if (!normalize || isnan(lufs) || lufs <= -70.0f) return 0;
+	float g = NORM_TARGET_LUFS - lufs;
+	if (meta_peak[idx] + g > NORM_MAX_PEAK) g = NORM_MAX_PEAK - meta_peak[idx];
+	if (g > 12.0f) g = 12.0f;
+	if (g < -20.0f) g = -20.0f;
+	return g;
+}
 
-		snprintf(line, sizeof(line), "%s%s %s", state, lmode, songs[playing]);
-		appendf(buf, &len, sizeof(buf),
-			"\033[%d;%dH%s%-*.*s%s",
-			rows - 1, main_col, MAIN_ACCENT_BOLD, main_cols, main_cols, line, MAIN_BASE);
+/* Install, replace or remove the @norm filter on the running mpv. */
+static void norm_update_live(void) {
+	if (mpv_pid <= 0 || playing < 0) return;
+	float g = norm_gain(playing);
+	if (norm_live && g == norm_applied) return;
+	if (norm_live) {
+		mpv_cmd("{\"command\":[\"af\",\"remove\",\"@norm\"]}\n");
+		norm_live = 0;
+	}
+	if (g != 0) {
+		char cmd[128];
+		snprintf(cmd, sizeof(cmd),
+			"{\"command\":[\"af\",\"add\",\"@norm:lavfi=[volume=%.2fdB]\"]}\n", g);
+		mpv_cmd(cmd);
+		norm_live = 1;
+	}
+	norm_applied = g;
+}
+
+static char loudness_cache[PATH_MAX];
+static char duration_cache[PATH_MAX];
+static char hash_cache[PATH_MAX];
+
+/* The line-per-song caches are appended to as results land, and later
+ * lines win. When more than half of a file's lines are for songs that are
+ * gone, changed or measured again, it is rewritten with put()'s line for
+ * each of the live songs that have one. */
+static void cache_compact(const char *path, int lines, int live, void (*put)(FILE *, int)) {
+	if (lines <= 2 * live || replay_mode) return;
+	char tmp[PATH_MAX + 8];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	FILE *f = fopen(tmp, "w");
+	if (!f) return;
+	for (int i = 0; i < nsongs; i++) put(f, i);
+	if (fclose(f) != 0 || rename(tmp, path) != 0) unlink(tmp);
+}
+
+static void loudness_put(FILE *f, int i) {
+	if (!isnan(meta_lufs[i]))
+		fprintf(f, "%lld\t%lld\t%.2f\t%.2f\t%s\n",
+			meta_size[i], meta_added[i], meta_lufs[i], meta_peak[i], songs[i]);
+}
+
+/* cache/loudness: "<size>\t<mtime>\t<lufs>\t<peak>\t<name>". */
+static void loudness_cache_load(void) {
+	FILE *f = fopen(loudness_cache, "r");
+	if (!f) return;
+	char line[PATH_MAX + 128];
+	int lines = 0;
+	while (fgets(line, sizeof(line), f)) {
+		long long size, mtime;
+		float lufs, peak;
+		int off = 0;
+		lines++;
+		if (sscanf(line, "%lld\t%lld\t%f\t%f\t%n", &size, &mtime, &lufs, &peak, &off) < 4 || !off)
+			continue;
+		char *name = line + off;
+		name[strcspn(name, "\r\n")] = '\0';
+		int idx = song_find(name);
+		if (idx >= 0 && meta_size[idx] == size && meta_added[idx] == mtime) {
+			meta_lufs[idx] = lufs;
+			meta_peak[idx] = peak;
+		}
+	}
+	fclose(f);
+
+	int live = 0;
+	for (int i = 0; i < nsongs; i++)
+		if (!isnan(meta_lufs[i])) live++;
+	cache_compact(loudness_cache, lines, live, loudness_put);
+}
+
+/* Waveform cache: a fixed-record file mapped MAP_SHARED. Records are keyed
+ * by filename hash plus size and mtime; meta_wave[] holds each song's record
+ * number, so drawing a thumbnail is a pointer lookup. Only the main thread
+ * touches the mapping. */
+#define WF_MAGIC 0x4657504dU /* "MPWF" */
+#define WF_VERSION 1
+
+struct wf_header {
+	uint32_t magic, version, buckets, count, capacity, pad[3];
+};
+
+struct wf_record {
+	uint64_t hash;
+	int64_t size, mtime;
+	unsigned char peak[WF_BUCKETS], rms[WF_BUCKETS];
+};
+
+static int wf_fd = -1;
+static struct wf_header *wf_map = NULL;
+static size_t wf_map_len = 0;
+static float wf_bar[512];              /* progress bar levels for wf_bar_slot */
+static int wf_bar_slot = -1, wf_bar_width = 0;
+
+static struct wf_record *wf_rec(int slot) {
+	return (struct wf_record *)(wf_map + 1) + slot;
+}
+
+/* Map the first want bytes of a record cache file, replacing old.
+ * --replay maps anonymous memory instead, filled from the old mapping or
+ * the file (fd may be -1), so its results never reach the file. */
+static void *cache_map(int fd, void *old, size_t old_len, size_t want) {
+	if (!replay_mode) {
+		if (old) munmap(old, old_len);
+		return mmap(NULL, want, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	void *m = mmap(NULL, want, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (m == MAP_FAILED) return m;
+	if (old) {
+		memcpy(m, old, old_len < want ? old_len : want);
+		munmap(old, old_len);
+	} else if (fd >= 0 && pread(fd, m, want, 0) < 0) {
+		memset(m, 0, want);
+	}
+	return m;
+}
+
+static int wf_map_file(uint32_t capacity) {
+	size_t want = sizeof(struct wf_header) + (size_t)capacity * sizeof(struct wf_record);
+	if (!replay_mode && ftruncate(wf_fd, want) != 0) return -1;
+	wf_map = cache_map(wf_fd, wf_map, wf_map_len, want);
+	if (wf_map == MAP_FAILED) {
+		wf_map = NULL;
+		return -1;
+	}
+	wf_map_len = want;
+	wf_map->capacity = capacity;
+	return 0;
+}
+
+static void wf_open(void) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/waveforms", cache_dir);
+	wf_fd = replay_mode ? open(path, O_RDONLY | O_CLOEXEC) :
+		open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (wf_fd < 0 && !replay_mode) return;
+
+	struct stat st;
+	struct wf_header h = { 0 };
+	if (fstat(wf_fd, &st) != 0 || (size_t)st.st_size < sizeof(h) ||
+	    pread(wf_fd, &h, sizeof(h), 0) != sizeof(h) || h.magic != WF_MAGIC ||
+	    h.version != WF_VERSION || h.buckets != WF_BUCKETS ||
+	    sizeof(h) + (size_t)h.capacity * sizeof(struct wf_record) > (size_t)st.st_size ||
+	    h.count > h.capacity) {
+		/* missing, foreign or truncated: start over */
+		h = (struct wf_header){ WF_MAGIC, WF_VERSION, WF_BUCKETS, 0, 0, { 0 } };
+		if (!replay_mode &&
+		    (ftruncate(wf_fd, 0) != 0 || pwrite(wf_fd, &h, sizeof(h), 0) != sizeof(h))) {
+			close(wf_fd);
+			wf_fd = -1;
+			return;
+		}
+		h.capacity = 256;
+	}
+	if (wf_map_file(h.capacity) != 0) {
+		close(wf_fd);
+		wf_fd = -1;
+		return;
+	}
+	if (replay_mode) *wf_map = h; /* the file may have held anything */
+
+}
+
+/* Every fixed-record cache file starts its records with this key. */
+struct cache_key {
+	uint64_t hash;
+	int64_t size, mtime;
+};
+
+/* Attach count records of stride bytes at recs to songs, storing each
+ * match's record number in slot[]. Hashes each name once; O(songs +
+ * records). */
+static void cache_attach(const void *recs, size_t stride, uint32_t count, int *slot_of) {
+	int size = 1;
+	while (size < 2 * nsongs) size <<= 1;
+	int *tab = calloc(size, sizeof(int));
+	uint64_t *hashes = malloc((nsongs ? nsongs : 1) * sizeof(uint64_t));
+	if (!tab || !hashes) {
+		free(tab);
+		free(hashes);
+		return;
+	}
+	for (int i = 0; i < nsongs; i++) {
+		hashes[i] = fnv1a(songs[i]);
+		unsigned slot = hashes[i] & (size - 1);
+		while (tab[slot]) slot = (slot + 1) & (size - 1);
+		tab[slot] = i + 1;
+	}
+	for (uint32_t r = 0; r < count; r++) {
+		const struct cache_key *rec = (const void *)((const char *)recs + r * stride);
+		unsigned slot = rec->hash & (size - 1);
+		while (tab[slot]) {
+			int i = tab[slot] - 1;
+			if (hashes[i] == rec->hash && meta_size[i] == rec->size && meta_added[i] == rec->mtime) {
+				slot_of[i] = r;
+				break;
+			}
+			slot = (slot + 1) & (size - 1);
+		}
+	}
+	free(tab);
+	free(hashes);
+}
+
+static void wf_attach(void) {
+	if (wf_map)
+		cache_attach(wf_rec(0), sizeof(struct wf_record), wf_map->count, meta_wave);
+}
+
+static void wf_store(int idx, const struct ajob *j) {
+	if (!wf_map) return;
+	int slot = meta_wave[idx];
+	if (slot < 0) {
+		if (wf_map->count == wf_map->capacity && wf_map_file(wf_map->capacity * 2) != 0)
+			return;
+		slot = wf_map->count;
+	}
+	struct wf_record *rec = wf_rec(slot);
+	rec->hash = fnv1a(j->name);
+	rec->size = j->size;
+	rec->mtime = j->mtime;
+	memcpy(rec->peak, j->wf_peak, WF_BUCKETS);
+	memcpy(rec->rms, j->wf_rms, WF_BUCKETS);
+	if (slot == (int)wf_map->count) wf_map->count++;
+	meta_wave[idx] = slot;
+	if (slot == wf_bar_slot) wf_bar_slot = -1;
+}
+
+/* Feature cache: cache/features, laid out like the waveform file with one
+ * FEAT_DIM vector per record; meta_feat[] holds each song's record. */
+#define FT_MAGIC 0x5446504dU /* "MPFT" */
+#define FT_VERSION 1
+
+struct ft_header {
+	uint32_t magic, version, dim, count, capacity, pad[3];
+};
+
+struct ft_record {
+	uint64_t hash;
+	int64_t size, mtime;
+	float v[FEAT_DIM];
+};
+
+static int ft_fd = -1;
+static struct ft_header *ft_map = NULL;
+static size_t ft_map_len = 0;
+
+static struct ft_record *ft_rec(int slot) {
+	return (struct ft_record *)(ft_map + 1) + slot;
+}
+
+static int ft_map_file(uint32_t capacity) {
+	size_t want = sizeof(struct ft_header) + (size_t)capacity * sizeof(struct ft_record);
+	if (!replay_mode && ftruncate(ft_fd, want) != 0) return -1;
+	ft_map = cache_map(ft_fd, ft_map, ft_map_len, want);
+	if (ft_map == MAP_FAILED) {
+		ft_map = NULL;
+		return -1;
+	}
+	ft_map_len = want;
+	ft_map->capacity = capacity;
+	return 0;
+}
+
+static void ft_open(void) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/features", cache_dir);
+	ft_fd = replay_mode ? open(path, O_RDONLY | O_CLOEXEC) :
+		open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (ft_fd < 0 && !replay_mode) return;
+
+	struct stat st;
+	struct ft_header h = { 0 };
+	if (fstat(ft_fd, &st) != 0 || (size_t)st.st_size < sizeof(h) ||
+	    pread(ft_fd, &h, sizeof(h), 0) != sizeof(h) || h.magic != FT_MAGIC ||
+	    h.version != FT_VERSION || h.dim != FEAT_DIM ||
+	    sizeof(h) + (size_t)h.capacity * sizeof(struct ft_record) > (size_t)st.st_size ||
+	    h.count > h.capacity) {
+		h = (struct ft_header){ FT_MAGIC, FT_VERSION, FEAT_DIM, 0, 0, { 0 } };
+		if (!replay_mode &&
+		    (ftruncate(ft_fd, 0) != 0 || pwrite(ft_fd, &h, sizeof(h), 0) != sizeof(h))) {
+			close(ft_fd);
+			ft_fd = -1;
+			return;
+		}
+		h.capacity = 256;
+	}
+	if (ft_map_file(h.capacity) != 0) {
+		close(ft_fd);
+		ft_fd = -1;
+		return;
+	}
+	if (replay_mode) *ft_map = h; /* the file may have held anything */
+	cache_attach(ft_rec(0), sizeof(struct ft_record), ft_map->count, meta_feat);
+	for (int i = 0; i < nsongs; i++)
+		if (meta_feat[i] >= 0) feat_lane_set(i, ft_rec(meta_feat[i])->v);
+}
+
+static void ft_store(int idx, const struct ajob *j) {
+	if (!ft_map) return;
+	int slot = meta_feat[idx];
+	if (slot < 0) {
+		if (ft_map->count == ft_map->capacity && ft_map_file(ft_map->capacity * 2) != 0)
+			return;
+		slot = ft_map->count;
+	}
+	struct ft_record *rec = ft_rec(slot);
+	rec->hash = fnv1a(j->name);
+	rec->size = j->size;
+	rec->mtime = j->mtime;
+	memcpy(rec->v, j->feat, sizeof(rec->v));
+	if (slot == (int)ft_map->count) ft_map->count++;
+	meta_feat[idx] = slot;
+	feat_lane_set(idx, rec->v);
+}
+
+/* cache/durations: "<size>\t<mtime>\t<seconds>\t<name>", -1 when the
+ * headers could not tell. Marks every song with a current entry in seen[]. */
+static void duration_cache_load(unsigned char *seen) {
+	FILE *f = fopen(duration_cache, "r");
+	if (!f) return;
+	char line[PATH_MAX + 128];
+	while (fgets(line, sizeof(line), f)) {
+		long long size, mtime;
+		float dur;
+		int off = 0;
+		if (sscanf(line, "%lld\t%lld\t%f\t%n", &size, &mtime, &dur, &off) < 3 || !off)
+			continue;
+		char *name = line + off;
+		name[strcspn(name, "\r\n")] = '\0';
+		int idx = song_find(name);
+		if (idx >= 0 && meta_size[idx] == size && meta_added[idx] == mtime) {
+			if (dur > 0) meta_dur[idx] = dur;
+			seen[idx] = 1;
+		}
+	}
+	fclose(f);
+	view_gen++;
+}
+
+static void hash_put(FILE *f, int i) {
+	if (meta_head[i] || meta_hash[i])
+		fprintf(f, "%lld\t%lld\t%016llx\t%016llx\t%s\n", meta_size[i], meta_added[i],
+			(unsigned long long)meta_head[i], (unsigned long long)meta_hash[i], songs[i]);
+}
+
+/* cache/hashes: "<size>\t<mtime>\t<head>\t<hash>\t<name>", both in hex,
+ * 0 = not hashed. Read when every scan ends, as scans start songs unhashed. */
+static void hash_cache_load(void) {
+	snprintf(hash_cache, sizeof(hash_cache), "%s/hashes", cache_dir);
+	FILE *f = fopen(hash_cache, "r");
+	if (!f) return;
+	char line[PATH_MAX + 128];
+	int lines = 0;
+	while (fgets(line, sizeof(line), f)) {
+		long long size, mtime;
+		unsigned long long head, hash;
+		int off = 0;
+		lines++;
+		if (sscanf(line, "%lld\t%lld\t%llx\t%llx\t%n", &size, &mtime, &head, &hash, &off) < 4 || !off)
+			continue;
+		char *name = line + off;
+		name[strcspn(name, "\r\n")] = '\0';
+		int idx = song_find(name);
+		if (idx >= 0 && meta_size[idx] == size && meta_added[idx] == mtime) {
+			meta_head[idx] = head;
+			meta_hash[idx] = hash;
+		}
+	}
+	fclose(f);
+
+	int live = 0;
+	for (int i = 0; i < nsongs; i++)
+		if (meta_head[i] || meta_hash[i]) live++;
+	cache_compact(hash_cache, lines, live, hash_put);
+}
+
+/* Queue every song without a cached measurement. */
+static void analysis_start(void) {
+	if (!replay_mode) mkdir(cache_dir, 0755);
+	snprintf(loudness_cache, sizeof(loudness_cache), "%s/loudness", cache_dir);
+	loudness_cache_load();
+	wf_open();
+	wf_attach();
+	ft_open();
+	snprintf(duration_cache, sizeof(duration_cache), "%s/durations", cache_dir);
+	unsigned char *seen = calloc(nsongs ? nsongs : 1, 1);
+	if (seen) {
+		duration_cache_load(seen);
+		/* header probes are cheap: queue them all ahead of any decoding */
+		for (int i = 0; i < nsongs; i++)
+			if (!seen[i]) an_enqueue(i, AN_DURATION);
+		free(seen);
+	}
+	for (int i = 0; i < nsongs; i++) {
+		unsigned need = 0;
+		if (isnan(meta_lufs[i])) need |= AN_LOUDNESS;
+		if (meta_wave[i] < 0 && wf_map) need |= AN_WAVEFORM;
+		if (meta_feat[i] < 0 && ft_map) need |= AN_FEATURES;
+		an_enqueue(i, need);
+	}
+}
+
+static void dup_advance(void);
+
+/* A line cache, opened for appending on a poll's first result; --replay
+ * keeps results in memory only. */
+static FILE *cache_append(FILE **f, const char *path) {
+	if (!*f && !replay_mode) *f = fopen(path, "a");
+	return *f;
+}
+
+/* Main-loop side: apply finished jobs and persist them. */
+static void analysis_poll(void) {
+	pthread_mutex_lock(&an_lock);
+	struct ajob *done = an_done;
+	an_done = NULL;
+	pthread_mutex_unlock(&an_lock);
+	if (!done) return;
+
+	FILE *lc = NULL, *dc = NULL, *hc = NULL;
+	while (done) {
+		struct ajob *j = done;
+		done = j->next;
+
+		int idx = (j->idx < nsongs && strcmp(songs[j->idx], j->name) == 0)
+			? j->idx : song_find(j->name);
+		if (idx >= 0 && (j->done & AN_LOUDNESS)) {
+			meta_lufs[idx] = j->lufs;
+			meta_peak[idx] = j->peak;
+			if (cache_append(&lc, loudness_cache))
+				fprintf(lc, "%lld\t%lld\t%.2f\t%.2f\t%s\n",
+					j->size, j->mtime, j->lufs, j->peak, j->name);
+			if (idx == playing) norm_update_live();
+		}
+		if (idx >= 0 && (j->done & AN_WAVEFORM))
+			wf_store(idx, j);
+		if (idx >= 0 && (j->done & AN_FEATURES))
+			ft_store(idx, j);
+		/* decodes report a length too; only keep it where headers failed */
+		if (idx >= 0 && (j->done & AN_DURATION) &&
+		    ((j->need & AN_DURATION) || meta_dur[idx] <= 0)) {
+			if (j->dur > 0 && meta_dur[idx] <= 0) {
+				meta_dur[idx] = j->dur;
+				meta_changed |= 1u << F_DURATION;
+				view_gen++;
+			}
+			if (cache_append(&dc, duration_cache))
+				fprintf(dc, "%lld\t%lld\t%.3f\t%s\n",
+					j->size, j->mtime, j->dur > 0 ? j->dur : -1.0f, j->name);
+		}
+		if (idx >= 0 && (j->done & AN_CONTENT) &&
+		    meta_size[idx] == j->size && meta_added[idx] == j->mtime) {
+			if (j->done & AN_HEAD) meta_head[idx] = j->head;
+			if (j->done & AN_HASH) meta_hash[idx] = j->hash;
+			if (cache_append(&hc, hash_cache)) hash_put(hc, idx);
+		}
+		if (j->need & AN_CONTENT) dup_jobs--;
+		free(j->name);
+		free(j->path);
+		free(j);
+		an_pending--;
+	}
+	if (lc) fclose(lc);
+	if (dc) fclose(dc);
+	if (hc) fclose(hc);
+	if ((dup_state == DUP_HEAD || dup_state == DUP_HASH) && dup_jobs == 0)
+		dup_advance();
+}
+
+static void load_playlist(int idx);
+static int find_in_display(int song_idx);
+static int song_at(int pos);
+static int display_len(void);
+static void play_song(int idx);
+static void apply_filter(void);
+
+static void queue_grow(void) {
+	int ncap = queue_cap ? queue_cap * 2 : 16;
+	int *nbuf = malloc(ncap * sizeof(int));
+	if (!nbuf) return;
+	/* unwrap into the new buffer so head starts at 0 */
+	for (int i = 0; i < queue_len; i++)
+		nbuf[i] = queue_buf[(queue_head + i) % queue_cap];
+	free(queue_buf);
+	queue_buf = nbuf;
+	queue_cap = ncap;
+	queue_head = 0;
+}
+
+static void queue_push_back(int idx) {
+	if (queue_len == queue_cap) queue_grow();
+	if (queue_len == queue_cap) return;
+	queue_buf[(queue_head + queue_len) % queue_cap] = idx;
+	queue_len++;
+}
+
+static void queue_push_front(int idx) {
+	if (queue_len == queue_cap) queue_grow();
+	if (queue_len == queue_cap) return;
+	queue_head = (queue_head + queue_cap - 1) % queue_cap;
+	queue_buf[queue_head] = idx;
+	queue_len++;
+}
+
+static int queue_pop_front(void) {
+	if (queue_len == 0) return -1;
+	int idx = queue_buf[queue_head];
+	queue_head = (queue_head + 1) % queue_cap;
+	queue_len--;
+	return idx;
+}
+
+static int queue_pop_back(void) {
+	if (queue_len == 0) return -1;
+	queue_len--;
+	return queue_buf[(queue_head + queue_len) % queue_cap];
+}
+
+static int queue_at(int i) {
+	return queue_buf[(queue_head + i) % queue_cap];
+}
+
+static void queue_clear(void) {
+	queue_head = 0;
+	queue_len = 0;
+}
+
+/* Rewrite entries through remap (old songs[] index -> new, -1 = removed),
+ * like filtered[]. Compacts in ring order; the write slot never overtakes
+ * the read slot. */
+static void queue_remap(const int *remap) {
+	int w = 0;
+	for (int i = 0; i < queue_len; i++) {
+		int val = remap[queue_at(i)];
+		if (val < 0) continue;
+		queue_buf[(queue_head + w) % queue_cap] = val;
+		w++;
+	}
+	queue_len = w;
+}
+
+/* Drop list entries through remap and shift the survivors. */
+static void remap_list(int *list, int *n, const int *remap) {
+	int w = 0;
+	for (int i = 0; i < *n; i++)
+		if (remap[list[i]] >= 0)
+			list[w++] = remap[list[i]];
+	*n = w;
+}
+
+static int bit_get(const uint64_t *bits, int i) {
+	return (bits[i >> 6] >> (i & 63)) & 1;
+}
+
+static void sel_set(int i, int on) {
+	if (bit_get(sel_bits, i) == on) return;
+	sel_bits[i >> 6] ^= 1ull << (i & 63);
+	nselected += on ? 1 : -1;
+}
+
+static void sel_clear(void) {
+	memset(sel_bits, 0, sizeof(sel_bits));
+	nselected = 0;
+	visual_anchor = -1;
+}
+
+static int in_visual(int dpos) {
+	if (visual_anchor < 0) return 0;
+	int lo = visual_anchor < cursor ? visual_anchor : cursor;
+	int hi = visual_anchor < cursor ? cursor : visual_anchor;
+	return dpos >= lo && dpos <= hi;
+}
+
+static int is_selected(int dpos) {
+	return bit_get(sel_bits, song_at(dpos)) || in_visual(dpos);
+}
+
+/* Fold the live V range into the bitset. */
+static void sel_commit(void) {
+	if (visual_anchor < 0) return;
+	int len = display_len();
+	for (int d = 0; d < len; d++)
+		if (in_visual(d)) sel_set(song_at(d), 1);
+	visual_anchor = -1;
+}
+
+static int sel_count(void) {
+	int n = nselected;
+	if (visual_anchor >= 0) {
+		int len = display_len();
+		for (int d = 0; d < len; d++)
+			if (in_visual(d) && !bit_get(sel_bits, song_at(d))) n++;
+	}
+	return n;
+}
+
+/* The committed selection as songs[] indices: visible songs in display
+ * order, then any hidden by the current filter or playlist. */
+static int sel_collect(int *out) {
+	static uint64_t left[(MAX_SONGS + 63) / 64];
+	memcpy(left, sel_bits, sizeof(left));
+	int n = 0, len = display_len();
+	for (int d = 0; d < len; d++) {
+		int s = song_at(d);
+		if (bit_get(left, s)) {
+			out[n++] = s;
+			left[s >> 6] &= ~(1ull << (s & 63));
+		}
+	}
+	for (int w = 0; w < (nsongs + 63) / 64; w++)
+		for (uint64_t b = left[w]; b; b &= b - 1)
+			out[n++] = w * 64 + __builtin_ctzll(b);
+	return n;
+}
+
+static void load_state_text(void) {
+	FILE *f = fopen(state_file, "r");
+	if (!f) return;
+	char line[1024];
+	while (fgets(line, sizeof(line), f)) {
+		int len = strlen(line);
+		while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+			line[--len] = '\0';
+
+		int v;
+		char s[16];
+		if (sscanf(line, "volume=%d", &v) == 1) {
+			if (v >= 0 && v <= 100) volume = v;
+		} else if (strncmp(line, "song=", 5) == 0) {
+			strncpy(saved_song, line + 5, sizeof(saved_song) - 1);
+			saved_song[sizeof(saved_song) - 1] = '\0';
+		} else if (sscanf(line, "position=%lf", &saved_pos) == 1) {
+			/* parsed inline */
+		} else if (strncmp(line, "cursor=", 7) == 0) {
+			strncpy(saved_cursor, line + 7, sizeof(saved_cursor) - 1);
+			saved_cursor[sizeof(saved_cursor) - 1] = '\0';
+		} else if (strncmp(line, "playlist=", 9) == 0) {
+			strncpy(saved_playlist, line + 9, sizeof(saved_playlist) - 1);
+			saved_playlist[sizeof(saved_playlist) - 1] = '\0';
+		} else if (sscanf(line, "loop=%15s", s) == 1) {
+			if (strcmp(s, "single") == 0) loop_mode = LOOP_SINGLE;
+			else loop_mode = LOOP_ALL;
+		} else if (sscanf(line, "shuffle=%d", &v) == 1) {
+			shuffle = (v != 0);
+		} else if (sscanf(line, "paused=%d", &v) == 1) {
+			saved_paused = (v != 0);
+		} else if (sscanf(line, "spectrum=%d", &v) == 1) {
+			viz_enabled = (v != 0);
+		} else if (sscanf(line, "normalize=%d", &v) == 1) {
+			normalize = (v != 0);
+		} else if (strncmp(line, "queue=", 6) == 0) {
+			char **nq = realloc(saved_queue, (nsaved_queue + 1) * sizeof(char *));
+			if (nq) {
+				saved_queue = nq;
+				saved_queue[nsaved_queue++] = strdup(line + 6);
+			}
+		}
+	}
+	fclose(f);
+}
+
+/* save_state_text() writes only when the text changes. While a song
+ * plays its position moves on every call, so a position-only change is
+ * written at most every STATE_POS_SECS (and on quit, state_flush()). */
+#define STATE_POS_SECS 5
+static char *state_text;         /* what state.save holds */
+static size_t state_text_len;
+static double state_text_at;     /* mono_now() of that write */
+static double state_text_pos;
+static int state_text_song = -1;
+
+static void save_state_text(void) {
+	double pos = song_pos;
+	if (playing >= 0 && playing == state_text_song && !paused &&
+	    mono_now() - state_text_at < STATE_POS_SECS)
+		pos = state_text_pos;
+
+	char *text = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&text, &len);
+	if (!f) return;
+	fprintf(f, "volume=%d\n", volume);
+	if (playing >= 0) {
+		fprintf(f, "song=%s\n", songs[playing]);
+		fprintf(f, "position=%.2f\n", pos);
+		fprintf(f, "paused=%d\n", paused);
+	}
+	if (display_len() > 0 && cursor >= 0 && cursor < display_len())
+		fprintf(f, "cursor=%s\n", songs[song_at(cursor)]);
+	if (playlist_active >= 0)
+		fprintf(f, "playlist=%s\n", playlists[playlist_active]);
+	fprintf(f, "loop=%s\n", (loop_mode == LOOP_SINGLE) ? "single" : "all");
+	fprintf(f, "shuffle=%d\n", shuffle);
+	fprintf(f, "spectrum=%d\n", viz_enabled);
+	fprintf(f, "normalize=%d\n", normalize);
+	for (int i = 0; i < queue_len; i++)
+		fprintf(f, "queue=%s\n", songs[queue_at(i)]);
+	fclose(f);
+
+	if (state_text && len == state_text_len && memcmp(text, state_text, len) == 0) {
+		free(text);
+		return;
+	}
+	f = fopen(state_file, "w");
+	if (!f) {
+		free(text);
+		return;
+	}
+	fwrite(text, 1, len, f);
+	fclose(f);
+	free(state_text);
+	state_text = text;
+	state_text_len = len;
+	if (pos == song_pos) state_text_at = mono_now();
+	state_text_pos = pos;
+	state_text_song = playing;
+}
+
+/* Optional binary state. When state.bin exists next to state.save it
+ * replaces the text file: a fixed-layout, versioned, checksummed record
+ * mapped MAP_SHARED, so save_state() updates it with plain stores instead
+ * of rewriting a file every tick. The page cache keeps those stores if the
+ * player dies; msync() only runs at checkpoints (song, playlist or queue
+ * change, every STATE_SYNC_SECS, exit). A torn record fails the checksum
+ * and loading falls back to state.save. */
+#define STATE_BIN_FILE "state.bin"
+#define STATE_MAGIC "MPST"
+#define STATE_VERSION 1
+#define STATE_QUEUE_BYTES 65536
+#define STATE_SYNC_SECS 30
+
+struct state_rec {
+	char magic[4];
+	uint32_t version;
+	uint32_t size;         /* sizeof(struct state_rec) */
+	uint32_t crc;          /* crc32 from checkpoints to the end of the used queue */
+	uint64_t checkpoints;
+	double position;
+	int32_t volume, paused, loop, shuffle, spectrum, normalize;
+	int32_t queue_len;
+	uint32_t queue_bytes;
+	uint64_t song_id, cursor_id; /* fnv1a of the names, 0 = none */
+	char song[1024];
+	char cursor[1024];
+	char playlist[256];
+	char queue[STATE_QUEUE_BYTES]; /* queue_len NUL-terminated names */
+};
+
+static const char *state_bin_file = STATE_BIN_FILE;
+static struct state_rec *state_map; /* NULL = text state */
+static double state_synced;
+
+static uint32_t crc32_buf(const void *buf, size_t len) {
+	static uint32_t tab[256];
+	if (!tab[1]) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			tab[i] = c;
+		}
+	}
+	const unsigned char *p = buf;
+	uint32_t c = 0xffffffffu;
+	while (len--) c = tab[(c ^ *p++) & 0xff] ^ (c >> 8);
+	return c ^ 0xffffffffu;
+}
+
+static uint32_t state_rec_crc(const struct state_rec *r) {
+	size_t start = offsetof(struct state_rec, checkpoints);
+	size_t end = offsetof(struct state_rec, queue) + r->queue_bytes;
+	return crc32_buf((const char *)r + start, end - start);
+}
+
+static int state_rec_valid(const struct state_rec *r) {
+	return memcmp(r->magic, STATE_MAGIC, 4) == 0 &&
+		r->version == STATE_VERSION && r->size == sizeof(*r) &&
+		r->queue_bytes <= STATE_QUEUE_BYTES && r->crc == state_rec_crc(r);
+}
+
+static void state_rec_init(struct state_rec *r) {
+	memset(r, 0, sizeof(*r));
+	memcpy(r->magic, STATE_MAGIC, 4);
+	r->version = STATE_VERSION;
+	r->size = sizeof(*r);
+}
+
+static void state_copy(char *dst, size_t size, const char *src) {
+	size_t n = strnlen(src, size - 1);
+	memmove(dst, src, n);
+	dst[n] = '\0';
+}
+
+/* Appends name to the record's queue; 0 when it no longer fits. */
+static int state_rec_queue_add(struct state_rec *r, const char *name) {
+	size_t n = strlen(name) + 1;
+	if (r->queue_bytes + n > STATE_QUEUE_BYTES) return 0;
+	memcpy(r->queue + r->queue_bytes, name, n);
+	r->queue_bytes += n;
+	r->queue_len++;
+	return 1;
+}
+
+/* Same effect as load_state_text(): settings applied, names kept for
+ * restore_state(). */
+static void state_rec_load(const struct state_rec *r) {
+	if (r->volume >= 0 && r->volume <= 100) volume = r->volume;
+	state_copy(saved_song, sizeof(saved_song), r->song);
+	saved_pos = r->song[0] ? r->position : 0;
+	saved_paused = r->song[0] && r->paused;
+	state_copy(saved_cursor, sizeof(saved_cursor), r->cursor);
+	state_copy(saved_playlist, sizeof(saved_playlist), r->playlist);
+	loop_mode = (r->loop == LOOP_SINGLE) ? LOOP_SINGLE : LOOP_ALL;
+	shuffle = (r->shuffle != 0);
+	viz_enabled = (r->spectrum != 0);
+	normalize = (r->normalize != 0);
+	const char *q = r->queue;
+	for (int i = 0; i < r->queue_len && q < r->queue + r->queue_bytes; i++) {
+		char **nq = realloc(saved_queue, (nsaved_queue + 1) * sizeof(char *));
+		if (!nq) break;
+		saved_queue = nq;
+		saved_queue[nsaved_queue++] = strdup(q);
+		q += strlen(q) + 1;
+	}
+}
+
+/* Builds a record from what load_state_text() read, for --import-state. */
+static void state_rec_from_saved(struct state_rec *r) {
+	state_rec_init(r);
+	r->volume = volume;
+	r->loop = loop_mode;
+	r->shuffle = shuffle;
+	r->spectrum = viz_enabled;
+	r->normalize = normalize;
+	if (saved_song[0]) {
+		state_copy(r->song, sizeof(r->song), saved_song);
+		r->song_id = fnv1a(r->song);
+		r->position = saved_pos;
+		r->paused = saved_paused;
+	}
+	if (saved_cursor[0]) {
+		state_copy(r->cursor, sizeof(r->cursor), saved_cursor);
+		r->cursor_id = fnv1a(r->cursor);
+	}
+	state_copy(r->playlist, sizeof(r->playlist), saved_playlist);
+	for (int i = 0; i < nsaved_queue; i++)
+		if (!state_rec_queue_add(r, saved_queue[i])) break;
+	r->crc = state_rec_crc(r);
+}
+
+static void state_rec_export(const struct state_rec *r, FILE *f) {
+	fprintf(f, "volume=%d\n", r->volume);
+	if (r->song[0]) {
+		fprintf(f, "song=%s\n", r->song);
+		fprintf(f, "position=%.2f\n", r->position);
+		fprintf(f, "paused=%d\n", r->paused);
+	}
+	if (r->cursor[0])
+		fprintf(f, "cursor=%s\n", r->cursor);
+	if (r->playlist[0])
+		fprintf(f, "playlist=%s\n", r->playlist);
+	fprintf(f, "loop=%s\n", (r->loop == LOOP_SINGLE) ? "single" : "all");
+	fprintf(f, "shuffle=%d\n", r->shuffle);
+	fprintf(f, "spectrum=%d\n", r->spectrum);
+	fprintf(f, "normalize=%d\n", r->normalize);
+	const char *q = r->queue;
+	for (int i = 0; i < r->queue_len && q < r->queue + r->queue_bytes; i++) {
+		fprintf(f, "queue=%s\n", q);
+		q += strlen(q) + 1;
+	}
+}
+
+/* Maps state.bin if it exists. Returns 0 with a valid record, 1 when the
+ * record was unusable and has been reset (caller falls back to text),
+ * -1 when there is no binary state. */
+static int state_bin_open(void) {
+	int fd = open(state_bin_file, replay_mode ? O_RDONLY : O_RDWR);
+	if (fd < 0) return -1;
+	struct stat st;
+	int ok = fstat(fd, &st) == 0 && st.st_size == (off_t)sizeof(struct state_rec);
+	if (!ok && (replay_mode || ftruncate(fd, sizeof(struct state_rec)) != 0)) {
+		close(fd);
+		return -1;
+	}
+	/* --replay reads a private copy */
+	void *m = mmap(NULL, sizeof(struct state_rec), PROT_READ | PROT_WRITE,
+		replay_mode ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED) return -1;
+	state_map = m;
+	state_synced = mono_now();
+	if (ok && state_rec_valid(state_map)) return 0;
+	state_rec_init(state_map);
+	state_map->crc = state_rec_crc(state_map);
+	return 1;
+}
+
+static void state_bin_sync(void) {
+	if (!state_map) return;
+	state_map->checkpoints++;
+	state_map->crc = state_rec_crc(state_map);
+	msync(state_map, sizeof(*state_map), MS_SYNC);
+	state_synced = mono_now();
+}
+
+static void save_state_bin(void) {
+	struct state_rec *r = state_map;
+	int checkpoint = 0;
+	r->volume = volume;
+	r->loop = loop_mode;
+	r->shuffle = shuffle;
+	r->spectrum = viz_enabled;
+	r->normalize = normalize;
+
+	if (playing >= 0) {
+		uint64_t id = fnv1a(songs[playing]);
+		if (id != r->song_id) {
+			state_copy(r->song, sizeof(r->song), songs[playing]);
+			r->song_id = id;
+			checkpoint = 1;
+		}
+		r->position = song_pos;
+		r->paused = paused;
+	} else if (r->song_id) {
+		r->song[0] = '\0';
+		r->song_id = 0;
+		r->position = 0;
+		r->paused = 0;
+		checkpoint = 1;
+	}
+
+	uint64_t cid = 0;
+	if (display_len() > 0 && cursor >= 0 && cursor < display_len())
+		cid = fnv1a(songs[song_at(cursor)]);
+	if (cid != r->cursor_id) {
+		state_copy(r->cursor, sizeof(r->cursor), cid ? songs[song_at(cursor)] : "");
+		r->cursor_id = cid;
+	}
+
+	const char *pl = (playlist_active >= 0) ? playlists[playlist_active] : "";
+	if (strcmp(pl, r->playlist) != 0) {
+		state_copy(r->playlist, sizeof(r->playlist), pl);
+		checkpoint = 1;
+	}
+
+	/* rewrite the queue only when it differs from what is stored */
+	const char *q = r->queue;
+	int same = (r->queue_len == queue_len);
+	for (int i = 0; same && i < queue_len; i++) {
+		const char *name = songs[queue_at(i)];
+		if (q >= r->queue + r->queue_bytes || strcmp(q, name) != 0) same = 0;
+		else q += strlen(q) + 1;
+	}
+	if (!same) {
+		r->queue_len = 0;
+		r->queue_bytes = 0;
+		for (int i = 0; i < queue_len; i++)
+			if (!state_rec_queue_add(r, songs[queue_at(i)])) break;
+		checkpoint = 1;
+	}
+
+	if (checkpoint || mono_now() - state_synced >= STATE_SYNC_SECS)
+		state_bin_sync();
+	else
+		r->crc = state_rec_crc(r);
+}
+
+static void load_state(void) {
+	int rc = state_bin_open();
+	if (rc == 0)
+		state_rec_load(state_map);
+	else
+		load_state_text();
+}
+
+static void save_state(void) {
+	if (scan_active) return; /* a partial library would drop saved names */
+	if (zone_cur != 0) { /* only the first zone persists */
+		int z = zone_cur;
+		zone_switch(0);
+		save_state();
+		zone_switch(z);
+		return;
+	}
+	if (state_map)
+		save_state_bin();
+	else
+		save_state_text();
+}
+
+/* Save with the current position, debounce or not: on the way out. */
+static void state_flush(void) {
+	state_text_at = 0;
+	save_state();
+}
+
+/* --export-state: state.bin as state.save text on stdout. Read-only, so
+ * a bad record is reported rather than reset. */
+static int state_export(void) {
+	static struct state_rec r;
+	int fd = open(state_bin_file, O_RDONLY);
+	ssize_t n = (fd >= 0) ? read(fd, &r, sizeof(r)) : -1;
+	if (fd >= 0) close(fd);
+	if (n != (ssize_t)sizeof(r) || !state_rec_valid(&r)) {
+		fprintf(stderr, "%s: missing or invalid\n", state_bin_file);
+		return 1;
+	}
+	state_rec_export(&r, stdout);
+	return 0;
+}
+
+/* --import-state: state.save into state.bin, switching to binary state. */
+static int state_import(void) {
+	static struct state_rec r;
+	load_state_text();
+	state_rec_from_saved(&r);
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", state_bin_file);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || write(fd, &r, sizeof(r)) != (ssize_t)sizeof(r) ||
+	    fsync(fd) != 0 || rename(tmp, state_bin_file) != 0) {
+		perror(state_bin_file);
+		if (fd >= 0) close(fd);
+		unlink(tmp);
+		return 1;
+	}
+	close(fd);
+	printf("%s: %d queued, song %s\n", state_bin_file, r.queue_len,
+		r.song[0] ? r.song : "(none)");
+	return 0;
+}
+
+/* Apply the loaded state as far as the library scanned so far allows:
+ * the cursor and playback as soon as their songs are in, the playlist and
+ * queue (which name many songs) once it is complete. Each part is applied
+ * once; its saved_* copy is cleared then. */
+static void restore_state(int complete) {
+	/* restore playlist first (affects find_in_display) */
+	if (complete && saved_playlist[0]) {
+		for (int i = 0; i < nplaylists; i++) {
+			if (strcmp(playlists[i], saved_playlist) == 0) {
+				playlist_active = i;
+				load_playlist(i);
+				break;
+			}
+		}
+	}
+
+	/* restore cursor */
+	if (saved_cursor[0] && (complete || !saved_playlist[0])) {
+		int i = song_find(saved_cursor);
+		if (i >= 0) cursor = find_in_display(i);
+		if (i >= 0 || complete) saved_cursor[0] = '\0';
+	}
+	if (complete) saved_playlist[0] = '\0';
+
+	/* restore up-next queue */
+	for (int q = 0; complete && q < nsaved_queue; q++) {
+		int i = song_find(saved_queue[q]);
+		if (i >= 0) queue_push_back(i);
+		free(saved_queue[q]);
+	}
+	if (complete) {
+		free(saved_queue);
+		saved_queue = NULL;
+		nsaved_queue = 0;
+	}
+
+	/* restore playback */
+	if (saved_song[0]) {
+		int idx = song_find(saved_song);
+		if (idx >= 0 || complete) saved_song[0] = '\0';
+		if (idx >= 0 && playing < 0) { /* unless a song was picked meanwhile */
+			hist_resuming = 1; /* a resume is not a new play */
+			play_song(idx);
+			hist_resuming = 0;
+			/* wait for mpv IPC socket (--replay's stand-in has none) */
+			for (int i = 0; i < 10 && !replay_mode; i++) {
+				usleep(50000);
+				if (mpv_connect() == 0) break;
+			}
+			if (saved_pos > 0) {
+				char cmd[128];
+				snprintf(cmd, sizeof(cmd),
+					"{\"command\":[\"seek\",%.2f,\"absolute\"]}\n", saved_pos);
+				mpv_cmd(cmd);
+			}
+			if (saved_paused) {
+				mpv_cmd("{\"command\":[\"cycle\",\"pause\"]}\n");
+				paused = 1;
+			}
+		}
+	}
+}
+
+/* Smart playlists: a .smart file holds a query such as
+ *   artist~"paige" and duration<240 and plays>3 order by added desc limit 200
+ * which is parsed once into a tree and evaluated column-at-a-time against
+ * the metadata store. Each node produces a byte mask over all songs. */
+enum { Q_CMP, Q_AND, Q_OR, Q_NOT };
+enum { OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE, OP_MATCH, OP_NOMATCH };
+
+struct qnode {
+	int type, field, op;
+	double num;
+	char *str;
+	regex_t re;
+	struct qnode *l, *r;
+};
+
+struct query {
+	struct qnode *where;
+	int order_field; /* -1 = songs[] order */
+	int order_desc;
+	int limit;       /* 0 = unlimited */
+	unsigned fields; /* (1 << F_*) columns the result depends on */
+};
+
+static struct query smart_query;
+static int smart_loaded = -1; /* playlists[] index smart_query was parsed from */
+static char smart_error[128];
+
+static int field_is_text(int f) {
+	return f == F_NAME || f == F_ARTIST || f == F_TITLE;
+}
+
+static const char *text_col(int f, int i) {
+	if (f == F_ARTIST) return meta_artist[i];
+	if (f == F_TITLE) return meta_title[i];
+	return songs[i];
+}
+
+static double num_col(int f, int i) {
+	if (f == F_DURATION) return meta_dur[i];
+	if (f == F_PLAYS) return meta_plays[i];
+	if (f == F_PLAYED) return (double)meta_last[i];
+	if (f == F_SKIPS) return meta_skips[i];
+	return (double)meta_added[i];
+}
+
+static void qnode_free(struct qnode *n) {
+	if (!n) return;
+	qnode_free(n->l);
+	qnode_free(n->r);
+	if (n->type == Q_CMP && (n->op == OP_MATCH || n->op == OP_NOMATCH))
+		regfree(&n->re);
+	free(n->str);
+	free(n);
+}
+
+/* --- tokenizer / recursive-descent parser --- */
+
+static const char *qp;   /* parse cursor */
+static char qtok[256];   /* current token text */
+static int qtok_str;     /* current token was a quoted string */
+
+static void qnext(void) {
+	while (*qp == ' ' || *qp == '\t' || *qp == '\n' || *qp == '\r') qp++;
+	int n = 0;
+	qtok_str = 0;
+	if (*qp == '"') {
+		qtok_str = 1;
+		qp++;
+		while (*qp && *qp != '"' && n < (int)sizeof(qtok) - 1) {
+			if (*qp == '\\' && (qp[1] == '"' || qp[1] == '\\')) qp++;
+			qtok[n++] = *qp++;
+		}
+		if (*qp == '"') qp++;
+	} else if (strchr("()", *qp) && *qp) {
+		qtok[n++] = *qp++;
+	} else if (strchr("<>=!~", *qp) && *qp) {
+		qtok[n++] = *qp++;
+		if (*qp == '=' || (*qp == '~' && qtok[0] == '!'))
+			qtok[n++] = *qp++;
+	} else {
+		while (*qp && !strchr(" \t\r\n()<>=!~\"", *qp) && n < (int)sizeof(qtok) - 1)
+			qtok[n++] = *qp++;
+	}
+	qtok[n] = '\0';
+}
+
+static int qkw(const char *kw) {
+	return !qtok_str && strcasecmp(qtok, kw) == 0;
+}
+
+static int qfield(const char *name) {
+	for (int f = 0; f < NFIELDS; f++)
+		if (strcasecmp(name, field_names[f]) == 0) return f;
+	return -1;
+}
+
+static struct qnode *qparse_or(struct query *q);
+
+static struct qnode *qnew(int type) {
+	struct qnode *n = calloc(1, sizeof(*n));
+	n->type = type;
+	return n;
+}
+
+static struct qnode *qparse_factor(struct query *q) {
+	if (qkw("not")) {
+		qnext();
+		struct qnode *inner = qparse_factor(q);
+		if (!inner) return NULL;
+		struct qnode *n = qnew(Q_NOT);
+		n->l = inner;
+		return n;
+	}
+	if (!qtok_str && strcmp(qtok, "(") == 0) {
+		qnext();
+		struct qnode *n = qparse_or(q);
+		if (!n) return NULL;
+		if (strcmp(qtok, ")") != 0) {
+			qnode_free(n);
+			snprintf(smart_error, sizeof(smart_error), "expected )");
+			return NULL;
+		}
+		qnext();
+		return n;
+	}
+
+	int f = qfield(qtok);
+	if (f < 0 || qtok_str) {
+		snprintf(smart_error, sizeof(smart_error), "unknown field '%.64s'", qtok);
+		return NULL;
+	}
+	qnext();
+	static const char *ops[] = { "=", "!=", "<", "<=", ">", ">=", "~", "!~" };
+	int op = -1;
+	for (int i = 0; i < 8 && !qtok_str; i++)
+		if (strcmp(qtok, ops[i]) == 0) op = i;
+	if (op < 0) {
+		snprintf(smart_error, sizeof(smart_error), "expected operator after %s", field_names[f]);
+		return NULL;
+	}
+	qnext();
+	if (!qtok[0] && !qtok_str) {
+		snprintf(smart_error, sizeof(smart_error), "missing value for %s", field_names[f]);
+		return NULL;
+	}
+
+	struct qnode *n = qnew(Q_CMP);
+	n->field = f;
+	n->op = op;
+	if (op == OP_MATCH || op == OP_NOMATCH) {
+		if (!field_is_text(f) ||
+		    regcomp(&n->re, qtok, REG_EXTENDED | REG_ICASE | REG_NOSUB) != 0) {
+			snprintf(smart_error, sizeof(smart_error), "bad pattern for %s", field_names[f]);
+			n->op = OP_EQ; /* nothing to regfree */
+			qnode_free(n);
+			return NULL;
+		}
+	} else if (field_is_text(f)) {
+		n->str = strdup(qtok);
+	} else {
+		char *end;
+		n->num = strtod(qtok, &end);
+		if (end == qtok || *end) {
+			snprintf(smart_error, sizeof(smart_error), "expected number for %s", field_names[f]);
+			qnode_free(n);
+			return NULL;
+		}
+	}
+	q->fields |= 1u << f;
+	qnext();
+	return n;
+}
+
+static struct qnode *qparse_and(struct query *q) {
+	struct qnode *l = qparse_factor(q);
+	while (l && qkw("and")) {
+		qnext();
+		struct qnode *r = qparse_factor(q);
+		if (!r) { qnode_free(l); return NULL; }
+		struct qnode *n = qnew(Q_AND);
+		n->l = l;
+		n->r = r;
+		l = n;
+	}
+	return l;
+}
+
+static struct qnode *qparse_or(struct query *q) {
+	struct qnode *l = qparse_and(q);
+	while (l && qkw("or")) {
+		qnext();
+		struct qnode *r = qparse_and(q);
+		if (!r) { qnode_free(l); return NULL; }
+		struct qnode *n = qnew(Q_OR);
+		n->l = l;
+		n->r = r;
+		l = n;
+	}
+	return l;
+}
+
+static void query_free(struct query *q) {
+	qnode_free(q->where);
+	memset(q, 0, sizeof(*q));
+	q->order_field = -1;
+}
+
+/* Returns 0 on success; on failure smart_error holds the reason. */
+static int query_parse(struct query *q, const char *text) {
+	query_free(q);
+	smart_error[0] = '\0';
+	qp = text;
+	qnext();
+
+	if (qtok[0] && !qkw("order") && !qkw("limit")) {
+		q->where = qparse_or(q);
+		if (!q->where) return -1;
+	}
+	if (qkw("order")) {
+		qnext();
+		if (!qkw("by")) {
+			snprintf(smart_error, sizeof(smart_error), "expected 'by' after order");
+			return -1;
+		}
+		qnext();
+		q->order_field = qfield(qtok);
+		if (q->order_field < 0) {
+			snprintf(smart_error, sizeof(smart_error), "unknown field '%.64s'", qtok);
+			return -1;
+		}
+		q->fields |= 1u << q->order_field;
+		qnext();
+		if (qkw("desc")) { q->order_desc = 1; qnext(); }
+		else if (qkw("asc")) qnext();
+	}
+	if (qkw("limit")) {
+		qnext();
+		q->limit = atoi(qtok);
+		qnext();
+	}
+	if (qtok[0] || qtok_str) {
+		snprintf(smart_error, sizeof(smart_error), "unexpected '%.64s'", qtok);
+		return -1;
+	}
+	return 0;
+}
+
+/* --- evaluation --- */
+
+/* Text predicates (regex, strcasecmp) cost far more than the numeric column
+ * scans, so AND evaluates the cheaper side first and passes its mask down as
+ * pre[]: rows already rejected are skipped by text comparisons. */
+static int qcost(const struct qnode *n) {
+	if (n->type == Q_CMP) return field_is_text(n->field);
+	return qcost(n->l) + (n->r ? qcost(n->r) : 0);
+}
+
+static void qeval(const struct qnode *n, unsigned char *m, int count,
+                  const unsigned char *pre) {
+	switch (n->type) {
+	case Q_AND: {
+		const struct qnode *a = n->l, *b = n->r;
+		if (qcost(a) > qcost(b)) { a = n->r; b = n->l; }
+		unsigned char *rm = malloc(count ? count : 1);
+		qeval(a, m, count, pre);
+		if (pre)
+			for (int i = 0; i < count; i++) m[i] &= pre[i];
+		qeval(b, rm, count, m);
+		for (int i = 0; i < count; i++) m[i] &= rm[i];
+		free(rm);
+		return;
+	}
+	case Q_OR: {
+		unsigned char *rm = malloc(count ? count : 1);
+		qeval(n->l, m, count, pre);
+		qeval(n->r, rm, count, pre);
+		for (int i = 0; i < count; i++) m[i] |= rm[i];
+		free(rm);
+		return;
+	}
+	case Q_NOT:
+		qeval(n->l, m, count, NULL);
+		for (int i = 0; i < count; i++) m[i] ^= 1;
+		return;
+	}
+
+	if (field_is_text(n->field)) {
+		for (int i = 0; i < count; i++) {
+			if (pre && !pre[i]) { m[i] = 0; continue; }
+			const char *v = text_col(n->field, i);
+			int hit;
+			switch (n->op) {
+			case OP_MATCH:   hit = regexec(&n->re, v, 0, NULL, 0) == 0; break;
+			case OP_NOMATCH: hit = regexec(&n->re, v, 0, NULL, 0) != 0; break;
+			default: {
+				int c = strcasecmp(v, n->str);
+				hit = (n->op == OP_EQ) ? c == 0 : (n->op == OP_NE) ? c != 0 :
+					(n->op == OP_LT) ? c < 0 : (n->op == OP_LE) ? c <= 0 :
+					(n->op == OP_GT) ? c > 0 : c >= 0;
+			}
+			}
+			m[i] = hit;
+		}
+		return;
+	}
+
+	/* numeric: tight loops over one column so the compiler can vectorise */
+	if (n->field == F_DURATION) {
+		float v = (float)n->num;
+		const float *c = meta_dur;
+		switch (n->op) {
+		case OP_EQ: for (int i = 0; i < count; i++) m[i] = c[i] == v; break;
+		case OP_NE: for (int i = 0; i < count; i++) m[i] = c[i] != v; break;
+		case OP_LT: for (int i = 0; i < count; i++) m[i] = c[i] < v; break;
+		case OP_LE: for (int i = 0; i < count; i++) m[i] = c[i] <= v; break;
+		case OP_GT: for (int i = 0; i < count; i++) m[i] = c[i] > v; break;
+		default:    for (int i = 0; i < count; i++) m[i] = c[i] >= v; break;
+		}
+	} else if (n->field == F_PLAYS) {
+		int v = (int)n->num;
+		const int *c = meta_plays;
+		switch (n->op) {
+		case OP_EQ: for (int i = 0; i < count; i++) m[i] = c[i] == v; break;
+		case OP_NE: for (int i = 0; i < count; i++) m[i] = c[i] != v; break;
+		case OP_LT: for (int i = 0; i < count; i++) m[i] = c[i] < v; break;
+		case OP_LE: for (int i = 0; i < count; i++) m[i] = c[i] <= v; break;
+		case OP_GT: for (int i = 0; i < count; i++) m[i] = c[i] > v; break;
+		default:    for (int i = 0; i < count; i++) m[i] = c[i] >= v; break;
+		}
+	} else {
+		long long v = (long long)n->num;
+		const long long *c = meta_added;
+		switch (n->op) {
+		case OP_EQ: for (int i = 0; i < count; i++) m[i] = c[i] == v; break;
+		case OP_NE: for (int i = 0; i < count; i++) m[i] = c[i] != v; break;
+		case OP_LT: for (int i = 0; i < count; i++) m[i] = c[i] < v; break;
+		case OP_LE: for (int i = 0; i < count; i++) m[i] = c[i] <= v; break;
+		case OP_GT: for (int i = 0; i < count; i++) m[i] = c[i] > v; break;
+		default:    for (int i = 0; i < count; i++) m[i] = c[i] >= v; break;
+		}
+	}
+}
+
+static const struct query *sort_query;
+
+static int smart_cmp(const void *a, const void *b) {
+	int x = *(const int *)a, y = *(const int *)b;
+	int f = sort_query->order_field;
+	int c;
+	if (field_is_text(f)) {
+		c = strcasecmp(text_col(f, x), text_col(f, y));
+	} else {
+		double dx = num_col(f, x), dy = num_col(f, y);
+		c = (dx > dy) - (dx < dy);
+	}
+	if (sort_query->order_desc) c = -c;
+	return c ? c : x - y;
+}
+
+/* Run q over the whole library into out[]; returns the result count. */
+static int query_eval(const struct query *q, int *out) {
+	int n = 0;
+	view_gen++;
+	if (q->where) {
+		unsigned char *m = malloc(nsongs ? nsongs : 1);
+		qeval(q->where, m, nsongs, NULL);
+		for (int i = 0; i < nsongs; i++)
+			if (m[i]) out[n++] = i;
+		free(m);
+	} else {
+		for (int i = 0; i < nsongs; i++) out[n++] = i;
+	}
+	if (q->order_field >= 0) {
+		sort_query = q;
+		qsort(out, n, sizeof(out[0]), smart_cmp);
+	}
+	if (q->limit > 0 && n > q->limit)
+		n = q->limit;
+	return n;
+}
+
+/* Sort orders. Every key but name keeps a permutation of songs[] indices
+ * (sort_perm) and its inverse (sort_rank). A background thread builds
+ * them: keys are snapshotted on the main thread, cut into one run per
+ * core, qsorted in parallel and merged. A permutation is rebuilt only
+ * when a column its key reads changes (meta_changed), so switching with
+ * s/S is a table swap. The library is shown through the permutation;
+ * playlist_songs[] and filtered[] are reordered by rank. Under name,
+ * playlists keep their file or query order. */
+enum { SORT_NAME, SORT_ARTIST, SORT_ADDED, SORT_DURATION, SORT_PLAYS, SORT_PLAYED, NSORTS };
+static const char *sort_names[NSORTS] = {
+	"name", "artist", "added", "duration", "plays", "played",
+};
+static const unsigned sort_fields[NSORTS] = {
+	0, (1u << F_ARTIST) | (1u << F_TITLE), 1u << F_ADDED,
+	1u << F_DURATION, 1u << F_PLAYS, 1u << F_PLAYED,
+};
+#define SORT_MAX_THREADS 8
+
+struct sort_key {
+	double num;        /* ascending */
+	const char *a, *b; /* then case-insensitive, when set */
+	int idx;           /* then songs[] order */
+};
+
+static int sort_mode = SORT_NAME;
+static int sort_perm[NSORTS][MAX_SONGS]; /* display position -> songs[] index */
+static int sort_rank[NSORTS][MAX_SONGS]; /* songs[] index -> display position */
+static int sort_have[NSORTS];
+static unsigned sort_stale = ((1u << NSORTS) - 1) & ~1u; /* (1 << SORT_*) to rebuild */
+
+/* the one background job; its keys hold meta_artist/meta_title pointers,
+ * so remove_songs() joins it before freeing any */
+static pthread_t sort_thread;
+static int sort_running = 0;
+static int sort_job_done = 0;
+static int sort_job_mode, sort_job_n;
+static struct sort_key *sort_job_keys;
+
+static void sort_keys_fill(int mode, struct sort_key *k) {
+	for (int i = 0; i < nsongs; i++) {
+		k[i] = (struct sort_key){ 0, NULL, NULL, i };
+		switch (mode) {
+		case SORT_ARTIST:
+			k[i].a = meta_artist[i];
+			k[i].b = meta_title[i];
+			break;
+		case SORT_ADDED: /* newest first */
+			k[i].num = -(double)meta_added[i];
+			break;
+		case SORT_DURATION: /* unknown last */
+			k[i].num = meta_dur[i] > 0 ? meta_dur[i] : INFINITY;
+			break;
+		case SORT_PLAYS:
+			k[i].num = -meta_plays[i];
+			break;
+		case SORT_PLAYED: /* most recent first, never played last */
+			k[i].num = -(double)meta_last[i];
+			break;
+		}
+	}
+}
+
+static int sort_key_cmp(const void *pa, const void *pb) {
+	const struct sort_key *x = pa, *y = pb;
+	if (x->num != y->num) return x->num < y->num ? -1 : 1;
+	int c;
+	if (x->a && (c = strcasecmp(x->a, y->a)) != 0) return c;
+	if (x->b && (c = strcasecmp(x->b, y->b)) != 0) return c;
+	return x->idx - y->idx;
+}
+
+struct sort_run {
+	struct sort_key *k;
+	int n;
+};
+
+static void *sort_run_thread(void *arg) {
+	struct sort_run *r = arg;
+	qsort(r->k, r->n, sizeof(*r->k), sort_key_cmp);
+	return NULL;
+}
+
+static void sort_keys(struct sort_key *k, int n) {
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int t = ncpu < 1 ? 1 : ncpu > SORT_MAX_THREADS ? SORT_MAX_THREADS : (int)ncpu;
+	struct sort_key *tmp = (t > 1 && n >= 4096) ? malloc(n * sizeof(*k)) : NULL;
+	if (!tmp) {
+		qsort(k, n, sizeof(*k), sort_key_cmp);
+		return;
+	}
+
+	struct sort_run runs[SORT_MAX_THREADS];
+	pthread_t th[SORT_MAX_THREADS];
+	int started[SORT_MAX_THREADS];
+	int bound[SORT_MAX_THREADS + 1];
+	for (int r = 0; r < t; r++) {
+		bound[r] = (int)((long long)n * r / t);
+		runs[r].k = k + bound[r];
+		runs[r].n = (int)((long long)n * (r + 1) / t) - bound[r];
+		started[r] = pthread_create(&th[r], NULL, sort_run_thread, &runs[r]) == 0;
+		if (!started[r]) sort_run_thread(&runs[r]);
+	}
+	bound[t] = n;
+	for (int r = 0; r < t; r++)
+		if (started[r]) pthread_join(th[r], NULL);
+
+	/* merge neighbouring runs pairwise, ping-ponging with tmp */
+	struct sort_key *src = k, *dst = tmp;
+	while (t > 1) {
+		int nt = 0;
+		for (int r = 0; r < t; r += 2) {
+			int lo = bound[r], mid = bound[r + 1];
+			int hi = (r + 1 < t) ? bound[r + 2] : mid;
+			int i = lo, j = mid, o = lo;
+			while (i < mid && j < hi)
+				dst[o++] = (sort_key_cmp(&src[j], &src[i]) < 0) ? src[j++] : src[i++];
+			while (i < mid) dst[o++] = src[i++];
+			while (j < hi) dst[o++] = src[j++];
+			bound[nt++] = lo;
+		}
+		bound[nt] = n;
+		t = nt;
+		struct sort_key *sw = src;
+		src = dst;
+		dst = sw;
+	}
+	if (src != k) memcpy(k, src, n * sizeof(*k));
+	free(tmp);
+}
+
+static void sort_install(int mode, const struct sort_key *k, int n) {
+	for (int p = 0; p < n; p++) {
+		sort_perm[mode][p] = k[p].idx;
+		sort_rank[mode][k[p].idx] = p;
+	}
+	sort_have[mode] = 1;
+}
+
+static void *sort_job(void *arg) {
+	(void)arg;
+	sort_keys(sort_job_keys, sort_job_n);
+	__atomic_store_n(&sort_job_done, 1, __ATOMIC_RELEASE);
+	loop_wake();
+	return NULL;
+}
+
+static int rank_cmp(const void *a, const void *b) {
+	const int *rank = sort_rank[sort_mode];
+	return rank[*(const int *)a] - rank[*(const int *)b];
+}
+
+/* Put a list of songs[] indices into the current order: a counting pass
+ * over ranks for long lists, qsort by rank for short ones. */
+static void sort_list(int *list, int n) {
+	if (sort_mode == SORT_NAME || n < 2) return;
+	if ((long long)n * 16 < nsongs) {
+		qsort(list, n, sizeof(int), rank_cmp);
+		return;
+	}
+	static int count[MAX_SONGS];
+	const int *perm = sort_perm[sort_mode], *rank = sort_rank[sort_mode];
+	for (int i = 0; i < n; i++) count[rank[list[i]]]++;
+	int w = 0;
+	for (int p = 0; p < nsongs && w < n; p++)
+		for (; count[p] > 0; count[p]--) list[w++] = perm[p];
+}
+
+/* Re-derive the shown lists after the order changed, putting the cursor
+ * back on songs[keep]. A playlist is re-sorted where it is, through the
+ * ranks; only name order goes back to the file or query order. The
+ * Duplicates view keeps its groups. */
+static void sort_refresh_view(int keep) {
+	if (playlist_active >= 0 && playlist_kind[playlist_active] != PL_DUPES) {
+		if (sort_mode != SORT_NAME) {
+			sort_list(playlist_songs, nplaylist_songs);
+			view_gen++;
+		} else {
+			load_playlist(playlist_active);
+		}
+	}
+	if (filter_active)
+		apply_filter();
+	view_gen++;
+	if (keep >= 0) cursor = find_in_display(keep);
+}
+
+static void sort_finish(void) {
+	if (!sort_running) return;
+	pthread_join(sort_thread, NULL);
+	sort_running = 0;
+	int keep = (display_len() > 0) ? song_at(cursor) : -1;
+	sort_install(sort_job_mode, sort_job_keys, sort_job_n);
+	free(sort_job_keys);
+	sort_job_keys = NULL;
+	if (sort_job_mode == sort_mode) sort_refresh_view(keep);
+}
+
+static void sort_start(int mode) {
+	struct sort_key *k = malloc((nsongs ? nsongs : 1) * sizeof(*k));
+	if (!k) return;
+	sort_keys_fill(mode, k);
+	sort_stale &= ~(1u << mode);
+	sort_job_mode = mode;
+	sort_job_n = nsongs;
+	sort_job_keys = k;
+	sort_job_done = 0;
+	if (pthread_create(&sort_thread, NULL, sort_job, NULL) == 0) {
+		sort_running = 1;
+		return;
+	}
+	sort_job(NULL);
+	sort_running = 1;
+	sort_finish();
+}
+
+/* Main loop tick: note columns that changed, install a finished job and
+ * start the next one — the shown order first, then the rest so that
+ * switching stays instant. The changes live on in sort_stale, so
+ * meta_changed is cleared here. */
+static void sort_poll(void) {
+	for (int m = 1; m < NSORTS; m++)
+		if (meta_changed & sort_fields[m]) sort_stale |= 1u << m;
+	meta_changed = 0;
+	if (sort_running) {
+		if (!__atomic_load_n(&sort_job_done, __ATOMIC_ACQUIRE)) return;
+		sort_finish();
+	}
+	int next = -1;
+	if (sort_mode != SORT_NAME && (sort_stale >> sort_mode) & 1) next = sort_mode;
+	/* while the library fills, the others wait for the last batch */
+	for (int m = 1; next < 0 && !scan_active && m < NSORTS; m++)
+		if ((sort_stale >> m) & 1) next = m;
+	if (next >= 0) sort_start(next);
+}
+
+/* New songs joined at the end of songs[]: put them after the rest in
+ * every built order until the rebuild sort_poll() starts next. */
+static void sort_extend(int from) {
+	for (int m = 1; m < NSORTS; m++) {
+		if (!sort_have[m]) continue;
+		for (int i = from; i < nsongs; i++) {
+			sort_perm[m][i] = i;
+			sort_rank[m][i] = i;
+		}
+	}
+}
+
+static void sort_set(int mode) {
+	if (mode != SORT_NAME && !sort_have[mode]) {
+		/* not built yet: finish or build it now */
+		if (!sort_running || sort_job_mode != mode) {
+			sort_finish();
+			sort_start(mode);
+		}
+		sort_finish();
+	}
+	if (mode != SORT_NAME && !sort_have[mode]) return;
+	int keep = (display_len() > 0) ? song_at(cursor) : -1;
+	sort_mode = mode;
+	sort_refresh_view(keep);
+}
+
+/* After remove_songs(): the surviving entries keep their relative order. */
+static void sort_remap(const int *remap, int old_n) {
+	for (int m = 1; m < NSORTS; m++) {
+		if (!sort_have[m]) continue;
+		int n = old_n;
+		remap_list(sort_perm[m], &n, remap);
+		for (int p = 0; p < n; p++) sort_rank[m][sort_perm[m][p]] = p;
+	}
+}
+
+static void load_smart(int idx) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s.smart", playlists_dir, playlists[idx]);
+	nplaylist_songs = 0;
+	smart_loaded = idx;
+	if (playlist_query[idx]) {
+		if (query_parse(&smart_query, playlist_query[idx]) != 0) {
+			query_free(&smart_query);
+			return;
+		}
+		nplaylist_songs = query_eval(&smart_query, playlist_songs);
+		sort_list(playlist_songs, nplaylist_songs);
+		smart_changed = 0;
+		return;
+	}
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		query_free(&smart_query);
+		snprintf(smart_error, sizeof(smart_error), "cannot read %s.smart", playlists[idx]);
+		return;
+	}
+
+	/* join non-comment lines into one query string */
+	char text[4096] = "";
+	char line[1024];
+	int tlen = 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#') continue;
+		tlen += snprintf(text + tlen, sizeof(text) - tlen, "%s ", line);
+		if (tlen >= (int)sizeof(text)) break;
+	}
+	fclose(f);
+
+	if (query_parse(&smart_query, text) != 0) {
+		query_free(&smart_query);
+		return;
+	}
+	nplaylist_songs = query_eval(&smart_query, playlist_songs);
+	sort_list(playlist_songs, nplaylist_songs);
+	smart_changed = 0;
+}
+
+/* Re-evaluate the active smart playlist when a column it reads has changed.
+ * Runs before sort_poll(), which clears meta_changed; this side keeps its
+ * own copy in smart_changed. */
+static void smart_refresh(void) {
+	smart_changed |= meta_changed;
+	if (playlist_active < 0 || playlist_kind[playlist_active] != PL_SMART ||
+	    smart_loaded != playlist_active) {
+		smart_changed = 0;
+		return;
+	}
+	unsigned ch = smart_changed & smart_query.fields;
+	smart_changed = 0;
+	if (!ch || smart_error[0]) return;
+
+	int prev_song = (display_len() > 0) ? song_at(cursor) : -1;
+	nplaylist_songs = query_eval(&smart_query, playlist_songs);
+	sort_list(playlist_songs, nplaylist_songs);
+	if (filter_active) {
+		apply_filter();
+	} else if (prev_song >= 0) {
+		cursor = 0;
+		for (int i = 0; i < nplaylist_songs; i++)
+			if (playlist_songs[i] == prev_song) { cursor = i; break; }
+	}
+}
+
+/* Duplicate finder: D, or the Duplicates view in the sidebar. Songs are
+ * grouped by size, and only sizes shared by two or more go on. Those get
+ * a head hash; songs whose size and head still pair up get a full hash to
+ * confirm. Both are AN_CONTENT jobs, so the analysis workers hash files in
+ * parallel, and cache/hashes keeps the results by name, size and mtime.
+ * dup_advance() moves to the next stage once a stage's jobs are applied.
+ * The view lists each group with its keeper first (most plays, then
+ * oldest, then first by name); the rest are its extras. */
+static int dup_view = -1;      /* playlists[] index of the view */
+static int dup_select = 0;     /* select the extras once the groups are known */
+static int dup_groups = 0;
+static long long dup_waste = 0; /* bytes in the extras */
+static uint64_t dup_extra[(MAX_SONGS + 63) / 64];
+static int dup_idx[MAX_SONGS];
+
+static void add_dupes_view(void) {
+	if (nplaylists == MAX_PLAYLISTS) return;
+	dup_view = nplaylists;
+	playlists[nplaylists] = strdup("Duplicates");
+	playlist_kind[nplaylists] = PL_DUPES;
+	nplaylists++;
+}
+
+/* Size, head, hash, then keeper order: every group is one run. */
+static int dup_cmp(const void *a, const void *b) {
+	int x = *(const int *)a, y = *(const int *)b;
+	if (meta_size[x] != meta_size[y]) return meta_size[x] < meta_size[y] ? -1 : 1;
+	if (meta_head[x] != meta_head[y]) return meta_head[x] < meta_head[y] ? -1 : 1;
+	if (meta_hash[x] != meta_hash[y]) return meta_hash[x] < meta_hash[y] ? -1 : 1;
+	if (meta_plays[x] != meta_plays[y]) return meta_plays[y] - meta_plays[x];
+	if (meta_added[x] != meta_added[y]) return meta_added[x] < meta_added[y] ? -1 : 1;
+	return x - y;
+}
+
+/* Non-empty songs into dup_idx[], sorted by dup_cmp(); returns the count. */
+static int dup_sort(void) {
+	int n = 0;
+	for (int i = 0; i < nsongs; i++)
+		if (meta_size[i] > 0) dup_idx[n++] = i;
+	qsort(dup_idx, n, sizeof(int), dup_cmp);
+	return n;
+}
+
+/* Queue job (AN_HEAD or AN_HASH) for each song missing it in a run of two
+ * or more with the same size (and, for AN_HASH, the same head). */
+static void dup_queue(unsigned job) {
+	int n = dup_sort();
+	for (int a = 0, b; a < n; a = b) {
+		int x = dup_idx[a];
+		for (b = a + 1; b < n && meta_size[dup_idx[b]] == meta_size[x] &&
+		     (job == AN_HEAD || meta_head[dup_idx[b]] == meta_head[x]); b++) {}
+		if (b - a < 2 || (job == AN_HASH && !meta_head[x])) continue;
+		for (int k = a; k < b; k++) {
+			int i = dup_idx[k];
+			if (!(job == AN_HEAD ? meta_head[i] : meta_hash[i])) an_enqueue(i, job);
+		}
+	}
+}
+
+/* Groups from the full hashes into dup_extra[] and, when it is shown, the
+ * view's list. */
+static void dup_collect(void) {
+	int shown = playlist_active >= 0 && playlist_active == dup_view;
+	memset(dup_extra, 0, sizeof(dup_extra));
+	dup_groups = 0;
+	dup_waste = 0;
+	int n = dup_sort(), m = 0;
+	for (int a = 0, b; a < n; a = b) {
+		int x = dup_idx[a];
+		for (b = a + 1; b < n && meta_size[dup_idx[b]] == meta_size[x] &&
+		     meta_head[dup_idx[b]] == meta_head[x] && meta_hash[dup_idx[b]] == meta_hash[x]; b++) {}
+		if (b - a < 2 || !meta_hash[x]) continue;
+		dup_groups++;
+		for (int k = a; k < b; k++) {
+			int i = dup_idx[k];
+			if (shown) playlist_songs[m++] = i;
+			if (k == a) continue;
+			dup_extra[i >> 6] |= 1ull << (i & 63);
+			dup_waste += meta_size[i];
+			if (dup_select) sel_set(i, 1);
+		}
+	}
+	dup_select = 0;
+	if (!shown) return;
+	nplaylist_songs = m;
+	view_gen++;
+	if (filter_active) apply_filter();
+	if (cursor >= display_len()) cursor = display_len() > 0 ? display_len() - 1 : 0;
+}
+
+static void dup_advance(void) {
+	if (dup_state == DUP_IDLE || dup_state == DUP_WAIT) {
+		if (scan_active) {
+			dup_state = DUP_WAIT;
+			return;
+		}
+		dup_state = DUP_HEAD;
+		dup_queue(AN_HEAD);
+		if (dup_jobs) return;
+	}
+	if (dup_state == DUP_HEAD) {
+		dup_state = DUP_HASH;
+		dup_queue(AN_HASH);
+		if (dup_jobs) return;
+	}
+	dup_state = DUP_DONE;
+	dup_collect();
+}
+
+/* The view: a finished search starts over, so new or changed songs are
+ * seen (cached hashes make that quick); one under way fills it later. */
+static void dup_load(void) {
+	nplaylist_songs = 0;
+	if (dup_state == DUP_DONE) dup_state = DUP_IDLE;
+	if (dup_state == DUP_IDLE) dup_advance();
+	view_gen++;
+}
+
+static void load_playlist(int idx) {
+	if (playlist_kind[idx] == PL_DUPES) {
+		dup_load();
+		return;
+	}
+	if (playlist_kind[idx] == PL_SMART) {
+		load_smart(idx);
+		return;
+	}
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s.playlist", playlists_dir, playlists[idx]);
+	FILE *f = fopen(path, "r");
+	if (!f) return;
+
+	nplaylist_songs = 0;
+	char line[1024];
+	while (fgets(line, sizeof(line), f)) {
+		/* strip newline */
+		int len = strlen(line);
+		while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+			line[--len] = '\0';
+		if (len == 0) continue;
+		int i = song_find(line);
+		if (i >= 0 && nplaylist_songs < MAX_SONGS)
+			playlist_songs[nplaylist_songs++] = i;
+	}
+	fclose(f);
+	sort_list(playlist_songs, nplaylist_songs);
+	view_gen++;
+}
+
+/* Playlist import (--import-playlist FILE [NAME]): an M3U/M3U8 (with
+ * #EXTINF titles), PLS or XSPF list becomes NAME.playlist. Each entry is
+ * decoded (file:// URIs and XSPF locations are %XX-unescaped, backslashes
+ * become slashes, a drive letter goes), made absolute against the list's
+ * own directory and resolved in order: the path relative to songs_dir and
+ * then its basename through song_index, the basename case-insensitively
+ * through imp_index, and last the entry's title as "Artist - Title".
+ * Unmatched entries are listed on stderr. */
+struct imp_entry {
+	char *loc;   /* location as written, NULL = none */
+	char *title; /* #EXTINF / TitleN / "creator - title", NULL = none */
+	int n;       /* PLS entry number */
+};
+
+static struct imp_entry *imp_ents;
+static int imp_n = 0, imp_cap = 0;
+static int *imp_index; /* songs[] index + 1 by lowercased stem, 0 = empty */
+
+static struct imp_entry *imp_add(char *loc, char *title, int n) {
+	if (imp_n == imp_cap) {
+		int cap = imp_cap ? imp_cap * 2 : 1024;
+		struct imp_entry *e = realloc(imp_ents, cap * sizeof(*e));
+		if (!e) return NULL;
+		imp_ents = e;
+		imp_cap = cap;
+	}
+	imp_ents[imp_n] = (struct imp_entry){ loc, title, n };
+	return &imp_ents[imp_n++];
+}
+
+static char ascii_lower(char c) {
+	return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+/* Length of name without its extension. */
+static int stem_len(const char *name) {
+	const char *dot = strrchr(name, '.');
+	return dot && dot != name ? (int)(dot - name) : (int)strlen(name);
+}
+
+static unsigned long long stem_hash(const char *s, int len) {
+	unsigned long long h = 1469598103934665603ULL;
+	for (int i = 0; i < len; i++) {
+		h ^= (unsigned char)ascii_lower(s[i]);
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static void imp_index_build(void) {
+	imp_index = calloc(SONG_INDEX_SIZE, sizeof(*imp_index));
+	if (!imp_index) return;
+	for (int i = 0; i < nsongs; i++) {
+		unsigned slot = stem_hash(songs[i], stem_len(songs[i])) % SONG_INDEX_SIZE;
+		while (imp_index[slot]) slot = (slot + 1) % SONG_INDEX_SIZE;
+		imp_index[slot] = i + 1;
+	}
+}
+
+/* A song whose stem equals stem[0, len) ignoring case; among several, the
+ * one with extension ext (also ignoring case), else the first. */
+static int imp_find_ci(const char *stem, int len, const char *ext) {
+	if (!imp_index) return -1;
+	int best = -1;
+	unsigned slot = stem_hash(stem, len) % SONG_INDEX_SIZE;
+	for (; imp_index[slot]; slot = (slot + 1) % SONG_INDEX_SIZE) {
+		int i = imp_index[slot] - 1;
+		if (stem_len(songs[i]) != len || strncasecmp(songs[i], stem, len) != 0) continue;
+		if (!ext || strcasecmp(songs[i] + len, ext) == 0) return i;
+		if (best < 0) best = i;
+	}
+	return best;
+}
+
+static int hex_val(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	c = ascii_lower(c);
+	return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+static void url_decode(char *s) {
+	char *out = s;
+	for (; *s; s++) {
+		int hi, lo;
+		if (*s == '%' && (hi = hex_val(s[1])) >= 0 && (lo = hex_val(s[2])) >= 0) {
+			*out++ = hi * 16 + lo;
+			s += 2;
+		} else {
+			*out++ = *s;
+		}
+	}
+	*out = '\0';
+}
+
+/* Lexically normalise an absolute path in place: "//", "/./" and
+ * "dir/../" go, without touching the filesystem. */
+static void path_clean(char *p) {
+	char *out = p, *in = p;
+	while (*in) {
+		while (*in == '/') in++;
+		char *end = strchr(in, '/');
+		int len = end ? (int)(end - in) : (int)strlen(in);
+		if (len == 0 || (len == 1 && in[0] == '.')) {
+			/* nothing */
+		} else if (len == 2 && in[0] == '.' && in[1] == '.') {
+			while (out > p && *--out != '/') {}
+		} else {
+			*out++ = '/';
+			memmove(out, in, len);
+			out += len;
+		}
+		in += len;
+	}
+	if (out == p) *out++ = '/';
+	*out = '\0';
+}
+
+/* path made absolute (against base when relative) and cleaned. */
+static void path_abs(char *out, size_t size, const char *base, const char *path) {
+	if (path[0] == '/')
+		snprintf(out, size, "%s", path);
+	else
+		snprintf(out, size, "%s/%s", base, path);
+	path_clean(out);
+}
+
+/* "/root/sub/name" -> "sub/name" when path lies under root. */
+static const char *path_under(const char *path, const char *root) {
+	size_t n = strlen(root);
+	if (n > 1 && strncmp(path, root, n) == 0 && path[n] == '/') return path + n + 1;
+	return NULL;
+}
+
+static int imp_resolve(const struct imp_entry *e, int uri, const char *base,
+                       const char *roots[2]) {
+	char loc[PATH_MAX], path[PATH_MAX * 2];
+	const char *name = NULL;
+	if (e->loc) {
+		snprintf(loc, sizeof(loc), "%s", e->loc);
+		char *s = loc;
+		int remote = 0;
+		if (strncasecmp(s, "file://", 7) == 0) {
+			s += 7;
+			if (strncasecmp(s, "localhost/", 10) == 0) s += 9;
+			url_decode(s);
+		} else if (strstr(s, "://")) {
+			remote = 1;
+		} else if (uri) {
+			url_decode(s);
+		}
+		for (char *c = s; *c; c++)
+			if (*c == '\\') *c = '/';
+		if (s[0] == '/' && s[1] && s[2] == ':') s++; /* file:///C:/... */
+		if (((s[0] >= 'A' && s[0] <= 'Z') || (s[0] >= 'a' && s[0] <= 'z')) && s[1] == ':')
+			s += 2;
+		if (!remote && *s) {
+			path_abs(path, sizeof(path), base, s);
+			for (int r = 0; r < 2; r++) {
+				const char *rel = roots[r] ? path_under(path, roots[r]) : NULL;
+				int i = rel ? song_find(rel) : -1;
+				if (i >= 0) return i;
+			}
+			name = strrchr(path, '/') + 1;
+			int i = song_find(name);
+			if (i >= 0) return i;
+			const char *dot = strrchr(name, '.');
+			i = imp_find_ci(name, stem_len(name), dot && dot != name ? dot : NULL);
+			if (i >= 0) return i;
+		}
+	}
+	if (e->title && e->title[0]) {
+		const char *dot = name ? strrchr(name, '.') : NULL;
+		return imp_find_ci(e->title, strlen(e->title), dot && dot != name ? dot : NULL);
+	}
+	return -1;
+}
+
+static char *slurp(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return NULL;
+	struct stat st;
+	char *text = NULL;
+	if (fstat(fd, &st) == 0 && (text = malloc(st.st_size + 1))) {
+		ssize_t n = read(fd, text, st.st_size);
+		text[n > 0 ? n : 0] = '\0';
+	}
+	close(fd);
+	return text;
+}
+
+/* Cut text into lines in place; trailing CR and blanks go. */
+static char *next_line(char **p) {
+	char *line = *p;
+	if (!line || !*line) return NULL;
+	char *nl = strchr(line, '\n');
+	if (nl) *nl++ = '\0';
+	*p = nl;
+	int len = strlen(line);
+	while (len > 0 && (line[len - 1] == '\r' || line[len - 1] == ' ' || line[len - 1] == '\t'))
+		line[--len] = '\0';
+	return line;
+}
+
+static void parse_m3u(char *text) {
+	char *title = NULL;
+	for (char *line; (line = next_line(&text)); ) {
+		while (*line == ' ' || *line == '\t') line++;
+		if (strncmp(line, "#EXTINF:", 8) == 0) {
+			char *comma = strchr(line, ',');
+			title = comma ? comma + 1 : NULL;
+		} else if (line[0] && line[0] != '#') {
+			imp_add(line, title, 0);
+			title = NULL;
+		}
+	}
+}
+
+static int imp_cmp_n(const void *a, const void *b) {
+	const struct imp_entry *x = a, *y = b;
+	return (x->n > y->n) - (x->n < y->n);
+}
+
+/* FileN= and TitleN= lines, in N order; a title pairs with its file. */
+static void parse_pls(char *text) {
+	int ntitles = 0;
+	for (char *line; (line = next_line(&text)); ) {
+		int file = strncasecmp(line, "File", 4) == 0;
+		int title = strncasecmp(line, "Title", 5) == 0;
+		if (!file && !title) continue;
+		char *eq = strchr(line, '=');
+		if (!eq) continue;
+		*eq = '\0';
+		int n = atoi(line + (file ? 4 : 5));
+		if (file) {
+			imp_add(eq + 1, NULL, n);
+		} else if (imp_add(NULL, eq + 1, n)) {
+			ntitles++;
+		}
+	}
+	qsort(imp_ents, imp_n, sizeof(*imp_ents), imp_cmp_n);
+	if (!ntitles) return;
+	/* fold each title into the file with its number */
+	int out = 0;
+	for (int i = 0; i < imp_n; ) {
+		int j = i;
+		char *loc = NULL, *title = NULL;
+		for (; j < imp_n && imp_ents[j].n == imp_ents[i].n; j++) {
+			if (imp_ents[j].loc && !loc) loc = imp_ents[j].loc;
+			if (imp_ents[j].title && !title) title = imp_ents[j].title;
+		}
+		if (loc) imp_ents[out++] = (struct imp_entry){ loc, title, imp_ents[i].n };
+		i = j;
+	}
+	imp_n = out;
+}
+
+static void xml_unescape(char *s) {
+	static const char *ents[][2] = {
+		{ "&amp;", "&" }, { "&lt;", "<" }, { "&gt;", ">" }, { "&quot;", "\"" }, { "&apos;", "'" },
+	};
+	char *out = s;
+	while (*s) {
+		if (*s == '&') {
+			int done = 0;
+			for (int i = 0; i < 5 && !done; i++) {
+				size_t n = strlen(ents[i][0]);
+				if (strncmp(s, ents[i][0], n) == 0) {
+					*out++ = ents[i][1][0];
+					s += n;
+					done = 1;
+				}
+			}
+			if (!done && s[1] == '#') { /* numeric, ASCII only */
+				char *end;
+				long c = s[2] == 'x' ? strtol(s + 3, &end, 16) : strtol(s + 2, &end, 10);
+				if (*end == ';' && c > 0 && c < 128) {
+					*out++ = c;
+					s = end + 1;
+					done = 1;
+				}
+			}
+			if (done) continue;
+		}
+		*out++ = *s++;
+	}
+	*out = '\0';
+}
+
+/* The first <tag> element in the NUL-terminated p: its text, with *close
+ * at its closing tag; NULL when absent. */
+static char *xml_elem(char *p, const char *tag, char **close) {
+	char open[32], shut[32];
+	snprintf(open, sizeof(open), "<%s>", tag);
+	snprintf(shut, sizeof(shut), "</%s>", tag);
+	char *s = strstr(p, open);
+	if (!s) return NULL;
+	s += strlen(open);
+	if (!(*close = strstr(s, shut))) return NULL;
+	return s;
+}
+
+static void parse_xspf(char *text) {
+	static const char *tags[3] = { "location", "title", "creator" };
+	char *p = text;
+	while ((p = strstr(p, "<track>")) != NULL) {
+		char *end = strstr(p, "</track>");
+		if (!end) break;
+		*end = '\0';
+		/* find all three before cutting any of them out */
+		char *val[3], *close[3];
+		for (int t = 0; t < 3; t++)
+			val[t] = xml_elem(p, tags[t], &close[t]);
+		for (int t = 0; t < 3; t++)
+			if (val[t]) {
+				*close[t] = '\0';
+				xml_unescape(val[t]);
+			}
+		char *loc = val[0], *title = val[1], *creator = val[2];
+		char *full = NULL;
+		if (title && creator && asprintf(&full, "%s - %s", creator, title) < 0)
+			full = NULL;
+		imp_add(loc, full ? full : title, 0);
+		p = end + 1;
+	}
+}
+
+static int playlist_import(const char *file, const char *name) {
+	double t0 = mono_now();
+	char *text = slurp(file);
+	if (!text) {
+		perror(file);
+		return 1;
+	}
+	const char *ext = strrchr(file, '.');
+	char *body = text;
+	if (strncmp(body, "\xef\xbb\xbf", 3) == 0) body += 3; /* UTF-8 BOM */
+	int uri = 0;
+	if (ext && strcasecmp(ext, ".pls") == 0) {
+		parse_pls(body);
+	} else if (ext && strcasecmp(ext, ".xspf") == 0) {
+		parse_xspf(body);
+		uri = 1;
+	} else if (ext && (strcasecmp(ext, ".m3u") == 0 || strcasecmp(ext, ".m3u8") == 0)) {
+		parse_m3u(body);
+	} else {
+		fprintf(stderr, "%s: not an .m3u, .m3u8, .pls or .xspf file\n", file);
+		return 1;
+	}
+
+	/* the list's directory and songs_dir, both absolute */
+	char cwd[PATH_MAX], base[PATH_MAX * 2], lexical[PATH_MAX * 2], real[PATH_MAX];
+	if (!getcwd(cwd, sizeof(cwd))) strcpy(cwd, "/");
+	path_abs(base, sizeof(base), cwd, file);
+	*strrchr(base, '/') = '\0';
+	if (!base[0]) strcpy(base, "/");
+	path_abs(lexical, sizeof(lexical), cwd, songs_dir);
+	const char *roots[2] = { lexical, realpath(songs_dir, real) };
+
+	char stem[256];
+	if (!name) {
+		const char *slash = strrchr(file, '/');
+		const char *b = slash ? slash + 1 : file;
+		snprintf(stem, sizeof(stem), "%.*s", stem_len(b), b);
+		name = stem;
+	}
+	if (!name[0] || strchr(name, '/')) {
+		fprintf(stderr, "%s: bad playlist name\n", name);
+		return 1;
+	}
+
+	imp_index_build();
+	char *out = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&out, &len);
+	if (!f) return 1;
+	int matched = 0;
+	for (int i = 0; i < imp_n; i++) {
+		int idx = imp_resolve(&imp_ents[i], uri, base, roots);
+		if (idx >= 0) {
+			fprintf(f, "%s\n", songs[idx]);
+			matched++;
+		} else {
+			fprintf(stderr, "unmatched: %s\n",
+				imp_ents[i].loc ? imp_ents[i].loc : imp_ents[i].title);
+		}
+	}
+	fclose(f);
+
+	mkdir(playlists_dir, 0755);
+	char path[PATH_MAX], tmp[PATH_MAX + 8];
+	snprintf(path, sizeof(path), "%s/%s.playlist", playlists_dir, name);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || write(fd, out, len) != (ssize_t)len || close(fd) != 0 ||
+	    rename(tmp, path) != 0) {
+		perror(path);
+		unlink(tmp);
+		return 1;
+	}
+	printf("%s: %d of %d entries matched (%.0f ms)\n", path, matched, imp_n,
+		(mono_now() - t0) * 1000);
+	return 0;
+}
+
+static int find_in_display(int song_idx) {
+	if (filter_active) {
+		for (int i = 0; i < nfiltered; i++)
+			if (filtered[i] == song_idx) return i;
+	} else if (playlist_active >= 0) {
+		for (int i = 0; i < nplaylist_songs; i++)
+			if (playlist_songs[i] == song_idx) return i;
+	} else {
+		if (song_idx >= 0 && song_idx < nsongs)
+			return (sort_mode == SORT_NAME) ? song_idx : sort_rank[sort_mode][song_idx];
+	}
+	return 0;
+}
+
+/* Frame output. Normally straight to the terminal; --replay renders into
+ * out_frame at the script's size instead. The daemon sets out_rows and
+ * out_cols to a client's size while it handles that client's keys. */
+static int out_rows = 0, out_cols = 0; /* 0 = ask the terminal */
+static int out_capture = 0;
+static char *out_frame = NULL;
+static size_t out_frame_len = 0, out_frame_cap = 0;
+
+static void out_write(const char *s, size_t n) {
+	if (!out_capture) {
+		write(STDOUT_FILENO, s, n);
+		return;
+	}
+	if (out_frame_len + n > out_frame_cap) {
+		size_t cap = out_frame_cap ? out_frame_cap : 65536;
+		while (cap < out_frame_len + n) cap *= 2;
+		char *f = realloc(out_frame, cap);
+		if (!f) return;
+		out_frame = f;
+		out_frame_cap = cap;
+	}
+	memcpy(out_frame + out_frame_len, s, n);
+	out_frame_len += n;
+}
+
+static int term_rows(void) {
+	if (out_rows > 0) return out_rows;
+	struct winsize ws;
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1)
+		return 24;
+	return ws.ws_row;
+}
+
+static int term_cols(void) {
+	if (out_cols > 0) return out_cols;
+	struct winsize ws;
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1)
+		return 80;
+	return ws.ws_col;
+}
+
+/* Rows left for the song list: header, separator, status, progress and
+ * the up-next, stats and lyrics panels when they are open. */
+static int queue_panel_rows(void) {
+	if (!queue_panel) return 0;
+	int n = queue_len < 1 ? 1 : queue_len;
+	if (n > QUEUE_PANEL_MAX) n = QUEUE_PANEL_MAX;
+	return n + 1;
+}
+
+static int stats_panel_rows(void) {
+	return stats_panel ? STATS_PANEL_ROWS + 1 : 0;
+}
+
+static int lyrics_panel_rows(void) {
+	return lyrics_panel ? LYRICS_PANEL_ROWS + 1 : 0;
+}
+
+static int list_height(void) {
+	int lr = term_rows() - 4 - queue_panel_rows() - stats_panel_rows() - lyrics_panel_rows();
+	return lr < 0 ? 0 : lr;
+}
+
+static int song_at(int pos) {
+	if (filter_active) return filtered[pos];
+	if (playlist_active >= 0) return playlist_songs[pos];
+	return (sort_mode == SORT_NAME) ? pos : sort_perm[sort_mode][pos];
+}
+
+static int display_len(void) {
+	if (filter_active) return nfiltered;
+	if (playlist_active >= 0) return nplaylist_songs;
+	return nsongs;
+}
+
+/* Running length of the display list. Summed while apply_filter() builds
+ * filtered[]; otherwise recomputed only when the list or a duration has
+ * changed since the last call. */
+static double view_secs;
+static int view_unknown;
+static unsigned view_key[4];
+
+static void view_key_now(unsigned *key) {
+	key[0] = view_gen;
+	key[1] = filter_active;
+	key[2] = playlist_active + 1;
+	key[3] = display_len();
+}
+
+static void view_totals(double *secs, int *unknown) {
+	unsigned key[4];
+	view_key_now(key);
+	if (memcmp(key, view_key, sizeof(key)) != 0) {
+		view_secs = 0;
+		view_unknown = 0;
+		for (int i = 0, n = display_len(); i < n; i++) {
+			float d = meta_dur[song_at(i)];
+			if (d > 0) view_secs += d;
+			else view_unknown++;
+		}
+		memcpy(view_key, key, sizeof(key));
+	}
+	*secs = view_secs;
+	*unknown = view_unknown;
+}
+
+/* "12 songs 41:07", with a '+' when some lengths are still unknown.
+ * Without with_time the length is left out, for a header too narrow
+ * for all of it. */
+static void format_totals(char *out, size_t size, int with_time) {
+	double secs;
+	int unknown;
+	view_totals(&secs, &unknown);
+	int n = display_len();
+	int len = snprintf(out, size, "%d song%s", n, n == 1 ? "" : "s");
+	if (with_time && n > unknown && len < (int)size) {
+		long t = (long)(secs + 0.5);
+		if (t >= 3600)
+			len += snprintf(out + len, size - len, " %ldh %02ldm", t / 3600, t / 60 % 60);
+		else
+			len += snprintf(out + len, size - len, " %ld:%02ld", t / 60, t % 60);
+		if (unknown && len < (int)size)
+			len += snprintf(out + len, size - len, "+");
+	}
+	if (playlist_active >= 0 && playlist_active == dup_view && dup_state == DUP_DONE &&
+	    dup_groups && len < (int)size)
+		len += snprintf(out + len, size - len, ", %d group%s (%.1f MB)",
+			dup_groups, dup_groups == 1 ? "" : "s", dup_waste / 1048576.0);
+	if (scan_active && len < (int)size)
+		snprintf(out + len, size - len, ", scanning");
+}
+
+/* The literal runs every match of the extended regex re must contain,
+ * lowercased and NUL-separated into buf (twice re's length), so
+ * apply_filter() can turn most names away with has_run() before
+ * regexec(). Conservative: a '|' anywhere gives none; groups, brackets,
+ * anchors, '.', escapes such as \w and non-ASCII bytes end a run, and a
+ * quantified atom is taken off it (quantifiers stack). Returns the number
+ * of runs. */
+static int regex_runs(const char *re, char *buf) {
+	if (strchr(re, '|')) return 0;
+	int n = 0, len = 0, depth = 0;
+	for (const char *p = re; *p; p++) {
+		unsigned char c = *p;
+		int lit = -1;
+		if (c == '\\' && p[1]) {
+			c = *++p;
+			char l = ascii_lower(c);
+			if (!(l >= 'a' && l <= 'z') && !(c >= '0' && c <= '9') && !strchr("<>`'", c))
+				lit = c; /* \w, \<, \1 and the like are not literals */
+		} else if (c == '[') {
+			const char *q = p + 1;
+			if (*q == '^') q++;
+			if (*q == ']') q++;
+			while (*q && *q != ']') {
+				if (*q == '[' && (q[1] == ':' || q[1] == '.' || q[1] == '=')) {
+					char d = q[1];
+					for (q += 2; *q && !(q[0] == d && q[1] == ']'); q++) {}
+					if (*q) q++;
+				}
+				if (*q) q++;
+			}
+			p = *q ? q : q - 1;
+		} else if (c == '(') {
+			depth++;
+		} else if (c == ')') {
+			depth--;
+		} else if (c == '*' || c == '?' || c == '+' || c == '{') {
+			if (len) len--;
+			if (c == '{')
+				while (p[1] && *p != '}') p++;
+		} else if (c < 0x80 && !strchr(".^$", c)) {
+			lit = ascii_lower(c);
+		}
+		if (lit >= 0 && lit < 0x80 && depth == 0) {
+			buf[len++] = lit;
+			continue;
+		}
+		if (len) {
+			buf[len] = '\0';
+			buf += len + 1;
+			len = 0;
+			n++;
+		}
+	}
+	if (len) {
+		buf[len] = '\0';
+		n++;
+	}
+	return n;
+}
+
+/* Whether s contains run (lowercase ASCII) in either case; strpbrk()
+ * finds the candidates for its first letter. */
+static int has_run(const char *s, const char *run) {
+	char first[3] = { run[0], run[0] >= 'a' && run[0] <= 'z' ? run[0] - ('a' - 'A') : 0, 0 };
+	for (s = strpbrk(s, first); s; s = strpbrk(s + 1, first)) {
+		int k = 1;
+		while (run[k] && ascii_lower(s[k]) == run[k]) k++;
+		if (!run[k]) return 1;
+	}
+	return 0;
+}
+
+static void apply_filter(void) {
+	int prev_song = song_at(cursor);
+
+	if (search_len == 0) {
+		filter_active = 0;
+		cursor = find_in_display(prev_song);
+		return;
+	}
+
+	regex_t re;
+	if (regcomp(&re, search_buf, REG_EXTENDED | REG_ICASE | REG_NOSUB) != 0)
+		return; /* invalid regex, keep previous state */
+
+	char runs[2 * sizeof(search_buf)];
+	int nruns = regex_runs(search_buf, runs);
+
+	nfiltered = 0;
+	view_secs = 0;
+	view_unknown = 0;
+	int base_count = (playlist_active >= 0) ? nplaylist_songs : nsongs;
+	for (int i = 0; i < base_count; i++) {
+		int sidx = (playlist_active >= 0) ? playlist_songs[i] :
+			(sort_mode == SORT_NAME) ? i : sort_perm[sort_mode][i];
+		const char *run = runs;
+		int r = 0;
+		while (r < nruns && has_run(songs[sidx], run)) {
+			run += strlen(run) + 1;
+			r++;
+		}
+		if (r == nruns && regexec(&re, songs[sidx], 0, NULL, 0) == 0) {
+			filtered[nfiltered++] = sidx;
+			if (meta_dur[sidx] > 0) view_secs += meta_dur[sidx];
+			else view_unknown++;
+		}
+	}
+	regfree(&re);
+	filter_active = 1;
+	view_gen++;
+	view_key_now(view_key);
+
+	/* try to keep cursor on the same song */
+	cursor = 0;
+	for (int i = 0; i < nfiltered; i++) {
+		if (filtered[i] == prev_song) {
+			cursor = i;
+			break;
+		}
+	}
+}
+
+static void flush_buf(char *buf, int *len) {
+	if (*len > 0) {
+		out_write(buf, *len);
+		*len = 0;
+	}
+}
+
+static void appendf(char *buf, int *len, size_t size, const char *fmt, ...) {
+	va_list ap;
+
+	for (;;) {
+		va_start(ap, fmt);
+		int n = vsnprintf(buf + *len, size - *len, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			return;
+		if ((size_t)n < size - *len) {
+			*len += n;
+			return;
+		}
+
+		flush_buf(buf, len);
+		if ((size_t)n >= size) {
+			char *tmp = malloc((size_t)n + 1);
+			if (!tmp)
+				return;
+			va_start(ap, fmt);
+			vsnprintf(tmp, (size_t)n + 1, fmt, ap);
+			va_end(ap);
+			out_write(tmp, (size_t)n);
+			free(tmp);
+			return;
+		}
+	}
+}
+
+static void append_repeat(char *buf, int *len, size_t size, char ch, int count) {
+	for (int i = 0; i < count; i++) {
+		if (*len >= (int)size - 1)
+			flush_buf(buf, len);
+		buf[(*len)++] = ch;
+	}
+}
+
+static void append_repeat_text(char *buf, int *len, size_t size, const char *text, int count) {
+	for (int i = 0; i < count; i++)
+		appendf(buf, len, size, "%s", text);
+}
+
+/* text truncated and padded to exactly cols terminal columns */
+static void append_cols(char *buf, int *len, size_t size, const char *text, int cols) {
+	int used;
+	int n = text_fit(text, cols, &used);
+	appendf(buf, len, size, "%.*s%*s", n, text, cols - used, "");
+}
+
+static void append_row(char *buf, int *len, size_t size, int row, int col,
+                       const char *style, const char *text, int cols) {
+	appendf(buf, len, size, "\033[%d;%dH%s", row, col, style);
+	append_cols(buf, len, size, text, cols);
+	appendf(buf, len, size, "%s", MAIN_BASE);
+}
+
+/* "── title ─────" across the main pane, opening a panel under the list. */
+static void append_panel_title(char *buf, int *len, size_t size, int row, int col,
+                               const char *border, const char *title, int cols) {
+	appendf(buf, len, size, "\033[%d;%dH%s", row, col, border);
+	append_repeat_text(buf, len, size, SEP_H, 2);
+	appendf(buf, len, size, "%s%.*s%s", MAIN_ACCENT_BOLD,
+		cols > 2 ? cols - 2 : 0, title, border);
+	int used = 2 + (int)strlen(title);
+	if (used < cols)
+		append_repeat_text(buf, len, size, SEP_H, cols - used);
+	appendf(buf, len, size, "%s", MAIN_BASE);
+}
+
+static const char *viz_glyphs[9] = { " ", "▁", "▂", "▃", "▄", "▅", "▆", "▇", "█" };
+
+static int spectrum_glyph(float lv) {
+	int g = (int)(lv * 8 + 0.5f);
+	return g < 0 ? 0 : g > 8 ? 8 : g;
+}
+
+static void append_spectrum(char *buf, int *len, size_t size, const float *lv, int nb) {
+	for (int b = 0; b < nb; b++)
+		appendf(buf, len, size, "%s", viz_glyphs[spectrum_glyph(lv[b])]);
+}
+
+/* What draw() shows from state a --client has no copy of: the zone
+ * table, the queue ring, per-song counters, the file cache's thread side,
+ * the waveform cache and the lyric files. shown_gather() fills it before
+ * a frame; a client gets it from the daemon with the rest. */
+static struct {
+	char zone[32];                  /* zones[zone_view].name */
+	int queue[QUEUE_PANEL_MAX];     /* the first queued songs */
+	long long plays, skips;         /* library totals, with the stats panel open */
+	int nfeat;
+	int fc_files;
+	long long fc_bytes;
+	int viz;                        /* viz_active() */
+	int wave_slot;                  /* the playing song's waveform record, -1 = none */
+	unsigned char wave[WF_BUCKETS];
+	int lyr_lit;                    /* lyr[1] is a lyric line, not a placeholder */
+	char lyr[LYRICS_PANEL_ROWS][256];
+} shown = { .wave_slot = -1 };
+
+/* Fold WF_BUCKETS peaks into cols bar levels on a 48 dB scale. Never
+ * fully blank, so silent passages still read as part of the bar. */
+static void wave_levels(const unsigned char *peak, int cols, float *lv) {
+	for (int c = 0; c < cols; c++) {
+		int lo = c * WF_BUCKETS / cols;
+		int hi = (c + 1) * WF_BUCKETS / cols;
+		if (hi <= lo) hi = lo + 1;
+		int pk = 0;
+		for (int b = lo; b < hi; b++)
+			if (peak[b] > pk) pk = peak[b];
+		float db = pk ? 20.0f * log10f(pk / 255.0f) : -96.0f;
+		float v = (db + 48.0f) / 48.0f;
+		lv[c] = v < 0.125f ? 0.125f : v > 1.0f ? 1.0f : v;
+	}
+}
+
+/* Column levels for the playing song's progress bar, from shown.wave;
+ * rebuilt only when the record or the bar width changes. */
+static const float *wave_bar(int width) {
+	int slot = shown.wave_slot;
+	if (slot < 0 || width > (int)(sizeof(wf_bar) / sizeof(wf_bar[0])))
+		return NULL;
+	if (slot != wf_bar_slot || width != wf_bar_width) {
+		wave_levels(shown.wave, width, wf_bar);
+		wf_bar_slot = slot;
+		wf_bar_width = width;
+	}
+	return wf_bar;
+}
+
+/* Time-synced lyrics: an .lrc file beside the song or in lyrics_dir,
+ * parsed once per track into lines sorted by timestamp. The current line
+ * follows the interpolated position through an advancing cursor, with a
+ * binary search after a seek, and draw_lyrics() repaints the panel only
+ * when the line changes. */
+static unsigned long long lyr_hash; /* fnv1a of the song loaded, 0 = none */
+static char *lyr_buf;               /* file text; lyr_text points into it */
+static float *lyr_time;             /* seconds, ascending */
+static char **lyr_text;
+static int lyr_n = 0;
+static int lyr_cur = -1;            /* last line at or before the position */
+static int lyr_drawn = -2;          /* lyr_cur as last painted */
+static int lyr_row = 0, lyr_col = 0, lyr_cols = 0; /* panel rows, from draw() */
+
+struct lyr_line {
+	float t;
+	int order; /* file order, so equal timestamps stay in order */
+	char *text;
+};
+
+static int lyr_line_cmp(const void *a, const void *b) {
+	const struct lyr_line *x = a, *y = b;
+	if (x->t != y->t) return x->t < y->t ? -1 : 1;
+	return x->order - y->order;
+}
+
+static void lyrics_free(void) {
+	free(lyr_buf);
+	free(lyr_time);
+	free(lyr_text);
+	lyr_buf = NULL;
+	lyr_time = NULL;
+	lyr_text = NULL;
+	lyr_n = 0;
+	lyr_cur = -1;
+}
+
+static char *lyrics_read(int idx) {
+	const char *dirs[2] = { songs_dir, lyrics_dir };
+	const char *name = songs[idx];
+	const char *dot = strrchr(name, '.');
+	int stem = dot && dot != name ? (int)(dot - name) : (int)strlen(name);
+	for (int d = 0; d < 2; d++) {
+		char path[PATH_MAX + 1024];
+		snprintf(path, sizeof(path), "%s/%.*s.lrc", dirs[d], stem, name);
+		int fd = open(path, O_RDONLY);
+		if (fd < 0) continue;
+		struct stat st;
+		char *text = NULL;
+		if (fstat(fd, &st) == 0 && (text = malloc(st.st_size + 1))) {
+			ssize_t n = read(fd, text, st.st_size);
+			text[n > 0 ? n : 0] = '\0';
+		}
+		close(fd);
+		return text;
+	}
+	return NULL;
+}
+
+/* "[mm:ss.xx]" tags (several may share a text), "[offset:+/-ms]"; other
+ * tags such as [ar:...] are ignored. */
+static void lyrics_load(int idx) {
+	lyr_buf = lyrics_read(idx);
+	if (!lyr_buf) return;
+	int cap = 64, n = 0;
+	struct lyr_line *lines = malloc(cap * sizeof(*lines));
+	double offset = 0;
+	for (char *line = lyr_buf; line && lines; ) {
+		char *next = strchr(line, '\n');
+		if (next) *next++ = '\0';
+		line[strcspn(line, "\r")] = '\0';
+		float stamps[16];
+		int nstamps = 0;
+		char *p = line;
+		while (*p == '[') {
+			char *close = strchr(p, ']');
+			if (!close) break;
+			int mm;
+			double ss;
+			char colon;
+			if (sscanf(p + 1, "%d:%lf%c", &mm, &ss, &colon) == 3 && colon == ']' && nstamps < 16)
+				stamps[nstamps++] = mm * 60 + ss;
+			else if (strncmp(p + 1, "offset:", 7) == 0)
+				offset = atof(p + 8) / 1000;
+			p = close + 1;
+		}
+		for (int i = 0; i < nstamps; i++) {
+			if (n == cap) {
+				struct lyr_line *l = realloc(lines, (cap *= 2) * sizeof(*lines));
+				if (!l) break;
+				lines = l;
+			}
+			lines[n] = (struct lyr_line){ stamps[i], n, p };
+			n++;
+		}
+		line = next;
+	}
+	if (!lines) return;
+	qsort(lines, n, sizeof(*lines), lyr_line_cmp);
+	lyr_time = malloc((n ? n : 1) * sizeof(*lyr_time));
+	lyr_text = malloc((n ? n : 1) * sizeof(*lyr_text));
+	if (lyr_time && lyr_text) {
+		/* a positive offset shows lines earlier */
+		for (int i = 0; i < n; i++) {
+			lyr_time[i] = lines[i].t - offset;
+			lyr_text[i] = lines[i].text;
+		}
+		lyr_n = n;
+	}
+	free(lines);
+}
+
+/* Last line at or before pos, -1 before the first. */
+static int lyrics_find(double pos) {
+	if (lyr_n == 0 || pos < lyr_time[0]) return -1;
+	int c = lyr_cur;
+	if (c >= 0 && c < lyr_n && lyr_time[c] <= pos) {
+		/* playing through: the same line or the next one */
+		if (c + 1 == lyr_n || lyr_time[c + 1] > pos) return c;
+		if (c + 2 == lyr_n || lyr_time[c + 2] > pos) return c + 1;
+	}
+	int lo = 0, hi = lyr_n - 1;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (lyr_time[mid] <= pos) lo = mid;
+		else hi = mid - 1;
+	}
+	return lo;
+}
+
+/* Load on a track change and move the cursor to the position. */
+static void lyrics_sync(void) {
+	unsigned long long h = playing >= 0 ? fnv1a(songs[playing]) : 0;
+	if (h != lyr_hash) {
+		lyrics_free();
+		lyr_hash = h;
+		if (playing >= 0) lyrics_load(playing);
+	}
+	lyr_cur = lyrics_find(interp_pos());
+}
+
+/* Milliseconds until the next line is due, -1 when nothing is. */
+static int lyrics_wait_ms(void) {
+	if (!lyrics_panel || playing < 0 || paused || lyr_n == 0) return -1;
+	if (lyr_cur + 1 >= lyr_n) return -1;
+	double wait = lyr_time[lyr_cur + 1] - interp_pos();
+	return wait <= 0 ? 0 : (int)(wait * 1000) + 1;
+}
+
+/* Previous, current and next line into shown.lyr. */
+static void lyrics_shown(void) {
+	for (int i = 0; i < LYRICS_PANEL_ROWS; i++) {
+		int l = lyr_cur - 1 + i;
+		const char *text = "";
+		if (playing < 0)
+			text = i == 1 ? "(nothing playing)" : "";
+		else if (lyr_n == 0)
+			text = i == 1 ? "(no lyrics)" : "";
+		else if (l >= 0 && l < lyr_n)
+			text = lyr_text[l];
+		snprintf(shown.lyr[i], sizeof(shown.lyr[i]), "%s", text);
+	}
+	shown.lyr_lit = lyr_n > 0;
+	lyr_drawn = lyr_cur;
+}
+
+static void append_lyrics(char *buf, int *len, size_t size) {
+	for (int i = 0; i < LYRICS_PANEL_ROWS; i++) {
+		char line[1024];
+		snprintf(line, sizeof(line), "  %s", shown.lyr[i]);
+		append_row(buf, len, size, lyr_row + 1 + i, lyr_col,
+			i == 1 && shown.lyr_lit ? MAIN_ACCENT_BOLD : MAIN_DIM, line, lyr_cols);
+	}
+}
+
+/* Between full frames: repaint the lyric rows only when the line moved. */
+static void draw_lyrics(void) {
+	if (!lyrics_panel || lyr_row <= 0) return;
+	lyrics_sync();
+	if (lyr_cur == lyr_drawn) return;
+	lyrics_shown();
+	char buf[8192];
+	int len = 0;
+	append_lyrics(buf, &len, sizeof(buf));
+	flush_buf(buf, &len);
+}
+
+static int progress_cells = 0; /* bar width at the last draw() */
+
+/* "[sleep 25m]", or seconds in the last minute. */
+static void sleep_tag(char *out, size_t size) {
+	double left = sleep_at - mono_now();
+	if (left < 0) left = 0;
+	if (left > 60)
+		snprintf(out, size, "[sleep %dm]", (int)ceil(left / 60));
+	else
+		snprintf(out, size, "[sleep %ds]", (int)ceil(left));
+}
+
+static void lyrics_sync(void);
+
+/* Fill shown from the live state. */
+static void shown_gather(void) {
+	snprintf(shown.zone, sizeof(shown.zone), "%s", zones[zone_view].name);
+	for (int i = 0; i < QUEUE_PANEL_MAX; i++)
+		shown.queue[i] = i < queue_len ? queue_at(i) : -1;
+	if (stats_panel) {
+		shown.plays = shown.skips = 0;
+		shown.nfeat = 0;
+		for (int i = 0; i < nsongs; i++) {
+			shown.plays += meta_plays[i];
+			shown.skips += meta_skips[i];
+			shown.nfeat += meta_feat[i] >= 0;
+		}
+		pthread_mutex_lock(&fc_lock);
+		shown.fc_files = fc_n;
+		shown.fc_bytes = fc_bytes;
+		pthread_mutex_unlock(&fc_lock);
+	}
+	shown.viz = viz_active();
+	shown.wave_slot = playing >= 0 && wf_map ? meta_wave[playing] : -1;
+	if (shown.wave_slot >= 0)
+		memcpy(shown.wave, wf_rec(shown.wave_slot)->peak, WF_BUCKETS);
+	if (lyrics_panel) {
+		lyrics_sync();
+		lyrics_shown();
+	}
+}
+
+/* Sidebar columns at a screen width, 0 with the playlist menu closed. */
+static int sidebar_cols(int cols) {
+	if (!playlist_menu || cols <= 2) return 0;
+	int w = SIDEBAR_WIDTH;
+	if (w > cols - 2) w = cols - 2;
+	return w < 1 ? 1 : w;
+}
+
+static int main_pane_cols(int cols) {
+	int sb = sidebar_cols(cols);
+	int w = sb ? cols - sb - 1 : cols;
+	return w < 1 ? 1 : w;
+}
+
+/* Progress bar cells in a main pane: all but the two times. */
+static int bar_cells(int main_cols) {
+	return main_cols - 14 < 4 ? 4 : main_cols - 14;
+}
+
+/* Vim-style edge scrolling: keep the cursor among the list_rows shown. */
+static void scroll_clamp(int list_rows) {
+	int count = display_len();
+	if (cursor < scroll_offset)
+		scroll_offset = cursor;
+	else if (cursor >= scroll_offset + list_rows)
+		scroll_offset = cursor - list_rows + 1;
+	if (count <= list_rows)
+		scroll_offset = 0;
+	else if (scroll_offset > count - list_rows)
+		scroll_offset = count - list_rows;
+	if (scroll_offset < 0)
+		scroll_offset = 0;
+}
+
+static void draw(void) {
+	int rows = term_rows();
+	int cols = term_cols();
+	int list_rows = list_height();
+
+	if (!client_mode) shown_gather();
+
+	out_write(MAIN_BASE "\033[2J\033[H", sizeof(MAIN_BASE "\033[2J\033[H") - 1);
+
+	char buf[65536];
+	int len = 0;
+	char line[4096];
+
+	int main_cols = main_pane_cols(cols);
+	int main_col = 1;
+	int sidebar_width = sidebar_cols(cols);
+	int sb_col = 0;
+	int sidebar_focused = playlist_menu && panel_focus == PANEL_SIDEBAR;
+	char totals[64];
+	int nsel = sel_count();
+	if (nsel > 0)
+		snprintf(totals, sizeof(totals), "%d selected", nsel);
+	else
+		format_totals(totals, sizeof(totals), 1);
+	int main_focused = !playlist_menu || panel_focus == PANEL_MAIN;
+	const char *sidebar_border = sidebar_focused ? SIDEBAR_BORDER_FOCUSED : SIDEBAR_BORDER_UNFOCUSED;
+	const char *main_border = main_focused ? MAIN_BORDER_FOCUSED : MAIN_BORDER_UNFOCUSED;
+
+	if (sidebar_width) {
+		sb_col = 1;
+		main_col = sidebar_width + 2;
+
+		for (int r = 1; r <= rows; r++) {
+			appendf(buf, &len, sizeof(buf), "\033[%d;%dH%s", r, sb_col, SIDEBAR_BASE);
+			append_repeat(buf, &len, sizeof(buf), ' ', sidebar_width);
+			appendf(buf, &len, sizeof(buf), "%s", MAIN_BASE);
+		}
+
+		appendf(buf, &len, sizeof(buf),
+			"\033[1;%dH%s%-*.*s%s",
+			sb_col, SIDEBAR_ACCENT_BOLD,
+			sidebar_width, sidebar_width, " Playlists", MAIN_BASE);
+
+		appendf(buf, &len, sizeof(buf), "\033[2;%dH%s", sb_col, sidebar_border);
+		append_repeat_text(buf, &len, sizeof(buf), SEP_H, sidebar_width);
+		appendf(buf, &len, sizeof(buf), "%s", MAIN_BASE);
+
+		for (int i = 0; i <= nplaylists && i < list_rows; i++) {
+			int row = i + 3;
+			const char *name = (i == 0) ? "[All Songs]" : playlists[i - 1];
+			const char *pfix = (i == playlist_cursor) ? "> " : "  ";
+			const char *style = SIDEBAR_BASE;
+			int is_active = (i == 0 && playlist_active == -1) ||
+				(i > 0 && playlist_active == i - 1);
+
+			if (i == playlist_cursor)
+				style = sidebar_focused ? SIDEBAR_SELECTED : SIDEBAR_CURSOR;
+			else if (is_active)
+				style = SIDEBAR_ACCENT_BOLD;
+
+			snprintf(line, sizeof(line), "%s%s", pfix, name);
+			append_row(buf, &len, sizeof(buf), row, sb_col, style, line, sidebar_width);
+		}
+
+		if (rows > nplaylists + 3) {
+			snprintf(line, sizeof(line), " %s", totals);
+			appendf(buf, &len, sizeof(buf),
+				"\033[%d;%dH%s%-*.*s%s",
+				rows, sb_col, SIDEBAR_DIM,
+				sidebar_width, sidebar_width, line, MAIN_BASE);
+		}
+
+		int border_col = sidebar_width + 1;
+		for (int r = 1; r <= rows; r++) {
+			const char *border = (r == 2) ? SEP_CROSS : SEP_V;
+			appendf(buf, &len, sizeof(buf),
+				"\033[%d;%dH%s%s%s",
+				r, border_col, sidebar_border, border, MAIN_BASE);
+		}
+	}
+
+	if (playlist_active >= 0) {
+		appendf(buf, &len, sizeof(buf),
+			"\033[1;%dH%s  MusicPlayer [%s]%s",
+			main_col, MAIN_ACCENT_BOLD, playlists[playlist_active], MAIN_BASE);
+	} else {
+		appendf(buf, &len, sizeof(buf),
+			"\033[1;%dH%s  MusicPlayer%s",
+			main_col, MAIN_ACCENT_BOLD, MAIN_BASE);
+	}
+	{
+		int vbars = volume / 5;
+		if (vbars < 0)
+			vbars = 0;
+		if (vbars > 20)
+			vbars = 20;
+
+		appendf(buf, &len, sizeof(buf), " | [");
+		if (vbars > 0)
+			appendf(buf, &len, sizeof(buf), "%s", MAIN_ACCENT);
+		for (int i = 0; i < 20; i++) {
+			if (i == vbars)
+				appendf(buf, &len, sizeof(buf), "%s", MAIN_DIM);
+			append_repeat(buf, &len, sizeof(buf), '|', 1);
+		}
+		appendf(buf, &len, sizeof(buf), "%s]", MAIN_BASE);
+
+		int used = 2 + 11 + 4 + 20 + 1;
+		if (playlist_active >= 0)
+			used += 3 + text_width(playlists[playlist_active]);
+		if (nsel == 0 && used + 3 + (int)strlen(totals) > main_cols)
+			format_totals(totals, sizeof(totals), 0);
+		if (used + 3 + (int)strlen(totals) <= main_cols) {
+			appendf(buf, &len, sizeof(buf), " | %s", totals);
+			used += 3 + (int)strlen(totals);
+		}
+		if (sort_mode != SORT_NAME && used + 6 + (int)strlen(sort_names[sort_mode]) <= main_cols) {
+			appendf(buf, &len, sizeof(buf), " | by %s", sort_names[sort_mode]);
+			used += 6 + (int)strlen(sort_names[sort_mode]);
+		}
+		if (nzones > 1 && used + 8 + text_width(shown.zone) <= main_cols) {
+			appendf(buf, &len, sizeof(buf), " | zone %s", shown.zone);
+			used += 8 + text_width(shown.zone);
+		}
+
+		/* spectrum fills the rest of the header row */
+		viz_width = 0;
+		if (shown.viz && main_cols - used - 1 >= 8) {
+			viz_width = main_cols - used - 1;
+			if (viz_width > VIZ_MAX_BANDS) viz_width = VIZ_MAX_BANDS;
+			viz_row = 1;
+			viz_col = main_col + used + 1;
+			appendf(buf, &len, sizeof(buf), " %s", MAIN_ACCENT);
+			append_spectrum(buf, &len, sizeof(buf), viz_level, viz_width);
+			appendf(buf, &len, sizeof(buf), "%s", MAIN_BASE);
+			for (int b = 0; b < viz_width; b++)
+				viz_drawn[b] = spectrum_glyph(viz_level[b]);
+		}
+	}
+
+	appendf(buf, &len, sizeof(buf), "\033[2;%dH%s", main_col, main_border);
+	append_repeat_text(buf, &len, sizeof(buf), SEP_H, main_cols);
+	appendf(buf, &len, sizeof(buf), "%s", MAIN_BASE);
+
+	/* song list */
+	int count = display_len();
+	scroll_clamp(list_rows);
+
+	for (int i = 0; i < list_rows && (i + scroll_offset) < count; i++) {
+		int dpos = i + scroll_offset;
+		int sidx = song_at(dpos);
+		int sel = is_selected(dpos);
+		int doomed = sidx == delete_pending || (sel && delete_pending == DELETE_SELECTION);
+		char prefix[3] = { dpos == cursor ? '>' : ' ', sel ? '*' : ' ', '\0' };
+		const char *style = MAIN_BASE;
+
+		if (doomed) {
+			style = (dpos == cursor) ? MAIN_DELETE_BOLD : MAIN_DELETE;
+		} else if (dpos == cursor) {
+			style = main_focused ? MAIN_SELECTED : MAIN_CURSOR;
+		} else if (sel) {
+			style = MAIN_VISUAL;
+		} else if (sidx == playing) {
+			style = MAIN_ACCENT;
+		}
+
+		const char *suffix = "";
+		if (doomed) {
+			suffix = " [delete]";
+		} else if (playlist_active >= 0 && playlist_active == dup_view &&
+			   bit_get(dup_extra, sidx)) {
+			suffix = " [duplicate]";
+		} else if (sidx == playing) {
+			if (loop_mode == LOOP_SINGLE) suffix = " [repeat]";
+			else if (shuffle) suffix = " [shuffle]";
+		}
+
+		if (main_cols < 2) {
+			append_row(buf, &len, sizeof(buf), i + 3, main_col, style, prefix, main_cols);
+			continue;
+		}
+		/* name cut from the per-song width cache, suffix gets what is left */
+		int used;
+		int nb = song_fit(sidx, main_cols - 2, &used);
+		int rest = main_cols - 2 - used;
+		appendf(buf, &len, sizeof(buf),
+			"\033[%d;%dH%s%s%.*s%-*.*s%s",
+			i + 3, main_col, style, prefix, nb, songs[sidx],
+			rest, rest, suffix, MAIN_BASE);
+	}
+
+	if (count == 0 && playlist_active >= 0 && playlist_kind[playlist_active] == PL_SMART &&
+	    smart_error[0] && list_rows > 0) {
+		snprintf(line, sizeof(line), "  query error: %s", smart_error);
+		append_row(buf, &len, sizeof(buf), 3, main_col, MAIN_DELETE, line, main_cols);
+	}
+	if (count == 0 && playlist_active >= 0 && playlist_active == dup_view && list_rows > 0) {
+		if (dup_state == DUP_DONE)
+			snprintf(line, sizeof(line), "  no duplicates");
+		else if (dup_state == DUP_WAIT)
+			snprintf(line, sizeof(line), "  finding duplicates after the scan");
+		else
+			snprintf(line, sizeof(line), "  finding duplicates: %s, %d file%s to go",
+				dup_state == DUP_HEAD ? "heads" : "whole files", dup_jobs, dup_jobs == 1 ? "" : "s");
+		append_row(buf, &len, sizeof(buf), 3, main_col, MAIN_DIM, line, main_cols);
+	}
+
+	if (queue_panel && list_rows + 3 <= rows - 2) {
+		int prow = list_rows + 3;
+		snprintf(line, sizeof(line), " Up next (%d)  a:add A:next *:all U:undo C:clear ", queue_len);
+		append_panel_title(buf, &len, sizeof(buf), prow, main_col, main_border, line, main_cols);
+
+		int nrows = queue_panel_rows() - 1;
+		for (int i = 0; i < nrows; i++) {
+			if (queue_len == 0)
+				snprintf(line, sizeof(line), "  (empty)");
+			else if (i == nrows - 1 && queue_len > nrows)
+				snprintf(line, sizeof(line), "  ... %d more", queue_len - nrows + 1);
+			else
+				snprintf(line, sizeof(line), "  %d. %s", i + 1, songs[shown.queue[i]]);
+			append_row(buf, &len, sizeof(buf), prow + 1 + i, main_col,
+				queue_len ? MAIN_BASE : MAIN_DIM, line, main_cols);
+		}
+	}
+
+	int srow = list_rows + 3 + queue_panel_rows();
+	if (stats_panel && srow + STATS_PANEL_ROWS <= rows - 2) {
+		append_panel_title(buf, &len, sizeof(buf), srow, main_col, main_border,
+			" Stats  i:close ", main_cols);
+		int n = snprintf(line, sizeof(line), "  library: %d song%s, %lld plays, %lld skips",
+			nsongs, nsongs == 1 ? "" : "s", shown.plays, shown.skips);
+		if (scan_active)
+			snprintf(line + n, sizeof(line) - n, ", scanning");
+		else if (scan_t0 > 0)
+			snprintf(line + n, sizeof(line) - n, ", scanned in %.0f ms", scan_ms);
+		append_row(buf, &len, sizeof(buf), srow + 1, main_col, MAIN_BASE, line, main_cols);
+		if (cache_secs)
+			snprintf(line, sizeof(line), "  buffering: %d stall%s, readahead %ds",
+				total_stalls, total_stalls == 1 ? "" : "s", cache_secs);
+		else
+			snprintf(line, sizeof(line), "  buffering: %d stalls", total_stalls);
+		append_row(buf, &len, sizeof(buf), srow + 2, main_col, MAIN_BASE, line, main_cols);
+		if (fc_budget) {
+			int files = shown.fc_files;
+			long long bytes = shown.fc_bytes;
+			snprintf(line, sizeof(line), "  file cache: %d hit%s, %d miss%s, %d file%s, %.1f of %lld MB",
+				fc_hits, fc_hits == 1 ? "" : "s", fc_misses, fc_misses == 1 ? "" : "es",
+				files, files == 1 ? "" : "s", bytes / 1048576.0, fc_budget >> 20);
+		} else {
+			snprintf(line, sizeof(line), "  file cache: off");
+		}
+		append_row(buf, &len, sizeof(buf), srow + 3, main_col, fc_budget ? MAIN_BASE : MAIN_DIM,
+			line, main_cols);
+		if (!crossfade_secs)
+			snprintf(line, sizeof(line), "  crossfade: off");
+		else if (xf_steps)
+			snprintf(line, sizeof(line), "  crossfade: %ds, last ramp %d steps, %.1f ms late at most",
+				crossfade_secs, xf_steps, xf_late);
+		else
+			snprintf(line, sizeof(line), "  crossfade: %ds", crossfade_secs);
+		append_row(buf, &len, sizeof(buf), srow + 4, main_col, crossfade_secs ? MAIN_BASE : MAIN_DIM,
+			line, main_cols);
+		n = snprintf(line, sizeof(line), "  radio: %s, %d of %d songs analysed",
+			radio ? "on" : "off", shown.nfeat, nsongs);
+		if (radio_ms >= 0)
+			snprintf(line + n, sizeof(line) - n, ", last pick %.3f ms over %d",
+				radio_ms, radio_seen);
+		append_row(buf, &len, sizeof(buf), srow + 5, main_col, radio ? MAIN_BASE : MAIN_DIM,
+			line, main_cols);
+	}
+
+	int lrow = srow + stats_panel_rows();
+	lyr_row = 0;
+	if (lyrics_panel && lrow + LYRICS_PANEL_ROWS <= rows - 2) {
+		append_panel_title(buf, &len, sizeof(buf), lrow, main_col, main_border,
+			" Lyrics  y:close ", main_cols);
+		lyr_row = lrow;
+		lyr_col = main_col;
+		lyr_cols = main_cols;
+		append_lyrics(buf, &len, sizeof(buf));
+	}
+
+	/* status lines at bottom */
+	if (playing >= 0) {
+		const char *state = paused ? "[paused]" : cache_waiting ? "[buffering]" : "[playing]";
+		const char *lmode = "";
+		if (loop_mode == LOOP_SINGLE) lmode = "[repeat]";
+		else if (shuffle) lmode = "[shuffle]";
+		int pm = (int)song_pos / 60, ps = (int)song_pos % 60;
+		int dm = (int)song_dur / 60, ds = (int)song_dur % 60;
+
+		char xtag[48] = "";
+		int xn = 0;
+		if (radio) xn = snprintf(xtag, sizeof(xtag), "[radio]");
+		if (crossfade_secs) xn += snprintf(xtag + xn, sizeof(xtag) - xn, "[xfade %ds]", crossfade_secs);
+		if (sleep_at > 0) sleep_tag(xtag + xn, sizeof(xtag) - xn);
+		int n = norm_live
+			? snprintf(line, sizeof(line), "%s%s%s %s  (%+.1f dB)", state, lmode, xtag, songs[playing], norm_applied)
+			: snprintf(line, sizeof(line), "%s%s%s %s", state, lmode, xtag, songs[playing]);
+		if (song_stalls > 0 && n >= 0 && n < (int)sizeof(line))
+			snprintf(line + n, sizeof(line) - n, "  (%d stall%s, %.0fs buffered)",
+				song_stalls, song_stalls == 1 ? "" : "s", cache_ahead > 0 ? cache_ahead : 0.0);
+		append_row(buf, &len, sizeof(buf), rows - 1, main_col, MAIN_ACCENT_BOLD, line, main_cols);
+
+		int bar_max = bar_cells(main_cols);
+		progress_cells = bar_max;
+		int filled = 0;
+		if (song_dur > 0)
+			filled = (int)(song_pos / song_dur * bar_max);
+		if (filled > bar_max) filled = bar_max;
+
+		appendf(buf, &len, sizeof(buf),
+			"\033[%d;%dH%s%d:%02d %s",
+			rows, main_col, MAIN_BASE, pm, ps, MAIN_ACCENT);
+		const float *wave = wave_bar(bar_max);
+		if (wave) {
+			/* played part in the accent colour, the rest dimmed */
+			append_spectrum(buf, &len, sizeof(buf), wave, filled);
+			appendf(buf, &len, sizeof(buf), "%s", MAIN_DIM);
+			append_spectrum(buf, &len, sizeof(buf), wave + filled, bar_max - filled);
+		}
+		for (int i = 0; i < bar_max && !wave; i++) {
+			if (i < filled)
+				append_repeat(buf, &len, sizeof(buf), '=', 1);
+			else if (i == filled)
+				append_repeat(buf, &len, sizeof(buf), '>', 1);
+			else
+				append_repeat(buf, &len, sizeof(buf), '-', 1);
+		}
+		appendf(buf, &len, sizeof(buf), "%s %d:%02d", MAIN_BASE, dm, ds);
+	} else if (!searching) {
+		/* attached clients detach with q and stop the daemon with Q */
+		const char *quit = client_mode ? "q:detach Q:quit" : "q:quit";
+		if (nsel > 0 && !sidebar_focused) {
+			snprintf(line, sizeof(line), "v:toggle V:range d:del a/A:queue p:add to playlist esc:clear %s", quit);
+		} else if (playlist_menu && sidebar_focused) {
+			snprintf(line, sizeof(line), "j/k:nav enter:apply spc:pause C-j/k:focus C-m:hide esc:hide %s", quit);
+		} else if (playlist_menu) {
+			snprintf(line, sizeof(line), "j/k:nav spc:play h/l:seek /:search C-j/k:focus C-m:hide %s", quit);
+		} else {
+			snprintf(line, sizeof(line), "j/k:nav spc:play/pause h/l:seek -/+:vol m:loop n:shuffle d:del esc:stop %s", quit);
+		}
+		append_row(buf, &len, sizeof(buf), rows, main_col, MAIN_DIM, line, main_cols);
+	}
+
+	if (searching) {
+		snprintf(line, sizeof(line), "/%s_", search_buf);
+		append_row(buf, &len, sizeof(buf), rows, main_col, MAIN_DIM, line, main_cols);
+	}
+
+	flush_buf(buf, &len);
+}
+
+/* Repaint the spectrum cells whose glyph changed since they were drawn
+ * (viz_drawn[]); used for ticks between full redraws. A run of changed
+ * cells shares one cursor move, and an unchanged bar writes nothing. */
+static void draw_spectrum(void) {
+	char buf[4096];
+	int len = 0, at = -1; /* column the cursor is at, -1 = not placed */
+	for (int b = 0; b < viz_width; b++) {
+		int g = spectrum_glyph(viz_level[b]);
+		if (g == viz_drawn[b]) continue;
+		if (at < 0)
+			appendf(buf, &len, sizeof(buf), "%s", MAIN_ACCENT);
+		if (at != b)
+			appendf(buf, &len, sizeof(buf), "\033[%d;%dH", viz_row, viz_col + b);
+		appendf(buf, &len, sizeof(buf), "%s", viz_glyphs[g]);
+		viz_drawn[b] = g;
+		at = b + 1;
+	}
+	if (at < 0) return;
+	appendf(buf, &len, sizeof(buf), "%s", MAIN_BASE);
+	flush_buf(buf, &len);
+}
+
+/* Open a 16-bit PCM WAV and leave f positioned at the first sample.
+ * Returns NULL (after printing why) for anything else. */
+static FILE *wav_open(const char *path, int *channels, int *rate, long *frames) {
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return NULL;
+	}
+	unsigned char hdr[12], ck[8];
+	int bits = 0;
+	long data_len = -1;
+	*channels = *rate = 0;
+	if (fread(hdr, 1, 12, f) != 12 || memcmp(hdr, "RIFF", 4) || memcmp(hdr + 8, "WAVE", 4)) {
+		fprintf(stderr, "%s: not a WAV file\n", path);
+		fclose(f);
+		return NULL;
+	}
+	while (fread(ck, 1, 8, f) == 8) {
+		long clen = ck[4] | ck[5] << 8 | ck[6] << 16 | (long)ck[7] << 24;
+		if (memcmp(ck, "fmt ", 4) == 0) {
+			unsigned char fmt[16];
+			if (clen < 16 || fread(fmt, 1, 16, f) != 16) break;
+			*channels = fmt[2] | fmt[3] << 8;
+			*rate = fmt[4] | fmt[5] << 8 | fmt[6] << 16 | fmt[7] << 24;
+			bits = fmt[14] | fmt[15] << 8;
+			fseek(f, clen - 16 + (clen & 1), SEEK_CUR);
+		} else if (memcmp(ck, "data", 4) == 0) {
+			data_len = clen;
+			break;
+		} else {
+			fseek(f, clen + (clen & 1), SEEK_CUR);
+		}
+	}
+	if (bits != 16 || *channels < 1 || *rate <= 0 || data_len < 0) {
+		fprintf(stderr, "%s: not 16-bit PCM\n", path);
+		fclose(f);
+		return NULL;
+	}
+	*frames = data_len / (2 * *channels);
+	return f;
+}
+
+/* --spectrum FILE.wav: analyse VIZ_N samples from the middle of a 16-bit
+ * PCM WAV and print the band row plus the index of the loudest band. */
+static int spectrum_file(const char *path, int nbands) {
+	int channels, rate;
+	long frames;
+	FILE *f = wav_open(path, &channels, &rate, &frames);
+	if (!f) return 1;
+	if (frames < VIZ_N) {
+		fprintf(stderr, "%s: need at least %d frames\n", path, VIZ_N);
+		fclose(f);
+		return 1;
+	}
+
+	float samples[VIZ_N];
+	fseek(f, (frames - VIZ_N) / 2 * 2 * channels, SEEK_CUR);
+	for (int n = 0; n < VIZ_N; n++) {
+		int acc = 0;
+		for (int c = 0; c < channels; c++) {
+			int lo = fgetc(f), hi = fgetc(f);
+			acc += (short)(lo | hi << 8);
+		}
+		samples[n] = (float)acc / channels / 32768.0f;
+	}
+	fclose(f);
+
+	if (nbands < 1) nbands = 1;
+	if (nbands > VIZ_MAX_BANDS) nbands = VIZ_MAX_BANDS;
+	float lv[VIZ_MAX_BANDS];
+	spectrum_bands(samples, rate, nbands, lv);
+
+	char buf[2048];
+	int len = 0, peak = 0;
+	append_spectrum(buf, &len, sizeof(buf), lv, nbands);
+	for (int b = 1; b < nbands; b++)
+		if (lv[b] > lv[peak]) peak = b;
+	appendf(buf, &len, sizeof(buf), "\npeak=%d\n", peak);
+	flush_buf(buf, &len);
+	return 0;
+}
+
+/* --loudness FILE.wav: run the R128 meter the analysis workers use directly
+ * on a mono or stereo 16-bit WAV, without a decoder subprocess. */
+static int loudness_file(const char *path) {
+	int channels, rate;
+	long frames;
+	FILE *f = wav_open(path, &channels, &rate, &frames);
+	if (!f) return 1;
+	if (channels > 2) {
+		fprintf(stderr, "%s: mono or stereo only\n", path);
+		fclose(f);
+		return 1;
+	}
+
+	struct loudness L;
+	loudness_init(&L, rate);
+	short pcm[4096];
+	float x[4096];
+	long left = frames;
+	while (left > 0) {
+		int want = (int)(sizeof(pcm) / sizeof(pcm[0]) / channels);
+		if (want > left) want = (int)left;
+		int n = (int)fread(pcm, 2 * channels, want, f);
+		if (n <= 0) break;
+		for (int i = 0; i < n * channels; i++) x[i] = pcm[i] / 32768.0f;
+		loudness_feed(&L, x, n, channels);
+		left -= n;
+	}
+	fclose(f);
+
+	float lufs, peak;
+	loudness_finish(&L, &lufs, &peak);
+	printf("lufs=%.1f peak=%.1f gain=%.1f\n", lufs, peak,
+		lufs <= -70.0f ? 0.0f : NORM_TARGET_LUFS - lufs);
+	return 0;
+}
+
+/* --features FILE.wav: compute the radio-mode features the analysis
+ * workers cache and print the readable ones and the vector. */
+static int features_file(const char *path) {
+	int channels, rate;
+	long frames;
+	FILE *f = wav_open(path, &channels, &rate, &frames);
+	if (!f) return 1;
+
+	struct featbuild *F = malloc(sizeof(*F));
+	if (!F) {
+		fclose(f);
+		return 1;
+	}
+	feat_init(F, rate);
+	short pcm[4096];
+	float x[4096];
+	long left = frames;
+	while (left > 0) {
+		int want = (int)(sizeof(pcm) / sizeof(pcm[0]) / channels);
+		if (want > left) want = (int)left;
+		int n = (int)fread(pcm, 2 * channels, want, f);
+		if (n <= 0) break;
+		for (int i = 0; i < n * channels; i++) x[i] = pcm[i] / 32768.0f;
+		feat_feed(F, x, n, channels);
+		left -= n;
+	}
+	fclose(f);
+
+	static const char *pitch[12] = {
+		"C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B",
+	};
+	float v[FEAT_DIM], bpm, centroid;
+	int ok = feat_finish(F, v, &bpm, &centroid);
+	free(F);
+	if (!ok) {
+		fprintf(stderr, "%s: no audio\n", path);
+		return 1;
+	}
+	int top = 0;
+	for (int i = 1; i < 12; i++)
+		if (v[4 + i] > v[4 + top]) top = i;
+	printf("tempo=%.1f centroid=%.0f chroma=%s\n", bpm, centroid, pitch[top]);
+	for (int i = 0; i < FEAT_DIM; i++)
+		printf("%s%.3f", i ? " " : "", v[i]);
+	printf("\n");
+	return 0;
+}
+
+/* --waveform FILE.wav [cols]: build the thumbnail the analysis workers
+ * cache and print it as one bar row. */
+static int waveform_file(const char *path, int cols) {
+	int channels, rate;
+	long frames;
+	FILE *f = wav_open(path, &channels, &rate, &frames);
+	if (!f) return 1;
+
+	struct wavebuild W;
+	wave_init(&W, rate);
+	short pcm[4096];
+	float x[4096];
+	long left = frames;
+	while (left > 0) {
+		int want = (int)(sizeof(pcm) / sizeof(pcm[0]) / channels);
+		if (want > left) want = (int)left;
+		int n = (int)fread(pcm, 2 * channels, want, f);
+		if (n <= 0) break;
+		for (int i = 0; i < n * channels; i++) x[i] = pcm[i] / 32768.0f;
+		wave_feed(&W, x, n, channels);
+		left -= n;
+	}
+	fclose(f);
+
+	unsigned char peak[WF_BUCKETS], rms[WF_BUCKETS];
+	if (!wave_finish(&W, peak, rms)) {
+		fprintf(stderr, "%s: no audio\n", path);
+		return 1;
+	}
+	if (cols < 1) cols = 1;
+	if (cols > WF_BUCKETS) cols = WF_BUCKETS;
+	float lv[WF_BUCKETS];
+	wave_levels(peak, cols, lv);
+
+	char buf[4096];
+	int len = 0;
+	append_spectrum(buf, &len, sizeof(buf), lv, cols);
+	appendf(buf, &len, sizeof(buf), "\n");
+	flush_buf(buf, &len);
+	return 0;
+}
+
+/* --duration FILE...: print what the header parsers make of each file. */
+static int duration_files(int argc, char **argv) {
+	int rc = 0;
+	for (int i = 0; i < argc; i++) {
+		double d = probe_duration(argv[i]);
+		if (d < 0) {
+			fprintf(stderr, "%s: unknown duration\n", argv[i]);
+			rc = 1;
+			continue;
+		}
+		printf("%.2f %s\n", d, argv[i]);
+	}
+	return rc;
+}
+
+/* Local file cache for a songs_dir on a slow mount, opt-in with
+ * SONG_CACHE_MB (byte budget) and SONG_CACHE_DIR (default cache/songs).
+ * A copy is named by the fnv1a of the song name and takes the source's
+ * mtime, so a source with another size or mtime reads as a miss. Hits
+ * set the copy's atime, which orders LRU eviction and survives restarts
+ * without an index file. Only the readahead thread adds and evicts. */
+static void fc_path(char *out, size_t size, unsigned long long hash) {
+	snprintf(out, size, "%s/%016llx", fc_dir, hash);
+}
+
+static int fc_find(unsigned long long hash) {
+	for (int i = 0; i < fc_n; i++)
+		if (fc_ents[i].hash == hash) return i;
+	return -1;
+}
+
+/* Drop entry i and its file. Caller holds fc_lock. */
+static void fc_drop(int i) {
+	char path[PATH_MAX];
+	fc_path(path, sizeof(path), fc_ents[i].hash);
+	unlink(path); /* a copy mpv still has open stays readable */
+	fc_bytes -= fc_ents[i].size;
+	fc_ents[i] = fc_ents[--fc_n];
+}
+
+/* Evict least recently used copies until need more bytes fit. */
+static void fc_evict(long long need) {
+	while (fc_n > 0 && fc_bytes + need > fc_budget) {
+		int lru = 0;
+		for (int i = 1; i < fc_n; i++)
+			if (fc_ents[i].used < fc_ents[lru].used) lru = i;
+		fc_drop(lru);
+	}
+}
+
+static void fc_add(unsigned long long hash, long long size) {
+	if (fc_n == fc_cap) {
+		int cap = fc_cap ? fc_cap * 2 : 64;
+		struct fc_entry *e = realloc(fc_ents, cap * sizeof(*e));
+		if (!e) return;
+		fc_ents = e;
+		fc_cap = cap;
+	}
+	fc_ents[fc_n++] = (struct fc_entry){ hash, size, wall_now() };
+	fc_bytes += size;
+}
+
+/* Index the cache directory; leftovers of interrupted copies go. Off
+ * under --replay, which copies no songs. */
+static void fc_open(void) {
+	const char *mb = getenv("SONG_CACHE_MB");
+	if (!mb || atoll(mb) <= 0 || replay_mode) return;
+	static char dir[PATH_MAX];
+	const char *env = getenv("SONG_CACHE_DIR");
+	if (env) {
+		snprintf(dir, sizeof(dir), "%s", env);
+	} else {
+		mkdir(cache_dir, 0755);
+		snprintf(dir, sizeof(dir), "%s/songs", cache_dir);
+	}
+	mkdir(dir, 0755);
+	DIR *d = opendir(dir);
+	if (!d) return;
+	fc_dir = dir;
+	fc_budget = atoll(mb) << 20;
+	int dfd = dirfd(d);
+	struct dirent *ent;
+	while ((ent = readdir(d))) {
+		struct stat st;
+		if (ent->d_name[0] == '.') {
+			if (strstr(ent->d_name, ".tmp")) unlinkat(dfd, ent->d_name, 0);
+			continue;
+		}
+		char *end;
+		unsigned long long hash = strtoull(ent->d_name, &end, 16);
+		if (*end || end - ent->d_name != 16) continue;
+		if (fstatat(dfd, ent->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode)) continue;
+		fc_add(hash, st.st_size);
+		fc_ents[fc_n - 1].used = st.st_atim.tv_sec + st.st_atim.tv_nsec / 1e9;
+	}
+	closedir(d);
+	fc_evict(0); /* the budget may have shrunk */
+}
+
+/* Whether the copy at cpath matches the source's size and mtime. */
+static int fc_valid(const char *cpath, const struct stat *src) {
+	struct stat st;
+	return stat(cpath, &st) == 0 && st.st_size == src->st_size &&
+		st.st_mtim.tv_sec == src->st_mtim.tv_sec &&
+		st.st_mtim.tv_nsec == src->st_mtim.tv_nsec;
+}
+
+/* Path to play songs[idx] from: the local copy when valid, else the
+ * source. Counts the hit or miss. */
+static int fc_lookup(int idx, char *out, size_t size) {
+	if (!fc_budget) return 0;
+	struct stat src;
+	char path[PATH_MAX + 1024];
+	snprintf(path, sizeof(path), "%s/%s", songs_dir, songs[idx]);
+	unsigned long long hash = fnv1a(songs[idx]);
+	fc_path(out, size, hash);
+	if (stat(path, &src) == 0 && fc_valid(out, &src)) {
+		struct timespec ts[2] = { { 0, UTIME_NOW }, { 0, UTIME_OMIT } };
+		utimensat(AT_FDCWD, out, ts, 0);
+		pthread_mutex_lock(&fc_lock);
+		int i = fc_find(hash);
+		if (i >= 0) fc_ents[i].used = wall_now();
+		pthread_mutex_unlock(&fc_lock);
+		fc_hits++;
+		return 1;
+	}
+	fc_misses++;
+	return 0;
+}
+
+/* Copy one song into the cache: copy_file_range, or sendfile where the
+ * filesystems can't share it, into a temp file renamed into place.
+ * Runs on the readahead thread. */
+static void fc_store(const char *name) {
+	char src[PATH_MAX + 1024], dst[PATH_MAX], tmp[PATH_MAX];
+	snprintf(src, sizeof(src), "%s/%s", songs_dir, name);
+	unsigned long long hash = fnv1a(name);
+	fc_path(dst, sizeof(dst), hash);
+	snprintf(tmp, sizeof(tmp), "%s/.%016llx.tmp", fc_dir, hash);
+
+	int in = open(src, O_RDONLY);
+	if (in < 0) return;
+	struct stat st, after;
+	if (fstat(in, &st) != 0 || st.st_size > fc_budget || fc_valid(dst, &st)) {
+		close(in);
+		return;
+	}
+	posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+	pthread_mutex_lock(&fc_lock);
+	int old = fc_find(hash);
+	if (old >= 0) fc_drop(old); /* stale copy of a changed source */
+	fc_evict(st.st_size);
+	pthread_mutex_unlock(&fc_lock);
+
+	int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0) {
+		close(in);
+		return;
+	}
+	off_t done = 0;
+	int use_sendfile = 0;
+	while (done < st.st_size) {
+		ssize_t n;
+		if (!use_sendfile) {
+			n = copy_file_range(in, NULL, out, NULL, st.st_size - done, 0);
+			if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+			              errno == EOPNOTSUPP)) {
+				use_sendfile = 1;
+				continue;
+			}
+		} else {
+			n = sendfile(out, in, NULL, st.st_size - done);
+		}
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) break;
+		done += n;
+	}
+	int ok = done == st.st_size && fstat(in, &after) == 0 &&
+		after.st_size == st.st_size && after.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+		after.st_mtim.tv_nsec == st.st_mtim.tv_nsec;
+	if (ok) {
+		struct timespec ts[2] = { { 0, UTIME_NOW }, st.st_mtim };
+		ok = futimens(out, ts) == 0;
+	}
+	close(in);
+	if (close(out) != 0) ok = 0;
+	if (!ok || rename(tmp, dst) != 0) {
+		unlink(tmp);
+		return;
+	}
+	pthread_mutex_lock(&fc_lock);
+	fc_add(hash, st.st_size);
+	pthread_mutex_unlock(&fc_lock);
+}
+
+/* Readahead: one background thread works through two request slots, the
+ * song that just started (to cache it) and the one predicted next. With
+ * the file cache on both are copied into it; otherwise the upcoming track
+ * is read through once (after POSIX_FADV_WILLNEED) so a spun-down disk or
+ * NAS is awake and the file is in the page cache before the transition.
+ * A newer request replaces one in the same slot not yet started. */
+#define PREFETCH_MAX (256 << 20)
+
+static pthread_mutex_t pf_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pf_cond = PTHREAD_COND_INITIALIZER;
+static char *pf_played;            /* song name to cache, NULL = none */
+static char *pf_next;              /* upcoming song name, NULL = none */
+static int pf_running = 0;
+static unsigned long long pf_hash; /* fnv1a of the last upcoming song */
+
+static void pf_read(const char *name) {
+	static char chunk[1 << 20];
+	char path[PATH_MAX + 1024];
+	snprintf(path, sizeof(path), "%s/%s", songs_dir, name);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	long long total = 0;
+	ssize_t r;
+	while (total < PREFETCH_MAX && (r = read(fd, chunk, sizeof(chunk))) > 0)
+		total += r;
+	close(fd);
+}
+
+static void *pf_worker(void *arg) {
+	(void)arg;
+	for (;;) {
+		pthread_mutex_lock(&pf_lock);
+		while (!pf_played && !pf_next) pthread_cond_wait(&pf_cond, &pf_lock);
+		char **slot = pf_played ? &pf_played : &pf_next;
+		char *name = *slot;
+		*slot = NULL;
+		pthread_mutex_unlock(&pf_lock);
+
+		if (fc_budget) {
+			fc_store(name);
+			loop_wake(); /* new cache counts for the stats panel */
+		} else {
+			pf_read(name);
+		}
+		free(name);
+	}
+	return NULL;
+}
+
+static void pf_request(char **slot, int idx) {
+	pthread_mutex_lock(&pf_lock);
+	if (!pf_running) {
+		pthread_t t;
+		if (pthread_create(&t, NULL, pf_worker, NULL) == 0) {
+			pthread_detach(t);
+			pf_running = 1;
+		}
+	}
+	free(*slot);
+	*slot = strdup(songs[idx]);
+	pthread_cond_signal(&pf_cond);
+	pthread_mutex_unlock(&pf_lock);
+}
+
+/* Launch mpv on songs[idx] with nothing else playing in this zone;
+ * silent while a crossfade ramps it up. */
+static void mpv_start(int idx) {
+	char path[PATH_MAX];
+	int cached = fc_lookup(idx, path, sizeof(path));
+	if (!cached)
+		snprintf(path, sizeof(path), "%s/%s", songs_dir, songs[idx]);
+
+	char vol_arg[32];
+	snprintf(vol_arg, sizeof(vol_arg), "--volume=%d", xf_tfd >= 0 ? 0 : volume);
+
+	/* per-track gain from the loudness cache; never wait for analysis */
+	float gain = norm_gain(idx);
+	char viz_af[4096], af_arg[4160];
+	int tap = viz_enabled && zone_cur == zone_view && viz_filter(viz_af, sizeof(viz_af));
+	int afn = snprintf(af_arg, sizeof(af_arg), "--af=%s", tap ? viz_af : "");
+	if (gain != 0)
+		snprintf(af_arg + afn, sizeof(af_arg) - afn, "%s@norm:lavfi=[volume=%.2fdB]",
+			tap ? "," : "", gain);
+	if (isnan(meta_lufs[idx]))
+		an_prioritize(idx);
+
+	/* keep the readahead earlier stalls asked for */
+	char cache_arg[48];
+	snprintf(cache_arg, sizeof(cache_arg), "--demuxer-readahead-secs=%d", cache_secs);
+
+	char ipc_arg[160];
+	snprintf(ipc_arg, sizeof(ipc_arg), "--input-ipc-server=%s", mpv_socket);
+
+	char *argv[10] = { "mpv", "--no-video", "--no-terminal", ipc_arg, vol_arg };
+	int argc = 5;
+	if (tap || gain != 0) argv[argc++] = af_arg;
+	if (cache_secs > 0) {
+		argv[argc++] = "--cache=yes";
+		argv[argc++] = cache_arg;
+	}
+	argv[argc++] = path;
+	argv[argc] = NULL;
+
+	pid_t pid = fork();
+	if (pid == 0 && replay_mode) {
+		/* --replay plays nothing: a silent stand-in until kill_mpv() */
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGQUIT, SIG_DFL);
+		for (;;) pause();
+	} else if (pid == 0) {
+		/* detach from terminal completely */
+		freopen("/dev/null", "r", stdin);
+		freopen("/dev/null", "w", stdout);
+		freopen("/dev/null", "w", stderr);
+		execvp("mpv", argv);
+		_exit(1);
+	} else if (pid > 0) {
+		mpv_pid = pid;
+		playing = idx;
+		paused = 0;
+		pos_stamp = mono_now();
+		song_stalls = 0;
+		cache_waiting = 0;
+		cache_ahead = -1;
+		norm_live = (gain != 0);
+		norm_applied = gain;
+		viz_live = tap;
+		if (fc_budget && !cached) pf_request(&pf_played, idx);
+		if (!hist_resuming) {
+			meta_plays[idx]++;
+			meta_last[idx] = wall_now();
+			meta_changed |= (1u << F_PLAYS) | (1u << F_PLAYED);
+			history_log(HIST_PLAY, idx, 0);
+		}
+	}
+}
+
+static void play_song(int idx) {
+	if (playing >= 0 && mpv_pid > 0)
+		history_log(HIST_SKIP, playing, song_pos);
+	kill_mpv();
+	mpv_start(idx);
+}
+
+static int shuffle_pick = -1; /* next shuffle choice, drawn early for readahead */
+static int radio_from = -1, radio_pick = -1; /* radio choice after radio_from */
+
+/* The list the current zone plays through: the one on screen for the
+ * zone the keys control, its own copy for the others. */
+static int play_len(void) {
+	return zone_cur == zone_view ? display_len() : zones[zone_cur].nlist;
+}
+
+static int play_at(int pos) {
+	return zone_cur == zone_view ? song_at(pos) : zones[zone_cur].list[pos];
+}
+
+/* Position of the entry after songs[prev] in that list, wrapping; 0 when
+ * prev is not in it, -1 when the list is empty. A zone off screen starts
+ * looking where it last played from. */
+static int play_after(int prev) {
+	int len = play_len();
+	if (len == 0) return -1;
+	int pos = zone_cur == zone_view ? -1 : zones[zone_cur].list_pos;
+	if (pos < 0 || pos >= len || play_at(pos) != prev)
+		for (pos = 0; pos < len && play_at(pos) != prev; pos++) {}
+	return pos + 1 < len ? pos + 1 : 0;
+}
+
+/* The zone leaving the screen keeps the list it was playing through. */
+static void zone_keep_list(struct zone *z) {
+	int len = display_len();
+	int *list = realloc(z->list, (len ? len : 1) * sizeof(*list));
+	if (!list) {
+		z->nlist = 0;
+		return;
+	}
+	z->list = list;
+	z->list_pos = -1;
+	for (int i = 0; i < len; i++) {
+		list[i] = song_at(i);
+		if (list[i] == z->playing && z->list_pos < 0) z->list_pos = i;
+	}
+	z->nlist = len;
+}
+
+static void shuffle_clear(void) {
+	memset(played, 0, sizeof(zone_played[0]));
+	nplayed = 0;
+	shuffle_pick = -1;
+}
+
+static void shuffle_mark(int idx) {
+	if (!bit_get(played, idx)) {
+		played[idx >> 6] |= 1ull << (idx & 63);
+		nplayed++;
+	}
+	if (nplayed >= play_len())
+		shuffle_clear();
+}
+
+static int shuffle_next(void) {
+	int len = play_len();
+	int avail = 0;
+	for (int i = 0; i < len; i++)
+		if (!bit_get(played, play_at(i)))
+			avail++;
+	if (avail <= 0) {
+		shuffle_clear();
+		avail = len;
+	}
+	int pick = rand() % avail;
+	int count = 0;
+	for (int i = 0; i < len; i++) {
+		if (!bit_get(played, play_at(i))) {
+			if (count == pick)
+				return play_at(i);
+			count++;
+		}
+	}
+	return play_at(0);
+}
+
+/* Whether the pre-drawn shuffle choice is still unplayed and listed. */
+static int shuffle_pick_ok(void) {
+	return shuffle_pick >= 0 && shuffle_pick < nsongs && !bit_get(played, shuffle_pick) &&
+		play_len() > 0 && (zone_cur != zone_view ||
+		song_at(find_in_display(shuffle_pick)) == shuffle_pick);
+}
+
+/* Next shuffle song: the one readahead already saw, if still valid. */
+static int shuffle_take(void) {
+	int next = shuffle_pick_ok() ? shuffle_pick : shuffle_next();
+	shuffle_pick = -1;
+	return next;
+}
+
+/* Radio mode (r): when a song ends with the queue empty, the next one is
+ * its nearest neighbour over the whole library by squared Euclidean
+ * distance, scanned from feat_lanes sixteen songs at a time. Songs played
+ * within RADIO_REPLAY_SECS are passed over; when that leaves none, the
+ * one played longest ago goes next. Songs not analysed yet are not
+ * candidates, and one without a vector itself falls back to the normal
+ * order. */
+#define RADIO_REPLAY_SECS (4 * 3600)
+
+typedef int8_t v16qi __attribute__((vector_size(16)));
+typedef int16_t v16hi __attribute__((vector_size(32)));
+typedef uint16_t v16hu __attribute__((vector_size(32)));
+typedef uint32_t v16su __attribute__((vector_size(64)));
+
+static int radio_nearest(int from) {
+	if (from < 0 || from >= nsongs || !(feat_have[from / 16] >> (from % 16) & 1)) return -1;
+	double t0 = real_now();
+	int16_t q[FEAT_DIM];
+	for (int k = 0; k < FEAT_DIM; k++) q[k] = feat_lanes[from / 16][k][from % 16];
+	long long fresh = (long long)wall_now() - RADIO_REPLAY_SECS;
+	int best = -1, seen = -1; /* from itself is not a candidate */
+	uint32_t best_d = UINT32_MAX;
+	for (int b = 0; b < (nsongs + 15) / 16; b++) {
+		unsigned have = feat_have[b];
+		if (16 * b + 16 > nsongs) have &= (1u << (nsongs - 16 * b)) - 1;
+		seen += __builtin_popcount(have);
+		if (!have) continue;
+		/* two dimensions at a time: each squared difference is at most
+		 * (2 * FEAT_QMAX)^2, so a pair still fits 16 bits unsigned */
+		v16su acc = { 0 };
+		for (int k = 0; k < FEAT_DIM; k += 2) {
+			v16qi x0, x1;
+			memcpy(&x0, feat_lanes[b][k], sizeof(x0));
+			memcpy(&x1, feat_lanes[b][k + 1], sizeof(x1));
+			v16hi d0 = __builtin_convertvector(x0, v16hi) - q[k];
+			v16hi d1 = __builtin_convertvector(x1, v16hi) - q[k + 1];
+			acc += __builtin_convertvector((v16hu)(d0 * d0) + (v16hu)(d1 * d1), v16su);
+		}
+		for (int l = 0; l < 16; l++) {
+			int i = 16 * b + l;
+			if (acc[l] < best_d && (have >> l & 1) && i != from && meta_last[i] <= fresh) {
+				best_d = acc[l];
+				best = i;
+			}
+		}
+	}
+	if (best < 0) {
+		for (int i = 0; i < nsongs; i++)
+			if ((feat_have[i / 16] >> (i % 16) & 1) && i != from &&
+			    (best < 0 || meta_last[i] < meta_last[best]))
+				best = i;
+	}
+	radio_ms = (real_now() - t0) * 1000;
+	radio_seen = seen;
+	return best;
+}
+
+/* The radio choice after songs[from], searched once per song so
+ * readahead and the transition agree. -1 = use the normal order. */
+static int radio_next(int from) {
+	if (!radio || from < 0) return -1;
+	if (radio_from != from) {
+		radio_pick = radio_nearest(from);
+		radio_from = from;
+	}
+	return radio_pick;
+}
+
+/* The song check_child() will start when the current one ends, without
+ * side effects (a shuffle choice is drawn once and kept). */
+static int upcoming_song(void) {
+	if (queue_len > 0) return queue_at(0);
+	if (loop_mode == LOOP_SINGLE) return playing;
+	if (radio_next(playing) >= 0) return radio_pick;
+	if (play_len() == 0) return -1;
+	if (shuffle) {
+		if (!shuffle_pick_ok()) shuffle_pick = shuffle_next();
+		return shuffle_pick;
+	}
+	return play_at(play_after(playing));
+}
+
+/* Start reading the upcoming track once the playing one enters its last
+ * PREFETCH_LEAD seconds, or at once when its length is unknown. */
+#define PREFETCH_LEAD 45
+
+static void prefetch_tick(void) {
+	if (playing < 0 || mpv_pid <= 0) return;
+	if (song_dur > 0 && song_dur - song_pos > PREFETCH_LEAD) return;
+	int next = upcoming_song();
+	if (next < 0 || next == playing) return;
+	unsigned long long h = fnv1a(songs[next]);
+	if (h == pf_hash) return;
+	pf_hash = h;
+	pf_request(&pf_next, next);
+}
+
+/* Park the playback globals in zones[zone_cur]. */
+static void zone_store(void) {
+	struct zone *z = &zones[zone_cur];
+	z->mpv_pid = mpv_pid;
+	z->mpv_fd = mpv_fd;
+	z->playing = playing;
+	z->paused = paused;
+	z->volume = volume;
+	z->loop_mode = loop_mode;
+	z->shuffle = shuffle;
+	z->song_pos = song_pos;
+	z->song_dur = song_dur;
+	z->pos_stamp = pos_stamp;
+	z->played = played;
+	z->nplayed = nplayed;
+	z->shuffle_pick = shuffle_pick;
+	z->radio_from = radio_from;
+	z->radio_pick = radio_pick;
+	z->queue_buf = queue_buf;
+	z->queue_cap = queue_cap;
+	z->queue_head = queue_head;
+	z->queue_len = queue_len;
+	z->cache_waiting = cache_waiting;
+	z->song_stalls = song_stalls;
+	z->cache_ahead = cache_ahead;
+	z->seek_dirty = seek_dirty;
+	z->seek_inflight = seek_inflight;
+	z->seek_target = seek_target;
+	z->volume_dirty = volume_dirty;
+	z->volume_inflight = volume_inflight;
+	z->norm_live = norm_live;
+	z->viz_live = viz_live;
+	z->norm_applied = norm_applied;
+	z->pf_hash = pf_hash;
+	z->mpv_socket = mpv_socket;
+	z->xf_pid = xf_pid;
+	z->xf_fd = xf_fd;
+	z->xf_tfd = xf_tfd;
+	z->xf_socket = xf_socket;
+	z->xf_t0 = xf_t0;
+	z->xf_len = xf_len;
+	z->xf_ticks = xf_ticks;
+}
+
+static void zone_load(int i) {
+	struct zone *z = &zones[i];
+	zone_cur = i;
+	mpv_socket = z->mpv_socket;
+	mpv_pid = z->mpv_pid;
+	mpv_fd = z->mpv_fd;
+	playing = z->playing;
+	paused = z->paused;
+	volume = z->volume;
+	loop_mode = z->loop_mode;
+	shuffle = z->shuffle;
+	song_pos = z->song_pos;
+	song_dur = z->song_dur;
+	pos_stamp = z->pos_stamp;
+	played = z->played;
+	nplayed = z->nplayed;
+	shuffle_pick = z->shuffle_pick;
+	radio_from = z->radio_from;
+	radio_pick = z->radio_pick;
+	queue_buf = z->queue_buf;
+	queue_cap = z->queue_cap;
+	queue_head = z->queue_head;
+	queue_len = z->queue_len;
+	cache_waiting = z->cache_waiting;
+	song_stalls = z->song_stalls;
+	cache_ahead = z->cache_ahead;
+	seek_dirty = z->seek_dirty;
+	seek_inflight = z->seek_inflight;
+	seek_target = z->seek_target;
+	volume_dirty = z->volume_dirty;
+	volume_inflight = z->volume_inflight;
+	norm_live = z->norm_live;
+	viz_live = z->viz_live;
+	norm_applied = z->norm_applied;
+	pf_hash = z->pf_hash;
+	xf_pid = z->xf_pid;
+	xf_fd = z->xf_fd;
+	xf_tfd = z->xf_tfd;
+	xf_socket = z->xf_socket;
+	xf_t0 = z->xf_t0;
+	xf_len = z->xf_len;
+	xf_ticks = z->xf_ticks;
+}
+
+static void zone_switch(int z) {
+	if (z == zone_cur || z < 0 || z >= nzones) return;
+	zone_store();
+	zone_load(z);
+}
+
+/* Name the zones from MUSIC_PLAYER_ZONES ("kitchen,den"; one unnamed
+ * zone without it) and give each an mpv socket of its own. Zones after
+ * the first start stopped, at the first one's volume. */
+static void zones_init(void) {
+	const char *env = getenv("MUSIC_PLAYER_ZONES");
+	nzones = 0;
+	while (env && *env && nzones < MAX_ZONES) {
+		size_t n = strcspn(env, ",");
+		if (n > 0) {
+			struct zone *z = &zones[nzones++];
+			snprintf(z->name, sizeof(z->name), "%.*s", (int)n, env);
+		}
+		env += n + (env[n] == ',');
+	}
+	if (nzones == 0) nzones = 1;
+	for (int i = 0; i < nzones; i++) {
+		for (int slot = 0; slot < 2; slot++)
+			snprintf(zones[i].socket[slot], sizeof(zones[i].socket[slot]), MPV_SOCKET,
+				run_dir, (int)getpid(), i, slot);
+		zones[i].mpv_socket = zones[i].socket[0];
+	}
+	played = zone_played[0];
+	zone_store();
+	for (int i = 1; i < nzones; i++) {
+		struct zone *z = &zones[i];
+		z->mpv_pid = -1;
+		z->mpv_fd = -1;
+		z->xf_pid = -1;
+		z->xf_fd = -1;
+		z->xf_tfd = -1;
+		z->playing = -1;
+		z->volume = volume;
+		z->loop_mode = LOOP_ALL;
+		z->played = zone_played[i];
+		z->shuffle_pick = -1;
+		z->radio_from = -1;
+		z->cache_ahead = -1;
+	}
+}
+
+/* songs[] rows moved (old -> new through remap, -1 = gone): follow them
+ * in every zone's playing song and queue, the index, the playlist and
+ * filter lists and the built sort orders. */
+static void songs_remapped(const int *remap, int old_n) {
+	meta_changed = ~0u;
+	for (int z = 0; z < nzones; z++) {
+		zone_switch(z);
+		if (playing >= 0) playing = remap[playing];
+		queue_remap(remap);
+		remap_list(zones[z].list, &zones[z].nlist, remap);
+		zones[z].list_pos = -1;
+		/* clear shuffle state — indices are invalidated */
+		shuffle_clear();
+		radio_from = -1;
+	}
+	zone_switch(zone_view);
+	song_index_rebuild();
+	view_gen++;
+
+	remap_list(playlist_songs, &nplaylist_songs, remap);
+	remap_list(filtered, &nfiltered, remap);
+	sort_remap(remap, old_n);
+}
+
+/* Move every song whose bit is set in mask to the trash and compact
+ * songs[], the metadata columns, the selection and every index list in a
+ * single pass through an old -> new remap. Renames go through two
+ * directory fds opened once for the batch. */
+static void remove_songs(const uint64_t *mask) {
+	static int remap[MAX_SONGS];
+
+	/* stop playback in any zone whose song goes */
+	for (int z = 0; z < nzones; z++) {
+		zone_switch(z);
+		if (playing >= 0 && bit_get(mask, playing))
+			kill_mpv();
+	}
+	zone_switch(zone_view);
+	sort_finish();
+	int old_n = nsongs;
+
+	/* --replay drops them from the list and leaves the files */
+	if (!replay_mode) mkdir(trash_dir, 0755);
+	int sfd = replay_mode ? -1 : open(songs_dir, O_RDONLY | O_DIRECTORY);
+	int tfd = replay_mode ? -1 : open(trash_dir, O_RDONLY | O_DIRECTORY);
+	int w = 0;
+	nselected = 0;
+	for (int i = 0; i < nsongs; i++) {
+		/* mask may be sel_bits itself: read both before clearing */
+		int gone = bit_get(mask, i), sel = bit_get(sel_bits, i);
+		sel_bits[i >> 6] &= ~(1ull << (i & 63));
+		if (!gone) {
+			/* w <= i, and bit w was read on an earlier iteration */
+			remap[i] = w;
+			songs[w] = songs[i];
+			meta_move(w, i);
+			if (sel) {
+				sel_bits[w >> 6] |= 1ull << (w & 63);
+				nselected++;
+			}
+			w++;
+			continue;
+		}
+		if (sfd >= 0 && tfd >= 0)
+			renameat(sfd, songs[i], tfd, songs[i]);
+		free(meta_artist[i]);
+		free(meta_title[i]);
+		free(songs[i]);
+		remap[i] = -1;
+	}
+	if (sfd >= 0) close(sfd);
+	if (tfd >= 0) close(tfd);
+
+	nsongs = w;
+	songs_remapped(remap, old_n);
+	if (playlist_active >= 0 && playlist_active == dup_view)
+		load_playlist(dup_view); /* regroup what is left */
+
+	/* clamp cursor to valid range */
+	if (cursor >= display_len()) cursor = display_len() - 1;
+	if (cursor < 0) cursor = 0;
+	visual_anchor = -1;
+}
+
+static int song_name_cmp(const void *a, const void *b) {
+	return strcmp(songs[*(const int *)a], songs[*(const int *)b]);
+}
+
+/* The streaming scan appends songs[] in directory order; once the last
+ * batch is in, put it in name order (what scan_songs() gives) and move
+ * the selection, the cursor's song and every index list along. */
+static void songs_sort(void) {
+	static int order[MAX_SONGS], remap[MAX_SONGS];
+	static uint64_t sel[(MAX_SONGS + 63) / 64];
+	int moved = 0;
+	for (int i = 0; i < nsongs; i++) order[i] = i;
+	qsort(order, nsongs, sizeof(order[0]), song_name_cmp);
+	for (int i = 0; i < nsongs; i++) {
+		remap[order[i]] = i;
+		moved |= order[i] != i;
+	}
+	if (!moved) return;
+
+	sort_finish();
+	/* a cursor still on the first row stays at the top */
+	int keep = (cursor > 0 && cursor < display_len()) ? song_at(cursor) : -1;
+	meta_permute(order, nsongs);
+	memcpy(sel, sel_bits, sizeof(sel));
+	memset(sel_bits, 0, sizeof(sel_bits));
+	for (int i = 0; i < nsongs; i++)
+		if (bit_get(sel, order[i])) sel_bits[i >> 6] |= 1ull << (i & 63);
+	if (delete_pending >= 0) delete_pending = remap[delete_pending];
+	state_text_song = -1;
+	songs_remapped(remap, nsongs);
+	if (filter_active) apply_filter(); /* filtered[] follows songs[] order */
+	if (keep >= 0) cursor = find_in_display(remap[keep]);
+	visual_anchor = -1;
+}
+
+static void remove_song(int rm) {
+	static uint64_t one[(MAX_SONGS + 63) / 64];
+	one[rm >> 6] = 1ull << (rm & 63);
+	remove_songs(one);
+	one[rm >> 6] = 0;
+}
+
+/* Append songs to the .playlist under the sidebar cursor with a single
+ * write; reloads it when it is the active one. */
+static void playlist_append(const int *idx, int n) {
+	if (playlist_cursor < 1 || playlist_kind[playlist_cursor - 1] != PL_FILE || n == 0)
+		return;
+	if (replay_mode) return; /* --replay leaves playlists alone */
+	int pl = playlist_cursor - 1;
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s.playlist", playlists_dir, playlists[pl]);
+	int fd = open(path, O_RDWR | O_APPEND);
+	if (fd < 0) return;
+
+	size_t cap = 1, len = 0;
+	for (int i = 0; i < n; i++) cap += strlen(songs[idx[i]]) + 1;
+	char *buf = malloc(cap);
+	if (!buf) {
+		close(fd);
+		return;
+	}
+	/* keep the last existing line intact */
+	char last;
+	off_t end = lseek(fd, 0, SEEK_END);
+	if (end > 0 && pread(fd, &last, 1, end - 1) == 1 && last != '\n')
+		buf[len++] = '\n';
+	for (int i = 0; i < n; i++) {
+		size_t l = strlen(songs[idx[i]]);
+		memcpy(buf + len, songs[idx[i]], l);
+		len += l;
+		buf[len++] = '\n';
+	}
+	if (write(fd, buf, len) < 0) { /* playlist unchanged */ }
+	free(buf);
+	close(fd);
+	if (playlist_active == pl) {
+		int keep = song_at(cursor);
+		load_playlist(pl);
+		if (filter_active) apply_filter();
+		cursor = find_in_display(keep);
+	}
+}
+
+/* Songs a batch key applies to: the selection when there is one (which
+ * the key consumes), else the song under the cursor. */
+static int batch_targets(const int **out) {
+	static int idx[MAX_SONGS];
+	*out = idx;
+	if (nselected > 0 || visual_anchor >= 0) {
+		sel_commit();
+		int n = sel_collect(idx);
+		sel_clear();
+		return n;
+	}
+	if (display_len() == 0) return 0;
+	idx[0] = song_at(cursor);
+	return 1;
+}
+
+/* What plays once prev ends: the queue head, prev again under
+ * LOOP_SINGLE, the radio choice, a shuffle pick or the next song in the
+ * zone's list (-1 when that is empty). Consumes the queue entry or
+ * shuffle pick. */
+static int next_song(int prev) {
+	if (queue_len > 0) {
+		int next = queue_pop_front();
+		if (shuffle) shuffle_mark(next);
+		return next;
+	}
+	if (loop_mode == LOOP_SINGLE)
+		return prev;
+	if (radio_next(prev) >= 0)
+		return radio_pick;
+	if (play_len() == 0) return -1;
+	if (shuffle) {
+		int next = shuffle_take();
+		shuffle_mark(next);
+		return next;
+	}
+	int pos = play_after(prev);
+	zones[zone_cur].list_pos = pos;
+	return play_at(pos);
+}
+
+static void check_child(void) {
+	if (mpv_pid > 0) {
+		int status;
+		pid_t ret = waitpid(mpv_pid, &status, WNOHANG);
+		if (ret == mpv_pid) {
+			int prev = playing;
+			history_log(HIST_DONE, prev, song_pos);
+			mpv_pid = -1;
+			paused = 0;
+			playing = -1;
+			song_pos = 0;
+			song_dur = 0;
+			/* auto-play based on mode */
+			int next = prev >= 0 ? next_song(prev) : -1;
+			if (next >= 0) play_song(next);
+		}
+	}
+}
+
+/* Crossfade: crossfade_secs before the end, the next song starts silent
+ * on the zone's other socket slot and the playing one becomes the
+ * outgoing instance. A CLOCK_MONOTONIC timerfd then fires every
+ * XF_STEP_MS, independent of the UI tick, and each step sets both
+ * volumes on an equal-power curve. When the ramp is done the outgoing mpv
+ * is retired. Tracks shorter than two fades are cut as before. Each step
+ * records how late it ran against its schedule (xf_late). */
+#define XF_STEP_MS 25
+
+static void xfade_begin(int next) {
+	history_log(HIST_DONE, playing, song_pos);
+	int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	struct itimerspec its = {
+		.it_interval = { 0, XF_STEP_MS * 1000000L },
+		.it_value = { 0, XF_STEP_MS * 1000000L },
+	};
+	if (tfd < 0 || timerfd_settime(tfd, 0, &its, NULL) != 0) {
+		if (tfd >= 0) close(tfd);
+		kill_mpv(); /* no timer, no fade: a plain cut */
+		mpv_start(next);
+		return;
+	}
+	xf_pid = mpv_pid;
+	xf_fd = mpv_fd;
+	xf_socket = mpv_socket;
+	xf_tfd = tfd;
+	xf_t0 = mono_now();
+	xf_len = crossfade_secs;
+	xf_ticks = 0;
+	xf_steps = 0;
+	xf_late = 0;
+
+	mpv_socket = mpv_socket == zones[zone_cur].socket[0] ?
+		zones[zone_cur].socket[1] : zones[zone_cur].socket[0];
+	mpv_pid = -1;
+	mpv_fd = -1;
+	viz_reset();
+	song_pos = 0;
+	song_dur = 0;
+	ipc_reset();
+	unlink(mpv_socket);
+	mpv_start(next);
+}
+
+/* End the ramp now: the outgoing mpv goes, the new one at full volume. */
+static void xfade_finish(void) {
+	if (xf_tfd < 0) return;
+	xfade_retire();
+	char cmd[96];
+	snprintf(cmd, sizeof(cmd), "{\"command\":[\"set_property\",\"volume\",%d]}\n", volume);
+	mpv_cmd(cmd);
+}
+
+static void xfade_step(void) {
+	uint64_t n;
+	if (read(xf_tfd, &n, sizeof(n)) != sizeof(n)) return;
+	double now = mono_now();
+	xf_ticks += n;
+	double late = (now - xf_t0 - xf_ticks * (XF_STEP_MS / 1000.0)) * 1000;
+	if (late > xf_late) xf_late = late;
+	xf_steps++;
+
+	double f = (now - xf_t0) / xf_len;
+	if (f >= 1) {
+		xfade_finish();
+		return;
+	}
+	char cmd[96];
+	snprintf(cmd, sizeof(cmd), "{\"command\":[\"set_property\",\"volume\",%.1f]}\n",
+		volume * sin(f * M_PI / 2));
+	mpv_cmd(cmd);
+
+	if (xf_pid > 0 && waitpid(xf_pid, NULL, WNOHANG) == xf_pid) {
+		xf_pid = -1; /* ran out before the ramp did */
+		unlink(xf_socket);
+	}
+	if (xf_pid <= 0) return;
+	if (xf_fd < 0) xf_fd = ipc_open(xf_socket);
+	snprintf(cmd, sizeof(cmd), "{\"command\":[\"set_property\",\"volume\",%.1f]}\n",
+		volume * cos(f * M_PI / 2));
+	if (xf_fd >= 0 && write(xf_fd, cmd, strlen(cmd)) < 0) {
+		close(xf_fd);
+		xf_fd = -1;
+	}
+}
+
+/* Start a crossfade once the playing song is within crossfade_secs of
+ * its end. */
+static void xfade_tick(void) {
+	if (crossfade_secs <= 0 || xf_tfd >= 0 || mpv_pid <= 0 || paused || playing < 0) return;
+	if (song_dur < 2 * crossfade_secs || song_dur - interp_pos() > crossfade_secs) return;
+	xfade_begin(next_song(playing));
+}
+
+/* The ramp timers of every zone, for the caller's poll(). */
+static int xfade_pollfds(struct pollfd *pfd, int *owner) {
+	zone_store();
+	int n = 0;
+	for (int z = 0; z < nzones; z++) {
+		if (zones[z].xf_tfd < 0) continue;
+		pfd[n] = (struct pollfd){ .fd = zones[z].xf_tfd, .events = POLLIN };
+		owner[n++] = z;
+	}
+	return n;
+}
+
+static void xfade_dispatch(const struct pollfd *pfd, const int *owner, int n) {
+	for (int i = 0; i < n; i++) {
+		if (!(pfd[i].revents & POLLIN)) continue;
+		zone_switch(owner[i]);
+		if (xf_tfd >= 0) xfade_step();
+	}
+	zone_switch(zone_view);
+}
+
+/* Reap, advance and poll the zones nobody is looking at. */
+static void zones_background(int tick) {
+	for (int z = 0; z < nzones; z++) {
+		if (z == zone_view) continue;
+		zone_switch(z);
+		check_child();
+		if (tick && mpv_pid > 0) {
+			update_position();
+			xfade_tick();
+			prefetch_tick();
+		}
+	}
+	zone_switch(zone_view);
+}
+
+/* Sleep timer: z cycles it through off and SLEEP_STEPS minutes, and
+ * SLEEP_MINUTES sets it at startup. Over its last SLEEP_FADE_SECS (at most
+ * half the timer) every zone's mpv is turned down in SLEEP_STEP_MS steps
+ * from the loop's scheduler, then playback stops. The volume setting is
+ * never touched, so the next song plays at the usual level. */
+#define SLEEP_FADE_SECS 10
+#define SLEEP_STEP_MS 100
+static const int sleep_steps[] = { 15, 30, 60 };
+
+/* Every zone's mpv to volume * gain, or stopped when gain is 0. */
+static void sleep_apply(double gain) {
+	for (int z = 0; z < nzones; z++) {
+		zone_switch(z);
+		if (mpv_pid <= 0) continue;
+		if (gain <= 0) {
+			kill_mpv();
+			continue;
+		}
+		xfade_finish();
+		char cmd[96];
+		snprintf(cmd, sizeof(cmd), "{\"command\":[\"set_property\",\"volume\",%.1f]}\n",
+			volume * gain);
+		mpv_cmd(cmd);
+	}
+	zone_switch(zone_view);
+}
+
+static void sleep_set(double secs) {
+	if (sleep_fading) sleep_apply(1); /* called off mid-fade */
+	sleep_fading = 0;
+	sleep_at = secs > 0 ? mono_now() + secs : 0;
+	sleep_fade = secs / 2 < SLEEP_FADE_SECS ? secs / 2 : SLEEP_FADE_SECS;
+}
+
+static void sleep_cycle(void) {
+	int n = sizeof(sleep_steps) / sizeof(sleep_steps[0]);
+	double left = sleep_at > 0 ? sleep_at - mono_now() : 0;
+	int i = 0;
+	/* the first step above what is left, or off after the last */
+	while (i < n && left > 0 && sleep_steps[i] * 60 <= left + 1) i++;
+	sleep_set(i < n ? sleep_steps[i] * 60 : 0);
+}
+
+/* When the sleep timer next needs the loop: the fade's start or next
+ * step, the end, or the next change of the status line countdown. */
+static double sleep_due(void) {
+	if (sleep_at <= 0) return 0;
+	double now = mono_now();
+	double left = sleep_at - now;
+	double due = sleep_at - sleep_fade;
+	if (now >= due) return now + SLEEP_STEP_MS / 1000.0 < sleep_at ?
+		now + SLEEP_STEP_MS / 1000.0 : sleep_at;
+	double shown = left > 60 ? (ceil(left / 60) - 1) * 60 : ceil(left) - 1;
+	return sleep_at - shown < due ? sleep_at - shown : due;
+}
+
+static void sleep_tick(void) {
+	if (sleep_at <= 0) return;
+	double left = sleep_at - mono_now();
+	if (left <= 0) {
+		sleep_apply(0);
+		sleep_at = 0;
+		sleep_fading = 0;
+	} else if (left <= sleep_fade) {
+		sleep_fading = 1;
+		sleep_apply(left / sleep_fade);
+	}
+}
+
+/* Hand the keys to another zone; anything still pending goes first. */
+static void zone_select(int z) {
+	ipc_flush();
+	if (viz_live) { /* only the zone on screen is measured */
+		mpv_cmd("{\"command\":[\"af\",\"remove\",\"@viz\"]}\n");
+		viz_reset();
+	}
+	if (z != zone_view) {
+		zone_store();
+		zone_keep_list(&zones[zone_view]);
+	}
+	zone_view = z;
+	zone_switch(z);
+	delete_pending = -1;
+}
+
+/* One decoded keypress. Kitty-protocol sequences for Enter and Ctrl+J/K/M
+ * are folded into flags; rows/cols are set for a window size report. */
+struct key {
+	char c;
+	int ctrl_j, ctrl_k, ctrl_m;
+	int rows, cols;
+};
+
+enum { KEY_DONE, KEY_DETACH, KEY_QUIT };
+#define KEY_BATCH 64 /* keys handled per frame, at most */
+
+/* --record FILE: the terminal's input as a --replay script. read_key()
+ * collects the bytes of each batch and trace_batch() writes them with the
+ * time since the one before. */
+static FILE *trace_fp = NULL;
+static char trace_keys[4096];
+static int trace_len = 0;
+static double trace_at = 0;
+
+/* s as a script argument: printable ASCII as is, the rest escaped (and a
+ * trailing space, which editors strip). */
+static void trace_escape(FILE *f, const char *s, int n) {
+	for (int i = 0; i < n; i++) {
+		unsigned char c = s[i];
+		if (c == '\\') fputs("\\\\", f);
+		else if (c == '\r') fputs("\\r", f);
+		else if (c == '\n') fputs("\\n", f);
+		else if (c == '\t') fputs("\\t", f);
+		else if (c == 0x1b) fputs("\\e", f);
+		else if (c < 0x20 || c >= 0x7f || (c == ' ' && i == n - 1)) fprintf(f, "\\x%02x", c);
+		else fputc(c, f);
+	}
+}
+
+static void trace_wait(void) {
+	double now = mono_now();
+	long ms = lround((now - trace_at) * 1000);
+	if (ms > 0) fprintf(trace_fp, "wait %ld\n", ms);
+	trace_at = now;
+}
+
+static void trace_size(void) {
+	if (!trace_fp) return;
+	trace_wait();
+	fprintf(trace_fp, "size %d %d\n", term_rows(), term_cols());
+}
+
+static void trace_batch(void) {
+	if (!trace_fp || trace_len == 0) return;
+	trace_wait();
+	fputs("keys ", trace_fp);
+	trace_escape(trace_fp, trace_keys, trace_len);
+	fputc('\n', trace_fp);
+	fflush(trace_fp);
+	trace_len = 0;
+}
+
+static int read_key(int fd, struct key *k) {
+	char c;
+	if (read(fd, &c, 1) != 1)
+		return -1;
+	memset(k, 0, sizeof(*k));
+
+	char seq[32];
+	int slen = 0;
+	int ctrl_j = (c == 0x0a);
+	int ctrl_k = (c == 0x0b);
+	int ctrl_m = 0;
+	int enter_key = (c == '\r');
+	if (trace_fp && fd == STDIN_FILENO && trace_len < (int)sizeof(trace_keys))
+		trace_keys[trace_len++] = c;
+	if (c == 0x1b) {
+		struct pollfd sp = { .fd = fd, .events = POLLIN };
+		while (slen < 31 && poll(&sp, 1, 20) > 0) {
+			if (read(fd, &seq[slen], 1) != 1) break;
+			slen++;
+			/* CSI final byte is >= 0x40, but skip '[' introducer */
+			if (slen > 1 && seq[slen-1] >= 0x40) break;
+		}
+		seq[slen] = '\0';
+		if (trace_fp && fd == STDIN_FILENO && trace_len + slen <= (int)sizeof(trace_keys)) {
+			memcpy(trace_keys + trace_len, seq, slen);
+			trace_len += slen;
+		}
+		if (strcmp(seq, "[13u") == 0) {
+			enter_key = 1;
+			c = 0;
+		} else if (strcmp(seq, "[106;5u") == 0) {
+			ctrl_j = 1;
+			c = 0;
+		} else if (strcmp(seq, "[107;5u") == 0) {
+			ctrl_k = 1;
+			c = 0;
+		} else if (strcmp(seq, "[109;5u") == 0) {
+			ctrl_m = 1;
+			c = 0;
+		} else if (sscanf(seq, "[8;%d;%dt", &k->rows, &k->cols) == 2) {
+			c = 0; /* window size report, sent by clients on attach and resize */
+		} else if (slen > 0) {
+			c = 0;
+		}
+	}
+	if (enter_key && c == 0)
+		c = '\r';
+	k->c = c;
+	k->ctrl_j = ctrl_j;
+	k->ctrl_k = ctrl_k;
+	k->ctrl_m = ctrl_m;
+	return 0;
+}
+
+/* Apply one key to the shared UI state. The caller saves and redraws. */
+static int handle_key(const struct key *k) {
+	char c = k->c;
+	int ctrl_j = k->ctrl_j, ctrl_k = k->ctrl_k, ctrl_m = k->ctrl_m;
+
+	if (ctrl_m) {
+		playlist_menu = !playlist_menu;
+		if (playlist_menu) {
+			playlist_cursor = (playlist_active >= 0) ? playlist_active + 1 : 0;
+			panel_focus = PANEL_SIDEBAR;
+		} else {
+			panel_focus = PANEL_MAIN;
+		}
+		return KEY_DONE;
+	}
+
+	if ((ctrl_j || ctrl_k) && playlist_menu && !searching) {
+		panel_focus = (panel_focus == PANEL_SIDEBAR) ? PANEL_MAIN : PANEL_SIDEBAR;
+		return KEY_DONE;
+	}
+	if (ctrl_j || ctrl_k)
+		c = 0;
+
+	if (searching) {
+		if (c == '\r') {
+			searching = 0;
+		} else if (c == 0x1b) {
+			searching = 0;
+			filter_active = 0;
+			cursor = find_in_display(search_prev_cursor);
+		} else if (c == 0x7f) {
+			if (search_len > 0) {
+				/* drop a whole codepoint, not just its last byte */
+				while (search_len > 1 && (search_buf[search_len - 1] & 0xc0) == 0x80)
+					search_len--;
+				search_buf[--search_len] = '\0';
+				apply_filter();
+			}
+		} else if ((c >= 32 && c < 127) || (unsigned char)c >= 0x80) {
+			if (search_len < (int)sizeof(search_buf) - 1) {
+				search_buf[search_len++] = c;
+				search_buf[search_len] = '\0';
+				apply_filter();
+			}
+		}
+		return KEY_DONE;
+	}
+
+	if (playlist_menu && panel_focus == PANEL_SIDEBAR) {
+		switch (c) {
+		case 0x03: /* Ctrl+C */
+		case 'q':
+			return KEY_DETACH;
+		case 'Q':
+			return KEY_QUIT;
+		case 'j':
+			if (playlist_cursor < nplaylists) playlist_cursor++;
+			break;
+		case 'k':
+			if (playlist_cursor > 0) playlist_cursor--;
+			break;
+		case 'g':
+			playlist_cursor = 0;
+			break;
+		case 'G':
+			playlist_cursor = nplaylists;
+			break;
+		case ' ':
+			if (mpv_pid > 0) {
+				mpv_cmd("{\"command\":[\"cycle\",\"pause\"]}\n");
+				paused = !paused;
+			}
+			break;
+		case '\r':
+			sel_commit();
+			if (playlist_cursor == 0) {
+				playlist_active = -1;
+				nplaylist_songs = 0;
+			} else {
+				playlist_active = playlist_cursor - 1;
+				load_playlist(playlist_active);
+			}
+			searching = 0;
+			search_buf[0] = '\0';
+			search_len = 0;
+			filter_active = 0;
+			cursor = 0;
+			delete_pending = -1;
+			break;
+		case 0x1b:
+			playlist_menu = 0;
+			panel_focus = PANEL_MAIN;
+			break;
+		}
+		return KEY_DONE;
+	}
+
+	switch (c) {
+	case 'q':
+	case 0x03: /* Ctrl+C (SIGINT blocked by raw mode, handle byte directly) */
+		return KEY_DETACH;
+	case 'Q':
+		return KEY_QUIT;
+	case 'j':
+		if (cursor < display_len() - 1) cursor++;
+		break;
+	case 'k':
+		if (cursor > 0) cursor--;
+		break;
+	case '\r':
+		if (display_len() > 0) {
+			play_song(song_at(cursor));
+			if (shuffle) shuffle_mark(song_at(cursor));
+		}
+		break;
+	case ' ':
+		if (mpv_pid > 0) {
+			xfade_finish(); /* a pause would leave the old track playing */
+			mpv_cmd("{\"command\":[\"cycle\",\"pause\"]}\n");
+			paused = !paused;
+		} else if (display_len() > 0) {
+			play_song(song_at(cursor));
+			if (shuffle) shuffle_mark(song_at(cursor));
+		}
+		break;
+	case '0':
+		seek_to(0, 0);
+		break;
+	case 'h':
+		seek_to(-5, 1);
+		break;
+	case 'H': {
+		if (playing < 0 || display_len() == 0) break;
+		int len = display_len();
+		int cur = -1;
+		for (int i = 0; i < len; i++) {
+			if (song_at(i) == playing) { cur = i; break; }
+		}
+		int prev = (cur > 0) ? cur - 1 : len - 1;
+		play_song(song_at(prev));
+		if (shuffle) shuffle_mark(song_at(prev));
+		break;
+	}
+	case 'l':
+		seek_to(5, 1);
+		break;
+	case 'L': {
+		if (playing < 0 || display_len() == 0) break;
+		if (queue_len > 0) {
+			int next = queue_pop_front();
+			if (shuffle) shuffle_mark(next);
+			play_song(next);
+		} else if (radio_next(playing) >= 0) {
+			play_song(radio_pick);
+		} else if (shuffle) {
+			int next = shuffle_take();
+			shuffle_mark(next);
+			play_song(next);
+		} else {
+			int len = display_len();
+			int cur = -1;
+			for (int i = 0; i < len; i++) {
+				if (song_at(i) == playing) { cur = i; break; }
+			}
+			int next = (cur >= 0 && cur + 1 < len) ? cur + 1 : 0;
+			play_song(song_at(next));
+		}
+		break;
+	}
+	case '=':
+	case '+':
+		volume_step(5);
+		break;
+	case '-':
+		volume_step(-5);
+		break;
+	case 'a': {
+		const int *idx;
+		int n = batch_targets(&idx);
+		for (int i = 0; i < n; i++) queue_push_back(idx[i]);
+		break;
+	}
+	case 'A': { /* pushed front-first in reverse so the batch plays in order */
+		const int *idx;
+		int n = batch_targets(&idx);
+		for (int i = n - 1; i >= 0; i--) queue_push_front(idx[i]);
+		break;
+	}
+	case 'p': { /* append to the playlist under the sidebar cursor */
+		if (playlist_cursor < 1 || playlist_kind[playlist_cursor - 1] != PL_FILE) break;
+		const int *idx;
+		int n = batch_targets(&idx);
+		playlist_append(idx, n);
+		break;
+	}
+	case 's':
+		sort_set((sort_mode + 1) % NSORTS);
+		break;
+	case 'S':
+		sort_set((sort_mode + NSORTS - 1) % NSORTS);
+		break;
+	case 'v':
+		if (display_len() > 0) {
+			int sidx = song_at(cursor);
+			sel_set(sidx, !bit_get(sel_bits, sidx));
+		}
+		break;
+	case 'V':
+		if (visual_anchor >= 0) sel_commit();
+		else if (display_len() > 0) visual_anchor = cursor;
+		break;
+	case '*': /* queue the whole display list (e.g. a filter result) */
+		for (int i = 0; i < display_len(); i++)
+			queue_push_back(song_at(i));
+		break;
+	case 'U':
+		queue_pop_back();
+		break;
+	case 'C':
+		queue_clear();
+		break;
+	case 'u':
+		queue_panel = !queue_panel;
+		break;
+	case 'i':
+		stats_panel = !stats_panel;
+		break;
+	case 'D':
+		/* the Duplicates view, with the extras selected for d d */
+		if (dup_view < 0) break;
+		sel_clear();
+		dup_select = 1;
+		playlist_active = dup_view;
+		playlist_cursor = dup_view + 1;
+		searching = 0;
+		search_buf[0] = '\0';
+		search_len = 0;
+		filter_active = 0;
+		cursor = 0;
+		delete_pending = -1;
+		load_playlist(dup_view);
+		break;
+	case 'y':
+		lyrics_panel = !lyrics_panel;
+		break;
+	case 'x': {
+		static const int steps[] = { 0, 2, 5, 10 };
+		int i = 0;
+		while (i < 3 && steps[i] != crossfade_secs) i++;
+		crossfade_secs = steps[(i + 1) % 4];
+		break;
+	}
+	case 'z':
+		sleep_cycle();
+		break;
+	case 'r':
+		radio = !radio;
+		radio_from = -1;
+		break;
+	case '\t':
+		zone_select((zone_view + 1) % nzones);
+		break;
+	case 'b':
+		viz_enabled = !viz_enabled;
+		break;
+	case 'N':
+		normalize = !normalize;
+		norm_update_live();
+		break;
+	case 'm':
+		if (loop_mode == LOOP_SINGLE) {
+			loop_mode = LOOP_ALL;
+		} else {
+			loop_mode = LOOP_SINGLE;
+			shuffle = 0;
+		}
+		break;
+	case 'n':
+		shuffle = !shuffle;
+		if (shuffle) {
+			loop_mode = LOOP_ALL;
+			shuffle_clear();
+			if (playing >= 0) shuffle_mark(playing);
+		}
+		break;
+	case 'd': {
+		if (display_len() == 0) break;
+		if (nselected > 0 || visual_anchor >= 0) {
+			sel_commit();
+			if (delete_pending == DELETE_SELECTION) {
+				remove_songs(sel_bits);
+				delete_pending = -1;
+			} else {
+				delete_pending = DELETE_SELECTION;
+			}
+			break;
+		}
+		int sidx = song_at(cursor);
+		if (delete_pending == sidx) {
+			/* confirm deletion */
+			remove_song(sidx);
+			delete_pending = -1;
+		} else {
+			/* mark for deletion */
+			delete_pending = sidx;
+		}
+		break;
+	}
+	case 0x1b: /* ESC */
+		if (delete_pending != -1) {
+			delete_pending = -1;
+		} else if (nselected > 0 || visual_anchor >= 0) {
+			sel_clear();
+		} else {
+			if (playing >= 0 && mpv_pid > 0)
+				history_log(HIST_SKIP, playing, song_pos);
+			kill_mpv();
+		}
+		break;
+	case '/':
+	case '?':
+		sel_commit(); /* the range is in display positions */
+		search_prev_cursor = song_at(cursor);
+		search_buf[0] = '\0';
+		search_len = 0;
+		filter_active = 0;
+		cursor = find_in_display(search_prev_cursor);
+		searching = 1;
+		break;
+	case 'g':
+		if (display_len() > 0) cursor = 0;
+		break;
+	case 'G':
+		if (display_len() > 0) cursor = display_len() - 1;
+		break;
+	case 0x05: { /* Ctrl+E — scroll down one line */
+		int cnt = display_len();
+		int lr = list_height();
+		if (cnt > lr && scroll_offset < cnt - lr)
+			scroll_offset++;
+		if (cursor < scroll_offset)
+			cursor = scroll_offset;
+		break;
+	}
+	case 0x19: { /* Ctrl+Y — scroll up one line */
+		int lr = list_height();
+		if (scroll_offset > 0)
+			scroll_offset--;
+		if (cursor >= scroll_offset + lr)
+			cursor = scroll_offset + lr - 1;
+		break;
+	}
+	case 0x04: { /* Ctrl+D — scroll down half page */
+		int half = list_height() / 2;
+		int cnt = display_len();
+		cursor += half;
+		scroll_offset += half;
+		if (cursor >= cnt) cursor = cnt - 1;
+		break;
+	}
+	case 0x15: { /* Ctrl+U — scroll up half page */
+		int half = list_height() / 2;
+		cursor -= half;
+		scroll_offset -= half;
+		if (cursor < 0) cursor = 0;
+		if (scroll_offset < 0) scroll_offset = 0;
+		break;
+	}
+	case 0x06: { /* Ctrl+F — scroll down full page */
+		int lr = list_height();
+		int cnt = display_len();
+		cursor += lr;
+		scroll_offset += lr;
+		if (cursor >= cnt) cursor = cnt - 1;
+		break;
+	}
+	case 0x02: { /* Ctrl+B — scroll up full page */
+		int lr = list_height();
+		cursor -= lr;
+		scroll_offset -= lr;
+		if (cursor < 0) cursor = 0;
+		if (scroll_offset < 0) scroll_offset = 0;
+		break;
+	}
+	}
+
+	return KEY_DONE;
+}
+
+/* Scheduler. The loops sleep in poll() until input, a worker's wake_fd
+ * post, a crossfade timer or the earliest deadline below; with nothing
+ * playing and no timer set there is none, so an idle or paused player
+ * never wakes. Deadlines are mono_now() times, 0 = none. */
+#define END_POLL_MS 50
+
+/* When the progress row next changes: the elapsed time's next second or
+ * the bar's next cell. In a track's last second mpv is checked every
+ * END_POLL_MS, so check_child() starts the next song without a gap. */
+static double progress_due(void) {
+	if (mpv_pid <= 0 || paused || playing < 0) return 0;
+	double pos = interp_pos();
+	double next = floor(pos) + 1;
+	if (song_dur > 0 && progress_cells > 0) {
+		double cell = song_dur / progress_cells;
+		double c = (floor(pos / cell) + 1) * cell;
+		if (c < next) next = c;
+	}
+	if (song_dur > 0 && pos > song_dur - 1) next = pos + END_POLL_MS / 1000.0;
+	if (next - pos < 0.02) next = pos + 0.02; /* mpv lagging our estimate */
+	return mono_now() + (next - pos) + 0.005;
+}
+
+static double sched_min(double a, double b) {
+	return a <= 0 ? b : b <= 0 || a < b ? a : b;
+}
+
+/* The next tick: progress, the sleep timer, and once a second for any
+ * other zone that is playing. */
+static double sched_due(double last_tick) {
+	double due = sched_min(progress_due(), sleep_due());
+	for (int z = 0; z < nzones; z++)
+		if (z != zone_cur && zones[z].mpv_pid > 0 && !zones[z].paused)
+			due = sched_min(due, last_tick + 1);
+	return due;
+}
+
+/* The deadline the loop last went to sleep for. Deadlines computed after
+ * waking would already have moved on to the next second or cell. */
+static double sched_next = 0;
+
+/* poll() timeout for the loops, -1 = sleep until an fd is ready. frames
+ * adds the spectrum's frame rate and the next lyric line. */
+static int loop_timeout(double last_tick, int frames) {
+	double due = sched_next = sched_due(last_tick);
+	int ms = -1;
+	if (due > 0) {
+		double wait = (due - mono_now()) * 1000;
+		ms = wait <= 0 ? 0 : (int)ceil(wait);
+	}
+	if (frames && viz_active() && !paused && (ms < 0 || ms > 1000 / VIZ_FPS))
+		ms = 1000 / VIZ_FPS;
+	int lyric = frames ? lyrics_wait_ms() : -1;
+	if (lyric >= 0 && (ms < 0 || lyric < ms)) ms = lyric;
+	return ms;
+}
+
+/* Consume wake_fd's count; whether there was one. */
+static int wake_drain(void) {
+	uint64_t n;
+	return read(wake_fd, &n, sizeof(n)) == sizeof(n);
+}
+
+/* Main-loop side of the library scan: take the batches the worker has
+ * published, append them and restore what state.save named. Once the
+ * scan is complete, start the analysis pipeline over the whole library. */
+static void scan_poll(void) {
+	if (!scan_active) return;
+	pthread_mutex_lock(&scan_lock);
+	struct scan_batch *b = scan_ready;
+	scan_ready = NULL;
+	scan_ready_tail = &scan_ready;
+	int finished = scan_finished, err = scan_errno;
+	pthread_mutex_unlock(&scan_lock);
+
+	int from = nsongs;
+	while (b) {
+		for (int i = 0; i < b->n; i++) {
+			if (nsongs == MAX_SONGS) {
+				free(b->name[i]);
+				continue;
+			}
+			songs[nsongs] = b->name[i];
+			meta_fill_name(nsongs);
+			meta_size[nsongs] = b->size[i];
+			meta_added[nsongs] = b->mtime[i];
+			song_index_add(nsongs);
+			nsongs++;
+		}
+		struct scan_batch *next = b->next;
+		free(b);
+		b = next;
+	}
+	if (nsongs > from) {
+		history_fill(from);
+		sort_extend(from);
+		meta_changed |= (1u << F_NAME) | (1u << F_ARTIST) | (1u << F_TITLE) | (1u << F_ADDED);
+		view_gen++;
+		if (filter_active) apply_filter();
+	}
+	if (finished) {
+		scan_active = 0;
+		if (err || nsongs == 0) {
+			cleanup();
+			if (err) {
+				errno = err;
+				perror(songs_dir);
+			} else {
+				fprintf(stderr, "No songs found in %s/\n", songs_dir);
+			}
+			exit(1);
+		}
+		songs_sort();
+		if (playlist_active >= 0 && !saved_playlist[0]) {
+			int keep = (display_len() > 0) ? song_at(cursor) : -1;
+			load_playlist(playlist_active);
+			if (filter_active) apply_filter();
+			if (keep >= 0) cursor = find_in_display(keep);
+		}
+		scan_ms = (mono_now() - scan_t0) * 1000;
+		library_save();
+		hash_cache_load(); /* before restore_state() can reopen the Duplicates view */
+	}
+	if (nsongs > from || finished) {
+		zone_switch(0); /* state.save is the first zone's */
+		restore_state(finished);
+		zone_switch(zone_view);
+	}
+	if (finished) analysis_start();
+	if (finished && dup_state == DUP_WAIT) dup_advance();
+}
+
+/* Per-iteration housekeeping shared by the terminal and daemon loops: reap
+ * mpv; on input or a deadline from sched_due() poll it and run the timers;
+ * on either of those or a wake_fd post (woken) apply finished background
+ * work. Worker results never poll mpv: a changed duration re-sorts, and
+ * that must not come back around as another poll. Returns whether this
+ * iteration was a tick. */
+static int loop_tick(int input_ready, int woken, double *last_tick) {
+	double now = mono_now();
+	int due = input_ready || (sched_next > 0 && now >= sched_next - 0.001);
+	int tick = due || woken;
+
+	check_child();
+	if (nzones > 1)
+		zones_background(due);
+	if (due) {
+		update_position();
+		xfade_tick();
+		sleep_tick();
+		prefetch_tick();
+		*last_tick = now;
+	}
+	if (tick) {
+		scan_poll();
+		analysis_poll();
+		smart_refresh();
+		sort_poll();
+	}
+	viz_update();
+	return tick;
+}
+
+/* Daemon / client. The daemon owns the library, mpv, the queue and the
+ * state file; it has no terminal. A client forwards raw tty input (plus a
+ * "CSI 8;rows;cols t" size report on attach and resize) and draws for
+ * itself: the daemon sends it a snapshot of everything draw() reads, then
+ * after each loop iteration only the parts that changed, and the client
+ * runs the same draw() over its copy at its own size. UI state is shared:
+ * every attached client sees the same view. */
+#define MAX_CLIENTS 16
+#define MIRROR_CHUNK 4096   /* diff granularity, and the largest record */
+#define MIRROR_END UINT32_MAX
+
+/* What draw() reads, mirrored on clients. An entry is one variable, the
+ * first *count elements of an array (the count is an entry of its own),
+ * or a blob of NUL-separated names standing in for a char * array. On the
+ * daemon, shadow holds the bytes clients were last sent. */
+struct mirror {
+	void *p;
+	size_t size;          /* bytes, or bytes per element with count */
+	int *count;
+	int cap;              /* elements a client has room for */
+	char **blob;          /* *blob holds *count bytes */
+	char *shadow;
+	size_t shadow_len;
+};
+
+static char *lib_names, *pl_names; /* songs[], playlists[] as blobs */
+static int lib_names_len, pl_names_len;
+static size_t lib_names_cap, pl_names_cap;
+static unsigned lib_names_gen;     /* view_gen lib_names was built for */
+static int lib_names_n;            /* songs in it */
+
+static struct mirror mirror[] = {
+	{ .blob = &lib_names, .count = &lib_names_len },
+	{ .blob = &pl_names, .count = &pl_names_len },
+	{ .p = meta_textw, .size = sizeof(meta_textw[0]), .count = &nsongs, .cap = MAX_SONGS },
+	{ .p = meta_dur, .size = sizeof(meta_dur[0]), .count = &nsongs, .cap = MAX_SONGS },
+	{ .p = filtered, .size = sizeof(filtered[0]), .count = &nfiltered, .cap = MAX_SONGS },
+	{ .p = playlist_songs, .size = sizeof(playlist_songs[0]), .count = &nplaylist_songs, .cap = MAX_SONGS },
+	{ .p = sort_perm[SORT_ARTIST], .size = sizeof(int), .count = &nsongs, .cap = MAX_SONGS },
+	{ .p = sort_perm[SORT_ADDED], .size = sizeof(int), .count = &nsongs, .cap = MAX_SONGS },
+	{ .p = sort_perm[SORT_DURATION], .size = sizeof(int), .count = &nsongs, .cap = MAX_SONGS },
+	{ .p = sort_perm[SORT_PLAYS], .size = sizeof(int), .count = &nsongs, .cap = MAX_SONGS },
+	{ .p = sort_perm[SORT_PLAYED], .size = sizeof(int), .count = &nsongs, .cap = MAX_SONGS },
+	{ .p = sel_bits, .size = sizeof(sel_bits) },
+	{ .p = dup_extra, .size = sizeof(dup_extra) },
+	{ .p = playlist_kind, .size = sizeof(playlist_kind) },
+	{ .p = viz_level, .size = sizeof(viz_level) },
+	{ .p = smart_error, .size = sizeof(smart_error) },
+	{ .p = search_buf, .size = sizeof(search_buf) },
+	{ .p = &shown, .size = sizeof(shown) },
+	{ .p = &nsongs, .size = sizeof(nsongs) },
+	{ .p = &cursor, .size = sizeof(cursor) },
+	{ .p = &scroll_offset, .size = sizeof(scroll_offset) },
+	{ .p = &playing, .size = sizeof(playing) },
+	{ .p = &paused, .size = sizeof(paused) },
+	{ .p = &song_pos, .size = sizeof(song_pos) },
+	{ .p = &song_dur, .size = sizeof(song_dur) },
+	{ .p = &volume, .size = sizeof(volume) },
+	{ .p = &loop_mode, .size = sizeof(loop_mode) },
+	{ .p = &shuffle, .size = sizeof(shuffle) },
+	{ .p = &filter_active, .size = sizeof(filter_active) },
+	{ .p = &nfiltered, .size = sizeof(nfiltered) },
+	{ .p = &playlist_active, .size = sizeof(playlist_active) },
+	{ .p = &nplaylist_songs, .size = sizeof(nplaylist_songs) },
+	{ .p = &nplaylists, .size = sizeof(nplaylists) },
+	{ .p = &playlist_cursor, .size = sizeof(playlist_cursor) },
+	{ .p = &playlist_menu, .size = sizeof(playlist_menu) },
+	{ .p = &panel_focus, .size = sizeof(panel_focus) },
+	{ .p = &sort_mode, .size = sizeof(sort_mode) },
+	{ .p = &nselected, .size = sizeof(nselected) },
+	{ .p = &visual_anchor, .size = sizeof(visual_anchor) },
+	{ .p = &delete_pending, .size = sizeof(delete_pending) },
+	{ .p = &view_gen, .size = sizeof(view_gen) },
+	{ .p = &queue_len, .size = sizeof(queue_len) },
+	{ .p = &queue_panel, .size = sizeof(queue_panel) },
+	{ .p = &stats_panel, .size = sizeof(stats_panel) },
+	{ .p = &lyrics_panel, .size = sizeof(lyrics_panel) },
+	{ .p = &searching, .size = sizeof(searching) },
+	{ .p = &dup_view, .size = sizeof(dup_view) },
+	{ .p = &dup_state, .size = sizeof(dup_state) },
+	{ .p = &dup_jobs, .size = sizeof(dup_jobs) },
+	{ .p = &dup_groups, .size = sizeof(dup_groups) },
+	{ .p = &dup_waste, .size = sizeof(dup_waste) },
+	{ .p = &scan_active, .size = sizeof(scan_active) },
+	{ .p = &scan_t0, .size = sizeof(scan_t0) },
+	{ .p = &scan_ms, .size = sizeof(scan_ms) },
+	{ .p = &cache_secs, .size = sizeof(cache_secs) },
+	{ .p = &total_stalls, .size = sizeof(total_stalls) },
+	{ .p = &cache_waiting, .size = sizeof(cache_waiting) },
+	{ .p = &song_stalls, .size = sizeof(song_stalls) },
+	{ .p = &cache_ahead, .size = sizeof(cache_ahead) },
+	{ .p = &fc_budget, .size = sizeof(fc_budget) },
+	{ .p = &fc_hits, .size = sizeof(fc_hits) },
+	{ .p = &fc_misses, .size = sizeof(fc_misses) },
+	{ .p = &crossfade_secs, .size = sizeof(crossfade_secs) },
+	{ .p = &xf_steps, .size = sizeof(xf_steps) },
+	{ .p = &xf_late, .size = sizeof(xf_late) },
+	{ .p = &radio, .size = sizeof(radio) },
+	{ .p = &radio_ms, .size = sizeof(radio_ms) },
+	{ .p = &radio_seen, .size = sizeof(radio_seen) },
+	{ .p = &sleep_at, .size = sizeof(sleep_at) },
+	{ .p = &norm_live, .size = sizeof(norm_live) },
+	{ .p = &norm_applied, .size = sizeof(norm_applied) },
+	{ .p = &nzones, .size = sizeof(nzones) },
+};
+#define NMIRROR (int)(sizeof(mirror) / sizeof(mirror[0]))
+static unsigned char mirror_dirty[NMIRROR]; /* changed in the last mirror_diff() */
+
+struct client {
+	int fd;
+	int rows, cols;       /* 0 until the client reports its size */
+	char *out;            /* the rest of a frame the socket would not take */
+	size_t out_len, out_off;
+	int behind;           /* missed a delta: the next frame is whole entries */
+	unsigned char missed[NMIRROR]; /* the entries it lacks */
+};
+
+static int ctl_fd = -1;
+static struct client *clients[MAX_CLIENTS];
+static int nclients = 0;
+
+static void blob_add(char **blob, int *len, size_t *cap, const char *s) {
+	size_t n = strlen(s) + 1;
+	if (*len + n > *cap) {
+		size_t ncap = *cap ? *cap : 65536;
+		while (ncap < *len + n) ncap *= 2;
+		char *grown = realloc(*blob, ncap);
+		if (!grown) return;
+		*blob = grown;
+		*cap = ncap;
+	}
+	memcpy(*blob + *len, s, n);
+	*len += n;
+}
+
+/* Bring shown and the name blobs up to date. songs[] only grows between
+ * view_gen bumps, so the library blob is appended to until the next. */
+static void mirror_gather(void) {
+	shown_gather();
+	if (lib_names_gen != view_gen || lib_names_n > nsongs) {
+		lib_names_gen = view_gen;
+		lib_names_len = lib_names_n = 0;
+	}
+	for (; lib_names_n < nsongs; lib_names_n++)
+		blob_add(&lib_names, &lib_names_len, &lib_names_cap, songs[lib_names_n]);
+	pl_names_len = 0;
+	for (int i = 0; i < nplaylists; i++)
+		blob_add(&pl_names, &pl_names_len, &pl_names_cap, playlists[i]);
+}
+
+static const char *mirror_data(const struct mirror *m, size_t *len) {
+	if (m->blob) {
+		*len = *m->count;
+		return *m->blob;
+	}
+	*len = m->count ? *m->count * m->size : m->size;
+	return m->p;
+}
+
+static void mirror_rec(FILE *o, uint32_t v, size_t total, size_t off, size_t len, const char *data) {
+	uint32_t h[4] = { v, total, off, len };
+	fwrite(h, sizeof(h), 1, o);
+	if (len) fwrite(data, 1, len, o);
+}
+
+/* Records for the chunks that differ from the shadows, which then take
+ * the new bytes; whether there were any. mirror_dirty marks the entries. */
+static int mirror_diff(FILE *o) {
+	int any = 0;
+	for (int v = 0; v < NMIRROR; v++) {
+		struct mirror *m = &mirror[v];
+		size_t len;
+		const char *cur = mirror_data(m, &len);
+		int sent = 0, resized = len != m->shadow_len;
+		for (size_t off = 0; off < len; off += MIRROR_CHUNK) {
+			size_t n = len - off < MIRROR_CHUNK ? len - off : MIRROR_CHUNK;
+			if (off + n <= m->shadow_len && memcmp(cur + off, m->shadow + off, n) == 0)
+				continue;
+			mirror_rec(o, v, len, off, n, cur + off);
+			sent = 1;
+		}
+		if (resized && !sent)
+			mirror_rec(o, v, len, 0, 0, NULL); /* shrunk */
+		if (len > m->shadow_len) {
+			char *grown = realloc(m->shadow, len);
+			if (!grown) {
+				m->shadow_len = 0; /* resend it all next time */
+				continue;
+			}
+			m->shadow = grown;
+		}
+		if (len) memcpy(m->shadow, cur, len);
+		m->shadow_len = len;
+		mirror_dirty[v] = sent || resized;
+		any |= mirror_dirty[v];
+	}
+	return any;
+}
+
+/* The entries marked in which, whole: everything for a snapshot, or what
+ * a client missed while its socket was full. */
+static void mirror_whole(FILE *o, const unsigned char *which) {
+	for (int v = 0; v < NMIRROR; v++) {
+		if (!which[v]) continue;
+		size_t len;
+		const char *cur = mirror_data(&mirror[v], &len);
+		if (!len) mirror_rec(o, v, 0, 0, 0, NULL);
+		for (size_t off = 0; off < len; off += MIRROR_CHUNK)
+			mirror_rec(o, v, len, off, len - off < MIRROR_CHUNK ? len - off : MIRROR_CHUNK, cur + off);
+	}
+	mirror_rec(o, MIRROR_END, 0, 0, 0, NULL);
+}
+
+/* Client side: apply one record. -1 when it does not fit the table. */
+static int mirror_put(const uint32_t *h, const char *data) {
+	uint32_t v = h[0], total = h[1], off = h[2], len = h[3];
+	if (v >= (uint32_t)NMIRROR || off > total || len > total - off) return -1;
+	struct mirror *m = &mirror[v];
+	char *dst = m->p;
+	if (m->blob) {
+		/* one spare byte keeps the last name terminated */
+		if ((int)total != *m->count) {
+			char *grown = realloc(*m->blob, total + 1);
+			if (!grown) return -1;
+			*m->blob = grown;
+			*m->count = total;
+			grown[total] = '\0';
+		}
+		dst = *m->blob;
+	} else if (total > (m->count ? m->cap * m->size : m->size)) {
+		return -1;
+	}
+	if (len) memcpy(dst + off, data, len);
+	if (m->p == &shown) wf_bar_slot = -1;
+	return 0;
+}
+
+/* Client side: point songs[] and playlists[] into the received blobs,
+ * and keep the counts within them. */
+static void mirror_names(void) {
+	int n = 0;
+	for (int i = 0; i < lib_names_len && n < MAX_SONGS; i += strlen(lib_names + i) + 1)
+		songs[n++] = lib_names + i;
+	if (nsongs > n) nsongs = n;
+	n = 0;
+	for (int i = 0; i < pl_names_len && n < MAX_PLAYLISTS; i += strlen(pl_names + i) + 1)
+		playlists[n++] = pl_names + i;
+	if (nplaylists > n) nplaylists = n;
+	if (playing >= nsongs) playing = -1;
+}
+
+static int send_all(int fd, const char *buf, size_t n) {
+	while (n > 0) {
+		ssize_t w = send(fd, buf, n, MSG_NOSIGNAL);
+		if (w <= 0) return -1;
+		buf += w;
+		n -= w;
+	}
+	return 0;
+}
+
+static void client_drop(int i) {
+	struct client *cl = clients[i];
+	close(cl->fd);
+	free(cl->out);
+	free(cl);
+	clients[i] = clients[--nclients];
+}
+
+/* Client sockets are non-blocking: what a client does not take now waits
+ * in cl->out, and until it has gone the client's frames are dropped. */
+static int client_send(struct client *cl, const char *buf, size_t n) {
+	ssize_t w = send(cl->fd, buf, n, MSG_NOSIGNAL);
+	if (w < 0 && errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+	if (w < 0) w = 0;
+	if ((size_t)w == n) return 0;
+	cl->out = malloc(n - w);
+	if (!cl->out) return -1;
+	memcpy(cl->out, buf + w, n - w);
+	cl->out_len = n - w;
+	cl->out_off = 0;
+	return 0;
+}
+
+static int client_flush(struct client *cl) {
+	ssize_t w = send(cl->fd, cl->out + cl->out_off, cl->out_len - cl->out_off, MSG_NOSIGNAL);
+	if (w < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+	cl->out_off += w;
+	if (cl->out_off == cl->out_len) {
+		free(cl->out);
+		cl->out = NULL;
+		cl->out_len = cl->out_off = 0;
+	}
+	return 0;
+}
+
+/* After each loop iteration: one delta for every client in step. A client
+ * whose socket is still full has the delta dropped and notes what it
+ * touched; once the socket drains it gets those entries whole in one
+ * frame, as a client that just attached gets all of them. */
+static void clients_sync(void) {
+	if (!nclients) return;
+	/* the progress tick follows the widest client's bar */
+	progress_cells = 0;
+	for (int i = 0; i < nclients; i++)
+		if (clients[i]->rows > 0 && bar_cells(main_pane_cols(clients[i]->cols)) > progress_cells)
+			progress_cells = bar_cells(main_pane_cols(clients[i]->cols));
+
+	mirror_gather();
+	char *delta = NULL;
+	size_t delta_len = 0;
+	FILE *o = open_memstream(&delta, &delta_len);
+	if (!o) return;
+	int changed = mirror_diff(o);
+	if (changed) mirror_rec(o, MIRROR_END, 0, 0, 0, NULL);
+	fclose(o);
+	for (int i = 0; i < nclients; i++) {
+		struct client *cl = clients[i];
+		int rc = 0;
+		if (!cl->out && !cl->behind) {
+			if (changed) rc = client_send(cl, delta, delta_len);
+		} else {
+			if (changed) {
+				for (int v = 0; v < NMIRROR; v++) cl->missed[v] |= mirror_dirty[v];
+				cl->behind = 1;
+			}
+			if (cl->out || !cl->behind) continue;
+			char *whole = NULL;
+			size_t whole_len = 0;
+			if (!(o = open_memstream(&whole, &whole_len))) continue;
+			mirror_whole(o, cl->missed);
+			fclose(o);
+			rc = client_send(cl, whole, whole_len);
+			free(whole);
+			memset(cl->missed, 0, sizeof(cl->missed));
+			cl->behind = 0;
+		}
+		if (rc < 0) client_drop(i--);
+	}
+	free(delta);
+}
+
+/* Private directory for the control socket, mpv's sockets and the
+ * spectrum FIFO: $XDG_RUNTIME_DIR/musicplayer, else /tmp/musicplayer-<uid>.
+ * It must be a directory we own; group and other access is taken away.
+ * Without MUSIC_PLAYER_HOME the control socket lives here too. */
+static int run_dir_init(void) {
+	const char *xdg = getenv("XDG_RUNTIME_DIR");
+	/* leave room in sockaddr_un's 108 bytes for "/mpv.<pid>.<z>.<s>.sock" */
+	if (xdg && xdg[0] == '/' && strlen(xdg) < 64)
+		snprintf(run_dir, sizeof(run_dir), "%s/musicplayer", xdg);
+	else
+		snprintf(run_dir, sizeof(run_dir), "/tmp/musicplayer-%d", (int)getuid());
+	struct stat st;
+	if (mkdir(run_dir, 0700) != 0 && errno != EEXIST) {
+		perror(run_dir);
+		return -1;
+	}
+	if (lstat(run_dir, &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid()) {
+		fprintf(stderr, "musicplayer: %s is not a directory of ours\n", run_dir);
+		return -1;
+	}
+	if ((st.st_mode & 077) && chmod(run_dir, 0700) != 0) {
+		perror(run_dir);
+		return -1;
+	}
+	if (!ctl_socket) {
+		static char ctl_path[PATH_MAX];
+		snprintf(ctl_path, sizeof(ctl_path), "%s/%s", run_dir, CTL_SOCKET);
+		ctl_socket = ctl_path;
+	}
+	return 0;
+}
+
+static int ctl_connect(void) {
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) return -1;
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	strncpy(addr.sun_path, ctl_socket, sizeof(addr.sun_path) - 1);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int ctl_listen(void) {
+	int fd = ctl_connect();
+	if (fd >= 0) {
+		close(fd);
+		fprintf(stderr, "musicplayer: a daemon is already running on %s\n", ctl_socket);
+		return -1;
+	}
+	/* a stale socket from a daemon that died; anything else is not ours */
+	struct stat st;
+	if (lstat(ctl_socket, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode) || st.st_uid != getuid()) {
+			fprintf(stderr, "musicplayer: %s is in the way and not our socket\n", ctl_socket);
+			return -1;
+		}
+		unlink(ctl_socket);
+	}
+	ctl_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (ctl_fd < 0) return -1;
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	strncpy(addr.sun_path, ctl_socket, sizeof(addr.sun_path) - 1);
+	if (bind(ctl_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(ctl_fd, 8) != 0) {
+		perror(ctl_socket);
+		close(ctl_fd);
+		ctl_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+static void ctl_accept(void) {
+	/* a client that stops reading must never stall playback */
+	int fd = accept4(ctl_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (fd < 0) return;
+	struct client *cl = nclients < MAX_CLIENTS ? calloc(1, sizeof(*cl)) : NULL;
+	if (!cl) {
+		close(fd);
+		return;
+	}
+	cl->fd = fd;
+	cl->behind = 1; /* a snapshot first */
+	memset(cl->missed, 1, sizeof(cl->missed));
+	clients[nclients++] = cl;
+}
+
+/* The daemon's loop: the terminal loop with the listening socket and the
+ * clients in place of stdin. */
+static int daemon_loop(void) {
+	double last_tick = 0;
+	for (;;) {
+		/* listener, clients, the wake eventfd, crossfade ramp timers */
+		struct pollfd pfd[MAX_CLIENTS + 2 + MAX_ZONES];
+		int owner[MAX_ZONES];
+		pfd[0] = (struct pollfd){ .fd = ctl_fd, .events = POLLIN };
+		for (int i = 0; i < nclients; i++)
+			pfd[i + 1] = (struct pollfd){ .fd = clients[i]->fd,
+				.events = POLLIN | (clients[i]->out ? POLLOUT : 0) };
+		int nfd = nclients + 1;
+		pfd[nfd] = (struct pollfd){ .fd = wake_fd, .events = POLLIN };
+		int nxf = xfade_pollfds(pfd + nfd + 1, owner);
+		int ready = poll(pfd, nfd + 1 + nxf, loop_timeout(last_tick, nclients > 0));
+		if (ready > 0 && nxf)
+			xfade_dispatch(pfd + nfd + 1, owner, nxf);
+		int woken = ready > 0 && (pfd[nfd].revents & POLLIN) && wake_drain();
+		int input = 0;
+		for (int p = 0; ready > 0 && p < nfd; p++)
+			if (pfd[p].revents & (POLLIN | POLLHUP | POLLERR)) input = 1;
+		/* clients are matched by fd: drops reorder clients[] */
+		for (int p = 1; ready > 0 && p < nfd; p++) {
+			if (!(pfd[p].revents & POLLOUT)) continue;
+			int i = 0;
+			while (i < nclients && clients[i]->fd != pfd[p].fd) i++;
+			if (i < nclients && client_flush(clients[i]) < 0)
+				client_drop(i);
+		}
+		ready = input;
+		int tick = loop_tick(ready, woken, &last_tick);
+
+		if (!ready) {
+			if (tick) save_state();
+			clients_sync();
+			continue;
+		}
+
+		for (int p = 1; p < nfd; p++) {
+			if (!(pfd[p].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+			int i = 0;
+			while (i < nclients && clients[i]->fd != pfd[p].fd) i++;
+			if (i == nclients) continue;
+			struct pollfd more = { .fd = pfd[p].fd, .events = POLLIN };
+			for (int n = 0; n < KEY_BATCH; n++) {
+				struct key k;
+				if (read_key(clients[i]->fd, &k) < 0) {
+					client_drop(i);
+					break;
+				}
+				if (k.rows > 0 && k.cols > 0) {
+					clients[i]->rows = k.rows;
+					clients[i]->cols = k.cols;
+				} else {
+					/* paging and scrolling go by this client's screen */
+					out_rows = clients[i]->rows;
+					out_cols = clients[i]->cols;
+					int r = handle_key(&k);
+					scroll_clamp(list_height());
+					out_rows = out_cols = 0;
+					if (r == KEY_QUIT) {
+						while (nclients) client_drop(0);
+						state_flush();
+						return 0;
+					}
+					if (r == KEY_DETACH) {
+						client_drop(i);
+						break;
+					}
+				}
+				if (poll(&more, 1, 0) <= 0) break;
+			}
+		}
+		if (pfd[0].revents & POLLIN)
+			ctl_accept();
+
+		ipc_flush();
+		save_state();
+		clients_sync();
+	}
+}
+
+/* Fork into the background with the socket already listening, so a client
+ * started right after can connect before the library scan finishes. */
+static int daemon_start(void) {
+	if (ctl_listen() != 0) return -1;
+	pid_t pid = fork();
+	if (pid < 0) return -1;
+	if (pid > 0) _exit(0);
+	setsid();
+	int devnull = open("/dev/null", O_RDWR);
+	if (devnull >= 0) {
+		dup2(devnull, STDIN_FILENO);
+		dup2(devnull, STDOUT_FILENO);
+		dup2(devnull, STDERR_FILENO);
+		if (devnull > STDERR_FILENO) close(devnull);
+	}
+	daemon_mode = 1;
+	return 0;
+}
+
+static volatile sig_atomic_t winch = 0;
+static sigset_t loop_sigmask; /* the mask ppoll() waits with: SIGWINCH open */
+
+static void winch_handler(int sig) {
+	(void)sig;
+	winch = 1;
+}
+
+static void client_send_size(int fd) {
+	char msg[32];
+	int n = snprintf(msg, sizeof(msg), "\033[8;%d;%dt", term_rows(), term_cols());
+	send_all(fd, msg, n);
+}
+
+/* --client: attach to the daemon, starting one if none is running, send
+ * it keys and draw the state it mirrors here until it hangs up (q
+ * detaches, Q stops the daemon). */
+static int client_main(char *self) {
+	int fd = ctl_connect();
+	if (fd < 0) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			execl("/proc/self/exe", self, "--daemon", (char *)NULL);
+			execlp(self, self, "--daemon", (char *)NULL);
+			_exit(127);
+		}
+		int status;
+		if (pid > 0) waitpid(pid, &status, 0);
+		fd = ctl_connect();
+	}
+	if (fd < 0) {
+		fprintf(stderr, "musicplayer: no daemon on %s\n", ctl_socket);
+		return 1;
+	}
 
-		int bar_max = main_cols - 14;
-		if (bar_max < 4) bar_max = 4;
-		int filled = 0;
-		if (song_dur > 0)
-			filled = (int)(song_pos / song_dur * bar_max);
-		if (filled > bar_max) filled = bar_max;
+	term_raw();
+	signal(SIGWINCH, winch_handler);
+	client_send_size(fd);
+	client_mode = 1;
 
-		appendf(buf, &len, sizeof(buf),
-			"\033[%d;%dH%s%d:%02d %s",
-			rows, main_col, MAIN_BASE, pm, ps, MAIN_ACCENT);
-		for (int i = 0; i < bar_max; i++) {
-			if (i < filled)
-				append_repeat(buf, &len, sizeof(buf), '=', 1);
-			else if (i == filled)
-				append_repeat(buf, &len, sizeof(buf), '>', 1);
-			else
-				append_repeat(buf, &len, sizeof(buf), '-', 1);
+	/* records arrive whole or split anywhere; have = bytes held */
+	static char buf[65536];
+	size_t have = 0;
+	int drawn = 0; /* a whole snapshot has arrived */
+	struct pollfd pfd[2] = {
+		{ .fd = STDIN_FILENO, .events = POLLIN },
+		{ .fd = fd, .events = POLLIN },
+	};
+	for (;;) {
+		if (winch) {
+			winch = 0;
+			client_send_size(fd);
+			if (drawn) draw();
 		}
-		appendf(buf, &len, sizeof(buf), "%s %d:%02d", MAIN_BASE, dm, ds);
-	} else if (!searching) {
-		const char *help;
-		if (playlist_menu && sidebar_focused) {
-			help = "j/k:nav enter:apply spc:pause C-j/k:focus C-m:hide esc:hide q:quit";
-		} else if (playlist_menu) {
-			help = "j/k:nav spc:play h/l:seek /:search C-j/k:focus C-m:hide q:quit";
-		} else {
-			help = "j/k:nav spc:play/pause h/l:seek -/+:vol m:loop n:shuffle d:del esc:stop q:quit";
+		if (poll(pfd, 2, -1) < 0)
+			continue; /* EINTR from SIGWINCH */
+		if (pfd[0].revents & POLLIN) {
+			char in[4096];
+			ssize_t n = read(STDIN_FILENO, in, sizeof(in));
+			if (n <= 0 || send_all(fd, in, n) < 0) break;
+		}
+		if (pfd[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+			ssize_t n = read(fd, buf + have, sizeof(buf) - have);
+			if (n <= 0) break;
+			have += n;
+			size_t at = 0;
+			int frame = 0, bad = 0;
+			uint32_t h[4];
+			while (have - at >= sizeof(h)) {
+				memcpy(h, buf + at, sizeof(h));
+				if (h[3] > MIRROR_CHUNK) {
+					bad = 1;
+					break;
+				}
+				if (have - at < sizeof(h) + h[3]) break;
+				if (h[0] == MIRROR_END)
+					frame = 1;
+				else if (mirror_put(h, buf + at + sizeof(h)) < 0)
+					bad = 1;
+				at += sizeof(h) + h[3];
+				if (bad) break;
+			}
+			if (bad) {
+				fprintf(stderr, "musicplayer: garbled frame from the daemon\n");
+				break;
+			}
+			memmove(buf, buf + at, have - at);
+			have -= at;
+			if (frame) {
+				mirror_names();
+				draw();
+				drawn = 1;
+			}
 		}
-		appendf(buf, &len, sizeof(buf),
-			"\033[%d;%dH%s%-*.*s%s",
-			rows, main_col, MAIN_DIM, main_cols, main_cols, help, MAIN_BASE);
 	}
+	close(fd);
+	term_restore();
+	return 0;
+}
 
-	if (searching) {
-		snprintf(line, sizeof(line), "/%s_", search_buf);
-		appendf(buf, &len, sizeof(buf),
-			"\033[%d;%dH%s%-*.*s%s",
-			rows, main_col, MAIN_DIM, main_cols, main_cols, line, MAIN_BASE);
-	}
+/* --replay SCRIPT: the terminal loop without a terminal. Input goes
+ * through read_key() and handle_key(), frames through draw() into
+ * out_frame, and a virtual clock stands in for mono_now(), so a script
+ * of hours runs in milliseconds. The script is line based:
+ *
+ *   keys TEXT        one read's worth of input; \e \r \n \t \\ \xHH escapes
+ *   wait MS          advance the clock, running each deadline on the way
+ *   size ROWS COLS   the screen size (24 80 until set)
+ *   snap [LABEL]     print the screen
+ *
+ * Before each step the library scan, queued analysis and sorts are let
+ * finish, so every run draws the same frames. The home is only read:
+ * state, history, playlists, caches and songs/ are left as they were,
+ * plays are counted in memory at virtual-clock times, and no mpv runs
+ * (mpv_start() forks a silent stand-in). A trace written by --record is
+ * such a script; without a snap, the last screen is printed. Processing
+ * times (thread CPU) go to stderr at the end. */
+#define REPLAY_CELL 8 /* one character and a combining mark, in UTF-8 */
+#define SCREEN_ROWS_MAX 512
 
-	flush_buf(buf, &len);
+static char (*scr)[REPLAY_CELL];
+static int scr_rows = 0, scr_cols = 0;
+
+/* Interpret out_frame into scr[] the way a terminal would: CSI row;col H
+ * moves, 2J clears, K erases to the end of the line (2K all of it); SGR
+ * and mode switches are dropped. Text is clipped at the right edge and a
+ * wide character's second cell is left empty. */
+static void screen_render(void) {
+	out_capture = 1;
+	out_write("", 1); /* a NUL, so utf8_next() stops at the end */
+	out_capture = 0;
+	const char *f = out_frame;
+	size_t n = out_frame_len - 1;
+	int r = 0, c = 0;
+	for (size_t i = 0; i < n;) {
+		unsigned char ch = f[i];
+		if (ch == 0x1b && i + 1 < n && f[i + 1] == '[') {
+			int p[2] = { 0, 0 }, np = 0, priv = 0;
+			size_t j = i + 2;
+			if (j < n && f[j] == '?') {
+				priv = 1;
+				j++;
+			}
+			for (; j < n && ((f[j] >= '0' && f[j] <= '9') || f[j] == ';'); j++) {
+				if (f[j] == ';') np = 1;
+				else p[np] = p[np] * 10 + f[j] - '0';
+			}
+			if (j >= n) break;
+			i = j + 1;
+			if (priv) continue;
+			if (f[j] == 'H') {
+				r = (p[0] ? p[0] : 1) - 1;
+				c = (p[1] ? p[1] : 1) - 1;
+			} else if (f[j] == 'J' && p[0] == 2) {
+				for (int k = 0; k < scr_rows * scr_cols; k++) strcpy(scr[k], " ");
+			} else if (f[j] == 'K' && r >= 0 && r < scr_rows) {
+				for (int k = p[0] == 2 ? 0 : c; k < scr_cols; k++)
+					strcpy(scr[r * scr_cols + k], " ");
+			}
+			continue;
+		}
+		if (ch == 0x1b) {
+			i += 2;
+			continue;
+		}
+		if (ch < 0x20) {
+			if (ch == '\r') c = 0;
+			if (ch == '\n') r++;
+			i++;
+			continue;
+		}
+		unsigned cp;
+		int len = utf8_next(f + i, &cp);
+		int w = cp_width(cp);
+		if (r >= 0 && r < scr_rows && c >= 0) {
+			if (w == 0 && c > 0) {
+				char *prev = scr[r * scr_cols + c - 1];
+				if (strlen(prev) + len < REPLAY_CELL) strncat(prev, f + i, len);
+			} else if (w > 0 && c + w <= scr_cols) {
+				memcpy(scr[r * scr_cols + c], f + i, len);
+				scr[r * scr_cols + c][len] = '\0';
+				if (w == 2) scr[r * scr_cols + c + 1][0] = '\0';
+			}
+		}
+		c += w;
+		i += len;
+	}
 }
 
-static void play_song(int idx) {
-	kill_mpv();
+static void replay_size(int rows, int cols) {
+	if (rows < 1 || cols < 1 || rows > SCREEN_ROWS_MAX || cols > 1024) return;
+	char (*grown)[REPLAY_CELL] = realloc(scr, (size_t)rows * cols * REPLAY_CELL);
+	if (!grown) return;
+	scr = grown;
+	scr_rows = out_rows = rows;
+	scr_cols = out_cols = cols;
+	for (int k = 0; k < rows * cols; k++) strcpy(scr[k], " ");
+}
 
-	char path[PATH_MAX];
-	snprintf(path, sizeof(path), "%s/%s", songs_dir, songs[idx]);
+/* Frame timing: draw() into out_frame, as each loop iteration would. */
+static int replay_frames = 0;
+static double replay_draw_sum = 0, replay_draw_max = 0;
 
-	char vol_arg[32];
-	snprintf(vol_arg, sizeof(vol_arg), "--volume=%d", volume);
+static void replay_draw(void) {
+	double t0 = thread_now();
+	out_capture = 1;
+	out_frame_len = 0;
+	draw();
+	out_capture = 0;
+	double t = thread_now() - t0;
+	replay_frames++;
+	replay_draw_sum += t;
+	if (t > replay_draw_max) replay_draw_max = t;
+}
 
-	pid_t pid = fork();
-	if (pid == 0) {
-		/* detach from terminal completely */
-		freopen("/dev/null", "r", stdin);
-		freopen("/dev/null", "w", stdout);
-		freopen("/dev/null", "w", stderr);
-		execlp("mpv", "mpv", "--no-video", "--no-terminal",
-			"--input-ipc-server=" MPV_SOCKET, vol_arg, path, NULL);
-		_exit(1);
-	} else if (pid > 0) {
-		mpv_pid = pid;
-		playing = idx;
-		paused = 0;
+static void replay_snap(const char *label) {
+	screen_render();
+	printf("--- screen%s%s ---\n", label[0] ? " " : "", label);
+	for (int r = 0; r < scr_rows; r++) {
+		char line[1024 * REPLAY_CELL];
+		int len = 0;
+		for (int k = 0; k < scr_cols; k++) {
+			const char *cell = scr[r * scr_cols + k];
+			size_t n = strlen(cell);
+			memcpy(line + len, cell, n);
+			len += n;
+		}
+		while (len > 0 && line[len - 1] == ' ') len--;
+		printf("%.*s\n", len, line);
 	}
+	printf("--- end ---\n");
 }
 
-static void shuffle_clear(void) {
-	memset(played, 0, sizeof(played));
-	nplayed = 0;
+/* Let background work finish: the scan's batches, queued analysis, and
+ * every stale sort order, each installed as the loop would. */
+static void replay_settle(double *last_tick) {
+	for (;;) {
+		loop_tick(0, 1, last_tick);
+		if (sort_running) {
+			sort_finish();
+			continue;
+		}
+		if (!scan_active && an_pending == 0) return;
+		struct pollfd p = { .fd = wake_fd, .events = POLLIN };
+		if (poll(&p, 1, 100) > 0) wake_drain();
+	}
 }
 
-static void shuffle_mark(int idx) {
-	if (!played[idx]) {
-		played[idx] = 1;
-		nplayed++;
+/* Advance the clock by secs, stopping at each deadline sched_due() sets
+ * (progress, the sleep timer) for a tick and a frame. */
+static void replay_wait(double secs, double *last_tick) {
+	double end = virt_now + secs;
+	for (;;) {
+		loop_timeout(*last_tick, 0);
+		if (sched_next <= 0 || sched_next > end) break;
+		virt_now = sched_next > virt_now ? sched_next : virt_now + 0.001;
+		loop_tick(0, 0, last_tick);
+		replay_settle(last_tick);
+		replay_draw();
 	}
-	if (nplayed >= display_len())
-		shuffle_clear();
+	virt_now = end;
 }
 
-static int shuffle_next(void) {
-	int len = display_len();
-	int avail = 0;
-	for (int i = 0; i < len; i++)
-		if (!played[song_at(i)])
-			avail++;
-	if (avail <= 0) {
-		shuffle_clear();
-		avail = len;
-	}
-	int pick = rand() % avail;
-	int count = 0;
-	for (int i = 0; i < len; i++) {
-		if (!played[song_at(i)]) {
-			if (count == pick)
-				return song_at(i);
-			count++;
+/* Decode a keys argument in place; returns its length. */
+static int replay_unescape(char *s) {
+	int n = 0;
+	for (char *p = s; *p; p++) {
+		if (*p != '\\' || !p[1]) {
+			s[n++] = *p;
+			continue;
 		}
+		p++;
+		if (*p == 'e') s[n++] = 0x1b;
+		else if (*p == 'r') s[n++] = '\r';
+		else if (*p == 'n') s[n++] = '\n';
+		else if (*p == 't') s[n++] = '\t';
+		else if (*p == 'x' && p[1] && p[2]) {
+			char hex[3] = { p[1], p[2], 0 };
+			s[n++] = (char)strtol(hex, NULL, 16);
+			p += 2;
+		} else s[n++] = *p;
 	}
-	return song_at(0);
+	return n;
 }
 
-static void remove_song(int rm) {
-	/* stop playback if this song is playing */
-	if (playing == rm)
-		kill_mpv();
+/* Feed one keys line through a pipe, the way a batch arrives on stdin;
+ * the write end is closed first so a lone Escape doesn't wait for more. */
+static int replay_keys(const char *bytes, int n, int *nkeys, double *key_sum, double *key_max) {
+	int fds[2];
+	if (n <= 0 || pipe(fds) != 0) return KEY_DONE;
+	if (write(fds[1], bytes, n) != n) n = 0;
+	close(fds[1]);
+	int r = KEY_DONE;
+	struct key k;
+	while (r == KEY_DONE && read_key(fds[0], &k) == 0) {
+		double t0 = thread_now();
+		r = handle_key(&k);
+		double t = thread_now() - t0;
+		(*nkeys)++;
+		*key_sum += t;
+		if (t > *key_max) *key_max = t;
+	}
+	close(fds[0]);
+	ipc_flush();
+	return r;
+}
 
-	/* move file to trash */
-	mkdir(trash_dir, 0755);
-	char src[PATH_MAX + 1024], dst[PATH_MAX + 1024];
-	snprintf(src, sizeof(src), "%s/%s", songs_dir, songs[rm]);
-	snprintf(dst, sizeof(dst), "%s/%s", trash_dir, songs[rm]);
-	rename(src, dst);
-
-	/* free the name */
-	free(songs[rm]);
-
-	/* adjust playing index */
-	if (playing > rm) playing--;
-	else if (playing == rm) playing = -1;
-
-	/* shift songs[] array down */
-	for (int i = rm; i < nsongs - 1; i++)
-		songs[i] = songs[i + 1];
-	nsongs--;
-
-	/* adjust playlist_songs[]: remove entry and shift indices */
-	int pw = 0;
-	for (int i = 0; i < nplaylist_songs; i++) {
-		if (playlist_songs[i] == rm) continue;
-		int val = playlist_songs[i];
-		if (val > rm) val--;
-		playlist_songs[pw++] = val;
-	}
-	nplaylist_songs = pw;
-
-	/* adjust filtered[]: remove entry and shift indices */
-	int fw = 0;
-	for (int i = 0; i < nfiltered; i++) {
-		if (filtered[i] == rm) continue;
-		int val = filtered[i];
-		if (val > rm) val--;
-		filtered[fw++] = val;
+static int replay_main(FILE *script) {
+	double start = real_now(), last_tick = 0;
+	double key_sum = 0, key_max = 0;
+	int nkeys = 0, snaps = 0, lineno = 0, r = KEY_DONE;
+	double virt_start = virt_now;
+	if (!scr) replay_size(24, 80);
+	replay_settle(&last_tick);
+	replay_draw();
+
+	char line[8192];
+	while (r == KEY_DONE && fgets(line, sizeof(line), script)) {
+		lineno++;
+		line[strcspn(line, "\n")] = '\0';
+		int rows, cols;
+		double ms;
+		if (line[0] == '\0' || line[0] == '#') continue;
+		if (strncmp(line, "keys ", 5) == 0) {
+			r = replay_keys(line + 5, replay_unescape(line + 5), &nkeys, &key_sum, &key_max);
+		} else if (sscanf(line, "wait %lf", &ms) == 1 && ms >= 0) {
+			replay_wait(ms / 1000, &last_tick);
+		} else if (sscanf(line, "size %d %d", &rows, &cols) == 2) {
+			replay_size(rows, cols);
+		} else if (strncmp(line, "snap", 4) == 0 && (line[4] == '\0' || line[4] == ' ')) {
+			replay_snap(line[4] ? line + 5 : "");
+			snaps++;
+			continue;
+		} else {
+			fprintf(stderr, "musicplayer: %d: not a replay command: %s\n", lineno, line);
+			cleanup();
+			return 1;
+		}
+		replay_settle(&last_tick);
+		replay_draw();
 	}
-	nfiltered = fw;
+	if (!snaps) replay_snap("");
+	fprintf(stderr, "replay: %d keys, %.1f us mean, %.1f us max; %d frames, "
+		"%.1f us mean, %.1f us max; %.1f s virtual in %.1f ms\n",
+		nkeys, nkeys ? key_sum / nkeys * 1e6 : 0, key_max * 1e6,
+		replay_frames, replay_frames ? replay_draw_sum / replay_frames * 1e6 : 0,
+		replay_draw_max * 1e6, virt_now - virt_start, (real_now() - start) * 1000);
+	cleanup();
+	return 0;
+}
 
-	/* clear shuffle state — indices are invalidated */
-	shuffle_clear();
+/* Query commands: ls, search REGEX, playlist NAME and now-playing print
+ * song names one per line (NUL-terminated with -0) and exit, with no
+ * terminal, mpv or analysis. The library comes from cache/library when it
+ * is current, else from scan_songs(), which then saves it for next time.
+ * search is apply_filter() over it and playlist load_playlist(), a smart
+ * one with the name fields, play history and cached durations it can
+ * query. Exits 1 when nothing was found, 2 on bad usage or a bad pattern. */
+enum { QC_LS, QC_SEARCH, QC_PLAYLIST, QC_NOW, NQC };
+static const char *query_commands[NQC] = { "ls", "search", "playlist", "now-playing" };
 
-	/* clamp cursor to valid range */
-	if (cursor >= display_len()) cursor = display_len() - 1;
-	if (cursor < 0) cursor = 0;
+static int query_command(const char *arg) {
+	for (int i = 0; i < NQC; i++)
+		if (strcmp(arg, query_commands[i]) == 0) return i;
+	return -1;
 }
 
-static void check_child(void) {
-	if (mpv_pid > 0) {
-		int status;
-		pid_t ret = waitpid(mpv_pid, &status, WNOHANG);
-		if (ret == mpv_pid) {
-			int prev = playing;
-			mpv_pid = -1;
-			paused = 0;
-			playing = -1;
-			song_pos = 0;
-			song_dur = 0;
-			/* auto-play based on mode */
-			if (prev >= 0) {
-				if (loop_mode == LOOP_SINGLE) {
-					play_song(prev);
-				} else if (shuffle) {
-					int next = shuffle_next();
-					shuffle_mark(next);
-					play_song(next);
-				} else {
-					int len = display_len();
-					int cur = -1;
-					for (int i = 0; i < len; i++) {
-						if (song_at(i) == prev) {
-							cur = i;
-							break;
-						}
-					}
-					if (cur >= 0 && cur + 1 < len)
-						play_song(song_at(cur + 1));
-					else
-						play_song(song_at(0));
-				}
+static int query_main(int argc, char **argv) {
+	int cmd = query_command(argv[1]);
+	const char *arg = NULL;
+	char sep = '\n';
+	int bad = 0;
+	for (int i = 2; i < argc; i++) {
+		if (strcmp(argv[i], "-0") == 0 || strcmp(argv[i], "--null") == 0)
+			sep = '\0';
+		else if (arg)
+			bad = 1;
+		else
+			arg = argv[i];
+	}
+	if (bad || (cmd == QC_SEARCH || cmd == QC_PLAYLIST) != (arg != NULL) ||
+	    (arg && strlen(arg) >= sizeof(search_buf))) {
+		fprintf(stderr, "usage: %s ls | search REGEX | playlist NAME | now-playing [-0]\n",
+			argv[0]);
+		return 2;
+	}
+	static char obuf[1 << 16];
+	setvbuf(stdout, obuf, _IOFBF, sizeof(obuf));
+
+	if (cmd == QC_NOW) {
+		/* state.bin read-only as --export-state does, else state.save */
+		static struct state_rec r;
+		const char *song = NULL;
+		int fd = open(state_bin_file, O_RDONLY);
+		if (fd >= 0) {
+			if (read(fd, &r, sizeof(r)) == (ssize_t)sizeof(r) && state_rec_valid(&r))
+				song = r.song;
+			close(fd);
+		}
+		if (!song) {
+			load_state_text();
+			song = saved_song;
+		}
+		if (!song[0]) return 1;
+		printf("%s%c", song, sep);
+		return 0;
+	}
+
+	int indexed = library_load() == 0;
+	if (!indexed) {
+		if (stat(songs_dir, &scan_dir_st) != 0) scan_dir_st.st_ino = 0;
+		scan_songs();
+		library_save();
+	}
+	if (cmd == QC_SEARCH) {
+		search_len = strlen(arg);
+		memcpy(search_buf, arg, search_len + 1);
+		apply_filter();
+		if (search_len && !filter_active) {
+			fprintf(stderr, "%s: invalid regular expression: %s\n", argv[0], arg);
+			return 2;
+		}
+	} else if (cmd == QC_PLAYLIST) {
+		scan_playlists();
+		add_history_views();
+		for (int i = 0; i < nplaylists && playlist_active < 0; i++)
+			if (strcmp(playlists[i], arg) == 0) playlist_active = i;
+		if (playlist_active < 0) {
+			fprintf(stderr, "%s: no playlist named %s\n", argv[0], arg);
+			return 1;
+		}
+		if (indexed) {
+			memset(song_index, 0, sizeof(song_index));
+			for (int i = 0; i < nsongs; i++) song_index_put(i, lib_hash[i]);
+		} else {
+			song_index_rebuild();
+		}
+		if (playlist_kind[playlist_active] == PL_SMART) {
+			for (int i = 0; indexed && i < nsongs; i++) {
+				meta_fill_name(i);
+				meta_size[i] = lib_size[i];
+				meta_added[i] = lib_mtime[i];
 			}
+			history_load();
+			snprintf(duration_cache, sizeof(duration_cache), "%s/durations", cache_dir);
+			unsigned char *seen = calloc(nsongs ? nsongs : 1, 1);
+			if (seen) duration_cache_load(seen);
+			free(seen);
+		}
+		load_playlist(playlist_active);
+		if (playlist_kind[playlist_active] == PL_SMART && smart_error[0]) {
+			fprintf(stderr, "%s: %s: %s\n", argv[0], arg, smart_error);
+			return 2;
 		}
 	}
+	int n = display_len();
+	for (int i = 0; i < n; i++) {
+		fputs_unlocked(songs[song_at(i)], stdout);
+		putc_unlocked(sep, stdout);
+	}
+	return n > 0 ? 0 : 1;
 }
 
 int main(int argc, char **argv) {
-	for (int i = 1; i < argc; i++)
+	if (argc >= 3 && strcmp(argv[1], "--spectrum") == 0)
+		return spectrum_file(argv[2], argc >= 4 ? atoi(argv[3]) : 32);
+	if (argc >= 3 && strcmp(argv[1], "--loudness") == 0)
+		return loudness_file(argv[2]);
+	if (argc >= 3 && strcmp(argv[1], "--duration") == 0)
+		return duration_files(argc - 2, argv + 2);
+	if (argc >= 3 && strcmp(argv[1], "--features") == 0)
+		return features_file(argv[2]);
+	if (argc >= 3 && strcmp(argv[1], "--waveform") == 0)
+		return waveform_file(argv[2], argc >= 4 ? atoi(argv[3]) : 40);
+
+	int want_daemon = 0, want_client = 0, want_export = 0, want_import = 0;
+	const char *import_file = NULL, *import_name = NULL;
+	const char *replay_file = NULL, *record_file = NULL;
+	for (int i = 1; i < argc; i++) {
 		if (strcmp(argv[i], "--tmux") == 0)
 			tmux_mode = 1;
+		else if (strcmp(argv[i], "--daemon") == 0)
+			want_daemon = 1;
+		else if (strcmp(argv[i], "--client") == 0)
+			want_client = 1;
+		else if (strcmp(argv[i], "--export-state") == 0)
+			want_export = 1;
+		else if (strcmp(argv[i], "--import-state") == 0)
+			want_import = 1;
+		else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+			replay_file = argv[++i];
+		else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+			record_file = argv[++i];
+		else if (strcmp(argv[i], "--import-playlist") == 0 && i + 1 < argc) {
+			import_file = argv[++i];
+			if (i + 1 < argc && argv[i + 1][0] != '-')
+				import_name = argv[++i];
+		}
+	}
 
 	const char *home = getenv("MUSIC_PLAYER_HOME");
 	if (home) {
 		static char songs_path[PATH_MAX];
 		static char playlists_path[PATH_MAX];
 		static char state_path[PATH_MAX];
+		static char cache_path[PATH_MAX];
+		static char ctl_path[PATH_MAX];
+		static char state_bin_path[PATH_MAX];
+		static char history_path[PATH_MAX];
+		static char history_snap_path[PATH_MAX];
+		static char lyrics_path[PATH_MAX];
 		snprintf(songs_path, sizeof(songs_path), "%s/%s", home, SONGS_DIR);
 		snprintf(playlists_path, sizeof(playlists_path), "%s/%s", home, PLAYLISTS_DIR);
 		snprintf(state_path, sizeof(state_path), "%s/%s", home, STATE_FILE);
+		snprintf(cache_path, sizeof(cache_path), "%s/%s", home, CACHE_DIR);
 		songs_dir = songs_path;
 		playlists_dir = playlists_path;
+		snprintf(lyrics_path, sizeof(lyrics_path), "%s/%s", home, LYRICS_DIR);
+		lyrics_dir = lyrics_path;
 		state_file = state_path;
+		snprintf(state_bin_path, sizeof(state_bin_path), "%s/%s", home, STATE_BIN_FILE);
+		state_bin_file = state_bin_path;
+		snprintf(history_path, sizeof(history_path), "%s/%s", home, HISTORY_FILE);
+		snprintf(history_snap_path, sizeof(history_snap_path), "%s/%s", home, HISTORY_SNAP);
+		history_file = history_path;
+		history_snap = history_snap_path;
+		cache_dir = cache_path;
+		snprintf(ctl_path, sizeof(ctl_path), "%s/%s", home, CTL_SOCKET);
+		ctl_socket = ctl_path;
 	}
 	const char *env_dir = getenv("SONGS_DIR");
 	if (env_dir)
@@ -943,6 +9140,12 @@ int main(int argc, char **argv) {
 	const char *env_pdir = getenv("PLAYLISTS_DIR");
 	if (env_pdir)
 		playlists_dir = env_pdir;
+	const char *env_xf = getenv("CROSSFADE_SECS");
+	if (env_xf && atoi(env_xf) > 0)
+		crossfade_secs = atoi(env_xf) > 30 ? 30 : atoi(env_xf);
+	const char *env_sleep = getenv("SLEEP_MINUTES");
+	if (env_sleep && atof(env_sleep) > 0)
+		sleep_set(atof(env_sleep) * 60);
 
 	/* derive trash_dir as sibling of songs_dir */
 	strncpy(trash_dir, songs_dir, sizeof(trash_dir) - 1);
@@ -954,356 +9157,134 @@ int main(int argc, char **argv) {
 		strcpy(trash_dir, "trash");
 	}
 
+	if (argc >= 2 && query_command(argv[1]) >= 0)
+		return query_main(argc, argv);
+	if (want_export)
+		return state_export();
+	if (want_import)
+		return state_import();
+	if (import_file) {
+		scan_songs();
+		song_index_rebuild();
+		return playlist_import(import_file, import_name);
+	}
+	if (run_dir_init() != 0)
+		return 1;
+	if (want_client)
+		return client_main(argv[0]);
+	if (want_daemon && daemon_start() != 0)
+		return 1;
+	FILE *script = NULL;
+	if (replay_file) {
+		script = strcmp(replay_file, "-") == 0 ? stdin : fopen(replay_file, "r");
+		if (!script) {
+			perror(replay_file);
+			return 1;
+		}
+		replay_mode = 1;
+		virt_now = real_now();
+		virt_wall = time(NULL) - virt_now;
+	}
+	if (record_file && !replay_mode && !daemon_mode) {
+		trace_fp = fopen(record_file, "w");
+		if (!trace_fp) {
+			perror(record_file);
+			return 1;
+		}
+	}
+
 	srand(time(NULL));
 	signal(SIGINT, sig_handler);
 	signal(SIGTERM, sig_handler);
 	signal(SIGQUIT, sig_handler);
 	signal(SIGPIPE, SIG_IGN);
 
-	if (scan_songs() == 0) {
-		fprintf(stderr, "No songs found in %s/\n", songs_dir);
-		return 1;
-	}
+	/* a resize only interrupts the terminal loop's ppoll(), never a
+	 * worker thread (they inherit the blocked mask) */
+	sigset_t winch_set;
+	sigemptyset(&winch_set);
+	sigaddset(&winch_set, SIGWINCH);
+	pthread_sigmask(SIG_BLOCK, &winch_set, &loop_sigmask);
+	signal(SIGWINCH, winch_handler);
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	width_table_init();
 	scan_playlists();
+	add_history_views();
+	add_dupes_view();
+	history_load();
 	load_state();
+	zones_init();
+	fc_open();
+	scan_start(); /* songs arrive through scan_poll() */
+
+	if (daemon_mode) {
+		daemon_loop();
+		cleanup();
+		return 0;
+	}
+	if (replay_mode)
+		return replay_main(script);
 
 	term_raw();
-	restore_state();
 	draw();
+	trace_at = mono_now();
+	trace_size();
 
-	struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+	double last_tick = 0;
 
 	for (;;) {
-		int ready = poll(&pfd, 1, 250);
-
-		check_child();
-		update_position();
-
-		if (ready <= 0) {
-			save_state();
-			draw();
-			continue;
-		}
+		/* stdin, the wake eventfd, then any crossfade ramp timers */
+		struct pollfd pfd[2 + MAX_ZONES];
+		int owner[MAX_ZONES];
+		pfd[0] = (struct pollfd){ .fd = STDIN_FILENO, .events = POLLIN };
+		pfd[1] = (struct pollfd){ .fd = wake_fd, .events = POLLIN };
+		int nxf = xfade_pollfds(pfd + 2, owner);
 
-		char c;
-		if (read(STDIN_FILENO, &c, 1) != 1)
-			break;
-
-		int ctrl_j = (c == 0x0a);
-		int ctrl_k = (c == 0x0b);
-		int ctrl_m = 0;
-		int enter_key = (c == '\r');
-		if (c == 0x1b) {
-			char seq[32];
-			int slen = 0;
-			struct pollfd sp = { .fd = STDIN_FILENO, .events = POLLIN };
-			while (slen < 31 && poll(&sp, 1, 20) > 0) {
-				if (read(STDIN_FILENO, &seq[slen], 1) != 1) break;
-				slen++;
-				/* CSI final byte is >= 0x40, but skip '[' introducer */
-				if (slen > 1 && seq[slen-1] >= 0x40) break;
-			}
-			seq[slen] = '\0';
-			if (strcmp(seq, "[13u") == 0) {
-				enter_key = 1;
-				c = 0;
-			} else if (strcmp(seq, "[106;5u") == 0) {
-				ctrl_j = 1;
-				c = 0;
-			} else if (strcmp(seq, "[107;5u") == 0) {
-				ctrl_k = 1;
-				c = 0;
-			} else if (strcmp(seq, "[109;5u") == 0) {
-				ctrl_m = 1;
-				c = 0;
-			} else if (slen > 0) {
-				c = 0;
-			}
-		}
-		if (enter_key && c == 0)
-			c = '\r';
+		/* SIGWINCH is blocked except while waiting here */
+		int timeout = loop_timeout(last_tick, 1);
+		struct timespec ts = { timeout / 1000, (timeout % 1000) * 1000000L };
+		int ready = ppoll(pfd, 2 + nxf, timeout < 0 ? NULL : &ts, &loop_sigmask);
+		if (ready > 0 && nxf)
+			xfade_dispatch(pfd + 2, owner, nxf);
+		int woken = (ready > 0 && (pfd[1].revents & POLLIN) && wake_drain()) || winch;
+		if (winch) trace_size();
+		winch = 0;
+		ready = ready > 0 && (pfd[0].revents & POLLIN);
+		int tick = loop_tick(ready, woken, &last_tick);
 
-		if (ctrl_m) {
-			playlist_menu = !playlist_menu;
-			if (playlist_menu) {
-				playlist_cursor = (playlist_active >= 0) ? playlist_active + 1 : 0;
-				panel_focus = PANEL_SIDEBAR;
+		if (!ready) {
+			if (tick) {
+				save_state();
+				draw();
 			} else {
-				panel_focus = PANEL_MAIN;
-			}
-			save_state();
-			draw();
-			continue;
-		}
-
-		if ((ctrl_j || ctrl_k) && playlist_menu && !searching) {
-			panel_focus = (panel_focus == PANEL_SIDEBAR) ? PANEL_MAIN : PANEL_SIDEBAR;
-			save_state();
-			draw();
-			continue;
-		}
-		if (ctrl_j || ctrl_k)
-			c = 0;
-
-		if (searching) {
-			if (c == '\r') {
-				searching = 0;
-			} else if (c == 0x1b) {
-				searching = 0;
-				filter_active = 0;
-				cursor = find_in_display(search_prev_cursor);
-			} else if (c == 0x7f) {
-				if (search_len > 0) {
-					search_buf[--search_len] = '\0';
-					apply_filter();
-				}
-			} else if (c >= 32 && c < 127) {
-				if (search_len < (int)sizeof(search_buf) - 1) {
-					search_buf[search_len++] = c;
-					search_buf[search_len] = '\0';
-					apply_filter();
-				}
+				draw_spectrum();
+				draw_lyrics();
 			}
-			save_state();
-			draw();
 			continue;
 		}
 
-		if (playlist_menu && panel_focus == PANEL_SIDEBAR) {
-			switch (c) {
-			case 0x03: /* Ctrl+C */
-			case 'q':
-				cleanup();
-				return 0;
-			case 'j':
-				if (playlist_cursor < nplaylists) playlist_cursor++;
-				break;
-			case 'k':
-				if (playlist_cursor > 0) playlist_cursor--;
+		/* take every key already queued (autorepeat) before one flush */
+		int r = KEY_DONE;
+		for (int n = 0; r == KEY_DONE && n < KEY_BATCH; n++) {
+			struct key k;
+			if (read_key(STDIN_FILENO, &k) < 0) {
+				r = KEY_QUIT;
 				break;
-			case 'g':
-				playlist_cursor = 0;
-				break;
-			case 'G':
-				playlist_cursor = nplaylists;
-				break;
-			case ' ':
-				if (mpv_pid > 0) {
-					mpv_cmd("{\"command\":[\"cycle\",\"pause\"]}\n");
-					paused = !paused;
-				}
-				break;
-			case '\r':
-				if (playlist_cursor == 0) {
-					playlist_active = -1;
-					nplaylist_songs = 0;
-				} else {
-					playlist_active = playlist_cursor - 1;
-					load_playlist(playlist_active);
-				}
-				searching = 0;
-				search_buf[0] = '\0';
-				search_len = 0;
-				filter_active = 0;
-				cursor = 0;
-				delete_pending = -1;
-				break;
-			case 0x1b:
-				playlist_menu = 0;
-				panel_focus = PANEL_MAIN;
-				break;
-			}
-			save_state();
-			draw();
-			continue;
-		}
-
-		switch (c) {
-		case 'q':
-		case 0x03: /* Ctrl+C (SIGINT blocked by raw mode, handle byte directly) */
-			cleanup();
-			return 0;
-		case 'j':
-			if (cursor < display_len() - 1) cursor++;
-			break;
-		case 'k':
-			if (cursor > 0) cursor--;
-			break;
-		case '\r':
-			if (display_len() > 0) {
-				play_song(song_at(cursor));
-				if (shuffle) shuffle_mark(song_at(cursor));
-			}
-			break;
-		case ' ':
-			if (mpv_pid > 0) {
-				mpv_cmd("{\"command\":[\"cycle\",\"pause\"]}\n");
-				paused = !paused;
-			} else if (display_len() > 0) {
-				play_song(song_at(cursor));
-				if (shuffle) shuffle_mark(song_at(cursor));
-			}
-			break;
-		case '0':
-			if (mpv_pid > 0)
-				mpv_cmd("{\"command\":[\"seek\",\"0\",\"absolute\"]}\n");
-			break;
-		case 'h':
-			if (mpv_pid > 0)
-				mpv_cmd("{\"command\":[\"seek\",\"-5\"]}\n");
-			break;
-		case 'H': {
-			if (playing < 0 || display_len() == 0) break;
-			int len = display_len();
-			int cur = -1;
-			for (int i = 0; i < len; i++) {
-				if (song_at(i) == playing) { cur = i; break; }
-			}
-			int prev = (cur > 0) ? cur - 1 : len - 1;
-			play_song(song_at(prev));
-			if (shuffle) shuffle_mark(song_at(prev));
-			break;
-		}
-		case 'l':
-			if (mpv_pid > 0)
-				mpv_cmd("{\"command\":[\"seek\",\"5\"]}\n");
-			break;
-		case 'L': {
-			if (playing < 0 || display_len() == 0) break;
-			if (shuffle) {
-				int next = shuffle_next();
-				shuffle_mark(next);
-				play_song(next);
-			} else {
-				int len = display_len();
-				int cur = -1;
-				for (int i = 0; i < len; i++) {
-					if (song_at(i) == playing) { cur = i; break; }
-				}
-				int next = (cur >= 0 && cur + 1 < len) ? cur + 1 : 0;
-				play_song(song_at(next));
-			}
-			break;
-		}
-		case '=':
-		case '+':
-			volume += 5;
-			if (volume > 100) volume = 100;
-			if (mpv_pid > 0)
-				mpv_cmd("{\"command\":[\"add\",\"volume\",5]}\n");
-			break;
-		case '-':
-			volume -= 5;
-			if (volume < 0) volume = 0;
-			if (mpv_pid > 0)
-				mpv_cmd("{\"command\":[\"add\",\"volume\",-5]}\n");
-			break;
-		case 'm':
-			if (loop_mode == LOOP_SINGLE) {
-				loop_mode = LOOP_ALL;
-			} else {
-				loop_mode = LOOP_SINGLE;
-				shuffle = 0;
-			}
-			break;
-		case 'n':
-			shuffle = !shuffle;
-			if (shuffle) {
-				loop_mode = LOOP_ALL;
-				shuffle_clear();
-				if (playing >= 0) shuffle_mark(playing);
-			}
-			break;
-		case 'd': {
-			if (display_len() == 0) break;
-			int sidx = song_at(cursor);
-			if (delete_pending == sidx) {
-				/* confirm deletion */
-				remove_song(sidx);
-				delete_pending = -1;
-			} else {
-				/* mark for deletion */
-				delete_pending = sidx;
-			}
-			break;
-		}
-		case 0x1b: /* ESC */
-			if (delete_pending >= 0) {
-				delete_pending = -1;
-			} else {
-				kill_mpv();
 			}
-			break;
-		case '/':
-		case '?':
-			search_prev_cursor = song_at(cursor);
-			search_buf[0] = '\0';
-			search_len = 0;
-			filter_active = 0;
-			cursor = find_in_display(search_prev_cursor);
-			searching = 1;
-			break;
-		case 'g':
-			if (display_len() > 0) cursor = 0;
-			break;
-		case 'G':
-			if (display_len() > 0) cursor = display_len() - 1;
-			break;
-		case 0x05: { /* Ctrl+E — scroll down one line */
-			int cnt = display_len();
-			int lr = term_rows() - 4;
-			if (cnt > lr && scroll_offset < cnt - lr)
-				scroll_offset++;
-			if (cursor < scroll_offset)
-				cursor = scroll_offset;
-			break;
-		}
-		case 0x19: { /* Ctrl+Y — scroll up one line */
-			int lr = term_rows() - 4;
-			if (scroll_offset > 0)
-				scroll_offset--;
-			if (cursor >= scroll_offset + lr)
-				cursor = scroll_offset + lr - 1;
-			break;
+			r = handle_key(&k);
+			if (poll(pfd, 1, 0) <= 0) break;
 		}
-		case 0x04: { /* Ctrl+D — scroll down half page */
-			int half = (term_rows() - 4) / 2;
-			int cnt = display_len();
-			cursor += half;
-			scroll_offset += half;
-			if (cursor >= cnt) cursor = cnt - 1;
+		trace_batch();
+		if (r != KEY_DONE)
 			break;
-		}
-		case 0x15: { /* Ctrl+U — scroll up half page */
-			int half = (term_rows() - 4) / 2;
-			cursor -= half;
-			scroll_offset -= half;
-			if (cursor < 0) cursor = 0;
-			if (scroll_offset < 0) scroll_offset = 0;
-			break;
-		}
-		case 0x06: { /* Ctrl+F — scroll down full page */
-			int lr = term_rows() - 4;
-			int cnt = display_len();
-			cursor += lr;
-			scroll_offset += lr;
-			if (cursor >= cnt) cursor = cnt - 1;
-			break;
-		}
-		case 0x02: { /* Ctrl+B — scroll up full page */
-			int lr = term_rows() - 4;
-			cursor -= lr;
-			scroll_offset -= lr;
-			if (cursor < 0) cursor = 0;
-			if (scroll_offset < 0) scroll_offset = 0;
-			break;
-		}
-		}
 
+		ipc_flush();
 		save_state();
 		draw();
 	}
 
+	state_flush();
 	cleanup();
 	return 0;
 }
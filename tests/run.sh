@@ -17,7 +17,10 @@ command -v mpv >/dev/null 2>&1 && HAS_MPV=1
 
 cleanup() {
 	tmux kill-session -t "$SESSION" 2>/dev/null || true
-	rm -f "$DIR/state.save"
+	rm -f "$DIR/state.save" "$DIR/state.bin" "$DIR/history.log" "$DIR/history.snap"
+	rm -rf "$DIR/cache"
+	pkill -f "$BINARY --daemon" 2>/dev/null || true
+	rm -f "$DIR/musicplayer.sock"
 }
 trap cleanup EXIT
 
@@ -36,6 +39,32 @@ start_resume() {
 	sleep 0.4
 }
 
+# Launch in $WDIR with it as MUSIC_PLAYER_HOME and $WDIR/bin (fake mpv)
+# first in PATH. -x/-y set the pane size, VAR=value words go into the
+# environment and words after -- onto the command line. No settle time:
+# callers sleep as long as their setup needs.
+start_home() {
+	local x=80 y=24 env="" args=""
+	while [ $# -gt 0 ]; do
+		case "$1" in
+		-x) x="$2"; shift 2 ;;
+		-y) y="$2"; shift 2 ;;
+		--) shift; args=" $*"; break ;;
+		*) env="$env$1 "; shift ;;
+		esac
+	done
+	tmux kill-session -t "$SESSION" 2>/dev/null || true
+	tmux new-session -d -s "$SESSION" -x "$x" -y "$y" \
+		"cd $WDIR && ${env}PATH=$WDIR/bin:\$PATH MUSIC_PLAYER_HOME=$WDIR $BINARY --tmux$args; echo; echo __EXITED__; sleep 10"
+}
+
+# $WDIR/bin/mpv runs tests/fake-mpv with these options (see its header)
+fake_mpv() {
+	mkdir -p "$WDIR/bin"
+	printf '#!/bin/sh\nexec "%s" %s -- "$@"\n' "$DIR/fake-mpv" "$*" > "$WDIR/bin/mpv"
+	chmod +x "$WDIR/bin/mpv"
+}
+
 send() {
 	if [ "$1" = "Enter" ]; then
 		send_seq $'\r'
@@ -58,6 +87,24 @@ wait_ms() {
 	sleep "0.$1"
 }
 
+# Poll the screen until it shows $1, for at most $2 seconds (default 5),
+# for setups whose time depends on the machine, such as big scans.
+wait_for() {
+	local tries=$(( ${2:-5} * 10 ))
+	while [ "$tries" -gt 0 ] && ! capture | grep -qF -- "$1"; do
+		sleep 0.1
+		tries=$((tries - 1))
+	done
+}
+
+wait_gone() {
+	local tries=$(( ${2:-5} * 10 ))
+	while [ "$tries" -gt 0 ] && capture | grep -qF -- "$1"; do
+		sleep 0.1
+		tries=$((tries - 1))
+	done
+}
+
 assert_contains() {
 	local label="$1" needle="$2"
 	local screen
@@ -86,6 +133,18 @@ assert_not_contains() {
 	fi
 }
 
+assert_true() {
+	local label="$1"
+	shift
+	if "$@"; then
+		printf "  \033[32mPASS\033[0m %s\n" "$label"
+		PASS=$((PASS + 1))
+	else
+		printf "  \033[31mFAIL\033[0m %s — command failed: %s\n" "$label" "$*"
+		FAIL=$((FAIL + 1))
+	fi
+}
+
 skip() {
 	local label="$1"
 	printf "  \033[33mSKIP\033[0m %s\n" "$label"
@@ -476,6 +535,1302 @@ wait_ms 300
 assert_contains "search within playlist finds alpha" "> alpha.mp3"
 assert_not_contains "search within playlist hides gamma" "gamma.ogg"
 
+echo ""
+echo "Smart playlist: query evaluation"
+start
+send_seq $'\033[109;5u'
+wait_ms 200
+assert_contains "smart playlist listed in sidebar" "upbeat"
+send j
+send j
+wait_ms 200
+send Enter
+wait_ms 300
+assert_contains "smart playlist header" "[upbeat]"
+assert_contains "order by name desc puts gamma first" "> gamma.ogg"
+assert_contains "smart playlist matches beta" "beta.flac"
+assert_not_contains "smart playlist excludes alpha" "alpha.mp3"
+
+echo ""
+echo "Up-next queue: enqueue and panel"
+start
+send a
+send j
+send j
+send a
+send k
+send A
+send u
+wait_ms 300
+assert_contains "queue panel shows count" "Up next (3)"
+assert_contains "A puts beta first" "1. beta.flac"
+assert_contains "a appends alpha" "2. alpha.mp3"
+assert_contains "a appends gamma last" "3. gamma.ogg"
+send U
+wait_ms 200
+assert_contains "U drops last entry" "Up next (2)"
+assert_not_contains "gamma no longer queued" "3. gamma.ogg"
+send q
+wait_ms 500
+start_resume
+wait_ms 300
+send u
+wait_ms 400
+assert_contains "queue restored from state" "Up next (2)"
+assert_contains "queue order restored" "1. beta.flac"
+send C
+wait_ms 200
+assert_contains "C clears queue" "(empty)"
+send u
+wait_ms 200
+assert_not_contains "u hides panel" "Up next"
+
+echo ""
+echo "Up-next queue: queue all filtered"
+start
+send /
+send 'alpha|gamma'
+wait_ms 200
+send Enter
+send '*'
+send u
+wait_ms 300
+assert_contains "* queues every filtered song" "Up next (2)"
+assert_contains "* keeps display order" "2. gamma.ogg"
+
+echo ""
+echo "Spectrum: FFT band analysis of generated WAVs"
+WAVDIR="$(mktemp -d)"
+python3 -c "
+import math, struct, wave
+for name, freq in [('low.wav', 200), ('high.wav', 5000)]:
+    with wave.open('$WAVDIR/' + name, 'w') as w:
+        w.setnchannels(1)
+        w.setsampwidth(2)
+        w.setframerate(22050)
+        w.writeframes(b''.join(struct.pack('<h', int(16000 * math.sin(2 * math.pi * freq * i / 22050))) for i in range(4096)))
+with wave.open('$WAVDIR/silence.wav', 'w') as w:
+    w.setnchannels(2)
+    w.setsampwidth(2)
+    w.setframerate(44100)
+    w.writeframes(b'\x00\x00\x00\x00' * 4096)
+"
+LOW_PEAK="$("$BINARY" --spectrum "$WAVDIR/low.wav" 32 | sed -n 's/^peak=//p')"
+HIGH_PEAK="$("$BINARY" --spectrum "$WAVDIR/high.wav" 32 | sed -n 's/^peak=//p')"
+assert_true "200 Hz peaks in band 9" [ "$LOW_PEAK" = 9 ]
+assert_true "5 kHz peaks in band 27" [ "$HIGH_PEAK" = 27 ]
+assert_true "silence renders an empty bar" \
+	[ "$("$BINARY" --spectrum "$WAVDIR/silence.wav" 16 | head -1)" = "                " ]
+assert_true "non-WAV input is rejected" \
+	bash -c "! '$BINARY' --spectrum '$DIR/songs/alpha.mp3' 2>/dev/null"
+rm -rf "$WAVDIR"
+
+echo ""
+echo "Spectrum: b toggle persists"
+start
+send b
+wait_ms 200
+send q
+wait_ms 500
+assert_true "b writes spectrum=1 to state" grep -qx "spectrum=1" "$DIR/state.save"
+
+echo ""
+echo "Spectrum: bands measured by the playing mpv"
+WDIR="$(mktemp -d)"
+mkdir -p "$WDIR/songs" "$WDIR/bin"
+touch "$WDIR/songs/a.mp3"
+printf 'spectrum=1\n' > "$WDIR/state.save"
+fake_mpv --viz
+start_home FAKE_MPV_LOG=$WDIR/mpv.log
+sleep 0.5
+send Enter
+sleep 0.8
+assert_true "tap is a filter on the playing mpv" grep -q " argv .*--af=@viz:lavfi=%[0-9]*%asplit" "$WDIR/mpv.log"
+assert_true "no second decoder" [ "$(grep -c " argv .*ipc-server" "$WDIR/mpv.log")" -eq 1 ]
+assert_true "low bands full, high bands empty" \
+	sh -c 'tmux capture-pane -t "$0" -p | head -1 | grep -q "████.*[▁▂▃▄▅▆]$"' "$SESSION"
+send b
+wait_ms 300
+assert_true "b off removes the filter" grep -q 'cmd \["af", "remove", "@viz"\]' "$WDIR/mpv.log"
+assert_not_contains "bar hidden" "█"
+send b
+wait_ms 500
+assert_true "b on adds it in front of the chain" grep -q 'cmd \["af", "pre", "@viz:lavfi=' "$WDIR/mpv.log"
+assert_contains "bar back from the new frames" "████"
+send q
+wait_ms 300
+rm -rf "$WDIR"
+
+echo ""
+echo "Spectrum: the bar follows the playback position"
+WDIR="$(mktemp -d)"
+mkdir -p "$WDIR/songs" "$WDIR/bin"
+touch "$WDIR/songs/a.mp3"
+printf 'spectrum=1\n' > "$WDIR/state.save"
+fake_mpv --viz --viz-flip 4
+start_home
+sleep 0.5
+send Enter
+sleep 0.8
+low() { tmux capture-pane -t "$SESSION" -p | head -1 | grep -q "████.*[▁▂▃▄▅▆]$"; }
+high() { tmux capture-pane -t "$SESSION" -p | head -1 | grep -Eq "1:40 {3,}(▁|▂|▃|▄|▅|▆|▇)?(█)+$"; }
+assert_true "before the flip the low bands are lit" low
+send l
+sleep 0.6
+assert_true "seeking past it draws the frames from there" high
+send 0
+sleep 0.6
+assert_true "seeking back draws the low bands again" low
+send q
+wait_ms 300
+rm -rf "$WDIR"
+
+echo ""
+echo "Loudness: R128 meter on generated WAVs"
+WAVDIR="$(mktemp -d)"
+python3 -c "
+import math, struct, wave
+amp = 10 ** (-23 / 20) * 32767
+with wave.open('$WAVDIR/ref.wav', 'w') as w:
+    w.setnchannels(2)
+    w.setsampwidth(2)
+    w.setframerate(48000)
+    w.writeframes(b''.join(struct.pack('<hh', int(amp * math.sin(2 * math.pi * 1000 * i / 48000)), int(amp * math.sin(2 * math.pi * 1000 * i / 48000))) for i in range(48000 * 3)))
+amp = 10 ** (-6 / 20) * 32767
+with wave.open('$WAVDIR/intersample.wav', 'w') as w:
+    w.setnchannels(1)
+    w.setsampwidth(2)
+    w.setframerate(48000)
+    w.writeframes(b''.join(struct.pack('<h', int(amp * math.sin(math.pi * i / 2 + math.pi / 4))) for i in range(48000)))
+"
+assert_true "-23 dBFS stereo 1 kHz sine measures -23 LUFS" \
+	grep -q "^lufs=-23.0 " <("$BINARY" --loudness "$WAVDIR/ref.wav")
+assert_true "gain targets -18 LUFS" \
+	grep -q "gain=5.0$" <("$BINARY" --loudness "$WAVDIR/ref.wav")
+assert_true "true peak finds inter-sample peak above sample peak" \
+	grep -q "peak=-6.[01] " <("$BINARY" --loudness "$WAVDIR/intersample.wav")
+rm -rf "$WAVDIR"
+
+echo ""
+echo "Waveform: thumbnails of generated WAVs"
+WAVDIR="$(mktemp -d)"
+python3 -c "
+import math, struct, wave
+with wave.open('$WAVDIR/ramp.wav', 'w') as w:
+    w.setnchannels(1)
+    w.setsampwidth(2)
+    w.setframerate(8000)
+    w.writeframes(b''.join(struct.pack('<h', int((600 if i < 8000 else 30000) * math.sin(2 * math.pi * 440 * i / 8000))) for i in range(16000)))
+"
+assert_true "quiet half then loud half" \
+	[ "$("$BINARY" --waveform "$WAVDIR/ramp.wav" 8)" = "▂▂▂▂████" ]
+assert_true "non-WAV input is rejected" \
+	bash -c "! '$BINARY' --waveform '$DIR/songs/alpha.mp3' 2>/dev/null"
+rm -rf "$WAVDIR"
+
+echo ""
+echo "Waveform: corrupt cache file is rebuilt"
+cleanup
+mkdir -p "$DIR/cache"
+printf 'garbage' > "$DIR/cache/waveforms"
+start_resume
+send q
+wait_ms 500
+assert_true "cache header rewritten" \
+	bash -c "head -c 4 '$DIR/cache/waveforms' | grep -qx MPWF"
+
+echo ""
+echo "Durations: container header parsing"
+WAVDIR="$(mktemp -d)"
+mkdir -p "$WAVDIR/songs"
+python3 -c "
+import struct, wave
+d = '$WAVDIR/songs'
+with wave.open(d + '/a.wav', 'w') as w:
+    w.setnchannels(1)
+    w.setsampwidth(2)
+    w.setframerate(8000)
+    w.writeframes(b'\\0\\0' * 20000)
+si = struct.pack('>HH', 4096, 4096) + bytes(6) + struct.pack('>Q', 44100 << 44 | 1 << 41 | 15 << 36 | 441000) + bytes(16)
+open(d + '/b.flac', 'wb').write(b'fLaC' + bytes([0x80, 0, 0, 34]) + si)
+def page(gran, seq, data, flags):
+    return b'OggS' + bytes([0, flags]) + struct.pack('<qII', gran, 7, seq) + bytes(4) + bytes([1, len(data)]) + data
+vid = b'\\x01vorbis' + struct.pack('<IBI', 0, 2, 48000) + bytes(16)
+open(d + '/c.ogg', 'wb').write(page(0, 0, vid, 2) + page(48000 * 7, 1, bytes(10), 4))
+frame = bytes([0xff, 0xfb, 0x90, 0x44]) + bytes(413)
+open(d + '/d.mp3', 'wb').write(b'ID3\\x04' + bytes(5) + b'\\x0a' + bytes(10) + frame * 100)
+xing = bytearray(frame)
+xing[36:48] = b'Xing' + struct.pack('>II', 1, 1000)
+open(d + '/e.mp3', 'wb').write(bytes(xing) + frame * 3)
+"
+probe() { "$BINARY" --duration "$WAVDIR/songs/$1" | cut -d' ' -f1; }
+assert_true "WAV data chunk" [ "$(probe a.wav)" = 2.50 ]
+assert_true "FLAC STREAMINFO" [ "$(probe b.flac)" = 10.00 ]
+assert_true "Ogg Vorbis last granule" [ "$(probe c.ogg)" = 7.00 ]
+assert_true "MP3 frame walk after ID3v2" [ "$(probe d.mp3)" = 2.61 ]
+assert_true "MP3 Xing frame count" [ "$(probe e.mp3)" = 26.12 ]
+assert_true "empty file has no duration" \
+	bash -c "! '$BINARY' --duration '$DIR/songs/alpha.mp3' 2>/dev/null"
+
+WDIR="$WAVDIR" start_home
+sleep 0.8
+assert_contains "header totals the library" "5 songs 0:48"
+send /
+send_seq "mp3"
+send Enter
+wait_ms 300
+assert_contains "header totals the filter result" "2 songs 0:29"
+send q
+wait_ms 300
+assert_true "durations cached" [ "$(wc -l < "$WAVDIR/cache/durations")" = 5 ]
+rm -rf "$WAVDIR"
+
+echo ""
+echo "Durations: totals with unknown lengths"
+start
+assert_contains "unparsed songs counted without a time" "| 3 songs"
+
+echo ""
+echo "UTF-8: rows are cut and padded by terminal column"
+WDIR="$(mktemp -d)"
+mkdir -p "$WDIR/songs" "$WDIR/playlists"
+touch "$WDIR/songs/あいうえおかきくけこさしすせそたちつてと.mp3" "$WDIR/songs/Café - Été.flac"
+printf 'Café - Été.flac\n' > "$WDIR/playlists/Mélodies.playlist"
+start_home -x 40 -y 12
+sleep 0.5
+assert_contains "accented name intact" "> Café - Été.flac"
+assert_contains "wide name fills 38 columns" "  あいうえおかきくけこさしすせそたちつて"
+assert_not_contains "wide name does not overflow" "てと"
+send_seq $'\033[109;5u'
+wait_ms 300
+assert_true "sidebar border stays aligned" bash -c "tmux capture-pane -t '$SESSION' -p | sed -n '3,4p' | python3 -c '
+import sys, unicodedata
+cols = set()
+for line in sys.stdin:
+    w = 0
+    for ch in line:
+        if ch == \"\\u2502\":
+            cols.add(w)
+            break
+        w += 2 if unicodedata.east_asian_width(ch) in \"WF\" else 1
+sys.exit(0 if cols == {24} else 1)
+'"
+assert_contains "accented playlist name" "Mélodies"
+send q
+wait_ms 300
+rm -rf "$WDIR"
+
+echo ""
+echo "Sort: s cycles cached orders and keeps the cursor"
+WDIR="$(mktemp -d)"
+mkdir -p "$WDIR/songs" "$WDIR/playlists"
+touch -d "2024-01-03" "$WDIR/songs/C - two.mp3"
+touch -d "2024-01-01" "$WDIR/songs/b - one.mp3"
+touch -d "2024-01-02" "$WDIR/songs/D - three.mp3"
+printf 'D - three.mp3\nC - two.mp3\n' > "$WDIR/playlists/pl.playlist"
+start_home
+sleep 0.5
+row() { capture | sed -n "$1p"; }
+assert_true "name order is byte order" [ "$(row 3)" = "> C - two.mp3" ]
+send s
+wait_ms 300
+assert_contains "header names the order" "| by artist"
+assert_true "artist order ignores case" [ "$(row 3)" = "  b - one.mp3" ]
+assert_true "cursor follows its song" [ "$(row 4)" = "> C - two.mp3" ]
+send s
+wait_ms 300
+assert_true "added order is newest first" \
+	[ "$(row 3)" = "> C - two.mp3" -a "$(row 4)" = "  D - three.mp3" -a "$(row 5)" = "  b - one.mp3" ]
+send_seq $'\033[109;5u'
+send j
+send Enter
+send_seq $'\033[109;5u'
+wait_ms 300
+assert_true "playlist reordered by the same key" \
+	[ "$(row 3)" = "> C - two.mp3" -a "$(row 4)" = "  D - three.mp3" ]
+# a re-sort works on the loaded list; only name order reads the file
+printf 'D - three.mp3\nC - two.mp3\nb - one.mp3\n' > "$WDIR/playlists/pl.playlist"
+send s
+wait_ms 300
+assert_not_contains "re-sort does not re-read the playlist" "b - one.mp3"
+send S
+send S
+send S
+wait_ms 300
+assert_true "name keeps playlist file order" \
+	[ "$(row 3)" = "  D - three.mp3" -a "$(row 4)" = "> C - two.mp3" -a "$(row 5)" = "  b - one.mp3" ]
+send q
+wait_ms 300
+rm -rf "$WDIR"
+
+WDIR="$(mktemp -d)"
+mkdir -p "$WDIR/songs" "$WDIR/playlists"
+python3 -c "
+import os
+for i in range(6000):
+    p = '$WDIR/songs/t%04d.mp3' % i
+    open(p, 'w').close()
+    t = 1700000000 + (i * 7919) % 6000
+    os.utime(p, (t, t))
+"
+EXPECT="$(python3 -c "
+print(' '.join('t%04d.mp3' % i for i in sorted(range(6000), key=lambda i: -((i * 7919) % 6000))[:20]))")"
+start_home
+sleep 0.8
+send s
+send s
+wait_ms 400
+send g
+wait_ms 200
+assert_true "parallel sort of 6000 songs by added" \
+	[ "$(capture | sed -n '3,22p' | cut -c3- | tr -s ' \n' ' ' | sed 's/ $//')" = "$EXPECT" ]
+send q
+wait_ms 300
+rm -rf "$WDIR"
+
+echo ""
+echo "Readahead and buffering: fake mpv over IPC"
+WDIR="$(mktemp -d)"
+mkdir -p "$WDIR/songs" "$WDIR/playlists" "$WDIR/bin"
+head -c 8192 /dev/zero > "$WDIR/songs/a.mp3"
+head -c 8192 /dev/zero > "$WDIR/songs/b.mp3"
+# 30s track, stalled for cache from 0.5s to 2s
+fake_mpv --len 30 --stall 0.5-2
+start_home FAKE_MPV_LOG=$WDIR/mpv.log
+sleep 0.5
+touch -a -d "2000-01-01" "$WDIR/songs/b.mp3" # after the startup duration probe
+send Enter
+sleep 1.2
+assert_contains "stall shown while mpv waits for cache" "[buffering] a.mp3"
+assert_true "next track read ahead" [ "$(stat -c %X "$WDIR/songs/b.mp3")" -gt 946771200 ]
+sleep 1.3
+assert_contains "underrun counted with buffer level" "[playing] a.mp3  (1 stall, 4s buffered)"
+assert_true "stall raises mpv readahead" \
+	grep -q 'cmd \["set_property", "demuxer-readahead-secs", 30\]' "$WDIR/mpv.log"
+send L
+wait_ms 500
+assert_true "next track starts with the larger cache" \
+	grep -q "argv .*--cache=yes --demuxer-readahead-secs=30 .*b.mp3" "$WDIR/mpv.log"
+send q
+wait_ms 300
+rm -rf "$WDIR"
+
+echo ""
+echo "IPC coalescing: seeks and volume steps"
+WDIR="$(mktemp -d)"
+mkdir -p "$WDIR/songs" "$WDIR/playlists" "$WDIR/bin"
+touch "$WDIR/songs/a.mp3"
+fake_mpv
+start_home FAKE_MPV_LOG=$WDIR/mpv.log
+sleep 0.5
+send Enter
+wait_ms 500
+send_seq "llllllll"
+wait_ms 100
+assert_contains "progress jumps to the seek target" "0:4"
+wait_ms 400
+assert_true "eight seeks sent as one" [ "$(grep -c '"seek"' "$WDIR/mpv.log")" -eq 1 ]
+assert_true "seek is absolute" grep -Eq 'cmd \["seek", 4[0-9]\.[0-9]+, "absolute"\]' "$WDIR/mpv.log"
+send_seq "----"
+wait_ms 500
+assert_true "four volume steps sent as one set" sh -c \
+	'[ "$(grep -c "\"volume\"" "$0")" -eq 1 ] && grep -q "cmd \[\"set_property\", \"volume\", 80\]" "$0"' "$WDIR/mpv.log"
+assert_contains "position reconciled from mpv" "0:4"
+echo 42 > "$WDIR/mpv.log.vol"
+sleep 1.2 # the next progress tick polls mpv
+assert_true "volume reconciled from mpv" grep -q "^volume=42$" "$WDIR/state.save"
+send q
+wait_ms 300
+rm -rf "$WDIR"
+
+echo ""
+echo "File cache: local copies, validation and LRU eviction"
+WDIR="$(mktemp -d)"
+mkdir -p "$WDIR/songs" "$WDIR/playlists" "$WDIR/bin"
+for s in a b c; do head -c 409600 /dev/urandom > "$WDIR/songs/$s.mp3"; done
+printf '#!/bin/sh\necho "$@" >> "$FAKE_MPV_LOG"\nexec sleep 30\n' > "$WDIR/bin/mpv"
+chmod +x "$WDIR/bin/mpv"
+# the path of the cached copy of songs/$1, if any
+cached() {
+	for f in "$WDIR"/cache/songs/*; do
+		cmp -s "$f" "$WDIR/songs/$1" && echo "$f" && return 0
+	done
+	return 1
+}
+start_home -x 100 FAKE_MPV_LOG=$WDIR/mpv.log SONG_CACHE_MB=1
+sleep 0.5
+send Enter
+wait_ms 800
+send i
+wait_ms 300
+assert_contains "first play is a miss" "file cache: 0 hits, 1 miss, 2 files, 0.8 of 1 MB"
+assert_true "played and upcoming songs copied" sh -c '[ -n "$0" ] && [ -n "$1" ]' "$(cached a.mp3)" "$(cached b.mp3)"
+send Escape
+wait_ms 200
+send Enter
+wait_ms 500
+assert_contains "replay is a hit" "file cache: 1 hit, 1 miss"
+assert_true "mpv plays the local copy" grep -q "$(cached a.mp3)\$" "$WDIR/mpv.log"
+send j
+send j
+send Enter
+sleep 1.2 # a tick: the upcoming song is requested then
+assert_true "least recently used copy evicted" sh -c '[ -n "$0" ] && [ -n "$1" ] && [ -z "$2" ]' \
+	"$(cached a.mp3)" "$(cached c.mp3)" "$(cached b.mp3)"
+touch -m -d "2001-01-01" "$WDIR/songs/a.mp3"
+send g
+send Enter
+wait_ms 500
+assert_contains "changed source is a miss" "file cache: 1 hit, 3 misses"
+assert_true "changed source plays from songs_dir" grep -q "songs/a.mp3\$" "$WDIR/mpv.log"
+send q
+wait_ms 300
+rm -rf "$WDIR"
+
+echo ""
+echo "Zones: independent playback contexts"
+WDIR="$(mktemp -d)"
+mkdir -p "$WDIR/songs" "$WDIR/playlists" "$WDIR/bin"
+touch "$WDIR"/songs/{a,b,c}.mp3
+# a.mp3 ends after a second; the others play on
+cat > "$WDIR/bin/mpv" <<'SH'
+#!/bin/bash
+echo "$@" >> "$FAKE_MPV_LOG"
+case "$*" in
+*a.mp3) sleep 1 ;;
+*) exec -a "fake-mpv $*" sleep 30 ;;
+esac
+SH
+chmod +x "$WDIR/bin/mpv"
+start_home FAKE_MPV_LOG=$WDIR/mpv.log MUSIC_PLAYER_ZONES=kitchen,den
+sleep 0.5
+assert_contains "header names the zone" "| zone kitchen"
+send Enter
+wait_ms 200
+send Tab
+wait_ms 200
+assert_contains "Tab switches zone" "| zone den"
+assert_not_contains "new zone is stopped" "[playing]"
+send -
+send -
+# the screen now lists c.mp3 only; the first zone keeps its own list
+send_seq "/c"
+send Enter
+send Enter
+wait_ms 500
+assert_contains "second zone plays its own song" "[playing] c.mp3"
+assert_true "zones get separate mpv sockets" \
+	[ "$(grep -o 'input-ipc-server=[^ ]*' "$WDIR/mpv.log" | sort -u | wc -l)" -eq 2 ]
+assert_true "volume is per zone" grep -q -- "--volume=90 .*c.mp3" "$WDIR/mpv.log"
+wait_ms 900
+assert_true "background zone advances through its own list" grep -q -- "--volume=100 .*b.mp3" "$WDIR/mpv.log"
+send Tab
+wait_ms 200
+assert_contains "first zone kept its playback" "[playing] b.mp3"
+assert_true "two mpv instances at once" [ "$(pgrep -fc "fake-mpv .*ipc-server.*$WDIR")" -eq 2 ]
+send q
+wait_ms 300
+assert_true "quit stops every zone" sh -c '! pgrep -f "[f]ake-mpv .*ipc-server.*$0" >/dev/null' "$WDIR"
+rm -rf "$WDIR"
+
+echo ""
+echo "Lyrics: .lrc sidecars and lyrics dir"
+WDIR="$(mktemp -d)"
+mkdir -p "$WDIR/songs" "$WDIR/playlists" "$WDIR/lyrics" "$WDIR/bin"
+touch "$WDIR"/songs/{a,b,c}.mp3
+printf '[ar:Someone]\n[00:00.00]first line\n[00:03.00][00:01.50]chorus\n[00:02.20]second\n' > "$WDIR/songs/a.lrc"
+printf '[offset:+1000]\r\n[00:02.00]bee line\r\n' > "$WDIR/lyrics/b.lrc"
+printf '#!/bin/sh\nexec sleep 30\n' > "$WDIR/bin/mpv"
+chmod +x "$WDIR/bin/mpv"
+# the lyric panel row holding the current line
+current_lyric() {
+	capture | grep -A2 " Lyrics " | sed -n 3p
+}
+start_home
+sleep 0.5
+assert_contains "lrc sidecar is not listed as a song" "3 songs"
+send y
+wait_ms 200
+assert_contains "lyrics panel opens" "(nothing playing)"
+send Enter
+wait_ms 500
+assert_true "first line is current" sh -c 'echo "$0" | grep -q "first line"' "$(current_lyric)"
+sleep 1.3
+assert_true "repeated timestamp line follows" sh -c 'echo "$0" | grep -q chorus' "$(current_lyric)"
+assert_contains "next line shown" "second"
+send j
+send Enter
+wait_ms 300
+assert_true "lyrics dir file, offset applied" sh -c '! echo "$0" | grep -q "bee line"' "$(current_lyric)"
+sleep 1
+assert_true "offset line reached" sh -c 'echo "$0" | grep -q "bee line"' "$(current_lyric)"
+send j
+send Enter
+wait_ms 300
+assert_contains "song without lyrics" "(no lyrics)"
+send q
+wait_ms 300
+rm -rf "$WDIR"
+
+echo ""
+echo "Crossfade: overlapping instances on a timer-driven ramp"
+WDIR="$(mktemp -d)"
+mkdir -p "$WDIR/songs" "$WDIR/playlists" "$WDIR/bin"
+touch "$WDIR/songs/a.mp3" "$WDIR/songs/b.mp3"
+fake_mpv --len a.mp3=4 --len 30 --exit
+start_home -x 100 FAKE_MPV_LOG=$WDIR/mpv.log
+sleep 0.5
+send x
+send Enter
+wait_ms 300
+assert_contains "x turns crossfade on" "[xfade 2s]"
+sleep 2.7
+assert_true "two instances play during the fade" sh -c \
+	'[ "$(pgrep -fc "[i]pc-server=.*/mpv\..*\.sock")" -eq 2 ]'
+sleep 1.8
+OLD="$(head -1 "$WDIR/mpv.log" | cut -d' ' -f1)"
+NEW="$(sed -n 's/ argv .*--volume=0 .*//p' "$WDIR/mpv.log" | head -1)"
+assert_true "next song starts silent on the other socket" sh -c '[ -n "$1" ] && [ "$0" != "$1" ]' "$OLD" "$NEW"
+assert_true "outgoing instance retired" grep -q "^$OLD exit\$" "$WDIR/mpv.log"
+assert_true "one instance left after the fade" sh -c \
+	'[ "$(pgrep -fc "[i]pc-server=.*/mpv\..*\.sock")" -eq 1 ]'
+assert_true "ramp runs in many small steps" sh -c \
+	'[ "$(grep -c "^$1 cmd .*\"volume\"" "$0")" -ge 30 ] && [ "$(grep -c "^$2 cmd .*\"volume\"" "$0")" -ge 30 ]' \
+	"$WDIR/mpv.log" "$OLD" "$NEW"
+assert_true "incoming ends at full volume" sh -c \
+	'grep "^$1 cmd .*\"volume\"" "$0" | tail -1 | grep -q " 100\]$"' "$WDIR/mpv.log" "$NEW"
+send i
+wait_ms 300
+LATE="$(capture | sed -n 's/.*crossfade: 2s, last ramp [0-9]* steps, \([0-9.]*\) ms late.*/\1/p')"
+assert_true "ramp steps stay on schedule" awk -v l="$LATE" 'BEGIN { exit !(l != "" && l < 20) }'
+send q
+wait_ms 300
+rm -rf "$WDIR"
+
+echo ""
+echo "Scheduler: no idle wakeups, sleep timer"
+WDIR="$(mktemp -d)"
+mkdir -p "$WDIR/songs" "$WDIR/playlists" "$WDIR/bin"
+touch "$WDIR/songs/a.mp3" "$WDIR/songs/b.mp3"
+fake_mpv
+# voluntary context switches of the player's main thread
+wakeups() {
+	local pid
+	pid="$(pgrep -x musicplayer -P "$(tmux display -p -t "$SESSION" '#{pane_pid}')")"
+	sed -n 's/^voluntary_ctxt_switches:\t*//p' "/proc/$pid/status"
+}
+start_home FAKE_MPV_LOG=$WDIR/mpv.log
+sleep 1
+W="$(wakeups)"
+sleep 1.5
+assert_true "stopped player sleeps" [ "$(($(wakeups) - W))" -le 1 ]
+send Enter
+wait_ms 500
+send Space
+wait_ms 300
+W="$(wakeups)"
+M="$(stat -c %y "$WDIR/state.save")"
+sleep 1.5
+assert_true "paused player sleeps" [ "$(($(wakeups) - W))" -le 1 ]
+assert_true "state.save left alone while paused" [ "$(stat -c %y "$WDIR/state.save")" = "$M" ]
+send b
+wait_ms 300
+W="$(wakeups)"
+sleep 1.5
+assert_true "paused player sleeps with the spectrum on" [ "$(($(wakeups) - W))" -le 1 ]
+send b
+send Space
+wait_ms 200
+send z
+wait_ms 200
+assert_contains "z sets a sleep timer" "[sleep 15m] a.mp3"
+send z
+wait_ms 200
+assert_contains "z lengthens it" "[sleep 30m] a.mp3"
+send_seq "zz"
+wait_ms 200
+assert_not_contains "z after the longest turns it off" "[sleep"
+send q
+wait_ms 300
+rm -f "$WDIR/mpv.log"
+start_home FAKE_MPV_LOG=$WDIR/mpv.log SLEEP_MINUTES=0.05
+sleep 0.5
+send Enter
+wait_ms 300
+assert_true "SLEEP_MINUTES counts down" sh -c 'tmux capture-pane -t "$0" -p | grep -Eq "\[sleep [23]s\] a.mp3"' "$SESSION"
+sleep 3
+assert_contains "playback stopped at the deadline" "j/k:nav"
+assert_true "mpv stopped" sh -c '! pgrep -f "[i]pc-server=.*/mpv\..*\.sock" >/dev/null'
+assert_true "volume faded out in steps" sh -c \
+	'[ "$(grep -c "\"volume\", [0-9]" "$0")" -ge 8 ] && [ "$(grep -o "\"volume\", [0-9]*" "$0" | cut -d" " -f2 | sort -n | head -1)" -lt 15 ]' \
+	"$WDIR/mpv.log"
+assert_true "volume setting kept" grep -q "^volume=100$" "$WDIR/state.save"
+send q
+wait_ms 300
+rm -rf "$WDIR"
+
+echo ""
+echo "Playlist import: M3U, PLS and XSPF"
+WDIR="$(mktemp -d)"
+mkdir -p "$WDIR/songs" "$WDIR/lists"
+touch "$WDIR/songs/Artist - One.mp3" "$WDIR/songs/Artist - Two.flac" \
+	"$WDIR/songs/x y.mp3" "$WDIR/songs/Other - Three.ogg"
+cat > "$WDIR/lists/mix.m3u8" <<M3U
+#EXTM3U
+#EXTINF:200,Artist - One
+../songs/Artist - One.mp3
+$WDIR/songs/x y.mp3
+file://$WDIR/songs/Other%20-%20Three.ogg
+E:\\Music\\ARTIST - TWO.FLAC
+#EXTINF:100,Other - Three
+C:\\Music\\renamed.ogg
+/elsewhere/nope.mp3
+http://radio.example/stream
+M3U
+printf '[playlist]\r\nFile2=../songs/x y.mp3\r\nTitle1=Artist - Two\r\nFile1=/old/box/gone.flac\r\nNumberOfEntries=2\r\n' \
+	> "$WDIR/lists/radio.pls"
+cat > "$WDIR/lists/fav.xspf" <<XSPF
+<?xml version="1.0" encoding="UTF-8"?>
+<playlist version="1" xmlns="http://xspf.org/ns/0/"><trackList>
+<track><location>file://$WDIR/songs/Artist%20-%20One.mp3</location></track>
+<track><title>Three</title><creator>Other</creator></track>
+<track><location>../songs/x%20y.mp3</location></track>
+<track><title>Missing &amp; Gone</title></track>
+</trackList></playlist>
+XSPF
+imp() {
+	(cd "$WDIR" && SONGS_DIR=songs PLAYLISTS_DIR=playlists "$BINARY" --import-playlist "$@")
+}
+imp lists/mix.m3u8 > "$WDIR/out" 2> "$WDIR/err"
+assert_true "m3u: every local form resolved in order" sh -c 'printf "%s\n" "Artist - One.mp3" "x y.mp3" \
+	"Other - Three.ogg" "Artist - Two.flac" "Other - Three.ogg" | cmp -s - "$0"' "$WDIR/playlists/mix.playlist"
+assert_true "m3u: summary counts matches" grep -q "mix.playlist: 5 of 7 entries matched" "$WDIR/out"
+assert_true "m3u: unmatched entries reported" sh -c \
+	'grep -qx "unmatched: /elsewhere/nope.mp3" "$0" && grep -qx "unmatched: http://radio.example/stream" "$0"' "$WDIR/err"
+imp lists/radio.pls > /dev/null 2>&1
+assert_true "pls: numbered entries, title fallback" sh -c \
+	'printf "%s\n" "Artist - Two.flac" "x y.mp3" | cmp -s - "$0"' "$WDIR/playlists/radio.playlist"
+imp lists/fav.xspf favourites > /dev/null 2> "$WDIR/err"
+assert_true "xspf: URIs and creator - title" sh -c \
+	'printf "%s\n" "Artist - One.mp3" "Other - Three.ogg" "x y.mp3" | cmp -s - "$0"' "$WDIR/playlists/favourites.playlist"
+assert_true "xspf: unmatched title reported" grep -qx "unmatched: Missing & Gone" "$WDIR/err"
+# 50k entries over a 5k-song library, every fourth one in the wrong case
+(cd "$WDIR/songs" && seq -f "track %05g.mp3" 1 5000 | xargs -d '\n' touch)
+awk -v d="$WDIR" 'BEGIN { print "#EXTM3U"; for (i = 0; i < 50000; i++) {
+	n = sprintf("track %05d.mp3", i % 5000 + 1); if (i % 4 == 0) n = toupper(n)
+	print (i % 2 ? d "/songs/" n : "../songs/" n) } }' > "$WDIR/lists/big.m3u"
+imp lists/big.m3u > "$WDIR/out" 2>&1
+assert_true "50k entries all resolved" grep -q "big.playlist: 50000 of 50000 entries matched" "$WDIR/out"
+assert_true "50k entries in well under a second" sh -c \
+	'[ "$(sed -n "s/.*(\([0-9]*\) ms)$/\1/p" "$0")" -lt 500 ]' "$WDIR/out"
+rm -rf "$WDIR"
+
+echo ""
+echo "Startup: UI first, library streamed in by a background scan"
+WDIR="$(mktemp -d)"
+mkdir -p "$WDIR/songs" "$WDIR/empty"
+(cd "$WDIR/songs" && seq -f "track %05g.mp3" 1 20000 | xargs -d '\n' touch)
+printf 'cursor=track 19990.mp3\n' > "$WDIR/state.save"
+start_home
+sleep 1.2
+assert_contains "whole library listed" "20000 songs"
+assert_not_contains "scan finished" "scanning"
+assert_contains "cursor restored once its song arrived" "> track 19990.mp3"
+capture | grep -B2 "> track 19990.mp3" | sed 's/ *$//' > "$WDIR/rows"
+assert_true "directory order sorted by name once the scan ends" \
+	cmp -s "$WDIR/rows" <(printf '  track 19988.mp3\n  track 19989.mp3\n> track 19990.mp3\n')
+send i
+wait_ms 200
+assert_contains "scan time in the stats panel" "library: 20000 songs, 0 plays, 0 skips, scanned in"
+send q
+wait_ms 500
+assert_true "state saved after the scan" grep -qx "cursor=track 19990.mp3" "$WDIR/state.save"
+start_home SONGS_DIR=empty
+sleep 0.5
+assert_contains "empty library still reported" "No songs found in empty/"
+assert_contains "empty library exits" "__EXITED__"
+rm -rf "$WDIR"
+
+echo ""
+echo "Radio: similarity features and nearest-neighbour next song"
+WDIR="$(mktemp -d)"
+mkdir -p "$WDIR/songs" "$WDIR/bin" "$WDIR/cache" "$WDIR/wav"
+python3 -c "
+import math, struct, wave
+def write(name, rate, ch, samples):
+    with wave.open('$WDIR/wav/' + name, 'w') as w:
+        w.setnchannels(ch)
+        w.setsampwidth(2)
+        w.setframerate(rate)
+        w.writeframes(b''.join(struct.pack('<' + 'h' * ch, *([int(s)] * ch)) for s in samples))
+def clicks(bpm, rate):
+    per = rate * 60 / bpm
+    return [12000 * math.sin(2 * math.pi * 1000 * i / rate) * math.exp(-(i % per) / (rate * 0.01))
+            for i in range(rate * 12)]
+write('click120.wav', 22050, 1, clicks(120, 22050))
+write('click90.wav', 48000, 2, clicks(90, 48000))
+write('a440.wav', 22050, 1, [8000 * math.sin(2 * math.pi * 440 * i / 22050) for i in range(22050 * 3)])
+"
+feat() { "$BINARY" --features "$WDIR/wav/$1" | head -1; }
+assert_true "120 BPM click track" sh -c \
+	'feat=$(sed -n "s/^tempo=\([0-9.]*\) .*/\1/p" "$0"); awk -v t="$feat" "BEGIN { exit !(t > 117 && t < 123) }"' \
+	<(feat click120.wav)
+assert_true "90 BPM at 48 kHz stereo" sh -c \
+	'feat=$(sed -n "s/^tempo=\([0-9.]*\) .*/\1/p" "$0"); awk -v t="$feat" "BEGIN { exit !(t > 87 && t < 93) }"' \
+	<(feat click90.wav)
+assert_true "steady tone: no tempo, chroma A" grep -q "^tempo=0.0 centroid=44[0-9] chroma=A$" <(feat a440.wav)
+assert_true "non-WAV input is rejected" \
+	bash -c "! '$BINARY' --features '$DIR/songs/alpha.mp3' 2>/dev/null"
+# 100k songs with vectors already in cache/features: t000001 is near
+# t077777 only, and plays for a second and a half
+(cd "$WDIR/songs" && seq -f "t%06g.mp3" 1 100000 | xargs -d '\n' touch)
+python3 - "$WDIR" <<'PY'
+import os, random, struct, sys
+d = sys.argv[1]
+names = sorted(os.listdir(d + "/songs"))
+def fnv1a(s):
+    h = 1469598103934665603
+    for b in s.encode():
+        h = ((h ^ b) * 1099511628211) & 0xffffffffffffffff
+    return h
+random.seed(7)
+with open(d + "/cache/features", "wb") as f:
+    f.write(struct.pack("<8I", 0x5446504d, 1, 24, len(names), len(names), 0, 0, 0))
+    for n in names:
+        st = os.stat(d + "/songs/" + n)
+        v = [0.0] * 24 if n == "t000001.mp3" else [0.01] * 24 if n == "t077777.mp3" else \
+            [random.uniform(0.5, 2) for _ in range(24)]
+        f.write(struct.pack("<Qqq24f", fnv1a(n), st.st_size, int(st.st_mtime), *v))
+PY
+fake_mpv --len t000001.mp3=1.5 --len 30 --exit
+start_home -x 100 -y 30
+wait_for "100000 songs" 10
+wait_gone "scanning"
+send r
+send Enter
+wait_ms 500
+assert_contains "r turns radio on" "[playing][radio] t000001.mp3"
+wait_for "[playing][radio] t077777.mp3"
+assert_contains "next song is the nearest neighbour" "[playing][radio] t077777.mp3"
+send i
+wait_for "songs analysed"
+assert_contains "every song has a vector" "radio: on, 100000 of 100000 songs analysed"
+# wall time on the monotonic clock, about half a millisecond here
+PICK="$(capture | sed -n 's/.*last pick \([0-9.]*\) ms over 99999.*/\1/p')"
+assert_true "100k vectors searched in under a millisecond" \
+	awk -v p="$PICK" 'BEGIN { exit !(p != "" && p < 1) }'
+send q
+wait_ms 300
+rm -rf "$WDIR"
+
+echo ""
+echo "Replay: headless keystroke scripts on a virtual clock"
+WDIR="$(mktemp -d)"
+mkdir -p "$WDIR/songs" "$WDIR/bin"
+touch "$WDIR/songs/alpha.mp3" "$WDIR/songs/beta.flac" "$WDIR/songs/gamma.ogg"
+# replays start no mpv to play (analysis may decode with one); this
+# one leaves a mark if it is asked to
+printf '#!/bin/sh\ncase "$*" in *--input-ipc-server=*) touch "$0.ran" ;; esac\nexit 1\n' > "$WDIR/bin/mpv"
+chmod +x "$WDIR/bin/mpv"
+replay() {
+	(cd "$WDIR" && PATH="$WDIR/bin:$PATH" MUSIC_PLAYER_HOME="$WDIR" "$BINARY" --replay "$@")
+}
+printf '%s\n' 'size 12 60' 'snap start' 'keys jj' 'snap' 'keys /bet\r' 'snap filtered' > "$WDIR/nav.txt"
+replay nav.txt > "$WDIR/nav.out" 2> "$WDIR/nav.err"
+assert_true "snapshots are labelled" grep -q "^--- screen filtered ---$" "$WDIR/nav.out"
+assert_true "first snapshot has the cursor on the first song" \
+	sh -c 'sed -n "/^--- screen start ---$/,/^--- end ---$/p" "$0" | grep -q "^> alpha.mp3$"' "$WDIR/nav.out"
+assert_true "jj moves the cursor down two" \
+	sh -c 'sed -n "/^--- screen ---$/,/^--- end ---$/p" "$0" | grep -q "^> gamma.ogg$"' "$WDIR/nav.out"
+assert_true "search filters the list" \
+	sh -c 'sed -n "/^--- screen filtered ---$/,/^--- end ---$/p" "$0" | grep -q "| 1 song$"' "$WDIR/nav.out"
+assert_true "screen is the size asked for" \
+	sh -c '[ "$(sed -n "/^--- screen start ---$/,/^--- end ---$/p" "$0" | wc -l)" -eq 14 ]' "$WDIR/nav.out"
+assert_true "per-key and per-frame times reported" grep -q "^replay: 7 keys, .* us mean, .* us max; .* frames" "$WDIR/nav.err"
+assert_true "nothing saved" test ! -e "$WDIR/state.save" -a ! -e "$WDIR/state.bin"
+# a sleep timer run out in virtual time
+printf '%s\n' 'keys \r' 'keys z' 'wait 60000' 'snap minute' 'wait 835000' 'snap end' 'wait 10000' 'snap' \
+	> "$WDIR/sleep.txt"
+replay sleep.txt > "$WDIR/sleep.out" 2> "$WDIR/sleep.err"
+assert_true "a minute later the timer shows 14m" \
+	sh -c 'sed -n "/^--- screen minute ---$/,/^--- end ---$/p" "$0" | grep -qF "[playing][sleep 14m] alpha.mp3"' "$WDIR/sleep.out"
+assert_true "five seconds before the end" \
+	sh -c 'sed -n "/^--- screen end ---$/,/^--- end ---$/p" "$0" | grep -qF "[sleep 5s]"' "$WDIR/sleep.out"
+assert_true "then playback stops" \
+	sh -c '! sed -n "/^--- screen ---$/,/^--- end ---$/p" "$0" | grep -qF "[playing]"' "$WDIR/sleep.out"
+assert_true "905 s of virtual time in a few seconds" \
+	sh -c 'grep -q "; 905.0 s virtual in " "$0" &&
+		awk "/virtual in/ { exit !(\$(NF - 1) < 3000) }" "$0"' "$WDIR/sleep.err"
+printf '%s\n' 'keys j' 'frobnicate' > "$WDIR/bad.txt"
+BAD_RC=0
+replay bad.txt > /dev/null 2> "$WDIR/bad.err" || BAD_RC=$?
+assert_true "a bad line is an error" \
+	sh -c '[ "$0" = 1 ] && grep -q "2: not a replay command: frobnicate" "$1"' "$BAD_RC" "$WDIR/bad.err"
+# record a live session, replay the trace
+start_home -- --record trace.txt
+sleep 0.5
+send j
+wait_ms 200
+send_seq "/gam"
+wait_ms 200
+send Enter
+wait_ms 200
+send q
+sleep 0.5
+assert_true "trace records size, waits and keys" \
+	sh -c 'grep -q "^size 24 80$" "$0" && grep -q "^wait [0-9]*$" "$0" && grep -q "^keys /gam$" "$0" && grep -q "^keys \\\\r$" "$0"' \
+	"$WDIR/trace.txt"
+replay trace.txt > "$WDIR/trace.out" 2>/dev/null
+assert_true "trace replays to the same screen" \
+	sh -c 'grep -q "^> gamma.ogg$" "$0" && grep -q "| 1 song$" "$0"' "$WDIR/trace.out"
+# a replay only reads the home: resume, play, delete
+rm -f "$WDIR/bin/mpv.ran" "$WDIR/state.bin"
+printf 'cursor=beta.flac\nsong=beta.flac\n' > "$WDIR/state.save"
+cp "$WDIR/state.save" "$WDIR/state.before"
+rm -rf "$WDIR/cache" "$WDIR/history.log"
+printf '%s\n' 'snap resumed' 'keys j\r' 'wait 5000' 'keys dd' 'snap deleted' > "$WDIR/rw.txt"
+replay rw.txt > "$WDIR/rw.out" 2>/dev/null
+assert_true "the saved song resumes" \
+	sh -c 'sed -n "/^--- screen resumed ---$/,/^--- end ---$/p" "$0" | grep -qF "[playing] beta.flac"' "$WDIR/rw.out"
+assert_true "d d drops the song from the list" \
+	sh -c 'sed -n "/^--- screen deleted ---$/,/^--- end ---$/p" "$0" | grep -q "| 2 songs$"' "$WDIR/rw.out"
+assert_true "no mpv started" test ! -e "$WDIR/bin/mpv.ran"
+assert_true "the file stays in songs/" test -e "$WDIR/songs/gamma.ogg" -a ! -e "$WDIR/trash"
+assert_true "state, history and caches untouched" \
+	sh -c 'cmp -s "$0/state.save" "$0/state.before" && [ ! -e "$0/state.bin" ] &&
+		[ ! -e "$0/history.log" ] && [ ! -e "$0/cache" ]' "$WDIR"
+rm -rf "$WDIR"
+
+echo ""
+echo "Query commands: ls, search, playlist and now-playing"
+WDIR="$(mktemp -d)"
+mkdir -p "$WDIR/songs" "$WDIR/playlists"
+touch "$WDIR/songs/alpha.mp3" "$WDIR/songs/beta.flac" "$WDIR/songs/gamma.ogg" "$WDIR/songs/Band - delta.mp3"
+printf 'beta.flac\nalpha.mp3\nmissing.mp3\n' > "$WDIR/playlists/mix.playlist"
+printf 'artist ~ Band\n' > "$WDIR/playlists/band.smart"
+query() { MUSIC_PLAYER_HOME="$WDIR" "$BINARY" "$@"; }
+assert_true "ls lists the library in name order" \
+	test "$(query ls)" = "$(printf 'Band - delta.mp3\nalpha.mp3\nbeta.flac\ngamma.ogg')"
+assert_true "ls saves the library index" test -s "$WDIR/cache/library"
+assert_true "-0 separates with NULs" \
+	sh -c '[ "$(MUSIC_PLAYER_HOME="$0" "$1" ls -0 | tr "\0" "\n")" = "$(MUSIC_PLAYER_HOME="$0" "$1" ls)" ]' "$WDIR" "$BINARY"
+assert_true "search matches like / does, ignoring case" \
+	test "$(query search 'A\.(mp3|ogg)$')" = "$(printf 'Band - delta.mp3\nalpha.mp3\ngamma.ogg')"
+assert_true "search with no match exits 1" sh -c '! MUSIC_PLAYER_HOME="$0" "$1" search zzz' "$WDIR" "$BINARY"
+assert_true "a bad pattern is an error" \
+	sh -c 'MUSIC_PLAYER_HOME="$0" "$1" search "(" 2>/dev/null; [ $? -eq 2 ]' "$WDIR" "$BINARY"
+assert_true "playlist prints the file's songs in its order" \
+	test "$(query playlist mix)" = "$(printf 'beta.flac\nalpha.mp3')"
+assert_true "smart playlists are evaluated" test "$(query playlist band)" = "Band - delta.mp3"
+assert_true "an unknown playlist exits 1" sh -c '! MUSIC_PLAYER_HOME="$0" "$1" playlist nope 2>/dev/null' "$WDIR" "$BINARY"
+# a new song moves the directory's mtime; putting it back shows the
+# index is what was read
+touch "$WDIR/songs/epsilon.mp3"
+assert_true "a changed songs directory is rescanned" sh -c 'MUSIC_PLAYER_HOME="$0" "$1" ls | grep -qx epsilon.mp3' "$WDIR" "$BINARY"
+STAMP="$(stat -c %y "$WDIR/songs")"
+touch "$WDIR/songs/zeta.mp3"
+touch -d "$STAMP" "$WDIR/songs"
+assert_true "an unchanged directory is answered from the index" \
+	sh -c '! MUSIC_PLAYER_HOME="$0" "$1" ls | grep -qx zeta.mp3' "$WDIR" "$BINARY"
+assert_true "now-playing without a saved song exits 1" sh -c '! MUSIC_PLAYER_HOME="$0" "$1" now-playing' "$WDIR" "$BINARY"
+printf 'song=gamma.ogg\n' > "$WDIR/state.save"
+assert_true "now-playing reads state.save" test "$(query now-playing)" = "gamma.ogg"
+query --import-state > /dev/null
+printf 'song=beta.flac\n' > "$WDIR/state.save"
+assert_true "now-playing prefers state.bin" test "$(query now-playing)" = "gamma.ogg"
+rm "$WDIR/cache/library"
+start_home
+wait_for "6 songs"
+send q
+wait_for "__EXITED__"
+assert_true "the player saves the index after its scan" test -s "$WDIR/cache/library"
+rm -rf "$WDIR"
+
+WDIR="$(mktemp -d)"
+mkdir -p "$WDIR/songs"
+(cd "$WDIR/songs" && seq -f "t%06g.mp3" 1 100000 | xargs -d '\n' touch)
+# wall time from exec to exit. The cold run scans and writes the index;
+# runs from the index must stay within a few ms (the bound leaves room
+# for a shared test box), a small fraction of the scan, and must leave
+# the index file alone
+elapsed_ms() {
+	local t0 t1
+	t0=$(date +%s%N)
+	query "$@" > "$WDIR/out"
+	t1=$(date +%s%N)
+	echo $(( (t1 - t0) / 1000000 ))
+}
+COLD="$(elapsed_ms ls)"
+INDEX="$(stat -c '%i %y' "$WDIR/cache/library")"
+MS="$(elapsed_ms ls)"
+assert_true "ls of 100k songs from the index in a few ms" \
+	sh -c '[ "$(wc -l < "$0")" -eq 100000 ] && [ "$1" -lt 40 ] && [ $(($1 * 4)) -lt "$2" ]' "$WDIR/out" "$MS" "$COLD"
+MS="$(elapsed_ms search 'T0999..\.MP3')"
+assert_true "search of 100k songs in a few ms" \
+	sh -c '[ "$(wc -l < "$0")" -eq 100 ] && [ "$1" -lt 40 ] && [ $(($1 * 4)) -lt "$2" ]' "$WDIR/out" "$MS" "$COLD"
+assert_true "no rescan: the index was not rewritten" \
+	test "$(stat -c '%i %y' "$WDIR/cache/library")" = "$INDEX"
+rm -rf "$WDIR"
+
+echo ""
+echo "Duplicates: content hashing and one-batch trash"
+WDIR="$(mktemp -d)"
+mkdir -p "$WDIR/songs"
+# zeros with a distinct tail: no 0xFF sync bytes, so no frame-walk
+# durations to widen the header
+{ head -c 307196 /dev/zero; printf aaaa; } > "$WDIR/songs/a.mp3"
+cp "$WDIR/songs/a.mp3" "$WDIR/songs/a copy.mp3"
+cp "$WDIR/songs/a.mp3" "$WDIR/songs/a again.mp3"
+# same size and head as a.mp3, different middle: only a full hash tells
+cp "$WDIR/songs/a.mp3" "$WDIR/songs/b.mp3"
+printf 'xxxx' | dd of="$WDIR/songs/b.mp3" bs=1 seek=150000 conv=notrunc 2>/dev/null
+{ head -c 996 /dev/zero; printf cccc; } > "$WDIR/songs/c.mp3"
+{ head -c 996 /dev/zero; printf c2c2; } > "$WDIR/songs/c2.mp3"
+cp "$WDIR/songs/c.mp3" "$WDIR/songs/d.mp3"
+{ head -c 4996 /dev/zero; printf eeee; } > "$WDIR/songs/e.mp3"
+touch -d "2020-01-01" "$WDIR/songs/a.mp3" "$WDIR/songs/c.mp3"
+start_home
+sleep 0.5
+send D
+wait_ms 500
+assert_contains "D opens the view with the extras selected" "3 selected"
+assert_contains "oldest copy kept" "  a.mp3"
+assert_not_contains "keeper not marked" " a.mp3 [duplicate]"
+assert_contains "extras marked" "a copy.mp3 [duplicate]"
+assert_contains "small files compared whole" "d.mp3 [duplicate]"
+assert_not_contains "same head, different middle" "b.mp3"
+assert_not_contains "same size, different content" "c2.mp3"
+assert_not_contains "unique size never hashed" "e.mp3"
+send d
+wait_ms 200
+assert_contains "d marks every extra" "a again.mp3 [delete]"
+send d
+wait_ms 300
+assert_true "extras moved to trash in one go" \
+	[ -e "$WDIR/trash/a copy.mp3" -a -e "$WDIR/trash/a again.mp3" -a -e "$WDIR/trash/d.mp3" ]
+assert_true "keepers stay" [ -e "$WDIR/songs/a.mp3" -a -e "$WDIR/songs/c.mp3" ]
+assert_contains "view regrouped after the delete" "no duplicates"
+send q
+wait_ms 300
+assert_true "hashes cached" grep -q "b.mp3$" "$WDIR/cache/hashes"
+assert_true "unique size not cached" bash -c "! grep -q 'e.mp3$' '$WDIR/cache/hashes'"
+# same size and mtime: the cached hashes still say c2 differs
+touch -r "$WDIR/songs/c2.mp3" "$WDIR/ref"
+cp "$WDIR/songs/c.mp3" "$WDIR/songs/c2.mp3"
+touch -r "$WDIR/ref" "$WDIR/songs/c2.mp3"
+start_home
+sleep 0.5
+send D
+wait_ms 500
+assert_contains "cache reused while size and mtime match" "no duplicates"
+send q
+wait_ms 300
+touch "$WDIR/songs/c2.mp3"
+start_home
+sleep 0.5
+send D
+wait_ms 500
+assert_contains "new mtime rehashed" "c2.mp3 [duplicate]"
+send_seq $'\033'
+wait_ms 200
+assert_contains "groups and waste in the header" "2 songs, 1 group (0.0 MB)"
+send q
+wait_ms 300
+for i in $(seq 20); do printf '1\t1\t0000000000000001\t0000000000000000\tgone.mp3\n'; done >> "$WDIR/cache/hashes"
+start_home
+sleep 0.5
+send q
+wait_ms 300
+assert_true "mostly stale hash cache rewritten at load" \
+	sh -c '! grep -q gone.mp3 "$0" && grep -q "c2.mp3$" "$0"' "$WDIR/cache/hashes"
+rm -rf "$WDIR"
+
+echo ""
+echo "History: log aggregation, snapshot and views"
+WDIR="$(mktemp -d)"
+mkdir -p "$WDIR/songs" "$WDIR/playlists" "$WDIR/bin"
+touch "$WDIR"/songs/{a,b,c}.mp3
+printf 'plays=1501\n' > "$WDIR/playlists/check.smart"
+printf '#!/bin/sh\nexec sleep 30\n' > "$WDIR/bin/mpv"
+chmod +x "$WDIR/bin/mpv"
+python3 -c "
+import struct
+def h(s):
+    x = 1469598103934665603
+    for c in s.encode():
+        x = ((x ^ c) * 1099511628211) & (2**64 - 1)
+    return x
+recs = [('a.mp3', 1, 1000)] * 3000 + [('b.mp3', 1, 1100)] * 1500 + [('c.mp3', 1, 1500)]
+recs += [('a.mp3', 2, 1600)] * 5 + [('gone.mp3', 1, 1700)] * 10
+with open('$WDIR/history.log', 'wb') as f:
+    f.write(b'MPHL' + struct.pack('<IQQ', 1, 0, 0))
+    for name, kind, t in recs:
+        f.write(struct.pack('<QIHBB', h(name), t, 30, kind, 0))
+"
+hstart() {
+	start_home
+	sleep 0.8
+}
+hstart
+assert_true "long tail compacted into a snapshot" \
+	python3 -c "
+import struct, sys
+d = open('$WDIR/history.snap', 'rb').read()
+sys.exit(0 if d[:4] == b'MPHS' and struct.unpack('<QQ', d[8:24]) == (24 + 4516 * 16, 4) else 1)"
+assert_true "the log starts over after its header" \
+	python3 -c "
+import struct, sys
+d = open('$WDIR/history.log', 'rb').read()
+sys.exit(0 if len(d) == 24 and d[:4] == b'MPHL' and struct.unpack('<Q', d[8:16])[0] == 4516 * 16 else 1)"
+send_seq $'\033[109;5u'
+assert_contains "history views listed" "Recently played"
+send j
+send j
+send j
+send Enter
+send_seq $'\033[106;5u'
+wait_ms 300
+assert_true "most played from the aggregates" \
+	[ "$(capture | sed -n '3,5p' | sed 's/^.*│//' | tr -d ' >' | tr '\n' ,)" = "a.mp3,b.mp3,c.mp3," ]
+send_seq $'\033[106;5u'
+send k
+send Enter
+send_seq $'\033[106;5u'
+wait_ms 300
+assert_true "recently played newest first" \
+	[ "$(capture | sed -n '3,5p' | sed 's/^.*│//' | tr -d ' >' | tr '\n' ,)" = "c.mp3,b.mp3,a.mp3," ]
+send Enter
+wait_ms 300
+send j
+send Enter
+wait_ms 300
+send q
+wait_ms 500
+assert_true "plays and the skip appended" [ "$(stat -c %s "$WDIR/history.log")" = "$((24 + 3 * 16))" ]
+hstart
+send_seq $'\033[109;5u'
+send g
+send j
+send Enter
+send_seq $'\033[106;5u'
+wait_ms 300
+assert_contains "snapshot plus tail, resume not counted" "> b.mp3"
+assert_not_contains "only b has 1501 plays" "a.mp3"
+send q
+wait_ms 500
+rm -rf "$WDIR"
+
+echo ""
+echo "Visual selection: batched queue, playlist and delete"
+WDIR="$(mktemp -d)"
+mkdir -p "$WDIR/songs" "$WDIR/playlists"
+touch "$WDIR"/songs/s{1,2,3,4,5,6}.mp3
+touch "$WDIR/playlists/mix.playlist"
+start_home
+sleep 0.5
+send V
+send j
+send j
+wait_ms 200
+assert_contains "V range follows the cursor" "3 selected"
+assert_contains "range rows are marked" " *s2.mp3"
+assert_contains "cursor row is marked" ">*s3.mp3"
+send V
+send j
+send v
+wait_ms 200
+assert_contains "v adds to the committed range" "4 selected"
+send a
+send u
+wait_ms 200
+assert_contains "a queues the whole selection" "Up next (4)"
+assert_contains "queued in display order" "4. s4.mp3"
+assert_not_contains "selection consumed" "selected"
+send v
+send_seq $'\033'
+wait_ms 200
+assert_not_contains "esc clears the selection" "selected"
+send_seq $'\033[109;5u'
+send j
+send_seq $'\033[106;5u'
+send g
+send v
+send G
+send v
+send p
+wait_ms 200
+assert_true "p appends the selection in one go" \
+	bash -c "[ \"\$(cat '$WDIR/playlists/mix.playlist')\" = \"\$(printf 's1.mp3\\ns6.mp3')\" ]"
+send_seq $'\033[109;5u'
+send V
+send k
+send d
+wait_ms 200
+assert_contains "d marks the selection" "s5.mp3 [delete]"
+send d
+wait_ms 300
+assert_true "selected files moved to trash" [ -e "$WDIR/trash/s5.mp3" -a -e "$WDIR/trash/s6.mp3" ]
+assert_not_contains "deleted songs leave the list" "s6.mp3"
+assert_contains "queue compacted with the list" "Up next (4)"
+assert_contains "totals follow the delete" "4 songs"
+send q
+wait_ms 300
+rm -rf "$WDIR"
+
+echo ""
+echo "Daemon: clients attach, detach and share one player"
+cleanup
+attach() {
+	tmux kill-session -t "$1" 2>/dev/null || true
+	tmux new-session -d -s "$1" -x "$2" -y 24 \
+		"cd $DIR && MUSIC_PLAYER_HOME=$DIR $BINARY --client --tmux; echo __EXITED__; sleep 10"
+}
+attach "$SESSION" 80
+sleep 0.8
+assert_contains "client starts a daemon and renders" "> alpha.mp3"
+assert_contains "help offers detach" "q:detach"
+assert_true "daemon listening" [ -S "$DIR/musicplayer.sock" ]
+send j
+wait_ms 300
+send q
+wait_ms 300
+assert_session_dead "q detaches the client"
+assert_true "daemon survives detach" bash -c "pgrep -f '$BINARY --daemon' >/dev/null"
+attach "$SESSION" 80
+attach "$SESSION-2" 60
+sleep 0.5
+assert_contains "reattached client sees the same cursor" "> beta.flac"
+tmux send-keys -t "$SESSION-2" j
+wait_ms 400
+assert_contains "keys from one client reach the other" "> gamma.ogg"
+assert_true "second client renders at its own width" \
+	bash -c "tmux capture-pane -t '$SESSION-2' -p | python3 -c 'import sys; sys.exit(sys.stdin.read().split(chr(10))[1] != chr(0x2500) * 60)'"
+send Q
+wait_ms 500
+assert_session_dead "Q stops the daemon"
+assert_true "socket removed" [ ! -e "$DIR/musicplayer.sock" ]
+assert_true "state saved by the daemon" grep -qx "cursor=gamma.ogg" "$DIR/state.save"
+tmux kill-session -t "$SESSION-2" 2>/dev/null || true
+WDIR="$(mktemp -d)"
+(cd "$DIR" && env -u MUSIC_PLAYER_HOME XDG_RUNTIME_DIR="$WDIR" SONGS_DIR=songs $BINARY --daemon)
+sleep 0.3
+assert_true "runtime dir is private" [ "$(stat -c %a "$WDIR/musicplayer")" = 700 ]
+assert_true "default socket in the runtime dir" [ -S "$WDIR/musicplayer/musicplayer.sock" ]
+pkill -f "$BINARY --daemon" 2>/dev/null || true
+sleep 0.3
+mkdir -p "$WDIR/home"
+echo keep > "$WDIR/home/musicplayer.sock"
+assert_true "refuses to replace what is not its socket" \
+	bash -c "! (cd '$DIR' && MUSIC_PLAYER_HOME='$WDIR/home' SONGS_DIR=songs $BINARY --daemon 2>/dev/null)"
+assert_true "foreign file left alone" grep -qx keep "$WDIR/home/musicplayer.sock"
+rm -rf "$WDIR"
+WDIR="$(mktemp -d)"
+mkdir -p "$WDIR/songs"
+(cd "$WDIR/songs" && seq -f 's%05g.mp3' 1 20000 | xargs touch)
+tmux kill-session -t "$SESSION" 2>/dev/null || true
+tmux new-session -d -s "$SESSION" -x 80 -y 24 \
+	"cd $WDIR && MUSIC_PLAYER_HOME=$WDIR $BINARY --client --tmux; echo __EXITED__; sleep 10"
+wait_for "20000 songs" 10
+# a client that reads nothing for 2s, then everything it is sent: one
+# line of "<bytes> <frames> <whole records> <names seen>"
+python3 - "$WDIR/musicplayer.sock" > "$WDIR/stuck.out" <<'PY' &
+import socket, struct, sys, time
+s = socket.socket(socket.AF_UNIX)
+s.connect(sys.argv[1])
+s.sendall(b"\x1b[8;24;80t")
+time.sleep(2)
+s.settimeout(0.5)
+d = b""
+try:
+    while True:
+        c = s.recv(1 << 20)
+        if not c:
+            break
+        d += c
+except socket.timeout:
+    pass
+i = frames = 0
+while i + 16 <= len(d):
+    v, _, _, n = struct.unpack_from("<4I", d, i)
+    i += 16 + n
+    frames += v == 0xffffffff
+print(len(d), frames, i == len(d), b"s00001.mp3\0s00002.mp3\0" in d)
+PY
+STUCK=$!
+sleep 0.5
+send j
+wait_ms 300
+assert_contains "a client that reads nothing holds up no one" "> s00002.mp3"
+wait "$STUCK"
+assert_true "the daemon sends state, not screens" awk '$4 == "True" { f = 1 } END { exit !f }' "$WDIR/stuck.out"
+# more than a socket buffer holds, so some of it waited in the daemon
+assert_true "it catches up with whole frames once it reads" \
+	awk '$1 > 262144 && $2 >= 1 && $3 == "True" { f = 1 } END { exit !f }' "$WDIR/stuck.out"
+send Q
+wait_ms 500
+rm -rf "$WDIR"
+
+echo ""
+echo "Binary state: import, in-place updates, export"
+cleanup
+printf 'volume=70\ncursor=beta.flac\nloop=single\nqueue=gamma.ogg\n' > "$DIR/state.save"
+assert_true "import writes state.bin" bash -c "cd $DIR && $BINARY --import-state >/dev/null"
+rm -f "$DIR/state.save"
+start_resume
+assert_contains "cursor restored from state.bin" "> beta.flac"
+send j
+wait_ms 300
+send q
+wait_ms 500
+assert_true "state.save not written in binary mode" [ ! -e "$DIR/state.save" ]
+assert_true "export shows the moved cursor" \
+	bash -c "cd $DIR && $BINARY --export-state | grep -qx cursor=gamma.ogg"
+assert_true "export keeps queue and loop" \
+	bash -c "cd $DIR && $BINARY --export-state | grep -qx queue=gamma.ogg && $BINARY --export-state | grep -qx loop=single"
+printf 'X' | dd of="$DIR/state.bin" bs=1 seek=100 conv=notrunc 2>/dev/null
+assert_true "corrupt record rejected" bash -c "! (cd $DIR && $BINARY --export-state 2>/dev/null)"
+printf 'cursor=alpha.mp3\n' > "$DIR/state.save"
+start_resume
+assert_contains "falls back to state.save" "> alpha.mp3"
+send q
+wait_ms 500
+assert_true "record rewritten after fallback" \
+	bash -c "cd $DIR && $BINARY --export-state | grep -qx cursor=alpha.mp3"
+
+echo ""
+echo "Loudness: N toggles normalisation"
+start
+send N
+wait_ms 200
+send q
+wait_ms 500
+assert_true "N writes normalize=0 to state" grep -qx "normalize=0" "$DIR/state.save"
+
+echo ""
+echo "Loudness: mostly stale cache rewritten at load"
+WDIR="$(mktemp -d)"
+mkdir -p "$WDIR/songs" "$WDIR/cache"
+touch "$WDIR/songs/a.mp3" "$WDIR/songs/b.mp3"
+A="$(stat -c '0\t%Y' "$WDIR/songs/a.mp3")"
+B="$(stat -c '0\t%Y' "$WDIR/songs/b.mp3")"
+printf "$A\t-14.00\t-1.00\ta.mp3\n$B\t-20.00\t-3.00\tb.mp3\n" > "$WDIR/cache/loudness"
+printf "0\t1\t-20.00\t-3.00\tgone.mp3\n" >> "$WDIR/cache/loudness"
+start_home
+sleep 0.5
+send q
+wait_ms 300
+assert_true "one stale line in three: file left alone" [ "$(wc -l < "$WDIR/cache/loudness")" -eq 3 ]
+# a line for an older a and a new measurement that replaces the first:
+# with gone.mp3 that is 3 stale lines of 5
+printf "0\t1\t-30.00\t-9.00\ta.mp3\n$A\t-15.00\t-2.00\ta.mp3\n" >> "$WDIR/cache/loudness"
+start_home
+sleep 0.5
+send q
+wait_ms 300
+assert_true "over half stale: one line per current song" \
+	test "$(cat "$WDIR/cache/loudness")" = "$(printf "$A\t-15.00\t-2.00\ta.mp3\n$B\t-20.00\t-3.00\tb.mp3")"
+rm -rf "$WDIR"
+
 echo ""
 echo "State persistence: cursor position"
 start